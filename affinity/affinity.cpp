@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/mempolicy.h>
+#include "affinity.h"
+
+bool affinity::parse(const char *list, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    if (!list)
+        return true;
+    const char *p = list;
+    while (*p)
+    {
+        char *end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return false;
+        long last = first;
+        p = end;
+        if (*p == '-')
+        {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return false;
+            p = end;
+        }
+        if (last >= CPU_SETSIZE)
+            return false;
+        for (long cpu = first; cpu <= last; cpu++)
+            CPU_SET(cpu, set);
+        if (*p == ',')
+            p++;
+        else if (*p)
+            return false;
+    }
+    return true;
+}
+
+int affinity::nth(const cpu_set_t *set, int n)
+{
+    int count = CPU_COUNT(set);
+    if (count == 0)
+        return -1;
+    n %= count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, set) && n-- == 0)
+            return cpu;
+    }
+    return -1;
+}
+
+void affinity::format(const cpu_set_t *set, char *buf, int len)
+{
+    int off = 0;
+    buf[0] = '\0';
+    for (int cpu = 0; cpu < CPU_SETSIZE && off < len; cpu++)
+    {
+        if (!CPU_ISSET(cpu, set))
+            continue;
+        //连续的CPU合并为一个区间
+        int last = cpu;
+        while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, set))
+            last++;
+        if (last == cpu)
+            off += snprintf(buf + off, len - off, "%s%d", off ? "," : "", cpu);
+        else
+            off += snprintf(buf + off, len - off, "%s%d-%d", off ? "," : "", cpu, last);
+        cpu = last;
+    }
+}
+
+int affinity::node_of(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), AFFINITY_NODE_PATH, cpu);
+    DIR *dir = opendir(path);
+    if (!dir)
+        return 0;
+    int node = 0;
+    struct dirent *ent;
+    while ((ent = readdir(dir)) != NULL)
+    {
+        if (strncmp(ent->d_name, "node", 4) == 0 && ent->d_name[4] >= '0' && ent->d_name[4] <= '9')
+        {
+            node = atoi(ent->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+int affinity::node_of_set(const cpu_set_t *set)
+{
+    int node = -1;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, set))
+            continue;
+        int n = node_of(cpu);
+        if (node >= 0 && n != node)
+            return -1;
+        node = n;
+    }
+    return node;
+}
+
+bool affinity::pin(pthread_t thread, const cpu_set_t *set)
+{
+    if (CPU_COUNT(set) == 0)
+        return true;
+    return pthread_setaffinity_np(thread, sizeof(cpu_set_t), set) == 0;
+}
+
+bool affinity::pin_cpu(pthread_t thread, int cpu)
+{
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pin(thread, &set);
+}
+
+int affinity::pinned_cpu()
+{
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0 || CPU_COUNT(&set) != 1)
+        return -1;
+    return nth(&set, 0);
+}
+
+bool affinity::bind_memory(void *addr, size_t len, int node)
+{
+    if (node < 0 || node >= (int)(sizeof(unsigned long) * 8))
+        return false;
+    long page = sysconf(_SC_PAGESIZE);
+    unsigned long start = ((unsigned long)addr + page - 1) & ~(page - 1);
+    unsigned long end = ((unsigned long)addr + len) & ~(page - 1);
+    if (end <= start)
+        return false;
+    //PREFERRED而不是BIND：节点内存不足时退回其他节点，不会因为放置策略导致分配失败
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) == 0;
+}
+
+void *affinity::alloc_memory(size_t len, int node)
+{
+    //只预留地址空间，物理页在首次写入时按已设置的策略分配
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    bind_memory(p, len, node);
+    return p;
+}
+
+void affinity::free_memory(void *addr, size_t len)
+{
+    if (addr)
+        munmap(addr, len);
+}
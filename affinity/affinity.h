@@ -0,0 +1,43 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <sched.h>
+#include <pthread.h>
+#include <stddef.h>
+
+#define AFFINITY_NODE_PATH "/sys/devices/system/cpu/cpu%d"   //该目录下的nodeN子目录表示CPU所在的NUMA节点
+
+//CPU绑定和NUMA内存放置
+//CPU列表使用与taskset、/sys相同的格式，如"0-3,8,10-11"，空列表表示不绑定
+//不依赖libnuma：节点拓扑从/sys读取，内存策略直接调用mbind系统调用
+class affinity{
+public:
+    //解析CPU列表，空串或NULL得到空集合，格式错误或CPU编号超出CPU_SETSIZE返回false
+    static bool parse(const char *list, cpu_set_t *set);
+    //集合中第n个(取模)CPU，集合为空返回-1
+    static int nth(const cpu_set_t *set, int n);
+    //把集合格式化为CPU列表，用于日志
+    static void format(const cpu_set_t *set, char *buf, int len);
+
+    //CPU所在的NUMA节点，没有NUMA信息(单节点机器、容器未挂载/sys)时返回0
+    static int node_of(int cpu);
+    //集合中的CPU都在同一个节点时返回该节点，跨节点或集合为空返回-1
+    static int node_of_set(const cpu_set_t *set);
+
+    //把线程绑定到集合中的CPU，集合为空时不做任何事
+    //绑定后线程在缺页时按内核默认的local策略从所在节点分配内存，线程自己首次写入的堆和栈都是本地的
+    static bool pin(pthread_t thread, const cpu_set_t *set);
+    static bool pin_cpu(pthread_t thread, int cpu);
+    //当前线程只允许在一个CPU上运行时返回该CPU，否则返回-1
+    static int pinned_cpu();
+
+    //让[addr, addr + len)中尚未分配物理页的部分优先从node节点分配
+    //只处理范围内完整的页，已分配的页不迁移，所以必须在首次写入之前调用；node为-1时不做任何事
+    static bool bind_memory(void *addr, size_t len, int node);
+    //映射len字节的匿名内存(全为0)并先调用bind_memory，之后无论哪个线程首次写入，物理页都优先来自node节点
+    //用于由主线程创建、构造的大数组(如所有连接的http_conn)，失败返回NULL
+    static void *alloc_memory(size_t len, int node);
+    static void free_memory(void *addr, size_t len);
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+__thread arena_pool *arena_pool::t_pool = NULL;
+
+arena_chunk *arena_pool::get(size_t size)
+{
+    if (size > ARENA_CHUNK_SIZE)
+    {
+        arena_chunk *big = (arena_chunk *)malloc(sizeof(arena_chunk) + size);
+        if (!big)
+            return NULL;
+        big->owner = NULL;
+        big->size = size;
+        return big;
+    }
+
+    arena_pool *pool = t_pool;
+    if (!pool)
+        pool = t_pool = new arena_pool;
+    if (!pool->m_free)
+        pool->m_free = pool->m_remote.exchange(NULL, std::memory_order_acquire);
+
+    arena_chunk *chunk = pool->m_free;
+    if (chunk)
+    {
+        pool->m_free = chunk->next;
+        return chunk;
+    }
+    chunk = (arena_chunk *)malloc(sizeof(arena_chunk) + ARENA_CHUNK_SIZE);
+    if (!chunk)
+        return NULL;
+    chunk->owner = pool;
+    chunk->size = ARENA_CHUNK_SIZE;
+    pool->m_allocated++;
+    return chunk;
+}
+
+void arena_pool::put(arena_chunk *chunk)
+{
+    arena_pool *pool = chunk->owner;
+    if (!pool)
+    {
+        free(chunk);
+        return;
+    }
+    if (pool == t_pool)
+    {
+        chunk->next = pool->m_free;
+        pool->m_free = chunk;
+        return;
+    }
+    arena_chunk *head = pool->m_remote.load(std::memory_order_relaxed);
+    do
+    {
+        chunk->next = head;
+    } while (!pool->m_remote.compare_exchange_weak(head, chunk, std::memory_order_release, std::memory_order_relaxed));
+}
+
+long long arena_pool::allocated()
+{
+    return t_pool ? t_pool->m_allocated : 0;
+}
+
+void *arena::alloc(size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (m_used + size <= ARENA_INLINE_SIZE)
+    {
+        void *p = m_inline + m_used;
+        m_used += size;
+        return p;
+    }
+    if (m_chunk && m_chunk_used + size <= m_chunk->size)
+    {
+        void *p = (char *)(m_chunk + 1) + m_chunk_used;
+        m_chunk_used += size;
+        return p;
+    }
+    arena_chunk *chunk = arena_pool::get(size);
+    if (!chunk)
+        return NULL;
+    chunk->next = m_chunk;
+    m_chunk = chunk;
+    m_chunk_used = size;
+    return chunk + 1;
+}
+
+char *arena::dup(const char *s, size_t len)
+{
+    char *p = (char *)alloc(len + 1);
+    if (!p)
+        return NULL;
+    memcpy(p, s, len);
+    p[len] = '\0';
+    return p;
+}
+
+char *arena::format(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if (len < 0)
+        return NULL;
+    char *p = (char *)alloc(len + 1);
+    if (!p)
+        return NULL;
+    va_start(args, fmt);
+    vsnprintf(p, len + 1, fmt, args);
+    va_end(args);
+    return p;
+}
+
+void arena::reset()
+{
+    while (m_chunk)
+    {
+        arena_chunk *next = m_chunk->next;
+        arena_pool::put(m_chunk);
+        m_chunk = next;
+    }
+    m_used = 0;
+    m_chunk_used = 0;
+}
@@ -0,0 +1,67 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <atomic>
+#include <stddef.h>
+#include <stdarg.h>
+
+#define ARENA_INLINE_SIZE 512      //每个连接内嵌的空间，登录注册请求的临时数据通常不超过该值
+#define ARENA_CHUNK_SIZE 4096      //内嵌空间不够时从线程的块池中取的块大小
+#define ARENA_ALIGN 16
+
+class arena_pool;
+
+//块头之后是可用空间，owner为NULL表示超过ARENA_CHUNK_SIZE的大块，归还时直接free
+struct alignas(ARENA_ALIGN) arena_chunk{
+    arena_chunk *next;
+    arena_pool *owner;
+    size_t size;
+};
+
+//每个线程一个块池，块只由所属线程从池中取出，可以由任何线程归还
+//请求在工作线程中分配、在主线程中随连接重置归还，其他线程归还的块放入无锁栈，所属线程取块时整体取回
+//空闲块不释放，池的大小等于该线程同时使用过的最多块数，稳定后不再调用malloc
+class arena_pool{
+public:
+    static arena_chunk *get(size_t size);
+    static void put(arena_chunk *chunk);
+    //当前线程的池向malloc申请过的块数
+    static long long allocated();
+
+private:
+    arena_pool() : m_free(NULL), m_remote(NULL), m_allocated(0) {}
+
+    arena_chunk *m_free;                    //所属线程使用
+    std::atomic<arena_chunk *> m_remote;    //其他线程归还的块
+    long long m_allocated;
+
+    static __thread arena_pool *t_pool;
+};
+
+//请求处理期间的临时内存：路由、登录注册的用户名密码和SQL等
+//从连接内嵌的空间顺序分配，用完后从线程块池取块，不单独释放，连接重置(一个响应发送完毕)时整体归还
+//只由当前处理该连接的线程使用，不加锁
+class arena{
+public:
+    arena() : m_used(0), m_chunk(NULL), m_chunk_used(0) {}
+    ~arena() { reset(); }
+
+    void *alloc(size_t size);
+    //复制字符串
+    char *dup(const char *s, size_t len);
+    //格式化到新分配的空间
+    char *format(const char *fmt, ...);
+    //归还所有块，之前分配的指针全部失效
+    void reset();
+
+private:
+    arena(const arena &);
+    arena &operator=(const arena &);
+
+    alignas(ARENA_ALIGN) char m_inline[ARENA_INLINE_SIZE];
+    size_t m_used;
+    arena_chunk *m_chunk;       //当前块，之前用完的块通过next串在后面
+    size_t m_chunk_used;
+};
+
+#endif
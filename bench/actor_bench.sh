@@ -0,0 +1,29 @@
+#!/bin/bash
+#对比proactor(-a 0)和reactor(-a 1)两种并发模型在不同响应大小下的吞吐量和时延
+#先执行 make server loadgen，服务器需要能连上数据库
+#用法：bench/actor_bench.sh [端口] [每项持续秒数] [连接数]
+
+PORT=${1:-9006}
+DURATION=${2:-10}
+CONNS=${3:-64}
+
+#不同大小的响应：640B、4KB、114KB、1.5MB
+URLS="/judge.html /favicon.ico /img.jpg /beauty.jpg"
+
+cd "$(dirname "$0")/.."
+if [ ! -x ./server ] || [ ! -x ./loadgen ]; then
+	echo "run 'make server loadgen' first"
+	exit 1
+fi
+
+for MODEL in 0 1; do
+	./server -a $MODEL $PORT > /dev/null 2>&1 &
+	PID=$!
+	sleep 1
+	for URL in $URLS; do
+		echo "== actor_model $MODEL, $URL, $CONNS keep-alive connections"
+		./loadgen -p $PORT -c $CONNS -d $DURATION -k $URL
+	done
+	kill $PID
+	wait $PID 2>/dev/null
+done
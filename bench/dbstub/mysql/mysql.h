@@ -0,0 +1,24 @@
+#ifndef DBSTUB_MYSQL_H
+#define DBSTUB_MYSQL_H
+
+//libmysqlclient的替身，只实现服务器用到的接口，用于没有MySQL的环境下编译和压测
+//数据保存在进程内存中的user表，启动时预置若干用户
+
+typedef struct st_mysql { int connected; } MYSQL;
+typedef struct st_mysql_res MYSQL_RES;
+typedef struct st_mysql_field { const char *name; } MYSQL_FIELD;
+typedef char **MYSQL_ROW;
+
+MYSQL *mysql_init(MYSQL *mysql);
+MYSQL *mysql_real_connect(MYSQL *mysql, const char *host, const char *user, const char *passwd,
+                          const char *db, unsigned int port, const char *unix_socket, unsigned long clientflag);
+int mysql_query(MYSQL *mysql, const char *q);
+MYSQL_RES *mysql_store_result(MYSQL *mysql);
+unsigned int mysql_num_fields(MYSQL_RES *res);
+MYSQL_FIELD *mysql_fetch_fields(MYSQL_RES *res);
+MYSQL_ROW mysql_fetch_row(MYSQL_RES *res);
+void mysql_free_result(MYSQL_RES *res);
+const char *mysql_error(MYSQL *mysql);
+void mysql_close(MYSQL *mysql);
+
+#endif
@@ -0,0 +1,147 @@
+//数据库替身：进程内的user(username, passwd)表
+//支持服务器用到的两种语句：SELECT username,passwd FROM user 和 INSERT INTO user(username, passwd) VALUES('a', 'b')
+//环境变量DBSTUB_LATENCY_US可为每条语句加上固定时延，模拟数据库往返
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include "mysql/mysql.h"
+
+using namespace std;
+
+struct st_mysql_res{
+    vector<pair<string, string> > rows;
+    size_t next;
+    char *row[2];
+};
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static vector<pair<string, string> > table;
+static bool seeded = false;
+static MYSQL_FIELD fields[2] = {{"username"}, {"passwd"}};
+static __thread bool has_result = false;   //上一条语句是SELECT
+
+//预置的用户，压测脚本用第一个登录
+static void seed()
+{
+    if (seeded)
+        return;
+    seeded = true;
+    table.push_back(make_pair(string("123"), string("123")));
+    table.push_back(make_pair(string("bench"), string("bench")));
+}
+
+static void simulate_latency()
+{
+    static long latency_us = -1;
+    if (latency_us < 0)
+    {
+        const char *env = getenv("DBSTUB_LATENCY_US");
+        latency_us = env ? atol(env) : 0;
+    }
+    if (latency_us > 0)
+        usleep(latency_us);
+}
+
+//取出'...'中的内容，返回其后的位置
+static const char *quoted(const char *p, string &out)
+{
+    p = strchr(p, '\'');
+    if (!p)
+        return NULL;
+    const char *end = strchr(p + 1, '\'');
+    if (!end)
+        return NULL;
+    out.assign(p + 1, end - p - 1);
+    return end + 1;
+}
+
+MYSQL *mysql_init(MYSQL *mysql)
+{
+    if (!mysql)
+        mysql = new MYSQL;
+    mysql->connected = 0;
+    return mysql;
+}
+
+MYSQL *mysql_real_connect(MYSQL *mysql, const char *, const char *, const char *,
+                          const char *, unsigned int, const char *, unsigned long)
+{
+    mysql->connected = 1;
+    return mysql;
+}
+
+int mysql_query(MYSQL *, const char *q)
+{
+    simulate_latency();
+    pthread_mutex_lock(&table_lock);
+    seed();
+    int ret = 0;
+    has_result = false;
+    if (strncasecmp(q, "SELECT", 6) == 0)
+        has_result = true;
+    else if (strncasecmp(q, "INSERT", 6) == 0)
+    {
+        string name, passwd;
+        const char *p = strstr(q, "VALUES");
+        if (p && (p = quoted(p, name)) && quoted(p, passwd))
+            table.push_back(make_pair(name, passwd));
+        else
+            ret = 1;
+    }
+    else
+        ret = 1;
+    pthread_mutex_unlock(&table_lock);
+    return ret;
+}
+
+MYSQL_RES *mysql_store_result(MYSQL *)
+{
+    if (!has_result)
+        return NULL;
+    MYSQL_RES *res = new MYSQL_RES;
+    pthread_mutex_lock(&table_lock);
+    res->rows = table;
+    pthread_mutex_unlock(&table_lock);
+    res->next = 0;
+    return res;
+}
+
+unsigned int mysql_num_fields(MYSQL_RES *)
+{
+    return 2;
+}
+
+MYSQL_FIELD *mysql_fetch_fields(MYSQL_RES *)
+{
+    return fields;
+}
+
+MYSQL_ROW mysql_fetch_row(MYSQL_RES *res)
+{
+    if (res->next >= res->rows.size())
+        return NULL;
+    res->row[0] = (char *)res->rows[res->next].first.c_str();
+    res->row[1] = (char *)res->rows[res->next].second.c_str();
+    res->next++;
+    return res->row;
+}
+
+void mysql_free_result(MYSQL_RES *res)
+{
+    delete res;
+}
+
+const char *mysql_error(MYSQL *)
+{
+    return "";
+}
+
+void mysql_close(MYSQL *mysql)
+{
+    delete mysql;
+}
@@ -0,0 +1,481 @@
+//压测客户端：单线程epoll
+//用法：loadgen [-h ip] [-p port] [-c 连接数] [-d 秒数] [-k] [-r 每秒请求数] [-m 场景配比] [-o csv文件] [url]
+//  -k  长连接，否则每个请求新建一个连接
+//  -r  开环模式，按固定速率发出请求，时延从计划发送时刻算起(修正coordinated omission)
+//      不指定时为闭环模式，每个连接收到完整响应后才发送下一个请求
+//  -m  场景配比，如 judge:70,beauty:10,login:20，不指定时请求url
+//  -o  按HdrHistogram的格式输出各场景的时延分位数
+//输出吞吐量和时延分位数，便于对比不同并发模型
+
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#define MAX_EVENT_NUMBER 1024
+#define RESP_BUF_SIZE 65536
+#define MAX_SCENARIO 8
+
+//时延直方图，对数线性分桶，每个2的幂区间再分128个子桶，相对误差小于1%
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40         //最大约18分钟(ns)
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct histogram{
+	long long counts[HIST_BUCKETS];
+	long long total;
+	long long max;
+
+	static int bucket(long long v){
+		if(v < HIST_SUB_COUNT)
+			return v < 0 ? 0 : v;
+		if(v >= (1LL << HIST_MAX_BITS))
+			v = (1LL << HIST_MAX_BITS) - 1;
+		int msb = 63 - __builtin_clzll(v);
+		int shift = msb - HIST_SUB_BITS;
+		return (shift + 1) * HIST_SUB_COUNT + (int)((v >> shift) - HIST_SUB_COUNT);
+	}
+	//桶内的最大值
+	static long long upper(int idx){
+		if(idx < HIST_SUB_COUNT)
+			return idx;
+		int shift = idx / HIST_SUB_COUNT - 1;
+		long long mantissa = HIST_SUB_COUNT + idx % HIST_SUB_COUNT;
+		return ((mantissa + 1) << shift) - 1;
+	}
+	void record(long long v){
+		counts[bucket(v)]++;
+		total++;
+		if(v > max)
+			max = v;
+	}
+	void merge(const histogram &h){
+		for(int i = 0; i < HIST_BUCKETS; i++)
+			counts[i] += h.counts[i];
+		total += h.total;
+		max = std::max(max, h.max);
+	}
+	//p取值0~100
+	long long percentile(double p) const{
+		long long target = (long long)ceil(p / 100 * total);
+		if(target < 1)
+			target = 1;
+		long long seen = 0;
+		for(int i = 0; i < HIST_BUCKETS; i++){
+			seen += counts[i];
+			if(seen >= target)
+				return std::min(upper(i), max);
+		}
+		return max;
+	}
+};
+
+//一种请求
+struct scenario{
+	const char *name;
+	char request[512];
+	int request_len;
+	int weight;
+	histogram hist;
+	long long errors;        //连接失败或响应不完整
+	long long non_200;       //状态码不是200
+};
+
+//单个连接的状态
+struct client{
+	int fd;                  //-1表示未建立连接
+	bool busy;               //正在处理请求
+	scenario *sc;            //当前请求
+	int sent;                //请求已发送字节数
+	long long start_ns;      //本次请求开始时间，开环模式下为计划发送时刻
+	long long header_len;    //响应头长度，未收到完整响应头时为-1
+	long long body_len;      //Content-Length
+	long long received;      //已收到字节数
+	char head[2048];         //暂存响应头
+	int head_len;
+};
+
+static struct sockaddr_in server_addr;
+static const char *host = "127.0.0.1";
+static bool keep_alive = false;
+static int epollfd;
+
+static scenario scenarios[MAX_SCENARIO];
+static int scenario_count = 0;
+static int weight_total = 0;
+static unsigned int seed = 1;
+
+static double rate = 0;                    //开环模式的每秒请求数，0为闭环
+static long long open_start;               //开环模式的起始时刻
+static long long dispatched = 0;           //开环模式已发出的请求数
+static std::vector<client *> idle;         //开环模式空闲的连接
+
+static long long bytes = 0;
+
+static long long now_ns(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static scenario *add_scenario(const char *name, int weight){
+	if(scenario_count == MAX_SCENARIO || weight <= 0)
+		return NULL;
+	scenario *sc = &scenarios[scenario_count++];
+	sc->name = name;
+	sc->weight = weight;
+	weight_total += weight;
+	return sc;
+}
+
+static void build_get(scenario *sc, const char *url){
+	sc->request_len = snprintf(sc->request, sizeof(sc->request), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n\r\n",
+	                           url, host, keep_alive ? "keep-alive" : "close");
+}
+
+static void build_post(scenario *sc, const char *url, const char *body){
+	sc->request_len = snprintf(sc->request, sizeof(sc->request),
+	                           "POST %s HTTP/1.1\r\nHost: %s\r\nConnection: %s\r\n"
+	                           "Content-Type: application/x-www-form-urlencoded\r\nContent-Length: %d\r\n\r\n%s",
+	                           url, host, keep_alive ? "keep-alive" : "close", (int)strlen(body), body);
+}
+
+//解析 judge:70,beauty:10,login:20
+static bool parse_mix(char *mix){
+	for(char *item = strtok(mix, ","); item; item = strtok(NULL, ",")){
+		char *colon = strchr(item, ':');
+		int weight = colon ? atoi(colon + 1) : 1;
+		if(colon)
+			*colon = '\0';
+		scenario *sc = NULL;
+		if(strcmp(item, "judge") == 0 && (sc = add_scenario("judge", weight)))
+			build_get(sc, "/judge.html");
+		else if(strcmp(item, "beauty") == 0 && (sc = add_scenario("beauty", weight)))
+			build_get(sc, "/beauty.jpg");
+		else if(strcmp(item, "login") == 0 && (sc = add_scenario("login", weight)))
+			build_post(sc, "/2CGISQL.cgi", "user=123&password=123");
+		if(!sc){
+			printf("bad scenario: %s\n", item);
+			return false;
+		}
+	}
+	return scenario_count > 0;
+}
+
+//按配比随机选择场景
+static scenario *pick_scenario(){
+	if(scenario_count == 1)
+		return &scenarios[0];
+	int r = rand_r(&seed) % weight_total;
+	for(int i = 0; i < scenario_count; i++){
+		r -= scenarios[i].weight;
+		if(r < 0)
+			return &scenarios[i];
+	}
+	return &scenarios[scenario_count - 1];
+}
+
+//建立连接并注册写事件，连接建立后发送请求
+static bool open_conn(client *c){
+	c->fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if(c->fd < 0)
+		return false;
+	int one = 1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if(connect(c->fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0 && errno != EINPROGRESS){
+		close(c->fd);
+		c->fd = -1;
+		return false;
+	}
+
+	epoll_event ev;
+	ev.data.ptr = c;
+	ev.events = EPOLLOUT;
+	epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev);
+	return true;
+}
+
+static void close_conn(client *c){
+	if(c->fd < 0)
+		return;
+	epoll_ctl(epollfd, EPOLL_CTL_DEL, c->fd, 0);
+	close(c->fd);
+	c->fd = -1;
+}
+
+//在连接c上发出一个请求，start_ns为计时起点
+static void start_request(client *c, long long start_ns){
+	c->busy = true;
+	c->sc = pick_scenario();
+	c->sent = 0;
+	c->start_ns = start_ns;
+	c->header_len = -1;
+	c->body_len = 0;
+	c->received = 0;
+	c->head_len = 0;
+	if(c->fd >= 0){
+		epoll_event ev;
+		ev.data.ptr = c;
+		ev.events = EPOLLOUT;
+		epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+		return;
+	}
+	while(!open_conn(c))
+		usleep(1000);
+}
+
+//一个请求结束(成功或失败)，闭环模式立即发出下一个，开环模式归还连接
+static void finish_request(client *c, bool ok){
+	c->busy = false;
+	if(!ok || !keep_alive)
+		close_conn(c);
+	if(rate == 0){
+		start_request(c, now_ns());
+		return;
+	}
+	if(c->fd >= 0){
+		//空闲的长连接只关心对方关闭
+		epoll_event ev;
+		ev.data.ptr = c;
+		ev.events = EPOLLIN;
+		epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+	}
+	idle.push_back(c);
+}
+
+//开环模式：补发到当前时刻为止应发出的请求
+//没有空闲连接时请求继续排队，时延仍从计划时刻算起
+static void dispatch(long long now){
+	long long due = (long long)((now - open_start) / 1e9 * rate) + 1;
+	while(dispatched < due && !idle.empty()){
+		client *c = idle.back();
+		idle.pop_back();
+		start_request(c, open_start + (long long)(dispatched * 1e9 / rate));
+		dispatched++;
+	}
+}
+
+//解析响应头，找到空行和Content-Length
+static void parse_header(client *c){
+	c->head[c->head_len] = '\0';
+	char *end = strstr(c->head, "\r\n\r\n");
+	if(!end)
+		return;
+	c->header_len = end + 4 - c->head;
+	char *cl = strcasestr(c->head, "Content-Length:");
+	c->body_len = cl ? atoll(cl + 15) : 0;
+	if(strncmp(c->head + 8, " 200", 4) != 0)
+		c->sc->non_200++;
+}
+
+//发送请求，发完后改为监听读事件
+static void on_writable(client *c){
+	scenario *sc = c->sc;
+	while(c->sent < sc->request_len){
+		int n = send(c->fd, sc->request + c->sent, sc->request_len - c->sent, MSG_NOSIGNAL);
+		if(n < 0){
+			if(errno == EAGAIN)
+				return;
+			sc->errors++;
+			finish_request(c, false);
+			return;
+		}
+		c->sent += n;
+	}
+	epoll_event ev;
+	ev.data.ptr = c;
+	ev.events = EPOLLIN;
+	epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+static void on_readable(client *c){
+	static char buf[RESP_BUF_SIZE];
+	while(true){
+		int n = recv(c->fd, buf, sizeof(buf), 0);
+		if(n < 0 && errno == EAGAIN)
+			return;
+		if(!c->busy){
+			//服务器关闭了空闲的长连接，下次使用时重连
+			close_conn(c);
+			return;
+		}
+		if(n <= 0){
+			//对方关闭连接，响应不完整视为错误
+			c->sc->errors++;
+			finish_request(c, false);
+			return;
+		}
+
+		if(c->header_len < 0){
+			int copy = std::min(n, (int)sizeof(c->head) - 1 - c->head_len);
+			memcpy(c->head + c->head_len, buf, copy);
+			c->head_len += copy;
+			parse_header(c);
+		}
+		c->received += n;
+
+		//收到完整响应
+		if(c->header_len >= 0 && c->received >= c->header_len + c->body_len){
+			c->sc->hist.record(now_ns() - c->start_ns);
+			bytes += c->received;
+			finish_request(c, true);
+			return;
+		}
+	}
+}
+
+static void print_latency(const char *name, const histogram &h){
+	printf("%s latency(us) p50 %.1f p90 %.1f p99 %.1f p999 %.1f max %.1f\n", name,
+	       h.percentile(50) / 1000.0, h.percentile(90) / 1000.0, h.percentile(99) / 1000.0,
+	       h.percentile(99.9) / 1000.0, h.max / 1000.0);
+}
+
+//与HdrHistogram的outputPercentileDistribution相同的取点方式，每次剩余比例减半时取5个点
+static void write_percentiles(FILE *fp, const char *name, const histogram &h){
+	const int ticks = 5;
+	double p = 0;
+	while(true){
+		long long v = h.percentile(p);
+		fprintf(fp, "%s,%.3f,%.12f,%lld,%.2f\n", name, v / 1000.0, p / 100,
+		        (long long)ceil(p / 100 * h.total), p < 100 ? 100 / (100 - p) : INFINITY);
+		if(p >= 100 || v >= h.max)
+			break;
+		double half = pow(2, floor(log2(100 / (100 - p))) + 1);
+		p += 100 / (ticks * half);
+	}
+	if(p < 100)
+		fprintf(fp, "%s,%.3f,%.12f,%lld,inf\n", name, h.max / 1000.0, 1.0, h.total);
+}
+
+static void usage(const char *prog){
+	printf("usage: %s [-h ip] [-p port] [-c conns] [-d seconds] [-k] [-r rate] [-m judge:70,beauty:10,login:20] [-o csv] [url]\n", prog);
+}
+
+int main(int argc, char *argv[]){
+	int port = 9006;
+	int conns = 32;
+	int duration = 10;
+	char *mix = NULL;
+	const char *csv = NULL;
+
+	int opt;
+	while((opt = getopt(argc, argv, "h:p:c:d:kr:m:o:")) != -1){
+		switch(opt){
+			case 'h': host = optarg; break;
+			case 'p': port = atoi(optarg); break;
+			case 'c': conns = atoi(optarg); break;
+			case 'd': duration = atoi(optarg); break;
+			case 'k': keep_alive = true; break;
+			case 'r': rate = atof(optarg); break;
+			case 'm': mix = optarg; break;
+			case 'o': csv = optarg; break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+	//url与-m二选一
+	if(optind != argc - (mix ? 0 : 1) || conns <= 0 || rate < 0){
+		usage(argv[0]);
+		return 1;
+	}
+	if(mix){
+		if(!parse_mix(mix))
+			return 1;
+	}
+	else
+		build_get(add_scenario("get", 1), argv[optind]);
+
+	bzero(&server_addr, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_port = htons(port);
+	inet_pton(AF_INET, host, &server_addr.sin_addr);
+
+	epollfd = epoll_create(5);
+	std::vector<client> clients(conns);
+	open_start = now_ns();
+	for(int i = 0; i < conns; i++){
+		clients[i].fd = -1;
+		clients[i].busy = false;
+		if(rate == 0)
+			start_request(&clients[i], now_ns());
+		else
+			idle.push_back(&clients[i]);
+	}
+
+	epoll_event events[MAX_EVENT_NUMBER];
+	long long deadline = open_start + duration * 1000000000LL;
+	long long now;
+	while((now = now_ns()) < deadline){
+		if(rate > 0)
+			dispatch(now);
+		int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, rate > 0 ? 1 : 100);
+		for(int i = 0; i < number; i++){
+			client *c = (client *)events[i].data.ptr;
+			if(events[i].events & EPOLLOUT)
+				on_writable(c);
+			else if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				on_readable(c);
+		}
+	}
+
+	//输出统计结果
+	histogram *all = (histogram *)calloc(1, sizeof(histogram));
+	long long errors = 0, non_200 = 0;
+	for(int i = 0; i < scenario_count; i++){
+		all->merge(scenarios[i].hist);
+		errors += scenarios[i].errors;
+		non_200 += scenarios[i].non_200;
+	}
+	long long n = all->total;
+	if(n == 0){
+		printf("no response, errors %lld\n", errors);
+		return 1;
+	}
+	printf("requests %lld, errors %lld, %.0f req/s, %.2f MB/s\n", n, errors,
+	       n / (double)duration, bytes / (double)duration / 1048576);
+	if(rate > 0){
+		//到结束时仍未发出的请求说明服务器跟不上目标速率
+		long long due = (long long)((deadline - open_start) / 1e9 * rate);
+		printf("target %.0f req/s, dispatched %lld, backlog %lld\n", rate, dispatched, std::max(0LL, due - dispatched));
+	}
+	if(non_200)
+		printf("non-200 responses %lld\n", non_200);
+	print_latency("all", *all);
+	if(scenario_count > 1){
+		for(int i = 0; i < scenario_count; i++){
+			scenario *sc = &scenarios[i];
+			if(sc->hist.total == 0)
+				continue;
+			printf("%s requests %lld, errors %lld, non-200 %lld\n", sc->name, sc->hist.total, sc->errors, sc->non_200);
+			print_latency(sc->name, sc->hist);
+		}
+	}
+
+	if(csv){
+		FILE *fp = fopen(csv, "w");
+		if(!fp){
+			printf("cannot open %s\n", csv);
+			return 1;
+		}
+		fprintf(fp, "scenario,value_us,percentile,total_count,inverse_1_minus_percentile\n");
+		write_percentiles(fp, "all", *all);
+		for(int i = 0; i < scenario_count && scenario_count > 1; i++)
+			if(scenarios[i].hist.total)
+				write_percentiles(fp, scenarios[i].name, scenarios[i].hist);
+		fclose(fp);
+	}
+	return 0;
+}
@@ -0,0 +1,839 @@
+//微基准测试：请求解析、定时器链表、计数器、阻塞队列、日志和线程池的热点路径，以及每个请求的malloc次数
+//基于Google Benchmark，除耗时外每项还输出cycles/op，即每次操作的CPU周期数(x86上为TSC周期)
+//BM_conn_cache_misses另外输出每次操作的L1数据缓存和末级缓存缺失数，需要perf_event_open可用
+//用法：make microbench && ./microbench [--benchmark_filter=正则]
+//日志写到临时目录，结束时删除；线程池使用数据库替身(bench/dbstub)，不需要MySQL
+
+#include <benchmark/benchmark.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include "http_conn.h"
+#include "lst_timer.h"
+#include "block_queue.h"
+#include "log.h"
+#include "threadpool.h"
+#include "sql_connection_pool.h"
+#include "clock_service.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+static inline unsigned long long cycles(){
+	return __rdtsc();
+}
+#else
+//没有TSC的平台以纳秒代替周期
+static inline unsigned long long cycles(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+#endif
+
+//==========内存分配计数==========
+//替换malloc、calloc和realloc，按线程统计调用次数，operator new也经由malloc，一并计入
+//用于验证请求处理的稳态路径不调用malloc
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t n, size_t size);
+extern "C" void *__libc_realloc(void *p, size_t size);
+static __thread long long t_allocs = 0;
+
+extern "C" void *malloc(size_t size){
+	t_allocs++;
+	return __libc_malloc(size);
+}
+extern "C" void *calloc(size_t n, size_t size){
+	t_allocs++;
+	return __libc_calloc(n, size);
+}
+extern "C" void *realloc(void *p, size_t size){
+	t_allocs++;
+	return __libc_realloc(p, size);
+}
+
+//==========缓存缺失计数==========
+//用perf_event_open统计本线程用户态的L1数据缓存读缺失和末级缓存缺失，两个事件放在一组同时计数
+//perf_event_paranoid不允许或虚拟机没有暴露PMU时打开失败，ok()返回false
+struct cache_counters{
+	int l1_fd;
+	int llc_fd;
+
+	cache_counters(){
+		l1_fd = open_event(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16), -1);
+		llc_fd = l1_fd < 0 ? -1 : open_event(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, l1_fd);
+	}
+	~cache_counters(){
+		if(llc_fd >= 0)
+			close(llc_fd);
+		if(l1_fd >= 0)
+			close(l1_fd);
+	}
+	static int open_event(unsigned type, unsigned long long config, int group){
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = group < 0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+	}
+	bool ok(){ return llc_fd >= 0; }
+	void start(){
+		ioctl(l1_fd, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(l1_fd, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+	//读出组内两个事件的计数
+	void stop(unsigned long long *l1_miss, unsigned long long *llc_miss){
+		ioctl(l1_fd, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		unsigned long long v[3] = {0, 0, 0};   //事件数、L1缺失、末级缓存缺失
+		if(read(l1_fd, v, sizeof(v)) != (ssize_t)sizeof(v))
+			v[1] = v[2] = 0;
+		*l1_miss = v[1];
+		*llc_miss = v[2];
+	}
+};
+
+//spent为本线程计时区间内的周期数，ops为其间完成的操作数，多线程时取各线程的平均值
+static void report_cycles(benchmark::State &state, unsigned long long spent, long long ops){
+	state.counters["cycles/op"] = benchmark::Counter(ops ? (double)spent / ops : 0, benchmark::Counter::kAvgThreads);
+	state.SetItemsProcessed(ops);
+}
+
+//==========请求解析==========
+//录制的请求报文
+struct recorded_request{
+	const char *name;
+	const char *data;
+};
+
+static const recorded_request requests[] = {
+	{"curl_get",
+	 "GET /judge.html HTTP/1.1\r\n"
+	 "Host: 127.0.0.1:9006\r\n"
+	 "User-Agent: curl/7.88.1\r\n"
+	 "Accept: */*\r\n"
+	 "\r\n"},
+	{"browser_get",
+	 "GET /beauty.jpg HTTP/1.1\r\n"
+	 "Host: 192.168.1.10:9006\r\n"
+	 "Connection: keep-alive\r\n"
+	 "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+	 "Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+	 "Referer: http://192.168.1.10:9006/picture.html\r\n"
+	 "Accept-Encoding: gzip, deflate\r\n"
+	 "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+	 "\r\n"},
+	{"post_login",
+	 "POST /2CGISQL.cgi HTTP/1.1\r\n"
+	 "Host: 192.168.1.10:9006\r\n"
+	 "Connection: keep-alive\r\n"
+	 "Content-Length: 21\r\n"
+	 "Origin: http://192.168.1.10:9006\r\n"
+	 "Content-Type: application/x-www-form-urlencoded\r\n"
+	 "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36\r\n"
+	 "Referer: http://192.168.1.10:9006/log.html\r\n"
+	 "\r\n"
+	 "user=123&password=123"},
+};
+
+//通过友元访问http_conn的私有成员
+struct http_conn_bench{
+	static http_conn conn;
+
+	//只重置parse_line用到的状态，然后放入报文
+	//m_read_idx之后的字节应为0，先清掉上次放入的报文
+	static void load_lines(const char *data, int len){
+		memset(conn.m_read_buf, '\0', conn.m_read_idx);
+		memcpy(conn.m_read_buf, data, len);
+		conn.m_read_idx = len;
+		conn.m_checked_idx = 0;
+		conn.m_start_line = 0;
+	}
+	//切出报文中所有完整的行，返回行数
+	static int split_lines(){
+		int lines = 0;
+		while(conn.parse_line() == http_conn::LINE_OK){
+			conn.m_start_line = conn.m_checked_idx;
+			lines++;
+		}
+		return lines;
+	}
+	static void reset(http_conn &c = conn){
+		c.init();
+	}
+	//处理一个请求并生成响应报文，与工作线程中process的路径相同，但不发送
+	static int respond(const char *data, int len, http_conn &c = conn){
+		c.init();
+		c.feed(data, len);
+		http_conn::HTTP_CODE ret = c.process_read();
+		c.process_write(ret);
+		c.unmap();
+		return ret;
+	}
+	//主线程处理一个事件时访问的连接字段：代数检查、分发时的引用计数和定时器用到的读写进度
+	static int dispatch(http_conn &c, unsigned gen){
+		if(!c.current(gen))
+			return 0;
+		c.hold();
+		int ret = c.m_state + c.has_request_data() + c.reading_body() + c.bytes_pending();
+		c.release();
+		return ret;
+	}
+	//完整处理一个请求，包括do_request对目标文件的stat和mmap
+	static int process(const char *data, int len){
+		conn.init();
+		conn.feed(data, len);
+		int ret = conn.process_read();
+		conn.unmap();
+		return ret;
+	}
+};
+http_conn http_conn_bench::conn;
+
+static void BM_parse_line(benchmark::State &state){
+	const recorded_request &req = requests[state.range(0)];
+	int len = strlen(req.data);
+	http_conn_bench::reset();
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		http_conn_bench::load_lines(req.data, len);
+		benchmark::DoNotOptimize(http_conn_bench::split_lines());
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+	state.SetBytesProcessed(ops * len);
+	state.SetLabel(req.name);
+}
+BENCHMARK(BM_parse_line)->DenseRange(0, 2);
+
+//包含init()的开销，可减去BM_http_conn_init
+static void BM_process_read(benchmark::State &state){
+	const recorded_request &req = requests[state.range(0)];
+	int len = strlen(req.data);
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		benchmark::DoNotOptimize(http_conn_bench::process(req.data, len));
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+	state.SetBytesProcessed(ops * len);
+	state.SetLabel(req.name);
+}
+BENCHMARK(BM_process_read)->DenseRange(0, 2);
+
+//每个请求的malloc次数，预热一次后(文件缓存、arena块池已建立)应为0
+static void BM_request_allocs(benchmark::State &state){
+	const recorded_request &req = requests[state.range(0)];
+	int len = strlen(req.data);
+	http_conn_bench::respond(req.data, len);
+	long long ops = 0;
+	long long allocs = t_allocs;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		benchmark::DoNotOptimize(http_conn_bench::respond(req.data, len));
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+	state.counters["allocs/op"] = benchmark::Counter(ops ? (double)(t_allocs - allocs) / ops : 0);
+	state.SetLabel(req.name);
+}
+BENCHMARK(BM_request_allocs)->DenseRange(0, 2);
+
+static void BM_http_conn_init(benchmark::State &state){
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		http_conn_bench::reset();
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+}
+BENCHMARK(BM_http_conn_init);
+
+//按扩展名查Content-Type，文件读入缓存时调用一次，之后的请求直接复制查好的头部行
+static void BM_mime_of(benchmark::State &state){
+	static const char *const paths[] = {"/judge.html", "/beauty.jpg", "/favicon.ico", "/video.mp4", "/archive.tar.zst"};
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		benchmark::DoNotOptimize(&mime::of(paths[ops % 5]));
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+}
+BENCHMARK(BM_mime_of);
+
+//n个连接上的事件按随机顺序到达，每次操作处理其中一个连接，连接对象大多不在缓存中
+//mode为0时只访问主线程分发事件用到的字段，为1时在该连接上处理一个完整请求(curl_get)
+static void BM_conn_cache_misses(benchmark::State &state){
+	int n = state.range(0);
+	int mode = state.range(1);
+	const recorded_request &req = requests[0];
+	int len = strlen(req.data);
+	http_conn *conns = new http_conn[n];
+	for(int i = 0; i < n; i++)
+		http_conn_bench::respond(req.data, len, conns[i]);
+	std::vector<int> order(n);
+	unsigned int seed = 1;
+	for(int i = 0; i < n; i++)
+		order[i] = i;
+	for(int i = n - 1; i > 0; i--)
+		std::swap(order[i], order[rand_r(&seed) % (i + 1)]);
+
+	cache_counters pmu;
+	long long ops = 0;
+	int next = 0;
+	if(pmu.ok())
+		pmu.start();
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		http_conn &c = conns[order[next]];
+		if(++next == n)
+			next = 0;
+		if(mode == 0)
+			benchmark::DoNotOptimize(http_conn_bench::dispatch(c, c.gen()));
+		else
+			benchmark::DoNotOptimize(http_conn_bench::respond(req.data, len, c));
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+	if(pmu.ok()){
+		unsigned long long l1_miss, llc_miss;
+		pmu.stop(&l1_miss, &llc_miss);
+		state.counters["L1d-miss/op"] = benchmark::Counter(ops ? (double)l1_miss / ops : 0);
+		state.counters["LLC-miss/op"] = benchmark::Counter(ops ? (double)llc_miss / ops : 0);
+	}
+	char label[64];
+	snprintf(label, sizeof(label), "%s sizeof=%d%s", mode == 0 ? "dispatch" : "request",
+	         (int)sizeof(http_conn), pmu.ok() ? "" : " no_pmu");
+	state.SetLabel(label);
+	delete[] conns;
+}
+BENCHMARK(BM_conn_cache_misses)->ArgsProduct({{1024, 16384}, {0, 1}});
+
+//==========定时器链表==========
+static void noop_cb(client_data *){
+}
+
+static util_timer *make_timer(time_t expire){
+	util_timer *timer = new util_timer;
+	timer->expire = expire;
+	timer->cb_func = noop_cb;
+	timer->user_data = NULL;
+	return timer;
+}
+
+//服务器的常见情形：新定时器的超时时间最晚，插入到尾部，删除最早的定时器
+static void BM_timer_add_sequential(benchmark::State &state){
+	int n = state.range(0);
+	sort_timer_lst lst;
+	std::deque<util_timer *> timers;
+	time_t base = clock_service::mono() + 3600;
+	for(int i = 0; i < n; i++){
+		timers.push_back(make_timer(base + i));
+		lst.add_timer(timers.back());
+	}
+
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		lst.del_timer(timers.front());
+		timers.pop_front();
+		timers.push_back(make_timer(base + n + ops));
+		lst.add_timer(timers.back());
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+	state.SetLabel("del+add");
+}
+BENCHMARK(BM_timer_add_sequential)->Arg(1000)->Arg(10000)->Arg(100000);
+
+//最坏情形：超时时间随机，插入时需要从尾部向前查找
+static void BM_timer_add_random(benchmark::State &state){
+	int n = state.range(0);
+	sort_timer_lst lst;
+	std::vector<util_timer *> timers(n);
+	time_t base = clock_service::mono() + 3600;
+	unsigned int seed = 1;
+	//先排序再加入，避免准备阶段本身是O(n^2)
+	std::vector<time_t> expires(n);
+	for(int i = 0; i < n; i++)
+		expires[i] = base + rand_r(&seed) % n;
+	std::sort(expires.begin(), expires.end());
+	for(int i = 0; i < n; i++){
+		timers[i] = make_timer(expires[i]);
+		lst.add_timer(timers[i]);
+	}
+
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		int i = rand_r(&seed) % n;
+		lst.del_timer(timers[i]);
+		timers[i] = make_timer(base + rand_r(&seed) % n);
+		lst.add_timer(timers[i]);
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+	state.SetLabel("del+add");
+}
+BENCHMARK(BM_timer_add_random)->Arg(1000)->Arg(10000)->Arg(100000);
+
+//读写后推后超时时间，只修改expire，不移动节点
+static void BM_timer_adjust(benchmark::State &state){
+	int n = state.range(0);
+	sort_timer_lst lst;
+	std::vector<util_timer *> timers(n);
+	time_t base = clock_service::mono() + 3600;
+	unsigned int seed = 1;
+	for(int i = 0; i < n; i++){
+		timers[i] = make_timer(base + i);
+		lst.add_timer(timers[i]);
+	}
+
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		util_timer *timer = timers[rand_r(&seed) % n];
+		timer->expire += 15;
+		lst.adjust_timer(timer);
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+}
+BENCHMARK(BM_timer_adjust)->Arg(1000)->Arg(10000)->Arg(100000);
+
+//n个定时器均已到期，其中postponed%的expire已被推后，tick时需要重新插入
+static void BM_timer_tick(benchmark::State &state){
+	int n = state.range(0);
+	int postponed = state.range(1);
+	time_t now = clock_service::mono();
+	long long ops = 0;
+	unsigned long long spent = 0;
+	for(auto _ : state){
+		state.PauseTiming();
+		sort_timer_lst *lst = new sort_timer_lst;
+		for(int i = 0; i < n; i++){
+			util_timer *timer = make_timer(now - 10);
+			lst->add_timer(timer);
+			if(i % 100 < postponed)
+				timer->expire = now + 3600;
+		}
+		state.ResumeTiming();
+
+		unsigned long long start = cycles();
+		benchmark::DoNotOptimize(lst->tick());
+		spent += cycles() - start;
+		ops += n;
+
+		state.PauseTiming();
+		delete lst;
+		state.ResumeTiming();
+	}
+	report_cycles(state, spent, ops);
+	state.SetLabel("per timer");
+}
+BENCHMARK(BM_timer_tick)->Args({10000, 0})->Args({10000, 50})->Args({100000, 0})->Args({100000, 50});
+
+//==========时钟服务==========
+//主线程每轮事件循环调用一次
+static void BM_clock_update(benchmark::State &state){
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		clock_service::update();
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+}
+BENCHMARK(BM_clock_update);
+
+//每个响应读取一次Date
+static void BM_clock_date(benchmark::State &state){
+	char date[CLOCK_DATE_LEN + 1];
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		clock_service::date(date);
+		benchmark::DoNotOptimize(date);
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+}
+BENCHMARK(BM_clock_date)->Threads(1)->Threads(4)->UseRealTime();
+
+//==========计数器==========
+//每个线程写自己的分片，对比所有线程共用一个原子变量时缓存行在核之间来回传递的开销
+static void BM_counter_sharded(benchmark::State &state){
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		metrics::add(COUNTER_BYTES_READ, 64);
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+}
+BENCHMARK(BM_counter_sharded)->Threads(1)->Threads(4)->UseRealTime();
+
+static std::atomic<long long> shared_counter(0);
+
+static void BM_counter_shared_atomic(benchmark::State &state){
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		shared_counter.fetch_add(64, std::memory_order_relaxed);
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+}
+BENCHMARK(BM_counter_shared_atomic)->Threads(1)->Threads(4)->UseRealTime();
+
+//读取时汇总所有分片，用于连接数等低频读取
+static void BM_counter_aggregate(benchmark::State &state){
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		benchmark::DoNotOptimize(http_conn::user_count());
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+}
+BENCHMARK(BM_counter_aggregate);
+
+//==========阻塞队列==========
+//一半线程push，一半线程pop，每个线程的操作数相同，队列最终被取空
+static block_queue<int> *queue_under_test;
+
+static void BM_block_queue(benchmark::State &state){
+	if(state.thread_index() == 0)
+		queue_under_test = new block_queue<int>(1000);
+	bool producer = state.thread_index() % 2 == 0;
+	long long ops = 0, full = 0;
+	int item = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		if(producer){
+			while(!queue_under_test->push(item))
+				full++;
+		}
+		else
+			queue_under_test->pop(item);
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+	state.counters["full"] = benchmark::Counter(full);
+	if(state.thread_index() == 0)
+		delete queue_under_test;
+}
+BENCHMARK(BM_block_queue)->Threads(2)->Threads(4)->Threads(8)->UseRealTime();
+
+//==========线程池==========
+//空任务，只测量入队、唤醒和取任务的开销
+struct bench_task{
+	MYSQL *mysql;
+	int m_state;
+	void process(){}
+	void process_busy(){}
+	enum READ_STATUS{ READ_CLOSED = 0, READ_DATA, READ_WAIT };
+	READ_STATUS read_once(){ return READ_DATA; }
+	int classify(){ return 0; }
+	bool write(){ return true; }
+	void close_later(){}
+	void done(){}
+};
+
+static threadpool<bench_task> *pool;
+static bench_task task;
+
+static void BM_threadpool_append(benchmark::State &state){
+	if(state.thread_index() == 0 && !pool){
+		connection_pool *conn_pool = connection_pool::GetInstance();
+		conn_pool->init("localhost", "root", "", "bench", 3306, 8);
+		pool = new threadpool<bench_task>(conn_pool, 8);
+	}
+	long long ops = 0, rejected = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		if(!pool->append(&task))
+			rejected++;
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+	state.counters["rejected"] = benchmark::Counter(rejected);
+	//等工作线程处理完积压的任务，避免影响后面的测试项
+	if(state.thread_index() == 0)
+		while(pool->queue_depth() > 0)
+			usleep(1000);
+}
+BENCHMARK(BM_threadpool_append)->Threads(1)->Threads(2)->UseRealTime();
+
+//==========日志==========
+//同步写日志，range(0)为1时每条之后flush，与process_read中的用法相同
+//日志单例只能从同步切换到异步，所以同步的各项须在异步之前注册
+static void BM_log_write_sync(benchmark::State &state){
+	bool flush = state.range(0);
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		LOG_INFO("%s", "GET /judge.html HTTP/1.1");
+		if(flush)
+			Log::get_instance()->flush();
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+}
+BENCHMARK(BM_log_write_sync)->Arg(0)->Arg(1)->Threads(1)->Threads(4)->UseRealTime();
+
+static char log_path[64];
+
+//异步写日志，写线程跟不上时队列满，write_log退化为同步写
+static void BM_log_write_async(benchmark::State &state){
+	static bool async = false;
+	if(state.thread_index() == 0 && !async){
+		Log::get_instance()->init(log_path, 2000, 800000, 1000);
+		async = true;
+	}
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		LOG_INFO("%s", "GET /judge.html HTTP/1.1");
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+}
+BENCHMARK(BM_log_write_async)->Threads(1)->Threads(4)->UseRealTime();
+
+//==========HTTP/2==========
+//nghttp在同一连接上先后请求/picture.html和/beauty.jpg时发出的头部块，字段按Chrome 120填写，字符串都经过哈夫曼编码
+//第一个块引用静态表并把字段加入动态表，第二个块除:path外都引用第一个块加入的项
+static const unsigned char h2_block_page[] = {
+	0x82, 0x04, 0x8a, 0x62, 0xb3, 0x11, 0x36, 0xd8, 0x55, 0xe7, 0x4d, 0x34, 0x7f, 0x86, 0x41, 0x8c,
+	0x0b, 0xe2, 0x5c, 0x2e, 0x3c, 0xb8, 0x57, 0x08, 0x2e, 0x3e, 0x00, 0x39, 0x53, 0xc8, 0x49, 0x7c,
+	0xa5, 0x89, 0xd3, 0x4d, 0x1f, 0x43, 0xae, 0xba, 0x0c, 0x41, 0xa4, 0xc7, 0xa9, 0x8f, 0x33, 0xa6,
+	0x9a, 0x3f, 0xdf, 0x9a, 0x68, 0xfa, 0x1d, 0x75, 0xd0, 0x62, 0x0d, 0x26, 0x3d, 0x4c, 0x79, 0xa6,
+	0x8f, 0xbe, 0xd0, 0x01, 0x77, 0xfe, 0x8d, 0x48, 0xe6, 0x2b, 0x03, 0xee, 0x69, 0x7e, 0x8d, 0x48,
+	0xe6, 0x2b, 0x1e, 0x0b, 0x1d, 0x7f, 0x46, 0xa4, 0x73, 0x15, 0x81, 0xd7, 0x54, 0xdf, 0x5f, 0x2c,
+	0x7c, 0xfd, 0xf6, 0x80, 0x0b, 0xbd, 0x50, 0x8d, 0x9b, 0xd9, 0xab, 0xfa, 0x52, 0x42, 0xcb, 0x40,
+	0xd2, 0x5f, 0xa5, 0x23, 0xb3, 0x7a, 0xd5, 0xd0, 0x7f, 0x66, 0xa2, 0x81, 0xb0, 0xda, 0xe0, 0x53,
+	0xfa, 0xe4, 0x6a, 0xa4, 0x3f, 0x84, 0x29, 0xa7, 0x7a, 0x81, 0x02, 0xe0, 0xfb, 0x53, 0x91, 0xaa,
+	0x71, 0xaf, 0xb5, 0x3c, 0xb8, 0xd7, 0xf6, 0xa4, 0x35, 0xd7, 0x41, 0x79, 0x16, 0x3c, 0xc6, 0x4b,
+	0x0d, 0xb2, 0xea, 0xec, 0xb8, 0xa7, 0xf5, 0x9b, 0x1e, 0xfd, 0x19, 0xfe, 0x94, 0xa0, 0xdd, 0x4a,
+	0xa6, 0x22, 0x93, 0xa9, 0xff, 0xb5, 0x2f, 0x4f, 0x61, 0xe9, 0x2b, 0x01, 0x10, 0x17, 0x02, 0xe0,
+	0x5c, 0x0a, 0x6e, 0x1c, 0xa3, 0xb0, 0xcc, 0x36, 0xcb, 0xab, 0xb2, 0xe7, 0x51, 0x93, 0xf7, 0x3a,
+	0xd7, 0xb4, 0xfd, 0x7b, 0x9f, 0xef, 0xb4, 0x00, 0x5d, 0xff, 0xa2, 0xd5, 0xf7, 0xda, 0x00, 0x2e,
+	0xf7, 0x73, 0x9a, 0x9d, 0x29, 0xae, 0xe3, 0x0c, 0x05, 0xf1, 0x2e, 0x17, 0x1e, 0x5c, 0x2b, 0x84,
+	0x17, 0x1f, 0x00, 0x1c, 0x63, 0xa5, 0xb2, 0x4c, 0x55, 0xe7, 0x4d, 0x34, 0x7f, 0x60, 0xb3, 0x8a,
+	0x61, 0xc1, 0x8a, 0x10, 0xae, 0x15, 0xc2, 0x26, 0x5a, 0x6d, 0xc7, 0x5e, 0x7c, 0x0b, 0x85, 0xd0,
+	0x00, 0x00, 0x00, 0x00, 0x0f, 0xb5, 0x10, 0x54, 0x20, 0xc7, 0xaa, 0x07, 0xa5, 0x0b, 0x45, 0x69,
+	0xb9, 0x48, 0x52, 0x8c, 0x2e, 0x3a, 0x36, 0xc6, 0xcb, 0x92, 0x16, 0x49, 0x1a, 0x8c, 0xa3, 0x13,
+	0x6d, 0x33, 0x40, 0x87, 0x41, 0x48, 0xb1, 0x27, 0x5a, 0xd1, 0xff, 0xb7, 0xfe, 0x74, 0x9d, 0x31,
+	0x42, 0xa5, 0xdb, 0x07, 0x54, 0x9f, 0xcf, 0xdf, 0x78, 0x3f, 0x97, 0xbf, 0x9f, 0xa5, 0x3f, 0x9b,
+	0xd3, 0xd8, 0x7a, 0x4d, 0x6d, 0x3f, 0xcf, 0xdf, 0x78, 0x3f, 0x90, 0x88, 0x1f, 0xcf, 0xd2, 0x9f,
+	0xce, 0x23, 0x9e, 0x6a, 0x0a, 0xa5, 0xe9, 0xec, 0x3d, 0x25, 0xfe, 0x7e, 0xfb, 0xc1, 0xfc, 0x84,
+	0x40, 0xfe, 0x7f, 0x40, 0x8b, 0x41, 0x48, 0xb1, 0x27, 0x5a, 0xd1, 0xad, 0x49, 0xe3, 0x35, 0x05,
+	0x02, 0x3f, 0x30, 0x40, 0x8d, 0x41, 0x48, 0xb1, 0x27, 0x5a, 0xd1, 0xad, 0x5d, 0x03, 0x4c, 0xa7,
+	0xb2, 0x9f, 0x88, 0xfe, 0x79, 0x1a, 0xa9, 0x0f, 0xe1, 0x1f, 0xcf, 0x40, 0x92, 0xb6, 0xb9, 0xac,
+	0x1c, 0x85, 0x58, 0xd5, 0x20, 0xa4, 0xb6, 0xc2, 0xad, 0x61, 0x7b, 0x5a, 0x54, 0x25, 0x1f, 0x01,
+	0x31, 0x40, 0x8a, 0x41, 0x48, 0xb4, 0xa5, 0x49, 0x27, 0x59, 0x06, 0x49, 0x7f, 0x88, 0x40, 0xe9,
+	0x2a, 0xc7, 0xb0, 0xd3, 0x1a, 0xaf, 0x40, 0x8a, 0x41, 0x48, 0xb4, 0xa5, 0x49, 0x27, 0x5a, 0x93,
+	0xc8, 0x5f, 0x86, 0xa8, 0x7d, 0xcd, 0x30, 0xd2, 0x5f, 0x40, 0x8a, 0x41, 0x48, 0xb4, 0xa5, 0x49,
+	0x27, 0x5a, 0x42, 0xa1, 0x3f, 0x86, 0x90, 0xe4, 0xb6, 0x92, 0xd4, 0x9f,
+};
+static const unsigned char h2_block_image[] = {
+	0x82, 0x04, 0x89, 0x62, 0x32, 0x8e, 0xd4, 0xfa, 0x5f, 0xa5, 0x73, 0x7f, 0x86, 0xcb, 0xca, 0xc9,
+	0xc8, 0xc7, 0xc6, 0xc5, 0xc4, 0xc3, 0xc2, 0xc1, 0xc0, 0xbf, 0xbe,
+};
+
+//两个块解码后的字段，只有:path不同
+struct h2_bench_field{
+	const char *name;
+	const char *value;                  //NULL表示:path，值由调用者给出
+};
+
+static const h2_bench_field h2_fields[] = {
+	{":method", "GET"},
+	{":path", NULL},
+	{":scheme", "http"},
+	{":authority", "192.168.1.10:9006"},
+	{"accept", "text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8"},
+	{"accept-encoding", "gzip, deflate, br"},
+	{"user-agent", "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36"},
+	{"accept-language", "zh-CN,zh;q=0.9,en;q=0.8"},
+	{"referer", "http://192.168.1.10:9006/judge.html"},
+	{"cookie", "_ga=GA1.1.1234567890.1700000000; session=8f14e45fceea167a5a36dedd4bea2543"},
+	{"sec-ch-ua", "\"Not_A Brand\";v=\"8\", \"Chromium\";v=\"120\", \"Google Chrome\";v=\"120\""},
+	{"sec-ch-ua-mobile", "?0"},
+	{"sec-ch-ua-platform", "\"Windows\""},
+	{"upgrade-insecure-requests", "1"},
+	{"sec-fetch-site", "same-origin"},
+	{"sec-fetch-mode", "navigate"},
+	{"sec-fetch-dest", "document"},
+};
+static const int h2_field_count = sizeof(h2_fields) / sizeof(h2_fields[0]);
+
+//解码一个头部块并与期望的字段逐个比较
+static bool hpack_check(hpack_decoder &d, const unsigned char *block, int len, const char *path){
+	d.begin((const char *)block, len);
+	hpack_field f;
+	for(int i = 0; i < h2_field_count; i++){
+		const char *name = h2_fields[i].name;
+		const char *value = h2_fields[i].value ? h2_fields[i].value : path;
+		if(d.next(&f) != 1)
+			return false;
+		if(f.name_len != (int)strlen(name) || memcmp(f.name, name, f.name_len) != 0)
+			return false;
+		if(f.value_len != (int)strlen(value) || memcmp(f.value, value, f.value_len) != 0)
+			return false;
+	}
+	return d.next(&f) == 0;
+}
+
+//两个块解码出的名字和值的总字节数
+static int hpack_field_bytes(){
+	int bytes = strlen("/picture.html") + strlen("/beauty.jpg");
+	for(int i = 0; i < h2_field_count; i++)
+		bytes += 2 * (strlen(h2_fields[i].name) + (h2_fields[i].value ? strlen(h2_fields[i].value) : 0));
+	return bytes;
+}
+
+//同一个解码器反复解码两个块，每轮都向动态表加入十几项，几轮后表满，之后每轮都要淘汰
+//计时前后各逐字段校验一次，循环中只核对字段数和总字节数
+static void BM_hpack_decode(benchmark::State &state){
+	hpack_decoder d;
+	if(!hpack_check(d, h2_block_page, sizeof(h2_block_page), "/picture.html")
+		|| !hpack_check(d, h2_block_image, sizeof(h2_block_image), "/beauty.jpg")){
+		state.SkipWithError("decoded fields mismatch");
+		return;
+	}
+	const unsigned char *blocks[2] = {h2_block_page, h2_block_image};
+	int lens[2] = {(int)sizeof(h2_block_page), (int)sizeof(h2_block_image)};
+	int expect = hpack_field_bytes();
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		int fields = 0, bytes = 0;
+		hpack_field f;
+		for(int i = 0; i < 2; i++){
+			d.begin((const char *)blocks[i], lens[i]);
+			while(d.next(&f) == 1){
+				fields++;
+				bytes += f.name_len + f.value_len;
+			}
+		}
+		if(fields != 2 * h2_field_count || bytes != expect){
+			state.SkipWithError("decoded fields mismatch");
+			break;
+		}
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+	if(!hpack_check(d, h2_block_page, sizeof(h2_block_page), "/picture.html")
+		|| !hpack_check(d, h2_block_image, sizeof(h2_block_image), "/beauty.jpg"))
+		state.SkipWithError("decoded fields mismatch after eviction");
+	state.SetBytesProcessed(ops * (lens[0] + lens[1]));
+}
+BENCHMARK(BM_hpack_decode);
+
+//追加一帧
+static void h2_put_frame(std::vector<char> &out, int type, int flags, unsigned int id, const void *payload, int len){
+	unsigned char head[9] = {(unsigned char)(len >> 16), (unsigned char)(len >> 8), (unsigned char)len, (unsigned char)type, (unsigned char)flags,
+		(unsigned char)(id >> 24), (unsigned char)(id >> 16), (unsigned char)(id >> 8), (unsigned char)id};
+	out.insert(out.end(), (const char *)head, (const char *)head + 9);
+	out.insert(out.end(), (const char *)payload, (const char *)payload + len);
+}
+
+//先知模式的连接一次读到的数据：前言、SETTINGS、WINDOW_UPDATE，拆成HEADERS和CONTINUATION的第一个请求，第二个请求和PING
+static std::vector<char> h2_batch(){
+	std::vector<char> out(H2_PREFACE, H2_PREFACE + H2_PREFACE_LEN);
+	unsigned char settings[12] = {0, H2_SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, 100, 0, H2_SETTINGS_INITIAL_WINDOW_SIZE, 0, 0, 0xff, 0xff};
+	h2_put_frame(out, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+	unsigned char increment[4] = {0x3f, 0xff, 0, 0};
+	h2_put_frame(out, H2_WINDOW_UPDATE, 0, 0, increment, sizeof(increment));
+	int split = 200;
+	h2_put_frame(out, H2_HEADERS, H2_FLAG_END_STREAM, 13, h2_block_page, split);
+	h2_put_frame(out, H2_CONTINUATION, H2_FLAG_END_HEADERS, 13, h2_block_page + split, sizeof(h2_block_page) - split);
+	h2_put_frame(out, H2_HEADERS, H2_FLAG_END_STREAM | H2_FLAG_END_HEADERS, 15, h2_block_image, sizeof(h2_block_image));
+	unsigned char ping[8] = {0};
+	h2_put_frame(out, H2_PING, 0, 0, ping, sizeof(ping));
+	return out;
+}
+
+//检查请求流的编号和receive记下的字段
+static bool h2_check_stream(h2_stream *s, unsigned int id, const char *path){
+	return s && s->id == id && !s->bad && !s->post && strcmp(s->path, path) == 0
+		&& strcmp(s->authority, "192.168.1.10:9006") == 0 && strcmp(s->accept_encoding, "gzip, deflate, br") == 0;
+}
+
+//每轮新建一个会话处理整批帧，取出两个请求并校验，包含会话的构造、start()排入SETTINGS和析构
+static void BM_h2_receive(benchmark::State &state){
+	std::vector<char> batch = h2_batch();
+	int len = batch.size();
+	long long ops = 0;
+	unsigned long long start = cycles();
+	for(auto _ : state){
+		h2_session s;
+		s.start();
+		int used = s.receive(batch.data(), len, http_conn::READ_BUFFER_SIZE);
+		h2_stream *page = s.next_request();
+		h2_stream *image = s.next_request();
+		if(used != len || !h2_check_stream(page, 13, "/picture.html") || !h2_check_stream(image, 15, "/beauty.jpg") || s.next_request()){
+			state.SkipWithError("h2 frames mismatch");
+			break;
+		}
+		ops++;
+	}
+	report_cycles(state, cycles() - start, ops);
+	state.SetBytesProcessed(ops * len);
+}
+BENCHMARK(BM_h2_receive);
+
+//删除临时目录下的日志文件
+static void remove_dir(const char *dir){
+	DIR *d = opendir(dir);
+	if(!d)
+		return;
+	char path[256];
+	struct dirent *entry;
+	while((entry = readdir(d)) != NULL){
+		if(entry->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		unlink(path);
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+int main(int argc, char **argv){
+	char dir[] = "/tmp/microbench.XXXXXX";
+	if(!mkdtemp(dir)){
+		perror("mkdtemp");
+		return 1;
+	}
+	snprintf(log_path, sizeof(log_path), "%s/ServerLog", dir);
+	clock_service::update();
+	Log::get_instance()->init(log_path, 2000, 800000, 0);
+
+	benchmark::Initialize(&argc, argv);
+	if(benchmark::ReportUnrecognizedArguments(argc, argv))
+		return 1;
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+	remove_dir(dir);
+	return 0;
+}
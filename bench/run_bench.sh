@@ -0,0 +1,47 @@
+#!/bin/bash
+#端到端压测：用数据库替身(bench/dbstub)编译的server_bench，分别以闭环和开环、长连接和短连接跑场景配比
+#由 make bench 调用，也可以单独执行(先 make server_bench loadgen)
+#各项的时延分位数以HdrHistogram格式写入 bench/results/<模式>.csv，便于和上一次的结果对比
+#用法：bench/run_bench.sh [端口] [每项持续秒数] [连接数] [开环每秒请求数]
+#环境变量：MIX 场景配比，SERVER_ARGS 服务器的额外参数，DBSTUB_LATENCY_US 数据库替身每条语句的时延
+
+PORT=${1:-9006}
+DURATION=${2:-10}
+CONNS=${3:-64}
+RATE=${4:-5000}
+MIX=${MIX:-judge:70,beauty:10,login:20}
+
+cd "$(dirname "$0")/.."
+if [ ! -x ./server_bench ] || [ ! -x ./loadgen ]; then
+	echo "run 'make server_bench loadgen' first"
+	exit 1
+fi
+if [ ! -d /root/intrv/webservnote/root ]; then
+	echo "warning: doc root /root/intrv/webservnote/root not found, static requests will fail"
+fi
+
+RESULTS=bench/results
+mkdir -p $RESULTS
+
+#服务器日志写在当前目录，放到临时目录中结束后删除
+LOGDIR=$(mktemp -d)
+(cd $LOGDIR && exec "$OLDPWD/server_bench" $SERVER_ARGS $PORT > /dev/null 2>&1) &
+PID=$!
+trap 'kill $PID 2>/dev/null; wait $PID 2>/dev/null; rm -rf $LOGDIR' EXIT
+sleep 1
+if ! kill -0 $PID 2>/dev/null; then
+	echo "server_bench failed to start on port $PORT"
+	exit 1
+fi
+
+run(){
+	NAME=$1
+	shift
+	echo "== $NAME"
+	./loadgen -p $PORT -c $CONNS -d $DURATION -m $MIX -o $RESULTS/$NAME.csv "$@"
+}
+
+run closed_keepalive -k
+run closed_close
+run open_keepalive -k -r $RATE
+run open_close -r $RATE
@@ -0,0 +1,63 @@
+#!/bin/bash
+#对比epoll(-e 0)和io_uring(-e 1)两种I/O引擎每个请求的系统调用次数和吞吐量
+#先执行 make server loadgen，服务器需要能连上数据库
+#系统调用次数用perf统计raw_syscalls:sys_enter，没有perf时用strace -c，都没有则只输出吞吐量
+#io_uring引擎另外在日志中定期输出主线程的系统调用次数(io_uring: ... syscalls per response)
+#用法：bench/syscall_bench.sh [端口] [每项持续秒数] [连接数]
+
+PORT=${1:-9006}
+DURATION=${2:-10}
+CONNS=${3:-64}
+
+URLS="/judge.html /beauty.jpg"
+
+cd "$(dirname "$0")/.."
+if [ ! -x ./server ] || [ ! -x ./loadgen ]; then
+	echo "run 'make server loadgen' first"
+	exit 1
+fi
+
+if command -v perf > /dev/null; then
+	TRACER=perf
+elif command -v strace > /dev/null; then
+	TRACER=strace
+else
+	TRACER=none
+	echo "perf and strace not found, syscall counts unavailable"
+fi
+
+for ENGINE in 0 1; do
+	for URL in $URLS; do
+		./server -e $ENGINE $PORT > /dev/null 2>&1 &
+		PID=$!
+		sleep 1
+
+		#统计整个服务器进程(包括工作线程)的系统调用
+		case $TRACER in
+			perf)   perf stat -e raw_syscalls:sys_enter -p $PID -x, -o /tmp/syscall_bench.$$ & ;;
+			strace) strace -c -f -p $PID -o /tmp/syscall_bench.$$ & ;;
+		esac
+		TPID=$!
+		sleep 0.5
+
+		echo "== io_engine $ENGINE, $URL, $CONNS keep-alive connections"
+		OUT=$(./loadgen -p $PORT -c $CONNS -d $DURATION -k $URL)
+		echo "$OUT"
+
+		if [ $TRACER != none ]; then
+			kill -INT $TPID
+			wait $TPID 2>/dev/null
+			if [ $TRACER = perf ]; then
+				CALLS=$(awk -F, '/raw_syscalls/ {print $1}' /tmp/syscall_bench.$$)
+			else
+				CALLS=$(awk '$NF == "total" {print $(NF-2)}' /tmp/syscall_bench.$$)
+			fi
+			REQS=$(echo "$OUT" | awk '/^requests/ {print $2 + 0}')
+			echo "syscalls $CALLS, $(awk -v c=$CALLS -v r=$REQS 'BEGIN {printf "%.2f", r ? c / r : 0}') per request"
+			rm -f /tmp/syscall_bench.$$
+		fi
+
+		kill $PID
+		wait $PID 2>/dev/null
+	done
+done
@@ -0,0 +1,66 @@
+#!/bin/bash
+#TLS握手压力下已建立连接的时延：CLIENTS个openssl s_time不断新建连接做完整握手，同时用一个长连接顺序请求PROBES次
+#握手的签名运算和SSL_read、SSL_write在哪个线程执行，决定了它们是否挡住主线程分发其他连接的事件
+#先执行 make server_bench，需要openssl和curl命令
+#用法：bench/tls_bench.sh 证书 私钥 [端口] [持续秒数] [握手客户端数]
+#环境变量：SERVER_ARGS 服务器的额外参数，PROBES 长连接上的请求数
+#每次运行在 bench/results/tls_handshake.csv 中追加一行
+
+CERT=$1
+KEY=$2
+PORT=${3:-9006}
+DURATION=${4:-10}
+CLIENTS=${5:-4}
+PROBES=${PROBES:-2000}
+
+if [ -z "$CERT" ] || [ -z "$KEY" ]; then
+	echo "usage: $0 cert_file key_file [port] [seconds] [clients]"
+	exit 1
+fi
+CERT=$(realpath "$CERT")
+KEY=$(realpath "$KEY")
+
+cd "$(dirname "$0")/.."
+if [ ! -x ./server_bench ]; then
+	echo "run 'make server_bench' first"
+	exit 1
+fi
+
+RESULTS=bench/results/tls_handshake.csv
+[ -f $RESULTS ] || echo "server_args,key,clients,handshakes_per_s,probe_requests,probe_p50_us,probe_p99_us,probe_max_us" > $RESULTS
+
+#服务器日志写在当前目录，放到临时目录中结束后删除
+LOGDIR=$(mktemp -d)
+(cd $LOGDIR && exec "$OLDPWD/server_bench" $SERVER_ARGS -s "$CERT,$KEY" $PORT > /dev/null 2>&1) &
+PID=$!
+trap 'kill $PID 2>/dev/null; wait $PID 2>/dev/null; rm -rf $LOGDIR' EXIT
+sleep 1
+if ! kill -0 $PID 2>/dev/null; then
+	echo "server_bench failed to start on port $PORT"
+	exit 1
+fi
+
+#握手客户端，每个连接只完成握手和一个很小的请求
+for i in $(seq $CLIENTS); do
+	openssl s_time -connect 127.0.0.1:$PORT -new -time $DURATION -www /judge.html > $LOGDIR/s_time.$i 2>&1 &
+done
+
+#同一个长连接上顺序请求，每个请求的首字节时间按微秒记录
+sleep 1
+URLS=()
+for i in $(seq $PROBES); do
+	URLS+=(https://127.0.0.1:$PORT/judge.html -o /dev/null)
+done
+curl -k -s -w '%{time_starttransfer}\n' "${URLS[@]}" | awk '{printf "%d\n", $1 * 1000000}' | sort -n > $LOGDIR/probe
+wait $(jobs -p | grep -v "^$PID$") 2>/dev/null
+
+HANDSHAKES=$(cat $LOGDIR/s_time.* | awk '/connections in .*real seconds/ {n += $1} END {print n + 0}')
+COUNT=$(wc -l < $LOGDIR/probe)
+P50=$(awk -v n=$COUNT 'NR == int(n * 0.5) + 1' $LOGDIR/probe)
+P99=$(awk -v n=$COUNT 'NR == int(n * 0.99) + 1' $LOGDIR/probe)
+MAX=$(tail -1 $LOGDIR/probe)
+KEYTYPE=$(openssl x509 -in "$CERT" -noout -text | awk -F'[:(]' '/Public Key Algorithm/ {gsub(/ /, "", $2); alg = $2} /Public-Key/ {gsub(/[ bit)]/, "", $3); print alg "-" $3; exit}')
+RATE=$(awk -v n=$HANDSHAKES -v d=$DURATION 'BEGIN {printf "%.0f", n / d}')
+
+echo "== SERVER_ARGS='$SERVER_ARGS' $KEYTYPE, $CLIENTS handshake clients: $RATE handshakes/s, keep-alive probe p50 ${P50}us p99 ${P99}us max ${MAX}us"
+echo "\"$SERVER_ARGS\",$KEYTYPE,$CLIENTS,$RATE,$COUNT,$P50,$P99,$MAX" >> $RESULTS
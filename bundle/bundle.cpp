@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "bundle.h"
+
+//把文件读入已分配的内存，出错或文件变短返回false
+static bool read_all(int fd, char *buf, size_t len)
+{
+    size_t got = 0;
+    while (got < len)
+    {
+        ssize_t n = pread(fd, buf + got, len - got, got);
+        if (n <= 0)
+            return false;
+        got += n;
+    }
+    return true;
+}
+
+//复制到大页内存中，优先使用预留的大页(hugetlbfs)，没有时用按2MB对齐的普通匿名内存并建议透明大页
+//返回的内存只读，失败返回NULL
+static char *load_huge(int fd, size_t len, bool *huge)
+{
+    size_t huge_len = (len + BUNDLE_HUGE_PAGE - 1) & ~(BUNDLE_HUGE_PAGE - 1);
+    char *base = (char *)mmap(NULL, huge_len, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    if (base != MAP_FAILED)
+        *huge = true;
+    else
+    {
+        //多映射一个大页用于对齐，透明大页只覆盖2MB对齐的区间；须在写入前madvise，缺页时才按大页分配
+        char *raw = (char *)mmap(NULL, huge_len + BUNDLE_HUGE_PAGE, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED)
+            return NULL;
+        base = (char *)(((unsigned long)raw + BUNDLE_HUGE_PAGE - 1) & ~(BUNDLE_HUGE_PAGE - 1));
+        if (base > raw)
+            munmap(raw, base - raw);
+        munmap(base + huge_len, raw + BUNDLE_HUGE_PAGE - base);
+        *huge = madvise(base, huge_len, MADV_HUGEPAGE) == 0;
+    }
+    if (!read_all(fd, base, len))
+    {
+        munmap(base, huge_len);
+        return NULL;
+    }
+    mprotect(base, huge_len, PROT_READ);
+    return base;
+}
+
+bundle *bundle::open(const char *path, bool huge)
+{
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        fprintf(stderr, "bundle: cannot open %s\n", path);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(bundle_header))
+    {
+        fprintf(stderr, "bundle: %s: not a bundle\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    //镜像在进程的整个生命周期内有效，不会munmap
+    //多进程模式下在fork前打开，worker共享同一份物理页
+    bundle *b = new bundle;
+    char *base;
+    if (huge)
+        base = load_huge(fd, st.st_size, &b->m_huge);
+    else
+    {
+        //MAP_POPULATE在mmap返回前读入全部页并建立页表，处理请求时不会缺页
+        base = (char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (base == MAP_FAILED)
+            base = NULL;
+    }
+    close(fd);
+    if (!base)
+    {
+        fprintf(stderr, "bundle: %s: cannot map\n", path);
+        delete b;
+        return NULL;
+    }
+
+    b->m_base = base;
+    b->m_header = (const bundle_header *)base;
+    b->m_entries = (const bundle_entry *)(base + sizeof(bundle_header));
+    if (b->m_header->size != (unsigned long long)st.st_size || !b->check())
+    {
+        fprintf(stderr, "bundle: %s: corrupt or wrong version\n", path);
+        munmap(base, st.st_size);
+        delete b;
+        return NULL;
+    }
+    return b;
+}
+
+//校验索引中所有的偏移都在镜像之内、字符串都有结尾，之后查找和发送不再检查边界
+bool bundle::check() const
+{
+    const bundle_header *h = m_header;
+    unsigned long long size = h->size;
+    if (memcmp(h->magic, BUNDLE_MAGIC, 8) != 0 || h->version != BUNDLE_VERSION)
+        return false;
+    //槽数是2的幂且至少有一个空槽，查找总会结束
+    if (h->slots == 0 || (h->slots & (h->slots - 1)) != 0 || h->files >= h->slots)
+        return false;
+    if (sizeof(bundle_header) + (unsigned long long)h->slots * sizeof(bundle_entry) > size)
+        return false;
+
+    unsigned int files = 0;
+    for (unsigned int i = 0; i < h->slots; i++)
+    {
+        const bundle_entry &e = m_entries[i];
+        if (e.hash == 0)
+            continue;
+        files++;
+        unsigned int strings[3] = {e.path, e.etag, e.headers};
+        for (int j = 0; j < 3; j++)
+            if (strings[j] >= size || !memchr(at(strings[j]), '\0', size - strings[j]))
+                return false;
+        if (strlen(at(e.headers)) != e.headers_len)
+            return false;
+        if (e.data > size || e.size > size - e.data || e.gz_data > size || e.gz_size > size - e.gz_data)
+            return false;
+        if (at(e.path)[0] != '/' || hash(at(e.path)) != e.hash)
+            return false;
+    }
+    return files == h->files;
+}
+
+const bundle_entry *bundle::find(const char *path) const
+{
+    unsigned long long h = hash(path);
+    unsigned int mask = m_header->slots - 1;
+    for (unsigned int i = h & mask; ; i = (i + 1) & mask)
+    {
+        const bundle_entry *e = &m_entries[i];
+        if (e->hash == 0)
+            return NULL;
+        if (e->hash == h && strcmp(at(e->path), path) == 0)
+            return e;
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+//静态资源镜像：把一个文档根目录打包成单个文件，启动时整体映射到内存
+//运行期间查找和发送都不访问文件系统，工作集在启动时就已读入
+//
+//镜像布局，偏移都从文件开头算起，按本机字节序：
+//  bundle_header
+//  bundle_entry[slots]     按路径哈希开放寻址的索引，hash为0的槽为空
+//  字符串区                 路径、ETag和预先拼好的响应头，以'\0'结尾
+//  数据区                   每个文件及其gzip压缩版本，按BUNDLE_ALIGN对齐
+//由bundle_pack生成：make root.bundle
+
+#define BUNDLE_MAGIC "WSBUNDLE"
+#define BUNDLE_VERSION 2
+#define BUNDLE_ALIGN 64                    //数据按缓存行对齐
+#define BUNDLE_PATH_LEN 128                //路径以/开头，相对文档根目录
+#define BUNDLE_HUGE_PAGE (2UL << 20)
+
+struct bundle_header{
+    char magic[8];
+    unsigned int version;
+    unsigned int slots;                     //索引槽数，2的幂，至少是文件数的两倍
+    unsigned int files;
+    unsigned int reserved;
+    unsigned long long size;                //镜像总字节数
+};
+
+struct bundle_entry{
+    unsigned long long hash;                //路径的FNV-1a哈希，0表示空槽
+    unsigned int path;                      //字符串区中的偏移
+    unsigned int etag;                      //带引号的强ETag，由内容哈希得到
+    unsigned int headers;                   //Content-Type、ETag和Vary头部行，发送时原样复制
+    unsigned int headers_len;
+    unsigned long long data;                //原文件在镜像中的偏移和长度
+    unsigned long long size;
+    unsigned long long gz_data;             //gzip版本，压缩后不够小时gz_size为0
+    unsigned long long gz_size;
+    long long mtime;                        //打包时原文件的修改时间
+};
+
+class bundle{
+public:
+    //路径哈希，打包和查找使用同一个函数，结果不为0
+    static unsigned long long hash(const char *path)
+    {
+        unsigned long long h = 14695981039346656037ULL;
+        for (; *path; path++)
+            h = (h ^ (unsigned char)*path) * 1099511628211ULL;
+        return h ? h : 1;
+    }
+
+    //映射并校验镜像，失败时向stderr输出原因并返回NULL
+    //huge为true时复制到大页内存中(没有预留的大页时退回透明大页)，否则以MAP_POPULATE映射文件本身
+    static bundle *open(const char *path, bool huge);
+
+    //path以/开头，找不到返回NULL
+    const bundle_entry *find(const char *path) const;
+    //镜像中偏移off处的数据
+    const char *at(unsigned long long off) const { return m_base + off; }
+
+    unsigned int files() const { return m_header->files; }
+    unsigned long long size() const { return m_header->size; }
+    bool huge() const { return m_huge; }
+
+private:
+    bundle() : m_base(0), m_header(0), m_entries(0), m_huge(false) {}
+    bool check() const;
+
+    const char *m_base;
+    const bundle_header *m_header;
+    const bundle_entry *m_entries;
+    bool m_huge;                            //镜像在大页内存中
+};
+
+#endif
@@ -0,0 +1,221 @@
+//把文档根目录打包成静态资源镜像，格式见bundle.h
+//用法：bundle_pack 文档根目录 输出文件
+//同样的输入总是生成相同的镜像：文件按路径排序，gzip头中不写时间
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "bundle.h"
+#include "mime.h"
+
+//gzip版本至少比原文件小这么多(%)才打包，图片等已压缩的文件不值得让客户端解压
+#define PACK_GZIP_MIN_SAVING 10
+
+struct pack_file{
+    std::string path;                       //以/开头，相对文档根目录
+    std::string data;
+    std::string gz;
+    std::string etag;
+    std::string headers;
+    long long mtime;
+    bundle_entry entry;
+};
+
+static bool read_file(const std::string &name, std::string *out)
+{
+    FILE *fp = fopen(name.c_str(), "rb");
+    if (!fp)
+        return false;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        out->append(buf, n);
+    bool ok = !ferror(fp);
+    fclose(fp);
+    return ok;
+}
+
+//递归收集目录下的普通文件，跳过以.开头的文件和目录
+static bool collect(const std::string &root, const std::string &rel, std::vector<pack_file> *files)
+{
+    std::string dir = root + rel;
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+    {
+        fprintf(stderr, "bundle_pack: cannot open %s\n", dir.c_str());
+        return false;
+    }
+    bool ok = true;
+    struct dirent *entry;
+    while (ok && (entry = readdir(d)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+        std::string path = rel + "/" + entry->d_name;
+        struct stat st;
+        if (stat((root + path).c_str(), &st) < 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+            ok = collect(root, path, files);
+        else if (S_ISREG(st.st_mode))
+        {
+            if (path.size() >= BUNDLE_PATH_LEN)
+            {
+                fprintf(stderr, "bundle_pack: path too long: %s\n", path.c_str());
+                ok = false;
+                break;
+            }
+            pack_file f;
+            f.path = path;
+            f.mtime = st.st_mtime;
+            ok = read_file(root + path, &f.data);
+            if (!ok)
+                fprintf(stderr, "bundle_pack: cannot read %s\n", (root + path).c_str());
+            files->push_back(f);
+        }
+    }
+    closedir(d);
+    return ok;
+}
+
+//gzip格式(windowBits加16)，最高压缩级别，只在打包时做一次
+static bool gzip(const std::string &in, std::string *out)
+{
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, 9, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK)
+        return false;
+    out->resize(deflateBound(&zs, in.size()));
+    zs.next_in = (Bytef *)in.data();
+    zs.avail_in = in.size();
+    zs.next_out = (Bytef *)&(*out)[0];
+    zs.avail_out = out->size();
+    int ret = deflate(&zs, Z_FINISH);
+    out->resize(zs.total_out);
+    deflateEnd(&zs);
+    return ret == Z_STREAM_END;
+}
+
+static unsigned long long align_up(unsigned long long n)
+{
+    return (n + BUNDLE_ALIGN - 1) & ~(unsigned long long)(BUNDLE_ALIGN - 1);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: %s root_dir output_file\n", argv[0]);
+        return 1;
+    }
+    std::string root = argv[1];
+    while (root.size() > 1 && root[root.size() - 1] == '/')
+        root.erase(root.size() - 1);
+
+    std::vector<pack_file> files;
+    if (!collect(root, "", &files))
+        return 1;
+    if (files.empty())
+    {
+        fprintf(stderr, "bundle_pack: %s: no files\n", root.c_str());
+        return 1;
+    }
+    std::sort(files.begin(), files.end(), [](const pack_file &a, const pack_file &b) { return a.path < b.path; });
+
+    unsigned int slots = 2;
+    while (slots < files.size() * 2)
+        slots <<= 1;
+
+    //字符串区紧跟索引，数据区从对齐的位置开始
+    unsigned long long strings_off = sizeof(bundle_header) + (unsigned long long)slots * sizeof(bundle_entry);
+    std::string strings;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        pack_file &f = files[i];
+        //ETag为全部内容的FNV-1a哈希，内容中可能有'\0'，不能用bundle::hash
+        char etag[32];
+        unsigned long long h = 14695981039346656037ULL;
+        for (size_t j = 0; j < f.data.size(); j++)
+            h = (h ^ (unsigned char)f.data[j]) * 1099511628211ULL;
+        snprintf(etag, sizeof(etag), "\"%016llx\"", h);
+        f.etag = etag;
+        if (!f.data.empty() && gzip(f.data, &f.gz) && f.gz.size() * 100 > f.data.size() * (100 - PACK_GZIP_MIN_SAVING))
+            f.gz.clear();
+        //类型与服务器从文件系统发送时相同，有压缩版本时响应随Accept-Encoding变化
+        f.headers = std::string(mime::of(f.path.c_str()).header) + "ETag:" + f.etag + "\r\n";
+        if (!f.gz.empty())
+            f.headers += "Vary:Accept-Encoding\r\n";
+
+        memset(&f.entry, 0, sizeof(f.entry));
+        f.entry.hash = bundle::hash(f.path.c_str());
+        f.entry.path = strings_off + strings.size();
+        strings.append(f.path).push_back('\0');
+        f.entry.etag = strings_off + strings.size();
+        strings.append(f.etag).push_back('\0');
+        f.entry.headers = strings_off + strings.size();
+        f.entry.headers_len = f.headers.size();
+        strings.append(f.headers).push_back('\0');
+        f.entry.mtime = f.mtime;
+    }
+
+    unsigned long long off = align_up(strings_off + strings.size());
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        pack_file &f = files[i];
+        f.entry.data = off;
+        f.entry.size = f.data.size();
+        off = align_up(off + f.data.size());
+        if (!f.gz.empty())
+        {
+            f.entry.gz_data = off;
+            f.entry.gz_size = f.gz.size();
+            off = align_up(off + f.gz.size());
+        }
+    }
+
+    std::string image(off, '\0');
+    bundle_header *header = (bundle_header *)&image[0];
+    memcpy(header->magic, BUNDLE_MAGIC, 8);
+    header->version = BUNDLE_VERSION;
+    header->slots = slots;
+    header->files = files.size();
+    header->size = off;
+    bundle_entry *entries = (bundle_entry *)&image[sizeof(bundle_header)];
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        pack_file &f = files[i];
+        unsigned int slot = f.entry.hash & (slots - 1);
+        while (entries[slot].hash != 0)
+            slot = (slot + 1) & (slots - 1);
+        entries[slot] = f.entry;
+        memcpy(&image[f.entry.data], f.data.data(), f.data.size());
+        if (!f.gz.empty())
+            memcpy(&image[f.entry.gz_data], f.gz.data(), f.gz.size());
+    }
+    memcpy(&image[strings_off], strings.data(), strings.size());
+
+    //先写临时文件再改名，正在运行的服务器不会映射到写了一半的镜像
+    std::string tmp = std::string(argv[2]) + ".tmp";
+    FILE *fp = fopen(tmp.c_str(), "wb");
+    if (!fp || fwrite(image.data(), 1, image.size(), fp) != image.size() || fclose(fp) != 0 ||
+        rename(tmp.c_str(), argv[2]) != 0)
+    {
+        fprintf(stderr, "bundle_pack: cannot write %s\n", argv[2]);
+        unlink(tmp.c_str());
+        return 1;
+    }
+
+    unsigned long long gz_files = 0;
+    for (size_t i = 0; i < files.size(); i++)
+        gz_files += !files[i].gz.empty();
+    printf("%s: %zu files (%llu with gzip), %llu bytes\n", argv[2], files.size(), gz_files, off);
+    return 0;
+}
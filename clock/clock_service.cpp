@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <string.h>
+#include "clock_service.h"
+
+std::atomic<unsigned> clock_service::s_seq(0);
+std::atomic<unsigned long long> clock_service::s_words[CLOCK_WORDS];
+
+static const char *week_days[7] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+static const char *months[12] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                 "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+
+//写者私有的上一份快照，秒数不变时只更新微秒部分
+static clock_snapshot last;
+
+void clock_service::update()
+{
+    struct timespec mono_ts, wall_ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &mono_ts);
+    clock_gettime(CLOCK_REALTIME, &wall_ts);
+
+    last.mono = mono_ts.tv_sec;
+    last.mono_ms = mono_ts.tv_sec * 1000LL + mono_ts.tv_nsec / 1000000;
+    if (wall_ts.tv_sec != last.wall)
+    {
+        last.wall = wall_ts.tv_sec;
+        struct tm gmt, local;
+        gmtime_r(&last.wall, &gmt);
+        localtime_r(&last.wall, &local);
+        //不用strftime，避免受locale影响
+        snprintf(last.date, sizeof(last.date), "%s, %02d %s %d %02d:%02d:%02d GMT",
+                 week_days[gmt.tm_wday], gmt.tm_mday, months[gmt.tm_mon], gmt.tm_year + 1900,
+                 gmt.tm_hour, gmt.tm_min, gmt.tm_sec);
+        snprintf(last.log_ts, sizeof(last.log_ts), "%d-%02d-%02d %02d:%02d:%02d.000000",
+                 local.tm_year + 1900, local.tm_mon + 1, local.tm_mday,
+                 local.tm_hour, local.tm_min, local.tm_sec);
+        last.mday = local.tm_mday;
+    }
+    last.usec = wall_ts.tv_nsec / 1000;
+    long usec = last.usec;
+    for (int i = CLOCK_LOG_TS_LEN - 1; i >= CLOCK_LOG_TS_LEN - 6; i--)
+    {
+        last.log_ts[i] = '0' + usec % 10;
+        usec /= 10;
+    }
+
+    unsigned long long words[CLOCK_WORDS];
+    memcpy(words, &last, sizeof(last));
+    unsigned seq = s_seq.load(std::memory_order_relaxed);
+    s_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    for (unsigned i = 0; i < CLOCK_WORDS; i++)
+        s_words[i].store(words[i], std::memory_order_relaxed);
+    s_seq.store(seq + 2, std::memory_order_release);
+}
+
+void clock_service::read(clock_snapshot *out)
+{
+    unsigned long long words[CLOCK_WORDS];
+    unsigned begin, end;
+    do
+    {
+        begin = s_seq.load(std::memory_order_acquire);
+        for (unsigned i = 0; i < CLOCK_WORDS; i++)
+            words[i] = s_words[i].load(std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_acquire);
+        end = s_seq.load(std::memory_order_relaxed);
+    } while ((begin & 1) || begin != end);
+    memcpy(out, words, sizeof(*out));
+}
+
+void clock_service::date(char *buf)
+{
+    clock_snapshot s;
+    read(&s);
+    memcpy(buf, s.date, sizeof(s.date));
+}
@@ -0,0 +1,67 @@
+#ifndef CLOCK_SERVICE_H
+#define CLOCK_SERVICE_H
+
+#include <atomic>
+#include <time.h>
+
+//Date头的格式(RFC 7231 IMF-fixdate)，如 Sun, 06 Nov 1994 08:49:37 GMT
+#define CLOCK_DATE_LEN 29
+//日志时间戳的格式，如 2026-10-19 05:21:00.123456
+#define CLOCK_LOG_TS_LEN 26
+
+//时钟快照
+struct alignas(8) clock_snapshot{
+    time_t mono;                        //粗粒度单调时钟，秒，定时器使用
+    long long mono_ms;                  //粗粒度单调时钟，毫秒，限流使用
+    time_t wall;                        //墙上时间，秒
+    long usec;                          //墙上时间的微秒部分
+    int mday;                           //本地时间的日，日志按天切分
+    char date[CLOCK_DATE_LEN + 1];      //Date头的值
+    char log_ts[CLOCK_LOG_TS_LEN + 1];  //日志时间戳
+};
+
+#define CLOCK_WORDS ((sizeof(clock_snapshot) + 7) / 8)
+
+//进程级的时钟服务
+//主线程每轮事件循环调用一次update，工作线程、定时器和日志只读取快照，不再调用time、gettimeofday和localtime
+//快照通过seqlock发布：写者修改前后各把序号加一，读者在序号为偶数且前后一致时才接受读到的副本
+//快照按8字节原子字存放，读者与写者并发时不存在数据竞争
+class clock_service{
+public:
+    //读取系统时钟并发布新快照，只能由一个线程调用
+    //clock_gettime走vDSO不陷入内核，日期字符串每秒才重新格式化一次
+    static void update();
+
+    //读取完整快照
+    static void read(clock_snapshot *out);
+
+    static time_t mono()
+    {
+        clock_snapshot s;
+        read(&s);
+        return s.mono;
+    }
+
+    static long long mono_ms()
+    {
+        clock_snapshot s;
+        read(&s);
+        return s.mono_ms;
+    }
+
+    static time_t wall()
+    {
+        clock_snapshot s;
+        read(&s);
+        return s.wall;
+    }
+
+    //复制Date头的值到buf，buf至少CLOCK_DATE_LEN + 1字节
+    static void date(char *buf);
+
+private:
+    static std::atomic<unsigned> s_seq;
+    static std::atomic<unsigned long long> s_words[CLOCK_WORDS];
+};
+
+#endif
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <string.h>
+#include "config.h"
+#include "master.h"
+#include "affinity.h"
+
+Config::Config(){
+	port = 0;
+	
+	//默认proactor，主线程负责读写
+	actor_model = 0;
+	
+	//默认epoll
+	io_engine = 0;
+	
+	backlog = 1024;
+	
+	header_timeout = 10;
+	body_timeout = 30;
+	request_timeout = 60;
+	min_send_rate = 1024;
+	conn_rate = 0;
+	conn_burst = 0;
+	request_rate = 0;
+	request_burst = 0;
+	overload_depth = 5000;
+	overload_age = 500;
+	task_deadline = 3000;
+	codel_target = 5;
+	codel_interval = 100;
+	vhost_file = NULL;
+	bundle_file = NULL;
+	bundle_huge = false;
+	tls_cert = NULL;
+	tls_key = NULL;
+	workers = 0;
+	stats_port = 0;
+	CPU_ZERO(&reactor_cpus);
+	CPU_ZERO(&worker_cpus);
+	CPU_ZERO(&log_cpus);
+	incoming_cpu = false;
+}
+
+//reactor/workers/log三段CPU列表，如"0/2-9/1"，某段为空表示该类线程不绑定
+static bool parse_cpus(const char *arg, cpu_set_t *sets[3]){
+	char buf[256];
+	if(snprintf(buf, sizeof(buf), "%s", arg) >= (int)sizeof(buf))
+		return false;
+	char *part = buf;
+	for(int i = 0; i < 3; i++){
+		char *slash = part ? strchr(part, '/') : NULL;
+		if(slash)
+			*slash = '\0';
+		if(!affinity::parse(part, sets[i]))
+			return false;
+		part = slash ? slash + 1 : NULL;
+	}
+	//多于三段
+	return part == NULL;
+}
+
+void Config::usage(const char *prog){
+	printf("usage：%s [-a actor_model] [-e io_engine] [-b backlog] [-t timeouts] [-l limits] [-q overload] [-d queue_policy] [-v vhost_file] [-r bundle_file[,huge]] [-s cert_file,key_file] [-w workers] [-c cpus] [-i] port_number\n", prog);
+	printf("  -a  0: proactor(default), 1: reactor\n");
+	printf("  -e  0: epoll(default), 1: io_uring, proactor only\n");
+	printf("  -b  listen backlog, default 1024\n");
+	printf("  -t  header_timeout,body_timeout,request_timeout(s),min_send_rate(B/s), default 10,30,60,1024\n");
+	printf("  -l  per-IP conn_rate,conn_burst,request_rate,request_burst(/s), default 0,0,0,0 (unlimited)\n");
+	printf("  -q  overload queue_depth,queue_age(ms): answer 503 when the pool queue exceeds either, default 5000,500\n");
+	printf("  -d  task_deadline,codel_target,codel_interval(ms): 503 after queueing past the deadline (0: never), LIFO when the delay stays above target, default 3000,5,100\n");
+	printf("  -v  virtual host config: host/root/cache/route/cgi lines, first host is the default\n");
+	printf("  -r  serve the default host from a packed image (make root.bundle); ,huge copies it into huge pages\n");
+	printf("  -s  terminate TLS with the given PEM certificate chain and private key, epoll only; implies -a 1\n");
+	printf("  -w  workers[,stats_port]: master/worker processes on SO_REUSEPORT, default 0 (single process)\n");
+	printf("  -c  reactor/workers/log CPU lists, e.g. 0/2-9/1; empty part leaves those threads unpinned\n");
+	printf("  -i  with -w, set SO_INCOMING_CPU on each worker's listener to its reactor CPU\n");
+}
+
+bool Config::parse_arg(int argc, char *argv[]){
+	int opt;
+	bool actor_given = false;
+	const char *str = "a:e:b:t:l:q:d:v:r:s:w:c:i";
+	while((opt = getopt(argc, argv, str)) != -1){
+		switch(opt){
+			case 'a':
+			{
+				actor_model = atoi(optarg);
+				if(actor_model != 0 && actor_model != 1)
+					return false;
+				actor_given = true;
+				break;
+			}
+			case 'e':
+			{
+				io_engine = atoi(optarg);
+				if(io_engine != 0 && io_engine != 1)
+					return false;
+				break;
+			}
+			case 'b':
+			{
+				backlog = atoi(optarg);
+				if(backlog <= 0)
+					return false;
+				break;
+			}
+			case 't':
+			{
+				if(sscanf(optarg, "%d,%d,%d,%d", &header_timeout, &body_timeout, &request_timeout, &min_send_rate) != 4)
+					return false;
+				if(header_timeout <= 0 || body_timeout <= 0 || request_timeout <= 0 || min_send_rate <= 0)
+					return false;
+				break;
+			}
+			case 'l':
+			{
+				if(sscanf(optarg, "%d,%d,%d,%d", &conn_rate, &conn_burst, &request_rate, &request_burst) != 4)
+					return false;
+				if(conn_rate < 0 || request_rate < 0 || (conn_rate > 0 && conn_burst <= 0) || (request_rate > 0 && request_burst <= 0))
+					return false;
+				break;
+			}
+			case 'q':
+			{
+				if(sscanf(optarg, "%d,%d", &overload_depth, &overload_age) != 2)
+					return false;
+				if(overload_depth <= 0 || overload_age <= 0)
+					return false;
+				break;
+			}
+			case 'd':
+			{
+				if(sscanf(optarg, "%d,%d,%d", &task_deadline, &codel_target, &codel_interval) != 3)
+					return false;
+				if(task_deadline < 0 || codel_target <= 0 || codel_interval <= 0)
+					return false;
+				break;
+			}
+			case 'v':
+			{
+				vhost_file = optarg;
+				break;
+			}
+			case 'r':
+			{
+				char *comma = strchr(optarg, ',');
+				if(comma){
+					*comma = '\0';
+					if(strcmp(comma + 1, "huge") != 0)
+						return false;
+					bundle_huge = true;
+				}
+				bundle_file = optarg;
+				break;
+			}
+			case 's':
+			{
+				char *comma = strchr(optarg, ',');
+				if(!comma || comma == optarg || comma[1] == '\0')
+					return false;
+				*comma = '\0';
+				tls_cert = optarg;
+				tls_key = comma + 1;
+				break;
+			}
+			case 'w':
+			{
+				if(sscanf(optarg, "%d,%d", &workers, &stats_port) < 1)
+					return false;
+				if(workers < 0 || workers > MASTER_MAX_WORKERS || stats_port < 0)
+					return false;
+				break;
+			}
+			case 'c':
+			{
+				cpu_set_t *sets[3] = {&reactor_cpus, &worker_cpus, &log_cpus};
+				if(!parse_cpus(optarg, sets))
+					return false;
+				break;
+			}
+			case 'i':
+			{
+				incoming_cpu = true;
+				break;
+			}
+			default:
+				return false;
+		}
+	}
+	
+	//io_uring引擎下读写都由主线程提交，与reactor模式冲突
+	if(actor_model == 1 && io_engine == 1)
+		return false;
+	
+	//io_uring引擎直接提交recv和writev，不经过OpenSSL
+	if(tls_cert && io_engine == 1)
+		return false;
+	
+	//proactor模式下握手的签名运算和记录的加解密都在主线程执行，期间其他连接的事件都要等待
+	//TLS连接改用reactor模式交给工作线程，显式指定-a 0时拒绝
+	//bench/tls_bench.sh：单核、4个客户端不断握手(RSA-2048)时，长连接请求的p50从4.9ms降到1.9ms，p99从11.2ms降到6.9ms
+	if(tls_cert){
+		if(actor_given && actor_model == 0)
+			return false;
+		actor_model = 1;
+	}
+	
+	//单进程只有一个监听socket，SO_INCOMING_CPU只在SO_REUSEPORT的socket之间选择时起作用
+	if(incoming_cpu && workers == 0)
+		return false;
+	
+	//端口是唯一的位置参数
+	if(optind != argc - 1)
+		return false;
+	port = atoi(argv[optind]);
+	return port > 0;
+}
@@ -0,0 +1,81 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <sched.h>
+
+//启动参数，未指定的选项使用默认值
+class Config{
+	public:
+		Config();
+		~Config(){}
+		
+		//解析命令行参数，格式错误返回false
+		bool parse_arg(int argc, char *argv[]);
+		//打印用法
+		void usage(const char *prog);
+		
+	public:
+		int port;           //监听端口
+		
+		//并发模型，0为proactor(主线程读写，工作线程解析)，1为reactor(工作线程负责读、解析和写)
+		int actor_model;
+		
+		//I/O引擎，0为epoll，1为io_uring(主线程批量提交accept、recv和writev)
+		int io_engine;
+		
+		//listen的全连接队列长度，实际值受/proc/sys/net/core/somaxconn限制
+		int backlog;
+		
+		//请求头、请求体的接收超时和请求总超时(s)，以及发送响应的最低速率(B/s)
+		//用于防止慢速发送(slowloris)和慢速读取的客户端长期占用连接
+		int header_timeout;
+		int body_timeout;
+		int request_timeout;
+		int min_send_rate;
+		
+		//单IP限流：每秒新建连接数及突发量，每秒请求数及突发量，速率为0表示不限制
+		//登录和注册请求按LIMIT_DB_COST个请求计
+		int conn_rate;
+		int conn_burst;
+		int request_rate;
+		int request_burst;
+		
+		//过载阈值：线程池的队列深度或队首请求的排队时间(ms)超过其一时，主线程直接回复503并暂停accept
+		int overload_depth;
+		int overload_age;
+		
+		//排队超过task_deadline(ms)的请求直接回复503，为0时不丢弃
+		//排队时延持续codel_interval(ms)超过codel_target(ms)时线程池改为LIFO出队
+		int task_deadline;
+		int codel_target;
+		int codel_interval;
+		
+		//虚拟主机配置文件，为NULL时只有一个默认主机，文档根目录和路由与原来相同
+		const char *vhost_file;
+		
+		//默认主机(-v时为配置文件中的第一个主机)的静态资源镜像，由bundle_pack生成，为NULL时从文档根目录读取
+		//bundle_huge为true时把镜像复制到大页内存中
+		const char *bundle_file;
+		bool bundle_huge;
+		
+		//TLS的证书链和私钥文件(PEM)，为NULL时只提供明文HTTP
+		const char *tls_cert;
+		const char *tls_key;
+		
+		//worker进程数，0为单进程；大于0时master fork出worker并在其退出后重启
+		//stats_port不为0时master在该端口输出所有worker汇总的/metrics
+		int workers;
+		int stats_port;
+		
+		//主线程(reactor)、工作线程和异步写日志线程允许使用的CPU，空集合表示不绑定
+		//多进程模式下第i个worker的主线程绑定到reactor_cpus中的第i个CPU，不指定时由master按编号分配
+		cpu_set_t reactor_cpus;
+		cpu_set_t worker_cpus;
+		cpu_set_t log_cpus;
+		
+		//多进程模式下在每个worker的监听socket上设置SO_INCOMING_CPU为其主线程所在的CPU
+		//网卡RSS队列的中断绑定到这些CPU后，连接由收包的那个核上的worker处理，数据不跨核、不跨NUMA节点
+		bool incoming_cpu;
+};
+
+#endif
@@ -1,6 +1,11 @@
 #include "http_conn.h"
 #include "log.h"
+#include "clock_service.h"
+#include "ip_limiter.h"
+#include "vhost.h"
+#include "affinity.h"
 #include <map>
+#include <new>
 #include <mysql/mysql.h>
 #include <fstream>
 
@@ -14,18 +19,18 @@
 const char* ok_200_title = "OK";
 const char* error_400_title = "Bad Request";
 const char* error_400_form = "Your request has bad syntax or is inherently impossible to staisfy.\n";
+const char* not_modified_304_title = "Not Modified";
 const char* error_403_title = "Forbidden";
 const char* error_403_form = "You do not have permission to get file from this server.\n";
 const char* error_404_title = "Not Found";
 const char* error_404_form = "The requested file was not found on this server.\n";
+const char* error_429_title = "Too Many Requests";
 const char* error_500_title = "Internal Error";
 const char* error_500_form = "There was an unusual problem serving the request file.\n";
 
-//当浏览器出现连接重置时，可能是网站根目录出错或http响应格式出错或访问的文件中内容完全为空
-const char* doc_root = "/root/intrv/webservnote/root";
-
 //将表中的用户名和密码放入map
-map<string, string> users;
+//透明比较器，可以直接用char*查找，登录时不用为用户名构造临时的string
+map<string, string, less<> > users;
 locker m_lock;
 
 //将数据库中的用户名和密码载入到服务器的map中来，map中的key为用户名，value为密码
@@ -70,9 +75,11 @@ int setnonblocking(int fd){
 }
 
 //将内核事件表注册读事件，设置ET模式，选择开启EPOLLONESHOT
-void addfd(int epollfd, int fd, bool one_shot){
+//fd须已是非阻塞的：连接由accept4直接创建为非阻塞，省去每个连接两次fcntl
+//gen为连接代数，与fd一起放在epoll_data.u64中，不是连接的描述符为0
+void addfd(int epollfd, int fd, bool one_shot, unsigned gen){
 	epoll_event event;
-	event.data.fd = fd;
+	event.data.u64 = http_conn::handle(fd, gen);
 	
 #ifdef connfdET
 	event.events = EPOLLIN | EPOLLET | EPOLLRDHUP;
@@ -93,7 +100,6 @@ void addfd(int epollfd, int fd, bool one_shot){
 	if(one_shot)
 		event.events |= EPOLLONESHOT;
 	epoll_ctl(epollfd, EPOLL_CTL_ADD, fd, &event);
-	setnonblocking(fd);
 }
 
 //从内核事件表中删除描述符
@@ -103,9 +109,9 @@ void removefd(int epollfd, int fd){
 }
 
 //将事件重置为EPOLLONESHOT
-void modfd(int epollfd, int fd, int ev){
+void modfd(int epollfd, int fd, int ev, unsigned gen){
 	epoll_event event;
-	event.data.fd = fd;
+	event.data.u64 = http_conn::handle(fd, gen);
 	
 #ifdef connfdLT
 	event.events = ev | EPOLLONESHOT | EPOLLRDHUP;
@@ -118,17 +124,82 @@ void modfd(int epollfd, int fd, int ev){
 	epoll_ctl(epollfd, EPOLL_CTL_MOD, fd, &event);
 }
 
-int http_conn::m_user_count = 0;
 int http_conn::m_epollfd = -1;
+completion_queue<http_conn> *http_conn::m_completion = NULL;
+int http_conn::m_actor_model = 0;
+int http_conn::m_io_engine = 0;
+int http_conn::m_retry_after = 0;
+std::atomic<bool> http_conn::m_draining(false);
+http_conn::cold_data *http_conn::m_cold_pool = NULL;
+int http_conn::m_cold_count = 0;
+int http_conn::m_cold_used = 0;
+
+bool http_conn::reserve_cold(int count, int node)
+{
+    if (node < 0)
+        return true;
+    m_cold_pool = (cold_data *)affinity::alloc_memory(sizeof(cold_data) * count, node);
+    if (!m_cold_pool)
+        return false;
+    m_cold_count = count;
+    return true;
+}
+
+//在所有连接析构之后调用
+void http_conn::release_cold_pool()
+{
+    affinity::free_memory(m_cold_pool, sizeof(cold_data) * m_cold_count);
+    m_cold_pool = NULL;
+    m_cold_count = 0;
+    m_cold_used = 0;
+}
+
+//预留区用完或没有预留时从堆上分配
+http_conn::cold_data *http_conn::alloc_cold()
+{
+    //热数据以m_cold结束，必须在对象开头的两个缓存行内，新增的热字段超出时编译失败
+    //http_conn的成员有不同的访问控制，不是标准布局，GCC对没有虚基类的类支持offsetof，只关闭这一处的提示
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winvalid-offsetof"
+    static_assert(offsetof(http_conn, m_cold) + sizeof(m_cold) <= 128, "http_conn hot fields exceed two cache lines");
+#pragma GCC diagnostic pop
+    if (m_cold_used < m_cold_count)
+    if (m_cold_used < m_cold_count)
+        return new (m_cold_pool + m_cold_used++) cold_data();
+    return new cold_data();
+}
+
+void http_conn::free_cold()
+{
+    if (m_cold >= m_cold_pool && m_cold < m_cold_pool + m_cold_count)
+        m_cold->~cold_data();
+    else
+        delete m_cold;
+    m_cold = 0;
+}
+
+void http_conn::init_busy_response(int retry_after)
+{
+    m_retry_after = retry_after;
+}
 
-//关闭连接，关闭一个连接，客户总量减一
+//Date头随时间变化，每次发送时重新格式化
+int http_conn::busy_response(char *buf, int size)
+{
+    char date[CLOCK_DATE_LEN + 1];
+    clock_service::date(date);
+    return snprintf(buf, size, "HTTP/1.1 503 Service Unavailable\r\nDate:%s\r\nRetry-After:%d\r\n"
+                               "Content-Length:0\r\nConnection:close\r\n\r\n", date, m_retry_after);
+}
+
+//关闭连接，计入关闭数，客户总量减一
 void http_conn::close_conn(bool real_close)
 {
     if (real_close && (m_sockfd != -1))
     {
         removefd(m_epollfd, m_sockfd);
         m_sockfd = -1;
-        m_user_count--;
+        metrics::add(COUNTER_CLOSED);
     }
 }
 
@@ -136,12 +207,25 @@ void http_conn::close_conn(bool real_close)
 void http_conn::init(int sockfd, const sockaddr_in &addr)
 {
     m_sockfd = sockfd;
-    m_address = addr;
     //int reuse=1;
     //setsockopt(m_sockfd,SOL_SOCKET,SO_REUSEADDR,&reuse,sizeof(reuse));
-    addfd(m_epollfd, sockfd, true);
-    m_user_count++;
+    //主线程持有的引用，关闭连接时归还
+    m_refs.store(1, std::memory_order_relaxed);
+    //io_uring引擎下读写请求由主线程直接提交，不注册到epoll
+    if (m_io_engine == 0)
+        addfd(m_epollfd, sockfd, true, gen());
+    m_accept_ns = metrics::now_ns();
+    metrics::add(COUNTER_ACCEPTED);
+    m_cq_event = CQ_WRITE;
+    m_state = 0;
+    //上一个连接在发送途中被关闭(超时、对方断开、优雅退出或过载拒绝)时，没发完的文件和流在这里释放
+    //编号被复用说明最后一个引用已经归还，没有工作线程还在使用这些文件
+    unmap();
+    //上一个连接的SSL对象在这里释放，之前可能还有工作线程在使用
+    delete m_tls;
+    m_tls = tls_context::enabled() ? new tls_conn(sockfd) : 0;
     init();
+    m_cold->address = addr;
 }
 
 //初始化新接受的连接
@@ -151,40 +235,85 @@ void http_conn::init()
     mysql = NULL;
     bytes_to_send = 0;
     bytes_have_send = 0;
+    m_ready_ns = 0;
+    m_limit_checked = false;
     m_check_state = CHECK_STATE_REQUESTLINE;
     m_linger = false;
     m_method = GET;
     m_url = 0;
-    m_version = 0;
     m_content_length = 0;
     m_host = 0;
+    m_accept_gzip = false;
+    m_upgrade_h2 = false;
+    m_if_none_match = 0;
+    m_h2_settings = 0;
+    m_vhost = vhost::get_default();
     m_start_line = 0;
     m_checked_idx = 0;
-    m_read_idx = 0;
     m_write_idx = 0;
     cgi = 0;
-    memset(m_read_buf, '\0', READ_BUFFER_SIZE);
-    memset(m_write_buf, '\0', WRITE_BUFFER_SIZE);
-    memset(m_real_file, '\0', FILENAME_LEN);
+    if (!m_cold)
+    {
+        //第一次使用该文件描述符，分配并清零缓冲区
+        m_cold = alloc_cold();
+        m_read_buf = m_cold->read_buf;
+        m_write_buf = m_cold->write_buf;
+    }
+    else
+    {
+        //m_read_idx之后的字节始终为0，只需清掉上一个请求用过的部分
+        //写缓冲区只按m_write_idx使用，real_file由strcpy和strncpy写入，最后一个字节始终为0，都不需要清零
+        memset(m_read_buf, '\0', m_read_idx);
+        //上一个请求的临时数据
+        m_cold->scratch.reset();
+    }
+    m_read_idx = 0;
 }
 
 //==========成员函数==========
 //循环读取客户数据，直至无数据可读或对方关闭连接
 //非阻塞ET模式下，需要一次性把数据读完
-bool http_conn::read_once(){
+http_conn::READ_STATUS http_conn::read_once(){
 	if(m_read_idx >= READ_BUFFER_SIZE){
-		return false;
+		return READ_CLOSED;
 	}
 	int bytes_read = 0;
+	
+	//TLS连接读取解密后的数据，SSL_read一次最多返回一个记录，读到缓冲区满或socket中没有完整的记录为止
+	if(m_tls){
+		int total = 0;
+		while(m_read_idx < READ_BUFFER_SIZE){
+			bytes_read = m_tls->read(m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx);
+			if(bytes_read <= 0)
+				break;
+			m_read_idx += bytes_read;
+			total += bytes_read;
+		}
+		if(total > 0){
+			on_read(total);
+			return READ_DATA;
+		}
+		//握手或记录不完整，按需要的方向重新注册事件，注册后其他线程可能立即处理该连接，必须是最后一次访问
+		if(bytes_read == TLS_WANT_READ || bytes_read == TLS_WANT_WRITE){
+			modfd(m_epollfd, m_sockfd, bytes_read == TLS_WANT_WRITE ? EPOLLOUT : EPOLLIN, gen());
+			return READ_WAIT;
+		}
+		if(bytes_read == TLS_ERROR)
+			metrics::add(COUNTER_IO_ERRORS);
+		return READ_CLOSED;
+	}
 
 #ifdef connfdLT
 	//从套接字接收数据，存储在m_read_buf缓冲区
 	bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
 	if(bytes_read <= 0){
-		return false;
+		if(bytes_read < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			metrics::add(COUNTER_IO_ERRORS);
+		return READ_CLOSED;
 	}
 	m_read_idx += bytes_read;   //更新缓冲区指针到最新处
-	return true;
+	on_read(bytes_read);
+	return READ_DATA;
 #endif
 
 #ifdef connfdET
@@ -193,35 +322,229 @@ bool http_conn::read_once(){
 	bytes_read = recv(m_sockfd, m_read_buf + m_read_idx, READ_BUFFER_SIZE - m_read_idx, 0);
 	if(bytes_read ==-1){
 		if(errno == EAGAIN || errno == EWOULDBLOCK)break;
-		return false;
+		metrics::add(COUNTER_IO_ERRORS);
+		return READ_CLOSED;
 	}
 	else if(bytes_read == 0){
-		return false;
+		return READ_CLOSED;
 	}
 	m_read_idx += bytes_read;   
+	on_read(bytes_read);
 	}
-	return ture;
+	return READ_DATA;
 #endif
 }
 
+void http_conn::on_read(int bytes){
+	metrics::add(COUNTER_BYTES_READ, bytes);
+	if(m_accept_ns){
+		metrics::record(STAGE_ACCEPT_READ, metrics::now_ns() - m_accept_ns);
+		m_accept_ns = 0;
+	}
+}
+
+http_conn::HTTP_CODE http_conn::parse_request(){
+	long long start = metrics::now_ns();
+	m_request_ns = 0;
+	HTTP_CODE ret = process_read();
+	metrics::record(STAGE_PROCESS_READ, metrics::now_ns() - start - m_request_ns);
+	return ret;
+}
+
+http_conn::HTTP_CODE http_conn::timed_request(){
+	long long start = metrics::now_ns();
+	HTTP_CODE ret = do_request();
+	m_request_ns = metrics::now_ns() - start;
+	metrics::record(STAGE_DO_REQUEST, m_request_ns);
+	return ret;
+}
+
 //各子线程通过process函数对任务进行处理
 void http_conn::process(){
-	//调用process_read完成报文解析
-	HTTP_CODE read_ret = process_read();
+	//HTTP/2连接，或以连接前言开头的新连接
+	if(m_h2 || h2_preface()){
+		process_h2();
+		return;
+	}
+	
+	//调用process_read完成报文解析，reactor模式下在这里检查单IP请求速率
+	HTTP_CODE read_ret = over_limit() ? TOO_MANY_REQUESTS : parse_request();
 	
 	//NO_REQUEST，表示请求不完整，需要继续接收请求数据
 	if(read_ret == NO_REQUEST){
+		//TLS记录解密出的数据比读缓冲区多，剩余的留在SSL中，socket上不会再有读事件
+		//此时读缓冲区已满，与明文连接下一次读取失败时相同，关闭连接
+		if(m_tls && m_tls->pending()){
+			close_later();
+			return;
+		}
 		//注册并监听读事件
-		modfd(m_epollfd, m_sockfd, EPOLLIN);
+		wait_read();
+		return;
+	}
+	//请求带Upgrade:h2c，切换到HTTP/2后在流1上回复
+	if(m_upgrade_h2 && upgrade_h2(read_ret)){
+		process_h2();
 		return;
 	}
 	//调用process_write完成报文响应
 	bool write_ret = process_write(read_ret);
 	if(!write_ret){
-		close_conn();     //???响应完就要关闭连接吗
+		close_later();     //响应报文生成失败，关闭连接
+		return;
 	}
-	//注册并监听写事件
-	modfd(m_epollfd, m_sockfd, EPOLLOUT);
+	//交给主线程发送
+	complete();
+}
+
+int http_conn::process_inline(){
+	//HTTP/2连接的帧都交给工作线程
+	if(m_h2 || h2_preface())
+		return 0;
+	
+	//超过单IP请求速率，直接回复429，不进入线程池
+	if(over_limit()){
+		if(!process_write(TOO_MANY_REQUESTS))
+			return -1;
+		m_ready_ns = metrics::now_ns();
+		return 1;
+	}
+	
+	//只处理新请求，请求行为GET /metrics或GET /metrics?...
+	if(m_check_state != CHECK_STATE_REQUESTLINE || m_read_idx < 13 || strncmp(m_read_buf, "GET /metrics", 12) != 0)
+		return 0;
+	if(m_read_buf[12] != ' ' && m_read_buf[12] != '?')
+		return 0;
+	
+	//请求不完整，已解析的状态保留，由工作线程继续
+	HTTP_CODE read_ret = parse_request();
+	if(read_ret == NO_REQUEST)
+		return 0;
+	if(!process_write(read_ret))
+		return -1;
+	m_ready_ns = metrics::now_ns();
+	return 1;
+}
+
+//定时器由主线程管理，工作线程不直接关闭连接，而是通过完成队列通知主线程
+void http_conn::close_later(){
+	if(!m_completion){
+		close_conn();
+		return;
+	}
+	push_completion(CQ_CLOSE);
+}
+
+//请求行完整后按客户端IP扣减请求令牌，每个请求只检查一次，登录和注册消耗更多令牌
+bool http_conn::over_limit(){
+	if(m_limit_checked || !ip_limiter::enabled(LIMIT_REQUEST))
+		return false;
+	if(!memchr(m_read_buf, '\n', m_read_idx))
+		return false;
+	m_limit_checked = true;
+	int cost = classify() == LANE_DB ? LIMIT_DB_COST : 1;
+	return !ip_limiter::allow(m_cold->address.sin_addr.s_addr, LIMIT_REQUEST, cost);
+}
+
+//根据方法和url判断请求类别，与默认主机的路由表保持一致，分发时还没有解析Host
+static http_conn::LANE route_lane(bool post, const char *url, int len){
+	//找到url中最后一个/
+	int slash = -1;
+	for(int i = 0; i < len; i++)
+		if(url[i] == '/')
+			slash = i;
+	char c = (slash >= 0 && slash + 1 < len) ? url[slash + 1] : '\0';
+	
+	if(post && (c == '2' || c == '3'))
+		return http_conn::LANE_DB;
+	if(post || c == '0' || c == '1' || c == '5' || c == '6' || c == '7')
+		return http_conn::LANE_DYNAMIC;
+	return http_conn::LANE_STATIC;
+}
+
+//主线程分发任务前只看请求行，不做完整解析
+//请求行还没被工作线程解析时，直接在读缓冲区中找出方法和url
+http_conn::LANE http_conn::classify(){
+	//HTTP/2连接的一批帧中可能有多个流，不区分类别
+	if(m_h2 || h2_preface())
+		return LANE_DYNAMIC;
+	if(m_check_state != CHECK_STATE_REQUESTLINE)
+		return route_lane(m_method == POST, m_url, strlen(m_url));
+	
+	//请求行结束位置
+	int end = 0;
+	while(end < m_read_idx && m_read_buf[end] != '\r' && m_read_buf[end] != '\n')
+		end++;
+	
+	bool post = end >= 4 && strncasecmp(m_read_buf, "POST", 4) == 0;
+	
+	//跳过方法和空白，url到下一个空白为止
+	int start = 0;
+	while(start < end && m_read_buf[start] != ' ' && m_read_buf[start] != '\t')
+		start++;
+	while(start < end && (m_read_buf[start] == ' ' || m_read_buf[start] == '\t'))
+		start++;
+	int stop = start;
+	while(stop < end && m_read_buf[stop] != ' ' && m_read_buf[stop] != '\t')
+		stop++;
+	
+	return route_lane(post, m_read_buf + start, stop - start);
+}
+
+//请求在线程池中排队超时，客户端大概率已经放弃，跳过解析和数据库访问
+//把503报文放入写缓冲区，由主线程发送后关闭连接
+void http_conn::process_busy(){
+	//HTTP/2连接不能回复503报文，拒绝等待处理的流，客户端可以重试，连接保持
+	if(m_h2){
+		consume(m_h2->receive(m_read_buf, m_read_idx, READ_BUFFER_SIZE));
+		m_h2->refuse();
+		metrics::status(503);
+		flush_h2();
+		return;
+	}
+	m_write_idx = busy_response(m_write_buf, WRITE_BUFFER_SIZE);
+	m_linger = false;
+	m_iv[0].iov_base = m_write_buf;
+	m_iv[0].iov_len = m_write_idx;
+	m_iv_count = 1;
+	bytes_to_send = m_write_idx;
+	metrics::status(503);
+	complete();
+}
+
+//放入完成队列，主线程取出后直接调用write，发送不完才注册EPOLLOUT
+void http_conn::complete(){
+	m_ready_ns = metrics::now_ns();
+	//reactor模式下由工作线程直接发送，此时读写缓冲区还在当前核的缓存中
+	if(m_actor_model == 1){
+		if(!write())
+			close_later();
+		return;
+	}
+	if(m_completion)
+		push_completion(CQ_WRITE);
+	else
+		modfd(m_epollfd, m_sockfd, EPOLLOUT, gen());
+}
+
+//epoll下工作线程自己注册读事件，io_uring下由主线程重新提交recv
+void http_conn::wait_read(){
+	if(m_io_engine == 1)
+		push_completion(CQ_READ);
+	else
+		modfd(m_epollfd, m_sockfd, EPOLLIN, gen());
+}
+
+//完成队列中的事件持有一个引用，主线程处理后归还
+void http_conn::push_completion(int event){
+	m_cq_event = event;
+	hold();
+	m_completion->push(this);
+}
+
+void http_conn::done(){
+	if(release() && m_completion)
+		push_completion(CQ_RELEASE);
 }
 
 //通过while循环，将主从状态机进行封装，对报文的每一行进行循环处理
@@ -259,13 +582,13 @@ http_conn::HTTP_CODE http_conn::process_read(){
 				if(ret == BAD_REQUEST)return BAD_REQUEST;
 				//完整解析get请求后，跳转到报文响应函数
 				else if(ret == GET_REQUEST)
-					return do_request();
+					return timed_request();
 				break;
 			case CHECK_STATE_CONTENT:
 				//解析消息体
 				ret = parse_content(text);
 				//完整解析post请求后，跳转到报文响应函数
-				if(ret == GET_REQUEST)return do_request();
+				if(ret == GET_REQUEST)return timed_request();
 				//解析完消息体即完成报文解析，避免
 				//再次进入循环，更新line_status
 				line_status = LINE_OPEN;
@@ -344,13 +667,14 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text){
 	m_url += strspn(m_url, " \t");
 	
 	//使用与判断请求方式的相同逻辑，判断http版本号
-	m_version = strpbrk(m_url, " \t");
-	if(!m_version)return BAD_REQUEST;
-	*m_version++ = '\0';
-	m_version += strspn(m_version, " \t");  //如果空格符或\t字符重复则跳过，现在m_version指向http版本字符串的最开头字符
+	//版本只在这里检查，不保存在对象中
+	char *version = strpbrk(m_url, " \t");
+	if(!version)return BAD_REQUEST;
+	*version++ = '\0';
+	version += strspn(version, " \t");  //如果空格符或\t字符重复则跳过，现在version指向http版本字符串的最开头字符
 	
 	//仅支持http/1.1
-	if(strcasecmp(m_version, "HTTP/1.1") != 0)
+	if(strcasecmp(version, "HTTP/1.1") != 0)
 		return BAD_REQUEST;
 		
 	//对请求资源前7个字符进行判断
@@ -379,6 +703,34 @@ http_conn::HTTP_CODE http_conn::parse_request_line(char *text){
 	return NO_REQUEST;
 }
 
+//Accept-Encoding中列出了gzip或*，且q不为0
+static bool accepts_gzip(const char *value){
+	while(*value){
+		value += strspn(value, " \t,");
+		int len = strcspn(value, " \t,;");
+		bool gzip = (len == 4 && strncasecmp(value, "gzip", 4) == 0) || (len == 1 && value[0] == '*');
+		value += len;
+		//该编码的参数直到下一个逗号为止，只关心q
+		const char *end = value + strcspn(value, ",");
+		double q = 1;
+		for(const char *param = value; (param = (const char *)memchr(param, ';', end - param)) != NULL; ){
+			param++;
+			param += strspn(param, " \t");
+			if((param[0] == 'q' || param[0] == 'Q') && param[1] == '=')
+				q = atof(param + 2);
+		}
+		if(gzip && q > 0)
+			return true;
+		value = end;
+	}
+	return false;
+}
+
+//If-None-Match为*或列表中有该ETag，弱比较，W/"x"与"x"相同
+static bool etag_match(const char *list, const char *etag){
+	return strcmp(list, "*") == 0 || strstr(list, etag) != NULL;
+}
+
 //解析http请求的一个头部信息
 //每次只处理一个字段
 http_conn::HTTP_CODE http_conn::parse_headers(char *text){
@@ -415,6 +767,27 @@ http_conn::HTTP_CODE http_conn::parse_headers(char *text){
 		text += 5;
 		text += strspn(text, " \t");
 		m_host = text;
+		//按预先计算的哈希查找虚拟主机
+		m_vhost = vhost::find(text);
+	}
+	//镜像中有gzip版本的文件按此选择发送的版本
+	else if(strncasecmp(text, "Accept-Encoding:", 16) == 0){
+		m_accept_gzip = accepts_gzip(text + 16);
+	}
+	else if(strncasecmp(text, "If-None-Match:", 14) == 0){
+		text += 14;
+		m_if_none_match = text + strspn(text, " \t");
+	}
+	//升级到HTTP/2，须同时带有HTTP2-Settings
+	else if(strncasecmp(text, "Upgrade:", 8) == 0){
+		text += 8;
+		text += strspn(text, " \t");
+		//h2c只用于明文连接，TLS连接通过ALPN协商h2
+		m_upgrade_h2 = !m_tls && strcasecmp(text, "h2c") == 0;
+	}
+	else if(strncasecmp(text, "HTTP2-Settings:", 15) == 0){
+		text += 15;
+		m_h2_settings = text + strspn(text, " \t");
 	}
 	else {
 		//printf("oop!unknow header: %s\n", text);
@@ -440,38 +813,48 @@ http_conn::HTTP_CODE http_conn::parse_content(char *text){
 //处理请求函数
 http_conn::HTTP_CODE http_conn::do_request(){
 	
-	//将初始化的m_real_file赋值为网站根目录
-	strcpy(m_real_file, doc_root);
-	int len = strlen(doc_root);
+	//运行指标，不对应文件
+	if(m_method == GET && strncmp(m_url, "/metrics", 8) == 0 && (m_url[8] == '\0' || m_url[8] == '?'))
+		return METRICS_REQUEST;
+	
+	//将初始化的real_file赋值为该Host的网站根目录
+	//当浏览器出现连接重置时，可能是网站根目录出错或http响应格式出错或访问的文件中内容完全为空
+	strcpy(m_cold->real_file, m_vhost->root);
+	int len = m_vhost->root_len;
 	
 	//找到m_url中/的位置
 	const char *p = strrchr(m_url, '/');
 	
 	//实现登录和注册校验
 	//处理cgi
-	if(cgi == 1 && (*(p+1) == '2' || *(p+1) == '3')){
+	if(cgi == 1 && m_vhost->cgi && (*(p+1) == '2' || *(p+1) == '3')){
 		//根据标志判断是登录检测还是注册检测
 		char flag = m_url[1];
 		
-		char *m_url_real = (char*)malloc(sizeof(char) * 200);
-		strcpy(m_url_real, "/");
-		strcat(m_url_real, m_url + 2);
-		strncpy(m_real_file + len, m_url_real, FILENAME_LEN - len - 1);
-		free(m_url_real);
+		//本次请求的临时数据都从连接的arena中分配，响应发送完毕后整体归还
+		char *m_url_real = m_cold->scratch.format("/%s", m_url + 2);
+		if(!m_url_real)
+			return INTERNAL_ERROR;
+		strncpy(m_cold->real_file + len, m_url_real, FILENAME_LEN - len - 1);
 
 		//将用户名和密码提取出来
         //user=123&passwd=123
-        char name[100], password[100];
+        //按消息体长度分配，用户名和密码再长也不会溢出
+        int body_len = strlen(m_string);
+        char *name = (char *)m_cold->scratch.alloc(body_len + 1);
+        char *password = (char *)m_cold->scratch.alloc(body_len + 1);
+        if (!name || !password)
+            return INTERNAL_ERROR;
         int i;
 
 		//以&为分隔符，后面的是密码
-        for (i = 5; m_string[i] != '&'; ++i)
+        for (i = 5; i < body_len && m_string[i] != '&'; ++i)
             name[i - 5] = m_string[i];
         name[i - 5] = '\0';
 
 		//以&为分隔符，后面的是密码
         int j = 0;
-        for (i = i + 10; m_string[i] != '\0'; ++i, ++j)
+        for (i = i + 10; i < body_len; ++i, ++j)
             password[j] = m_string[i];
         password[j] = '\0';
 
@@ -480,13 +863,9 @@ http_conn::HTTP_CODE http_conn::do_request(){
         {
             //如果是注册，先检测数据库中是否有重名的
             //没有重名的，进行增加数据
-            char *sql_insert = (char *)malloc(sizeof(char) * 200);
-            strcpy(sql_insert, "INSERT INTO user(username, passwd) VALUES(");
-            strcat(sql_insert, "'");
-            strcat(sql_insert, name);
-            strcat(sql_insert, "', '");
-            strcat(sql_insert, password);
-            strcat(sql_insert, "')");
+            char *sql_insert = m_cold->scratch.format("INSERT INTO user(username, passwd) VALUES('%s', '%s')", name, password);
+            if (!sql_insert)
+                return INTERNAL_ERROR;
 
 			//判断map中能否找到重复的用户名
             if (users.find(name) == users.end())
@@ -511,79 +890,61 @@ http_conn::HTTP_CODE http_conn::do_request(){
         //若浏览器端输入的用户名和密码在表中可以查找到，返回1，否则返回0
         else if (*(p + 1) == '2')
         {
-            if (users.find(name) != users.end() && users[name] == password)
+            map<string, string, less<> >::iterator it = users.find(name);
+            if (it != users.end() && it->second == password)
                 strcpy(m_url, "/welcome.html");
             else
                 strcpy(m_url, "/logError.html");
         }
 	}
 	
-	//如果请求资源为/0，表示跳转注册界面
-	if(*(p+1) == '0'){
-		char *m_url_real = (char*)malloc(sizeof(char) * 200);
-		strcpy(m_url_real, "/register.html");
-		
-		//将网站目录和/register.html进行拼接，更新到m_real_file中
-		strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-		
-		free(m_url_real);
-	}
-	
-	//如果请求资源为/1，表示跳转登录界面
-	else if(*(p+1) == '1'){
-		char *m_url_real = (char*)malloc(sizeof(char) * 200);
-		strcpy(m_url_real, "/log.html");
-		//将网站目录和/log.html进行拼接，更新到m_real_file中
-		strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-		
-		free(m_url_real);
-	}
-	
-	//图片页面
-	else if(*(p+1) == '5'){
-		char *m_url_real = (char*)malloc(sizeof(char) * 200);
-		strcpy(m_url_real, "/picture.html");
-		strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-		free(m_url_real);
-	}
+	//按该Host的路由表改写，如/0为注册界面，/1为登录界面
+	const char *route = m_vhost->route(m_url);
+	if(route)
+		strncpy(m_cold->real_file + len, route, FILENAME_LEN - len - 1);
+	else 
+		//如果以上均不符合，即不是登录和注册，直接将url与网站目录拼接
+		//这里的情况是欢迎界面，请求服务器上的一个图片?
+		strncpy(m_cold->real_file + len, m_url, FILENAME_LEN - len -1);
 	
-	//视频页面
-	else if(*(p+1) == '6'){
-		char *m_url_real = (char*)malloc(sizeof(char) * 200);
-		strcpy(m_url_real, "/video.html");
-		strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-		free(m_url_real);
+	//文档根目录已打包成镜像时只在镜像中查找，不stat、不open，镜像中没有的文件按不存在处理
+	if(m_vhost->packed){
+		m_packed = m_vhost->packed->find(m_cold->real_file + len);
+		if(!m_packed)
+			return NO_RESOURCE;
+		if(m_if_none_match && etag_match(m_if_none_match, m_vhost->packed->at(m_packed->etag)))
+			return NOT_MODIFIED;
+		return FILE_REQUEST;
 	}
 	
-	//关注页面
-	else if(*(p+1) == '7'){
-		char *m_url_real = (char*)malloc(sizeof(char) * 200);
-		strcpy(m_url_real, "/fans.html");
-		strncpy(m_real_file + len, m_url_real, strlen(m_url_real));
-		free(m_url_real);
+	//缓存命中时跳过stat、open和mmap，缓存中只有可读的普通文件
+	m_file_cache = m_vhost->lookup(m_cold->real_file);
+	if(m_file_cache){
+		m_cold->file_stat = m_file_cache->st;
+		m_file_address = m_file_cache->data;
+		return FILE_REQUEST;
 	}
 	
-	else 
-		//如果以上均不符合，即不是登录和注册，直接将url与网站目录拼接
-		//这里的情况是欢迎界面，请求服务器上的一个图片?
-		strncpy(m_real_file + len, m_url, FILENAME_LEN - len -1);
-	
-	//通过stat获取请求资源文件信息，成功则将信息更新到m_file_stat结构体
+	//通过stat获取请求资源文件信息，成功则将信息更新到file_stat结构体
 	//失败返回NO_RESOURCE状态，表示资源不存在
-	if(stat(m_real_file, &m_file_stat) < 0)
+	if(stat(m_cold->real_file, &m_cold->file_stat) < 0)
 		return NO_RESOURCE;
 	
 	//判断文件的权限，是否可读，不可读则返回FORBIDDEN_REQUEST状态
-	if(!(m_file_stat.st_mode&S_IROTH))
+	if(!(m_cold->file_stat.st_mode&S_IROTH))
 		return FORBIDDEN_REQUEST;
 	
 	//判断文件类型，如果是目录，则返回BAD_REQUEST，表示请求报文有误
-	if(S_ISDIR(m_file_stat.st_mode))
+	if(S_ISDIR(m_cold->file_stat.st_mode))
 		return BAD_REQUEST;
 	
-	//以只读方式获取文件描述符，通过mmap将该文件映射到内存中
-	int fd = open(m_real_file, O_RDONLY);
-	m_file_address = (char*)mmap(0, m_file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	//以只读方式获取文件描述符，先尝试读入缓存，超出缓存预算时通过mmap将该文件映射到内存中
+	int fd = open(m_cold->real_file, O_RDONLY);
+	m_file_cache = m_vhost->insert(m_cold->real_file, fd, m_cold->file_stat);
+	if(m_file_cache)
+		m_file_address = m_file_cache->data;
+	else
+		m_file_address = (char*)mmap(0, m_cold->file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
 	
 	//避免文件描述符的浪费和占用
 	close(fd);
@@ -594,11 +955,224 @@ http_conn::HTTP_CODE http_conn::do_request(){
 
 void http_conn::unmap()
 {
-    if (m_file_address)
+    //HTTP/2连接的文件由各个流持有，连接关闭前随会话一起释放
+    if (m_h2)
     {
-        munmap(m_file_address, m_file_stat.st_size);
+        delete m_h2;
+        m_h2 = 0;
+    }
+    //镜像中的文件不需要释放
+    if (m_packed)
+    {
+        m_packed = 0;
         m_file_address = 0;
     }
+    //缓存中的文件只释放引用
+    else if (m_file_cache)
+    {
+        vhost::release(m_file_cache);
+        m_file_cache = 0;
+        m_file_address = 0;
+    }
+    else if (m_file_address)
+    {
+        munmap(m_file_address, m_cold->file_stat.st_size);
+        m_file_address = 0;
+    }
+}
+
+//==========HTTP/2==========
+bool http_conn::h2_preface(){
+	int n = m_read_idx < H2_PREFACE_LEN ? m_read_idx : H2_PREFACE_LEN;
+	return m_check_state == CHECK_STATE_REQUESTLINE && n > 0 && memcmp(m_read_buf, H2_PREFACE, n) == 0;
+}
+
+void http_conn::process_h2(){
+	if(!m_h2){
+		//前言还没有收全，可能是以P开头的HTTP/1.1请求，不改变解析状态
+		if(m_read_idx < H2_PREFACE_LEN){
+			wait_read();
+			return;
+		}
+		m_h2 = new h2_session();
+		m_h2->start();
+	}
+	consume(m_h2->receive(m_read_buf, m_read_idx, READ_BUFFER_SIZE));
+	//TLS记录中放不进读缓冲区的数据留在SSL中，socket上不会再有读事件，处理完已有的帧后接着读
+	//SSL中已有解密的数据，read_once总能读到，不会重新注册事件
+	while(m_tls && m_tls->pending() && m_read_idx < READ_BUFFER_SIZE && read_once() == READ_DATA)
+		consume(m_h2->receive(m_read_buf, m_read_idx, READ_BUFFER_SIZE));
+	for(h2_stream *s; (s = m_h2->next_request()) != NULL; )
+		serve_h2(s);
+	//优雅退出中不再接受新的流，已有的流发送完后关闭连接
+	if(m_draining.load(std::memory_order_relaxed))
+		m_h2->shutdown();
+	flush_h2();
+}
+
+void http_conn::flush_h2(){
+	bytes_to_send = m_h2->fill();
+	if(bytes_to_send > 0)
+		complete();
+	else if(m_h2->closing())
+		close_later();
+	else
+		wait_read();
+}
+
+//请求的各个字段指向流中的副本，do_request原地改写的m_url是流中的path
+void http_conn::serve_h2(h2_stream *s){
+	m_method = s->post ? POST : GET;
+	cgi = s->post;
+	m_url = s->path;
+	m_string = s->body;
+	m_vhost = s->authority[0] ? vhost::find(s->authority) : vhost::get_default();
+	m_accept_gzip = accepts_gzip(s->accept_encoding);
+	m_if_none_match = s->if_none_match[0] ? s->if_none_match : NULL;
+	
+	HTTP_CODE ret;
+	if(s->bad)
+		ret = BAD_REQUEST;
+	//每个流按一个请求扣减令牌
+	else if(ip_limiter::enabled(LIMIT_REQUEST) &&
+			!ip_limiter::allow(m_cold->address.sin_addr.s_addr, LIMIT_REQUEST,
+			                   route_lane(s->post, m_url, strlen(m_url)) == LANE_DB ? LIMIT_DB_COST : 1))
+		ret = TOO_MANY_REQUESTS;
+	else{
+		//当url为/时，显示欢迎界面
+		if(strlen(m_url) == 1)
+			strcat(m_url, "judge.html");
+		ret = timed_request();
+	}
+	h2_respond(s, ret);
+	//本次请求的临时数据
+	m_cold->scratch.reset();
+}
+
+//与process_write的各个分支对应，状态码和头部用HPACK编码，消息体由会话分成DATA帧
+//NO_RESOURCE在HTTP/1.1下直接关闭连接，这里回复404，不影响同一连接上的其他流
+void http_conn::h2_respond(h2_stream *s, HTTP_CODE ret){
+	const char *body = NULL;
+	long long size = 0;
+	int status;
+	switch(ret){
+		case FILE_REQUEST:
+			{
+				status = 200;
+				s->add_status(status);
+				//镜像中的文件：类型按路径查，ETag和压缩版本与HTTP/1.1相同
+				if(m_packed){
+					const bundle *pack = m_vhost->packed;
+					bool gz = m_accept_gzip && m_packed->gz_size != 0;
+					const mime_type &type = mime::of(pack->at(m_packed->path));
+					const char *etag = pack->at(m_packed->etag);
+					s->add_header(HPACK_CONTENT_TYPE, type.type, strlen(type.type));
+					s->add_header(HPACK_ETAG, etag, strlen(etag));
+					if(m_packed->gz_size)
+						s->add_header(HPACK_VARY, "Accept-Encoding", 15);
+					if(gz)
+						s->add_header(HPACK_CONTENT_ENCODING, "gzip", 4);
+					body = pack->at(gz ? m_packed->gz_data : m_packed->data);
+					size = gz ? m_packed->gz_size : m_packed->size;
+					break;
+				}
+				const mime_type *type = m_file_cache ? m_file_cache->mime : &mime::of(m_cold->real_file);
+				body = m_file_address;
+				size = m_cold->file_stat.st_size;
+				if(size == 0){
+					body = "<html><body></body></html>";
+					size = strlen(body);
+					type = &mime::by_ext("html", 4);
+				}
+				s->add_header(HPACK_CONTENT_TYPE, type->type, strlen(type->type));
+				//文件的引用交给流，这个流的最后一帧发出后释放
+				s->cache = m_file_cache;
+				if(!m_file_cache){
+					s->map = m_file_address;
+					s->map_len = m_cold->file_stat.st_size;
+				}
+				break;
+			}
+		case NOT_MODIFIED:
+			{
+				status = 304;
+				s->add_status(status);
+				const char *etag = m_vhost->packed->at(m_packed->etag);
+				s->add_header(HPACK_ETAG, etag, strlen(etag));
+				break;
+			}
+		case METRICS_REQUEST:
+			{
+				status = 200;
+				s->add_status(status);
+				metrics::render(&s->metrics);
+				s->add_header(HPACK_CONTENT_TYPE, "text/plain; version=0.0.4", 25);
+				body = s->metrics.data();
+				size = s->metrics.size();
+				break;
+			}
+		case TOO_MANY_REQUESTS:
+			status = 429;
+			s->add_status(status);
+			s->add_header(HPACK_RETRY_AFTER, 1);
+			break;
+		case FORBIDDEN_REQUEST:
+			status = 403;
+			s->add_status(status);
+			body = error_403_form;
+			size = strlen(body);
+			break;
+		case BAD_REQUEST:
+		case NO_RESOURCE:
+			status = 404;
+			s->add_status(status);
+			body = error_404_form;
+			size = strlen(body);
+			break;
+		default:
+			status = 500;
+			s->add_status(status);
+			body = error_500_form;
+			size = strlen(body);
+			break;
+	}
+	metrics::status(status);
+	char date[CLOCK_DATE_LEN + 1];
+	clock_service::date(date);
+	s->add_header(HPACK_DATE, date, strlen(date));
+	s->add_header(HPACK_CONTENT_LENGTH, size);
+	m_h2->respond(s, body, size);
+	m_file_cache = 0;
+	m_file_address = 0;
+	m_packed = 0;
+}
+
+//带消息体的请求不升级，按HTTP/1.1回复；HTTP2-Settings无效时也不升级
+bool http_conn::upgrade_h2(HTTP_CODE ret){
+	if(cgi || !m_h2_settings)
+		return false;
+	h2_session *h2 = new h2_session();
+	h2_stream *s = h2->upgrade(m_h2_settings);
+	if(!s){
+		delete h2;
+		return false;
+	}
+	m_h2 = h2;
+	h2_respond(s, ret);
+	//请求之后的数据属于HTTP/2，从缓冲区开头按帧解析
+	consume(m_checked_idx);
+	m_check_state = CHECK_STATE_REQUESTLINE;
+	m_checked_idx = 0;
+	m_start_line = 0;
+	m_cold->scratch.reset();
+	return true;
+}
+
+void http_conn::consume(int n){
+	memmove(m_read_buf, m_read_buf + n, m_read_idx - n);
+	//m_read_idx之后的字节始终为0
+	memset(m_read_buf + m_read_idx - n, '\0', n);
+	m_read_idx -= n;
 }
 
 //更新m_write_idx指针和m_write_buf缓冲区
@@ -640,19 +1214,37 @@ bool http_conn::add_status_line(int status, const char *title){
 
 //添加消息报头，具体的添加文本长度、连接状态和空行
 bool http_conn::add_headers(int content_len){
+	add_date();
 	add_content_length(content_len);
 	add_linger();
 	add_blank_line();
 }
 
+//添加Date，取自时钟服务预先格式化好的字符串
+bool http_conn::add_date(){
+	char date[CLOCK_DATE_LEN + 1];
+	clock_service::date(date);
+	return add_response("Date:%s\r\n", date);
+}
+
 //添加content-length，表示响应报文的长度
 bool http_conn::add_content_length(int content_len){
 	return add_response("Content-Length:%d\r\n", content_len);
 }
 
-//添加文本类型，这里是html
-bool http_conn::add_content_type(){
-	return add_response("Content-Type:%s\r\n", "text/html");
+//原样复制，不经过vsnprintf，与add_response一样保持缓冲区以'\0'结尾
+bool http_conn::add_raw(const char *data, int len){
+	if(len >= WRITE_BUFFER_SIZE - 1 - m_write_idx)
+		return false;
+	memcpy(m_write_buf + m_write_idx, data, len);
+	m_write_idx += len;
+	m_write_buf[m_write_idx] = '\0';
+	return true;
+}
+
+//添加文本类型，头部行来自编译期的类型表
+bool http_conn::add_content_type(const mime_type &type){
+	return add_raw(type.header, type.header_len);
 }
 
 //添加连接状态，通知浏览器端是保持连接还是关闭
@@ -672,12 +1264,16 @@ bool http_conn::add_content(const char* content){
 
 //服务器子线程调用process_write完成响应报文的写入
 bool http_conn::process_write(HTTP_CODE ret){
+	//优雅退出中不再保持长连接
+	if(m_draining.load(std::memory_order_relaxed))
+		m_linger = false;
 	switch(ret){
 		
 		//内部错误，500
 		case INTERNAL_ERROR:
 			{
 				//状态行
+				metrics::status(500);
 				add_status_line(500, error_500_title);
 				//消息报头
 				add_headers(strlen(error_500_form));
@@ -689,6 +1285,7 @@ bool http_conn::process_write(HTTP_CODE ret){
 		//报文语法有误，404
 		case BAD_REQUEST:
 			{
+				metrics::status(404);
 				add_status_line(404, error_404_title);
 				add_headers(strlen(error_404_form));
 				if(!add_content(error_404_form))
@@ -699,6 +1296,7 @@ bool http_conn::process_write(HTTP_CODE ret){
 		//资源没有访问权限
 		case FORBIDDEN_REQUEST:
 			{
+				metrics::status(403);
 				add_status_line(403, error_403_title);
 				add_headers(strlen(error_403_form));
 				if(!add_content(error_403_form))
@@ -709,27 +1307,88 @@ bool http_conn::process_write(HTTP_CODE ret){
 		//文件存在，200
 		case FILE_REQUEST:
 			{
+				metrics::status(200);
 				add_status_line(200, ok_200_title);
+				//镜像中的文件：客户端接受gzip且有压缩版本时发送压缩版本，类型和ETag的头部行在打包时拼好
+				if(m_packed){
+					const bundle *pack = m_vhost->packed;
+					bool gz = m_accept_gzip && m_packed->gz_size != 0;
+					unsigned long long size = gz ? m_packed->gz_size : m_packed->size;
+					add_raw(pack->at(m_packed->headers), m_packed->headers_len);
+					static const char gzip_header[] = "Content-Encoding:gzip\r\n";
+					if(gz)
+						add_raw(gzip_header, sizeof(gzip_header) - 1);
+					add_headers(size);
+					m_file_address = (char *)pack->at(gz ? m_packed->gz_data : m_packed->data);
+					m_iv[0].iov_base = m_write_buf;
+					m_iv[0].iov_len = m_write_idx;
+					m_iv[1].iov_base = m_file_address;
+					m_iv[1].iov_len = size;
+					m_iv_count = 2;
+					bytes_to_send = m_write_idx + size;
+					return true;
+				}
 				//如果请求的资源存在
-				if(m_file_stat.st_size != 0){
-					add_headers(m_file_stat.st_size);
+				if(m_cold->file_stat.st_size != 0){
+					//缓存中的文件读入时已查好类型，超出缓存预算直接mmap的文件每次按扩展名查
+					add_content_type(m_file_cache ? *m_file_cache->mime : mime::of(m_cold->real_file));
+					add_headers(m_cold->file_stat.st_size);
 					//第一个iovec指针指向响应报文缓冲区，长度指向m_write_idx
 					m_iv[0].iov_base = m_write_buf;
 					m_iv[0].iov_len = m_write_idx;
 					//第二个iovec指针指向mmap返回的文件指针，长度指向文件大小
 					m_iv[1].iov_base = m_file_address;
-					m_iv[1].iov_len = m_file_stat.st_size;
+					m_iv[1].iov_len = m_cold->file_stat.st_size;
 					m_iv_count = 2;
 					//发送的全部数据为状态行+响应报文头部信息+文件总大小
-					bytes_to_send = m_write_idx + m_file_stat.st_size;
+					bytes_to_send = m_write_idx + m_cold->file_stat.st_size;
 					return true;
 				}
 				else{
 					const char *ok_string = "<html><body></body></html>";
+					add_content_type(mime::by_ext("html", 4));
 					add_headers(strlen(ok_string));
 					if(!add_content(ok_string))
 						return false;
 				}
+				break;
+			}
+		//客户端缓存的版本仍然有效，304不带消息体
+		case NOT_MODIFIED:
+			{
+				metrics::status(304);
+				add_status_line(304, not_modified_304_title);
+				add_response("ETag:%s\r\n", m_vhost->packed->at(m_packed->etag));
+				add_date();
+				add_linger();
+				add_blank_line();
+				break;
+			}
+		//超过单IP请求速率，回复后关闭连接
+		case TOO_MANY_REQUESTS:
+			{
+				metrics::status(429);
+				m_linger = false;
+				add_status_line(429, error_429_title);
+				add_response("Retry-After:%d\r\n", 1);
+				add_headers(0);
+				break;
+			}
+		//运行指标，消息体放在单独的缓冲区中，与文件一样用第二个iovec发送
+		case METRICS_REQUEST:
+			{
+				metrics::status(200);
+				metrics::render(&m_cold->metrics);
+				add_status_line(200, ok_200_title);
+				add_response("Content-Type:%s\r\n", "text/plain; version=0.0.4");
+				add_headers(m_cold->metrics.size());
+				m_iv[0].iov_base = m_write_buf;
+				m_iv[0].iov_len = m_write_idx;
+				m_iv[1].iov_base = m_cold->metrics.data();
+				m_iv[1].iov_len = m_cold->metrics.size();
+				m_iv_count = 2;
+				bytes_to_send = m_write_idx + m_cold->metrics.size();
+				return true;
 			}
 		default:
 			{
@@ -752,54 +1411,96 @@ bool http_conn::write(){
 	//若要发送的数据长度为0
 	//表示响应报文为空，一般不会出现这种情况
 	if(bytes_to_send == 0){
-		//注册读事件
-		modfd(m_epollfd, m_sockfd, EPOLLIN);
-		init();
+		//TLS握手消息没有发完时注册的写事件，继续握手
+		if(m_tls && m_tls->handshaking()){
+			int ret = m_tls->handshake();
+			if(ret == TLS_ERROR || ret == TLS_CLOSED)
+				return false;
+			modfd(m_epollfd, m_sockfd, ret == TLS_WANT_WRITE ? EPOLLOUT : EPOLLIN, gen());
+			return true;
+		}
+		//read_once读TLS记录时需要先发出数据(TLS_WANT_WRITE)而注册的写事件，现在可写了，重新注册读事件由read_once继续读
+		//读缓冲区中可能已有不完整的请求，HTTP/2连接中可能有没收完的帧，都不能重新初始化
+		//响应发完时finish_write已经重新初始化，这里没有完成任何响应，不调用init()
+		modfd(m_epollfd, m_sockfd, EPOLLIN, gen());
 		return true;
 	}
 	
 	while(1){
 		//将响应报文的状态行、消息头、空行和响应正文发送给浏览器端
-		temp = writev(m_sockfd, m_iv, m_iv_count);
+		//TLS连接由tls_conn加密或交给内核加密，返回值的含义与writev相同
+		temp = m_tls ? m_tls->writev(get_iov(), get_iov_count()) : writev(m_sockfd, get_iov(), get_iov_count());
 		
 		if(temp < 0){
 			if(errno == EAGAIN){
 				//重新注册写事件
-				modfd(m_epollfd, m_sockfd, EPOLLOUT);
+				modfd(m_epollfd, m_sockfd, EPOLLOUT, gen());
 				return true;
 			}
 			//如果发送失败，但不是缓冲区问题，取消映射
+			metrics::add(COUNTER_IO_ERRORS);
 			unmap();
 			return false;
 		}
 		
-		bytes_have_send += temp;
-		bytes_to_send -= temp;
-		//第一个iovec头部信息的数据已发送完，发送第二个iovec的数据
-		if(bytes_have_send >= m_iv[0].iov_len){
-			m_iv[0].iov_len = 0;
-			m_iv[1].iov_base = m_file_address + (bytes_have_send - m_write_idx);
-			m_iv[1].iov_len = bytes_to_send;
-		}
-		//继续发送第一个iovec的数据
-		else {
-			m_iv[0].iov_base = m_write_buf + bytes_have_send;
-			m_iv[0].iov_len -= bytes_have_send;
-		}
-		
-		if(bytes_to_send <= 0){
+		if(advance_iov(temp))
+			return finish_write();
+	}
+}
+
+bool http_conn::advance_iov(int len){
+	bytes_have_send += len;
+	metrics::add(COUNTER_BYTES_WRITTEN, len);
+	//HTTP/2连接一批发完后由会话生成下一批，都发完才算发送完毕
+	if(m_h2){
+		bool done = m_h2->sent(len);
+		bytes_to_send = m_h2->pending();
+		return done;
+	}
+	bytes_to_send -= len;
+	//依次跳过已发送的部分，第二个iovec可能是文件也可能是/metrics的消息体
+	for(int i = 0; i < m_iv_count && len > 0; i++){
+		int n = len < (int)m_iv[i].iov_len ? len : m_iv[i].iov_len;
+		m_iv[i].iov_base = (char *)m_iv[i].iov_base + n;
+		m_iv[i].iov_len -= n;
+		len -= n;
+	}
+	return bytes_to_send <= 0;
+}
+
+bool http_conn::finish_write(){
+	if(m_ready_ns)
+		metrics::record(STAGE_WRITE, metrics::now_ns() - m_ready_ns);
+	//HTTP/2连接发完后继续读，不重新初始化；GOAWAY已发出且没有未完成的流时关闭
+	if(m_h2){
+		if(m_h2->closing()){
 			unmap();
-			//注册读事件
-			modfd(m_epollfd, m_sockfd, EPOLLIN);
-			//如果浏览器的请求为长连接
-			if(m_linger){
-				//重新初始化http对象
-				init();
-				return true;
-			}
-			else{
-				return false;
-			}
+			return false;
 		}
+		if(m_io_engine == 0)
+			modfd(m_epollfd, m_sockfd, EPOLLIN, gen());
+		return true;
 	}
+	unmap();
+	//如果浏览器的请求为长连接
+	if(m_linger){
+		//重新初始化http对象
+		init();
+		//注册读事件，短连接马上就要关闭，不再注册
+		//否则reactor模式下关闭前可能又收到该连接的事件
+		//reactor模式下注册后主线程可能立即把下一个读事件交给另一个工作线程，必须是最后一次访问连接
+		if(m_io_engine == 0)
+			modfd(m_epollfd, m_sockfd, EPOLLIN, gen());
+		return true;
+	}
+	return false;
+}
+
+bool http_conn::feed(const char *data, int len){
+	if(len > READ_BUFFER_SIZE - m_read_idx)
+		return false;
+	memcpy(m_read_buf + m_read_idx, data, len);
+	m_read_idx += len;
+	on_read(len);
+	return true;
 }
\ No newline at end of file
@@ -20,15 +20,35 @@
 #include <errno.h>
 #include <sys/wait.h>
 #include <sys/uio.h>
+#include <atomic>
 #include "locker.h"
 #include "sql_connection_pool.h"
+#include "completion_queue.h"
+#include "metrics.h"
+#include "vhost.h"
+#include "arena.h"
+#include "http2.h"
+#include "tls.h"
 
-class http_conn{                      //http连接类
+class alignas(64) http_conn{           //http连接类
+	//微基准测试(bench/microbench.cpp)直接调用私有的解析函数
+	friend struct http_conn_bench;
+	
 	//成员变量	
 	public:
 		static int m_epollfd;
-		static int m_user_count;
-		MYSQL *mysql;
+		//当前进程的连接数，由各线程分片中的接受数和关闭数汇总，开销与线程数成正比，不要在每个请求上调用
+		static int user_count(){ return metrics::local(COUNTER_ACCEPTED) - metrics::local(COUNTER_CLOSED); }
+		//工作线程处理完请求后放入该队列，由主线程发送，为NULL时工作线程自己注册EPOLLOUT
+		static completion_queue<http_conn> *m_completion;
+		//并发模型，0为proactor，1为reactor(工作线程负责读、解析和写)
+		static int m_actor_model;
+		//I/O引擎，0为epoll，1为io_uring(由主线程提交读写请求，连接不注册到epoll)
+		static int m_io_engine;
+		//过载时的503响应报文，启动时格式化一次，主线程和工作线程共用
+		static int m_retry_after;
+		//优雅退出中，之后生成的响应都带Connection:close，由主线程设置，工作线程读取
+		static std::atomic<bool> m_draining;
 		
 		//设置读取文件的名称m_real_file大小
 		static const int FILENAME_LEN=200;
@@ -48,6 +68,13 @@ class http_conn{                      //http连接类
 			CONNECT,
 			PATH
 		};
+		//工作线程通过完成队列通知主线程的事件
+		enum CQ_EVENT{
+			CQ_WRITE = 0,   //响应报文已生成，需要发送
+			CQ_READ,        //请求不完整，需要继续读取(仅io_uring引擎)
+			CQ_CLOSE,       //处理失败，需要关闭连接
+			CQ_RELEASE      //连接已被主线程关闭，工作线程归还了最后一个引用，由主线程关闭文件描述符
+		};
 		//主状态机的状态
 		enum CHECK_STATE{
 			CHECK_STATE_REQUESTLINE = 0,    //解析请求行
@@ -63,7 +90,23 @@ class http_conn{                      //http连接类
 			FORBIDDEN_REQUEST,
 			FILE_REQUEST,
 			INTERNAL_ERROR, //服务器内部错误，该结果在主状态逻辑switch的default下，一般不会触发
-			CLOSED_CONNECTION
+			CLOSED_CONNECTION,
+			METRICS_REQUEST,   //请求/metrics，输出运行指标
+			TOO_MANY_REQUESTS, //超过单IP请求速率
+			NOT_MODIFIED       //If-None-Match与镜像中文件的ETag相同
+		};
+		//请求类别，决定请求进入线程池的哪个队列
+		enum LANE{
+			LANE_STATIC = 0,   //静态文件，处理代价小
+			LANE_DYNAMIC,      //需要路由改写的页面和不访问数据库的POST
+			LANE_DB,           //登录和注册，需要访问数据库
+			LANE_COUNT
+		};
+		//read_once的结果
+		enum READ_STATUS{
+			READ_CLOSED = 0,   //读不到数据、对方关闭连接或出错，需要关闭连接
+			READ_DATA,         //读到了新的请求数据
+			READ_WAIT          //TLS握手或记录不完整，已按需要重新注册读或写事件，之后连接可能已交给其他线程
 		};
 		//从状态机的状态
 		enum LINE_STATUS{
@@ -73,45 +116,88 @@ class http_conn{                      //http连接类
 		};
 	
 	private:
-		int m_sockfd;
-		sockaddr_in m_address;
+		//缓冲区和冷数据，放在对象之外，只在解析请求和生成响应时访问
+		//文件描述符第一次被使用时分配，之后随users中的对象一起复用，空闲的描述符不占用这部分内存
+		struct cold_data{
+			char read_buf[READ_BUFFER_SIZE];     //存储读取的请求报文数据
+			char write_buf[WRITE_BUFFER_SIZE];   //存储发出的响应报文数据
+			char real_file[FILENAME_LEN];        //用于存储读取文件的名称
+			struct stat file_stat;               //目标文件的属性
+			sockaddr_in address;                 //客户端地址
+			metrics_buf metrics;                 ///metrics响应的消息体，在多次请求间复用
+			arena scratch;                       //本次请求的临时内存，init时归还
+		};
+		//reactor模式下缓冲区由工作线程读写，而cold_data在主线程accept时分配，从预留区分配才能落在工作线程的节点上
+		static cold_data *m_cold_pool;
+		static int m_cold_count;
+		static int m_cold_used;              //只由主线程在init中修改
+		cold_data *alloc_cold();
+		void free_cold();
 		
-		//存储读取的请求报文数据
-		char m_read_buf[READ_BUFFER_SIZE];
-		//缓冲区中m_read_buf中数据的最后一个字节的下一个位置
+		//==========热数据==========
+		//主线程分发每个事件、状态机每次转移都要访问的字段，集中在对象开头的两个缓存行(共128字节)
+		//对象按缓存行对齐，users[fd]的热数据不会与相邻连接共享缓存行
+		//第一个缓存行：描述符、引用计数、解析和发送进度
+		int m_sockfd;
+		//连接代数，主线程关闭连接时加一，注册到epoll和提交给io_uring的事件带有注册时的代数
+		//文件描述符被新连接复用后，旧连接残留的事件代数不同，据此丢弃
+		std::atomic<unsigned> m_gen;
+		//引用计数：连接打开期间主线程持有一个，每个线程池任务和完成队列中的每个事件各持有一个
+		//归零之前文件描述符不会被close，编号不会被新连接复用，users中的这个对象也不会被重新init
+		std::atomic<int> m_refs;
+	public:
+		int m_state;             //reactor模式下由主线程设置，0为读，1为写
+		int m_cq_event;          //放入完成队列的原因，见CQ_EVENT
+	private:
+		//缓冲区中m_read_buf中数据的最后一个字节的下一个位置，之后的字节始终为0
 		int m_read_idx;
 		//m_read_buf读取的位置
 		int m_checked_idx;
 		//m_read_buf中已经解析的字符个数
 		int m_start_line;
-		
-		//存储发出的响应报文数据
-		char m_write_buf[WRITE_BUFFER_SIZE];
+		//主状态机的状态
+		CHECK_STATE m_check_state;
 		//指示buffer中的长度或者也可以理解为m_write_buf中数据的最后一个字节的下一个位置
 		int m_write_idx;
+		int bytes_to_send;    //剩余发送字节数
+		int bytes_have_send;  //已发送字节数
+		int m_iv_count;
+		bool m_linger;    //连接状态，如果是请求报文中connection字段是长连接，置为true
+		bool m_limit_checked;      //本次请求已按客户端IP扣减过请求令牌
+	public:
+		http_conn *m_cq_next;    //完成队列中的下一个连接
+	private:
+		//第二个缓存行：缓冲区指针和发送用的iovec
+		char *m_read_buf;          //指向m_cold->read_buf
+		char *m_write_buf;         //指向m_cold->write_buf
+		struct iovec m_iv[2];       //io向量机制iovec
+		char *m_file_address;    //读取服务器上的文件地址
+		cold_data *m_cold;
 		
-		//主状态机的状态
-		CHECK_STATE m_check_state;
+		//==========每个请求访问一次的数据==========
 		//请求方法
 		METHOD m_method;
-		
-		//以下为解析请求报文中对应的6个变量
-		//用于存储读取文件的名称
-		char m_real_file[FILENAME_LEN];
-		char *m_url;
-		char *m_version;            //估计是http版本
-		char *m_host;                //服务器域名
 		int m_content_length;     //指明发动给接收方的消息主体的大小
-		bool m_linger;    //连接状态，如果是请求报文中connection字段是长连接，置为true
-		
-		char *m_file_address;    //读取服务器上的文件地址
-		struct stat m_file_stat;   //stat是某个库的结构体
-		struct iovec m_iv[2];       //io向量机制iovec
-		int m_iv_count;
 		int cgi;                   //是否启用的post
+		bool m_accept_gzip;        //Accept-Encoding中接受gzip
+		bool m_upgrade_h2;         //Upgrade中有h2c
+		//以下为解析请求报文中对应的变量，指向m_read_buf
+		char *m_url;
+		char *m_host;                //服务器域名
 		char *m_string;       //用于存储请求头数据
-		int bytes_to_send;    //剩余发送字节数
-		int bytes_have_send;  //已发送字节数
+		char *m_if_none_match;     //If-None-Match的值，没有该头时为NULL
+		char *m_h2_settings;       //HTTP2-Settings的值，没有该头时为NULL
+		vhost *m_vhost;              //按Host选出的虚拟主机，没有Host头时为默认主机
+		static_file *m_file_cache; //文件来自虚拟主机的缓存时不为NULL，发送完释放引用
+		const bundle_entry *m_packed; //文件来自虚拟主机的镜像时不为NULL，m_file_address指向镜像
+		h2_session *m_h2;          //连接已切换到HTTP/2时不为NULL，在连接的各个请求间保持
+		tls_conn *m_tls;           //启用TLS时不为NULL，连接的读写都经过它
+	public:
+		MYSQL *mysql;
+	private:
+		long long m_accept_ns;     //accept的时间，读到第一个请求数据后清零
+		long long m_ready_ns;      //响应报文生成的时间
+		long long m_request_ns;    //本次do_request的耗时
 	
 	//成员函数
 	private:
@@ -128,6 +214,30 @@ class http_conn{                      //http连接类
 		HTTP_CODE parse_content(char *text);
 		//生成响应报文
 		HTTP_CODE do_request();
+		//调用process_read并记录解析和do_request的耗时
+		HTTP_CODE parse_request();
+		//记录do_request的耗时
+		HTTP_CODE timed_request();
+		//收到请求数据后更新统计
+		void on_read(int bytes);
+		//请求行完整后检查单IP请求速率，超限返回true
+		bool over_limit();
+		
+		//HTTP/2，帧的处理和分帧发送见http2/http2.h
+		//读缓冲区以连接前言开头，收到的数据不足前言长度时比较已收到的部分
+		bool h2_preface();
+		//处理读缓冲区中的帧，为请求完整的流生成响应，一起交给主线程发送
+		void process_h2();
+		//在一个流上按HTTP/1.1的流程处理请求
+		void serve_h2(h2_stream *s);
+		//按do_request的结果在流上生成响应，文件的引用交给流，发送完由会话释放
+		void h2_respond(h2_stream *s, HTTP_CODE ret);
+		//HTTP/1.1请求带Upgrade:h2c时切换到HTTP/2，在流1上回复该请求，不能升级返回false
+		bool upgrade_h2(HTTP_CODE ret);
+		//生成下一批帧交给主线程发送，没有要发送的继续读，连接出错时关闭
+		void flush_h2();
+		//丢弃读缓冲区开头已处理的n字节
+		void consume(int n);
 		
 		//get_line用于将指针向后偏移，指向未处理的字符
 		//m_start_line是已经解析的字符
@@ -143,25 +253,97 @@ class http_conn{                      //http连接类
 		bool add_content(const char* content);
 		bool add_status_line(int status, const char* title);
 		bool add_headers(int content_length);
-		bool add_content_type();
+		bool add_raw(const char *data, int len);      //原样复制预先生成的头部行
+		bool add_content_type(const mime_type &type);
 		bool add_content_length(int content_length);
 		bool add_linger();
 		bool add_blank_line();
+		bool add_date();
+		
+		//响应报文准备完成，交给主线程发送
+		void complete();
+		//请求不完整，继续等待读事件
+		void wait_read();
+		//放入完成队列
+		void push_completion(int event);
 		
 	public:
-		http_conn(){}
-		~http_conn(){}
+		http_conn(): m_gen(1), m_refs(0), m_read_idx(0), m_file_address(0), m_cold(0), m_file_cache(0), m_packed(0), m_h2(0), m_tls(0){}
+		~http_conn(){ delete m_h2; delete m_tls; free_cold(); }
 		
 		//初始化套接字地址，函数内部会调用私有方法init
 		void init(int sockfd, const sockaddr_in &addr);
 		//关闭http连接
 		void close_conn(bool real_close=true);
 		void process();
+		//请求排队超时，不再解析，直接回复503
+		void process_busy();
+		//根据请求行判断请求类别，主线程在分发任务前调用
+		LANE classify();
+		//主线程直接处理/metrics请求，不经过线程池，过载时也能取到指标
+		//返回1表示响应报文已生成，0表示不是完整的/metrics请求(交给工作线程)，-1表示生成失败
+		int process_inline();
+		//工作线程中读写失败，交给主线程关闭连接并删除定时器
+		void close_later();
+		
+		//epoll_data.u64中的连接句柄：高32位为连接代数，低32位为文件描述符
+		//监听socket、管道等不是连接的描述符代数为0，连接的代数从1开始，不会与之混淆
+		static unsigned long long handle(int fd, unsigned gen){ return ((unsigned long long)gen << 32) | (unsigned)fd; }
+		static int handle_fd(unsigned long long h){ return (int)(h & 0xffffffff); }
+		static unsigned handle_gen(unsigned long long h){ return h >> 32; }
+		unsigned gen(){ return m_gen.load(std::memory_order_relaxed); }
+		//事件是当前连接的，而不是该文件描述符上已关闭的旧连接残留的
+		bool current(unsigned gen){ return gen == 0 || gen == m_gen.load(std::memory_order_relaxed); }
+		//主线程关闭连接时调用，之后到达的旧事件都会被丢弃
+		void retire(){
+			unsigned g = m_gen.load(std::memory_order_relaxed) + 1;
+			m_gen.store(g ? g : 1, std::memory_order_relaxed);
+		}
+		//取得和归还引用，release在归还最后一个引用时返回true，此时调用者负责close文件描述符
+		void hold(){ m_refs.fetch_add(1, std::memory_order_relaxed); }
+		bool release(){ return m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+		//工作线程处理完一个任务后调用，归还分发时取得的引用
+		//连接在处理期间已被主线程关闭时，由主线程close文件描述符，工作线程不直接close
+		void done();
+		//格式化503响应报文，retry_after为建议客户端重试的间隔(s)
+		static void init_busy_response(int retry_after);
+		//为count个连接的缓冲区预留地址空间，物理页优先从node节点分配，node为-1时不预留，缓冲区从堆上分配
+		static bool reserve_cold(int count, int node);
+		static void release_cold_pool();
+		//格式化503报文，返回长度
+		static int busy_response(char *buf, int size);
 		//读取浏览器端发来的全部数据
-		bool read_once();
+		//返回READ_WAIT时调用者跳过本次处理，除归还引用外不能再访问连接
+		READ_STATUS read_once();
 		//响应报文写入函数
 		bool write();
-		sockaddr_in* get_address(){return &m_address;}
+		
+		//io_uring引擎使用，由主线程提交recv和writev，结果通过以下接口交给状态机
+		//把收到的数据追加到读缓冲区，缓冲区已满返回false
+		bool feed(const char *data, int len);
+		int read_space(){ return READ_BUFFER_SIZE - m_read_idx; }
+		//HTTP/2连接发送会话中的一批帧
+		struct iovec *get_iov(){ return m_h2 ? m_h2->iov() : m_iv; }
+		int get_iov_count(){ return m_h2 ? m_h2->iov_count() : m_iv_count; }
+		//已发送len字节后调整iovec，全部发送完毕返回true
+		bool advance_iov(int len);
+		//响应全部发送完毕，长连接返回true并重新初始化，短连接返回false
+		bool finish_write();
+		sockaddr_in* get_address(){return &m_cold->address;}
+		
+		//主线程计算请求各阶段超时时间时使用，调用时连接不在工作线程中
+		//读缓冲区中有未处理完的请求数据
+		bool has_request_data(){ return m_read_idx > 0; }
+		//accept后还没有读到过数据
+		bool never_read(){ return m_accept_ns != 0; }
+		//请求头已解析完，正在接收请求体
+		bool reading_body(){ return m_check_state == CHECK_STATE_CONTENT; }
+		//响应报文剩余未发送的字节数
+		int bytes_pending(){ return bytes_to_send; }
+		//已切换到HTTP/2，不能再回复HTTP/1.1的报文
+		bool http2(){ return m_h2 != 0; }
+		//连接走TLS，不能直接向socket写入明文
+		bool tls(){ return m_tls != 0; }
 		//同步线程初始化数据库读取表
 		void initmysql_result(connection_pool *connPool);
 		
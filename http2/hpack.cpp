@@ -0,0 +1,427 @@
+#include <string.h>
+#include "hpack.h"
+
+//静态表(RFC 7541附录A)，下标从1开始
+struct hpack_static{
+    const char *name;
+    int name_len;
+    const char *value;
+    int value_len;
+};
+#define HPACK_STATIC(name, value) {name, sizeof(name) - 1, value, sizeof(value) - 1}
+
+static const hpack_static static_table[HPACK_STATIC_COUNT] = {
+    HPACK_STATIC(":authority", ""),
+    HPACK_STATIC(":method", "GET"),
+    HPACK_STATIC(":method", "POST"),
+    HPACK_STATIC(":path", "/"),
+    HPACK_STATIC(":path", "/index.html"),
+    HPACK_STATIC(":scheme", "http"),
+    HPACK_STATIC(":scheme", "https"),
+    HPACK_STATIC(":status", "200"),
+    HPACK_STATIC(":status", "204"),
+    HPACK_STATIC(":status", "206"),
+    HPACK_STATIC(":status", "304"),
+    HPACK_STATIC(":status", "400"),
+    HPACK_STATIC(":status", "404"),
+    HPACK_STATIC(":status", "500"),
+    HPACK_STATIC("accept-charset", ""),
+    HPACK_STATIC("accept-encoding", "gzip, deflate"),
+    HPACK_STATIC("accept-language", ""),
+    HPACK_STATIC("accept-ranges", ""),
+    HPACK_STATIC("accept", ""),
+    HPACK_STATIC("access-control-allow-origin", ""),
+    HPACK_STATIC("age", ""),
+    HPACK_STATIC("allow", ""),
+    HPACK_STATIC("authorization", ""),
+    HPACK_STATIC("cache-control", ""),
+    HPACK_STATIC("content-disposition", ""),
+    HPACK_STATIC("content-encoding", ""),
+    HPACK_STATIC("content-language", ""),
+    HPACK_STATIC("content-length", ""),
+    HPACK_STATIC("content-location", ""),
+    HPACK_STATIC("content-range", ""),
+    HPACK_STATIC("content-type", ""),
+    HPACK_STATIC("cookie", ""),
+    HPACK_STATIC("date", ""),
+    HPACK_STATIC("etag", ""),
+    HPACK_STATIC("expect", ""),
+    HPACK_STATIC("expires", ""),
+    HPACK_STATIC("from", ""),
+    HPACK_STATIC("host", ""),
+    HPACK_STATIC("if-match", ""),
+    HPACK_STATIC("if-modified-since", ""),
+    HPACK_STATIC("if-none-match", ""),
+    HPACK_STATIC("if-range", ""),
+    HPACK_STATIC("if-unmodified-since", ""),
+    HPACK_STATIC("last-modified", ""),
+    HPACK_STATIC("link", ""),
+    HPACK_STATIC("location", ""),
+    HPACK_STATIC("max-forwards", ""),
+    HPACK_STATIC("proxy-authenticate", ""),
+    HPACK_STATIC("proxy-authorization", ""),
+    HPACK_STATIC("range", ""),
+    HPACK_STATIC("referer", ""),
+    HPACK_STATIC("refresh", ""),
+    HPACK_STATIC("retry-after", ""),
+    HPACK_STATIC("server", ""),
+    HPACK_STATIC("set-cookie", ""),
+    HPACK_STATIC("strict-transport-security", ""),
+    HPACK_STATIC("transfer-encoding", ""),
+    HPACK_STATIC("user-agent", ""),
+    HPACK_STATIC("vary", ""),
+    HPACK_STATIC("via", ""),
+    HPACK_STATIC("www-authenticate", ""),
+};
+
+//哈夫曼编码表(RFC 7541附录B)，码字右对齐，第256项为EOS
+struct hpack_code{
+    unsigned int code;
+    int bits;
+};
+
+static constexpr hpack_code huffman_codes[257] = {
+    {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+    {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+    {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+    {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+    {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+    {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+    {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+    {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+    {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+    {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+    {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+    {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+    {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+    {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+    {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+    {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+    {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+    {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+    {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+    {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+    {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+    {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+    {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+    {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+    {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+    {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+    {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+    {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+    {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+    {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+    {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+    {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+    {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+    {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+    {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+    {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+    {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+    {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+    {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+    {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+    {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+    {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+    {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+    {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+    {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+    {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+    {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+    {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+    {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+    {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+    {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+    {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+    {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+    {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+    {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+    {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+    {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+    {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+    {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+    {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+    {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+    {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+    {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+    {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+    {0x3fffffff, 30},
+};
+
+//由编码表在编译期建成的解码树，每次按一位走一步
+//child大于0为内部节点的下标，小于0为叶子，~child为符号；根节点0不会是任何节点的子节点
+struct huffman_tree{
+    short child[256][2];
+
+    constexpr huffman_tree() : child()
+    {
+        int nodes = 1;
+        for (int sym = 0; sym < 257; sym++)
+        {
+            int node = 0;
+            for (int bit = huffman_codes[sym].bits - 1; bit > 0; bit--)
+            {
+                int b = (huffman_codes[sym].code >> bit) & 1;
+                if (child[node][b] == 0)
+                    child[node][b] = nodes++;
+                node = child[node][b];
+            }
+            child[node][huffman_codes[sym].code & 1] = ~sym;
+        }
+    }
+};
+
+static constexpr huffman_tree huffman;
+static_assert(huffman.child[0][0] > 0 && huffman.child[0][1] > 0, "");
+
+//解码到out，out的空间不足、出现EOS或末尾的填充不是不超过7位的全1时返回-1
+static int huffman_decode(const unsigned char *in, int len, char *out, int cap)
+{
+    int n = 0;
+    int node = 0;
+    int pad = 0;                    //上一个符号之后的位数
+    bool ones = true;               //这些位都是1
+    for (int i = 0; i < len; i++)
+    {
+        for (int bit = 7; bit >= 0; bit--)
+        {
+            int b = (in[i] >> bit) & 1;
+            int c = huffman.child[node][b];
+            pad++;
+            ones = ones && b;
+            if (c > 0)
+            {
+                node = c;
+                continue;
+            }
+            if (~c == 256 || n == cap)
+                return -1;
+            out[n++] = ~c;
+            node = 0;
+            pad = 0;
+            ones = true;
+        }
+    }
+    return pad <= 7 && ones ? n : -1;
+}
+
+void hpack_decoder::begin(const char *data, int len)
+{
+    m_pos = (const unsigned char *)data;
+    m_end = m_pos + len;
+}
+
+//前缀整数，超过2^28视为错误
+bool hpack_decoder::integer(int prefix, unsigned int *value)
+{
+    unsigned int mask = (1u << prefix) - 1;
+    unsigned int v = *m_pos++ & mask;
+    if (v < mask)
+    {
+        *value = v;
+        return true;
+    }
+    for (int shift = 0; m_pos < m_end && shift <= 21; shift += 7)
+    {
+        unsigned char b = *m_pos++;
+        v += (unsigned int)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+        {
+            *value = v;
+            return true;
+        }
+    }
+    return false;
+}
+
+//字面字符串，哈夫曼编码的解码到m_scratch中，否则直接指向头部块
+bool hpack_decoder::string(const char **str, int *len)
+{
+    if (m_pos >= m_end)
+        return false;
+    bool huffman_coded = *m_pos & 0x80;
+    unsigned int n;
+    if (!integer(7, &n) || n > (unsigned int)(m_end - m_pos))
+        return false;
+    if (huffman_coded)
+    {
+        int out = huffman_decode(m_pos, n, m_scratch + m_scratch_len, HPACK_SCRATCH_SIZE - m_scratch_len);
+        if (out < 0)
+            return false;
+        *str = m_scratch + m_scratch_len;
+        *len = out;
+        m_scratch_len += out;
+    }
+    else
+    {
+        *str = (const char *)m_pos;
+        *len = n;
+    }
+    m_pos += n;
+    return true;
+}
+
+//下标1到61为静态表，之后为动态表，最新加入的项下标最小
+bool hpack_decoder::lookup(unsigned int index, hpack_field *field)
+{
+    if (index == 0)
+        return false;
+    if (index <= HPACK_STATIC_COUNT)
+    {
+        const hpack_static &s = static_table[index - 1];
+        field->name = s.name;
+        field->name_len = s.name_len;
+        field->value = s.value;
+        field->value_len = s.value_len;
+        return true;
+    }
+    index -= HPACK_STATIC_COUNT + 1;
+    if (index >= (unsigned int)m_count)
+        return false;
+    const entry &e = m_entries[m_count - 1 - index];
+    field->name = m_data + e.offset;
+    field->name_len = e.name_len;
+    field->value = m_data + e.offset + e.name_len;
+    field->value_len = e.value_len;
+    return true;
+}
+
+void hpack_decoder::evict(int size)
+{
+    int k = 0;
+    int bytes = 0;
+    while (k < m_count && m_size + size > m_max)
+    {
+        m_size -= m_entries[k].name_len + m_entries[k].value_len + HPACK_ENTRY_OVERHEAD;
+        bytes += m_entries[k].name_len + m_entries[k].value_len;
+        k++;
+    }
+    if (k == 0)
+        return;
+    m_count -= k;
+    m_used -= bytes;
+    memmove(m_data, m_data + bytes, m_used);
+    memmove(m_entries, m_entries + k, m_count * sizeof(entry));
+    for (int i = 0; i < m_count; i++)
+        m_entries[i].offset -= bytes;
+}
+
+void hpack_decoder::insert(hpack_field *field)
+{
+    int size = field->name_len + field->value_len + HPACK_ENTRY_OVERHEAD;
+    //比整个表还大的项使表变空，自身不加入
+    if (size > m_max)
+    {
+        evict(size);
+        return;
+    }
+    //名字可能引用动态表中即将被淘汰的项，淘汰会移动m_data，先复制出来
+    //能放入表中的项名字和值都不超过HPACK_TABLE_SIZE，m_scratch放得下
+    if (field->name >= m_data && field->name < m_data + HPACK_TABLE_SIZE)
+    {
+        memcpy(m_scratch + m_scratch_len, field->name, field->name_len);
+        field->name = m_scratch + m_scratch_len;
+        m_scratch_len += field->name_len;
+    }
+    evict(size);
+    entry &e = m_entries[m_count++];
+    e.offset = m_used;
+    e.name_len = field->name_len;
+    e.value_len = field->value_len;
+    memcpy(m_data + m_used, field->name, field->name_len);
+    memcpy(m_data + m_used + field->name_len, field->value, field->value_len);
+    m_used += field->name_len + field->value_len;
+    m_size += size;
+    field->name = m_data + e.offset;
+    field->value = m_data + e.offset + e.name_len;
+}
+
+int hpack_decoder::next(hpack_field *field)
+{
+    m_scratch_len = 0;
+    while (m_pos < m_end)
+    {
+        unsigned char b = *m_pos;
+        unsigned int index;
+        //索引字段：1xxxxxxx
+        if (b & 0x80)
+        {
+            if (!integer(7, &index) || !lookup(index, field))
+                return -1;
+            return 1;
+        }
+        //动态表大小更新：001xxxxx，不能超过SETTINGS中通告的大小
+        if ((b & 0xe0) == 0x20)
+        {
+            unsigned int size;
+            if (!integer(5, &size) || size > HPACK_TABLE_SIZE)
+                return -1;
+            m_max = size;
+            evict(0);
+            continue;
+        }
+        //字面字段：01xxxxxx加入动态表，0000xxxx不索引，0001xxxx永不索引
+        bool indexing = (b & 0xc0) == 0x40;
+        if (!integer(indexing ? 6 : 4, &index))
+            return -1;
+        if (index)
+        {
+            hpack_field name;
+            if (!lookup(index, &name))
+                return -1;
+            field->name = name.name;
+            field->name_len = name.name_len;
+        }
+        else if (!string(&field->name, &field->name_len))
+            return -1;
+        if (!string(&field->value, &field->value_len))
+            return -1;
+        if (indexing)
+            insert(field);
+        return 1;
+    }
+    return 0;
+}
+
+//前缀整数，first为第一个字节中前缀之外的高位
+static int encode_integer(char *out, int cap, unsigned int value, int prefix, unsigned char first)
+{
+    unsigned int mask = (1u << prefix) - 1;
+    if (cap < 1)
+        return -1;
+    if (value < mask)
+    {
+        out[0] = first | value;
+        return 1;
+    }
+    out[0] = first | mask;
+    value -= mask;
+    int n = 1;
+    for (; value >= 0x80; value >>= 7)
+    {
+        if (n == cap)
+            return -1;
+        out[n++] = (value & 0x7f) | 0x80;
+    }
+    if (n == cap)
+        return -1;
+    out[n++] = value;
+    return n;
+}
+
+int hpack_encoder::indexed(char *out, int cap, int index)
+{
+    return encode_integer(out, cap, index, 7, 0x80);
+}
+
+int hpack_encoder::literal(char *out, int cap, int name_index, const char *value, int len)
+{
+    int n = encode_integer(out, cap, name_index, 4, 0x00);
+    if (n < 0)
+        return -1;
+    int m = encode_integer(out + n, cap - n, len, 7, 0x00);
+    if (m < 0 || n + m + len > cap)
+        return -1;
+    memcpy(out + n + m, value, len);
+    return n + m + len;
+}
@@ -0,0 +1,84 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+//HPACK(RFC 7541)：HTTP/2的头部压缩
+//解码器维护静态表和动态表，支持哈夫曼编码的字符串，每个连接一个
+//编码器只用静态表中的名字加不索引的字面值，不修改对端的动态表，响应的头部块可以按任意顺序发送
+
+#define HPACK_TABLE_SIZE 4096                          //动态表的最大大小，即SETTINGS_HEADER_TABLE_SIZE的默认值
+#define HPACK_ENTRY_OVERHEAD 32                        //每项在名字和值之外计入的大小
+#define HPACK_TABLE_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+#define HPACK_STATIC_COUNT 61
+#define HPACK_SCRATCH_SIZE 8192                        //一个字段的名字和值经哈夫曼解码后的总长度上限
+
+//响应用到的静态表下标
+#define HPACK_STATUS_200 8
+#define HPACK_STATUS_304 11
+#define HPACK_STATUS_404 13
+#define HPACK_STATUS_500 14
+#define HPACK_CONTENT_ENCODING 26
+#define HPACK_CONTENT_LENGTH 28
+#define HPACK_CONTENT_TYPE 31
+#define HPACK_DATE 33
+#define HPACK_ETAG 34
+#define HPACK_RETRY_AFTER 53
+#define HPACK_VARY 59
+
+//解码出的一个字段，字符串不以'\0'结尾
+struct hpack_field{
+    const char *name;
+    int name_len;
+    const char *value;
+    int value_len;
+};
+
+class hpack_decoder{
+public:
+    hpack_decoder() : m_pos(0), m_end(0), m_count(0), m_used(0), m_size(0), m_max(HPACK_TABLE_SIZE), m_scratch_len(0) {}
+
+    //开始解码一个完整的头部块，解码期间data须保持有效
+    void begin(const char *data, int len);
+    //取出下一个字段，返回1表示取到，0表示头部块已结束，-1表示压缩错误，连接须以COMPRESSION_ERROR关闭
+    //字段中的字符串指向静态表、动态表、头部块或内部的缓冲区，只在下一次调用前有效
+    int next(hpack_field *field);
+
+private:
+    bool integer(int prefix, unsigned int *value);
+    bool string(const char **str, int *len);
+    bool lookup(unsigned int index, hpack_field *field);
+    //加入动态表，field改为指向表中的副本
+    void insert(hpack_field *field);
+    //淘汰最旧的项，直到再放入size大小的项也不超过m_max
+    void evict(int size);
+
+    const unsigned char *m_pos;
+    const unsigned char *m_end;
+
+    //动态表：m_entries按加入的先后排列，最新的在最后；名字和值依次存放在m_data中
+    struct entry{
+        int offset;
+        int name_len;
+        int value_len;
+    };
+    entry m_entries[HPACK_TABLE_ENTRIES];
+    int m_count;
+    int m_used;                             //m_data中已用的字节数
+    int m_size;                             //按RFC计算的大小，每项为名字和值的长度加32
+    int m_max;                              //由头部块中的表大小更新指令调整，不超过HPACK_TABLE_SIZE
+    char m_data[HPACK_TABLE_SIZE];
+
+    //哈夫曼解码的结果，每个字段开始时清空
+    int m_scratch_len;
+    char m_scratch[HPACK_SCRATCH_SIZE];
+};
+
+class hpack_encoder{
+public:
+    //静态表中名字和值都相同的字段，如:status 200
+    static int indexed(char *out, int cap, int index);
+    //静态表中的名字加字面值，不加入动态表，值不做哈夫曼编码
+    static int literal(char *out, int cap, int name_index, const char *value, int len);
+    //以上两个函数返回写入的字节数，空间不足返回-1
+};
+
+#endif
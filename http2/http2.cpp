@@ -0,0 +1,879 @@
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "http2.h"
+
+static void put32(unsigned char *p, unsigned int v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static unsigned int get32(const unsigned char *p)
+{
+    return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+//帧头：24位长度、类型、标志、31位流编号
+static void put_header(char *out, int len, int type, int flags, unsigned int id)
+{
+    unsigned char *p = (unsigned char *)out;
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5, id & 0x7fffffff);
+}
+
+//HTTP2-Settings的值，base64url编码，不带填充；出错或超出cap返回-1
+static int base64url_decode(const char *in, unsigned char *out, int cap)
+{
+    int n = 0;
+    unsigned int bits = 0;
+    int count = 0;
+    for (; *in && *in != ' ' && *in != '\t' && *in != '='; in++)
+    {
+        int c = *in;
+        int v;
+        if (c >= 'A' && c <= 'Z')
+            v = c - 'A';
+        else if (c >= 'a' && c <= 'z')
+            v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9')
+            v = c - '0' + 52;
+        else if (c == '-')
+            v = 62;
+        else if (c == '_')
+            v = 63;
+        else
+            return -1;
+        bits = bits << 6 | v;
+        count += 6;
+        if (count >= 8)
+        {
+            if (n == cap)
+                return -1;
+            count -= 8;
+            out[n++] = bits >> count;
+        }
+    }
+    return n;
+}
+
+static void copy_field(char *dst, int cap, const char *value, int len)
+{
+    if (len > cap - 1)
+        len = cap - 1;
+    memcpy(dst, value, len);
+    dst[len] = '\0';
+}
+
+static bool field_is(const hpack_field &f, const char *name)
+{
+    return f.name_len == (int)strlen(name) && memcmp(f.name, name, f.name_len) == 0;
+}
+
+bool h2_stream::add_status(int status)
+{
+    //静态表中有的状态码直接引用，其他的用:status的名字加字面值
+    int index;
+    switch (status)
+    {
+    case 200:
+        index = HPACK_STATUS_200;
+        break;
+    case 304:
+        index = HPACK_STATUS_304;
+        break;
+    case 404:
+        index = HPACK_STATUS_404;
+        break;
+    case 500:
+        index = HPACK_STATUS_500;
+        break;
+    default:
+        return add_header(HPACK_STATUS_200, status);
+    }
+    int n = hpack_encoder::indexed(head + head_len, H2_HEAD_LEN - head_len, index);
+    if (n < 0)
+        return false;
+    head_len += n;
+    return true;
+}
+
+bool h2_stream::add_header(int name_index, const char *value, int len)
+{
+    int n = hpack_encoder::literal(head + head_len, H2_HEAD_LEN - head_len, name_index, value, len);
+    if (n < 0)
+        return false;
+    head_len += n;
+    return true;
+}
+
+bool h2_stream::add_header(int name_index, long long value)
+{
+    char text[24];
+    return add_header(name_index, text, snprintf(text, sizeof(text), "%lld", value));
+}
+
+h2_session::h2_session()
+    : m_last_id(0), m_next(0), m_peer_window(H2_WINDOW), m_peer_frame(H2_FRAME_SIZE), m_window(H2_WINDOW),
+      m_expect_preface(false), m_failed(false), m_goaway(false), m_peer_goaway(false),
+      m_block_id(0), m_block_end(false), m_block_refused(false), m_block_trailer(false),
+      m_has_method(false), m_has_path(false), m_block_len(0),
+      m_in_block(false), m_block_last(false), m_block_left(0), m_block_pad(0),
+      m_data_stream(0), m_data_id(0), m_data_left(0), m_data_pad(0), m_data_end(false), m_in_data(false),
+      m_out_len(0), m_out_mark(0), m_iov_count(0), m_batch(0)
+{
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        m_streams[i].id = 0;
+        m_streams[i].state = H2_IDLE;
+        m_streams[i].cache = 0;
+        m_streams[i].map = 0;
+    }
+}
+
+h2_session::~h2_session()
+{
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+        if (m_streams[i].state != H2_IDLE)
+            close_stream(&m_streams[i]);
+}
+
+h2_stream *h2_session::find(unsigned int id)
+{
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+        if (m_streams[i].state != H2_IDLE && m_streams[i].id == id)
+            return &m_streams[i];
+    return NULL;
+}
+
+h2_stream *h2_session::open_stream(unsigned int id)
+{
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        h2_stream *s = &m_streams[i];
+        if (s->state != H2_IDLE)
+            continue;
+        s->id = id;
+        s->state = H2_OPEN;
+        s->window = m_peer_window;
+        s->post = false;
+        s->bad = false;
+        s->path[0] = '\0';
+        s->authority[0] = '\0';
+        s->accept_encoding[0] = '\0';
+        s->if_none_match[0] = '\0';
+        s->body_len = 0;
+        s->body[0] = '\0';
+        s->head_len = 0;
+        s->head_sent = false;
+        s->data = 0;
+        s->size = 0;
+        s->sent = 0;
+        s->cache = 0;
+        s->map = 0;
+        s->map_len = 0;
+        return s;
+    }
+    return NULL;
+}
+
+void h2_session::close_stream(h2_stream *s)
+{
+    //与http_conn::unmap相同：缓存中的文件只释放引用，镜像中的不需要释放
+    if (s->cache)
+        vhost::release(s->cache);
+    else if (s->map)
+        munmap(s->map, s->map_len);
+    s->cache = 0;
+    s->map = 0;
+    s->metrics.clear();
+    s->state = H2_IDLE;
+    s->id = 0;
+}
+
+int h2_session::active()
+{
+    int n = 0;
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+        n += m_streams[i].state != H2_IDLE;
+    return n;
+}
+
+unsigned char *h2_session::queue(int type, int flags, unsigned int id, int len)
+{
+    if (m_out_len + H2_FRAME_HEADER_LEN + len > H2_OUT_LEN - H2_OUT_RESERVE)
+    {
+        fail(H2_ENHANCE_YOUR_CALM);
+        return NULL;
+    }
+    put_header(m_out + m_out_len, len, type, flags, id);
+    m_out_len += H2_FRAME_HEADER_LEN + len;
+    return (unsigned char *)m_out + m_out_len - len;
+}
+
+//GOAWAY使用m_out中保留的空间
+void h2_session::goaway(int error)
+{
+    if (m_out_len + H2_FRAME_HEADER_LEN + 8 > H2_OUT_LEN)
+        return;
+    put_header(m_out + m_out_len, 8, H2_GOAWAY, 0, 0);
+    unsigned char *p = (unsigned char *)m_out + m_out_len + H2_FRAME_HEADER_LEN;
+    put32(p, m_last_id);
+    put32(p + 4, error);
+    m_out_len += H2_FRAME_HEADER_LEN + 8;
+    m_goaway = true;
+}
+
+bool h2_session::fail(int error)
+{
+    if (!m_failed)
+    {
+        m_failed = true;
+        goaway(error);
+    }
+    return false;
+}
+
+void h2_session::reset(unsigned int id, int error)
+{
+    unsigned char *p = queue(H2_RST_STREAM, 0, id, 4);
+    if (p)
+        put32(p, error);
+}
+
+bool h2_session::window_update(unsigned int id, int increment)
+{
+    unsigned char *p = queue(H2_WINDOW_UPDATE, 0, id, 4);
+    if (!p)
+        return false;
+    put32(p, increment);
+    return true;
+}
+
+void h2_session::start()
+{
+    m_expect_preface = true;
+    unsigned char *p = queue(H2_SETTINGS, 0, 0, 12);
+    p[0] = 0;
+    p[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(p + 2, H2_MAX_STREAMS);
+    p[6] = 0;
+    p[7] = H2_SETTINGS_MAX_HEADER_LIST_SIZE;
+    put32(p + 8, H2_HEADER_BLOCK);
+}
+
+h2_stream *h2_session::upgrade(const char *settings)
+{
+    unsigned char payload[6 * 16];
+    int len = base64url_decode(settings, payload, sizeof(payload));
+    if (len < 0 || len % 6 != 0 || apply_settings(payload, len) != H2_NO_ERROR)
+        return NULL;
+    //101之后就是HTTP/2的帧，HTTP2-Settings不需要回复ACK，101即为确认
+    static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection:Upgrade\r\nUpgrade:h2c\r\n\r\n";
+    memcpy(m_out + m_out_len, switching, sizeof(switching) - 1);
+    m_out_len += sizeof(switching) - 1;
+    start();
+    m_last_id = 1;
+    h2_stream *s = open_stream(1);
+    s->state = H2_SENDING;
+    return s;
+}
+
+int h2_session::apply_settings(const unsigned char *p, int len)
+{
+    for (int i = 0; i + 6 <= len; i += 6)
+    {
+        int id = p[i] << 8 | p[i + 1];
+        unsigned int value = get32(p + i + 2);
+        switch (id)
+        {
+        case H2_SETTINGS_ENABLE_PUSH:
+            if (value > 1)
+                return H2_PROTOCOL_ERROR;
+            break;
+        case H2_SETTINGS_INITIAL_WINDOW_SIZE:
+            //已打开的流的发送窗口按差值调整
+            if (value > H2_WINDOW_MAX)
+                return H2_FLOW_CONTROL_ERROR;
+            for (int k = 0; k < H2_MAX_STREAMS; k++)
+            {
+                h2_stream *s = &m_streams[k];
+                if (s->state == H2_IDLE)
+                    continue;
+                long long window = (long long)s->window + value - m_peer_window;
+                if (window > H2_WINDOW_MAX)
+                    return H2_FLOW_CONTROL_ERROR;
+                s->window = window;
+            }
+            m_peer_window = value;
+            break;
+        case H2_SETTINGS_MAX_FRAME_SIZE:
+            if (value < H2_FRAME_SIZE || value > 0xffffff)
+                return H2_PROTOCOL_ERROR;
+            m_peer_frame = value;
+            break;
+        default:
+            //HEADER_TABLE_SIZE只影响编码器的动态表，编码器不使用动态表；未知参数忽略
+            break;
+        }
+    }
+    return H2_NO_ERROR;
+}
+
+int h2_session::receive(const char *buf, int len, int cap)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    int pos = 0;
+    if (m_failed)
+        return len;
+    if (m_expect_preface)
+    {
+        int n = len < H2_PREFACE_LEN ? len : H2_PREFACE_LEN;
+        if (memcmp(buf, H2_PREFACE, n) != 0)
+        {
+            fail(H2_PROTOCOL_ERROR);
+            return len;
+        }
+        if (n < H2_PREFACE_LEN)
+            return 0;
+        m_expect_preface = false;
+        pos = H2_PREFACE_LEN;
+    }
+    while (!m_failed)
+    {
+        //DATA帧的负载可以分多次收到，末尾m_data_pad字节是填充
+        if (m_in_data)
+        {
+            int n = len - pos < m_data_left ? len - pos : m_data_left;
+            int body = m_data_left - m_data_pad;
+            if (body > 0)
+                data(buf + pos, n < body ? n : body);
+            m_data_left -= n;
+            pos += n;
+            if (m_data_left > 0)
+                break;
+            end_data();
+            continue;
+        }
+        //头部块的片段直接追加到m_block，帧可以比读缓冲区大，只受H2_HEADER_BLOCK限制
+        if (m_in_block)
+        {
+            int n = len - pos < m_block_left ? len - pos : m_block_left;
+            int frag = m_block_left - m_block_pad;
+            if (frag > 0 && !append_block(p + pos, n < frag ? n : frag))
+                break;
+            m_block_left -= n;
+            pos += n;
+            if (m_block_left > 0)
+                break;
+            m_in_block = false;
+            if (m_block_last && !end_headers())
+                break;
+            continue;
+        }
+        if (len - pos < H2_FRAME_HEADER_LEN)
+            break;
+        int flen = p[pos] << 16 | p[pos + 1] << 8 | p[pos + 2];
+        int type = p[pos + 3];
+        int flags = p[pos + 4];
+        unsigned int id = get32(p + pos + 5) & 0x7fffffff;
+        if (flen > H2_FRAME_SIZE)
+        {
+            fail(H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (type == H2_DATA)
+        {
+            //带填充时先要收到填充长度
+            int pad = 0;
+            int skip = H2_FRAME_HEADER_LEN;
+            if (flags & H2_FLAG_PADDED)
+            {
+                if (len - pos <= H2_FRAME_HEADER_LEN)
+                    break;
+                pad = p[pos + H2_FRAME_HEADER_LEN];
+                skip++;
+                if (flen < 1 || pad >= flen)
+                {
+                    fail(H2_PROTOCOL_ERROR);
+                    break;
+                }
+            }
+            if (!begin_data(flags, id, flen))
+                break;
+            m_data_left = flen - (skip - H2_FRAME_HEADER_LEN);
+            m_data_pad = pad;
+            pos += skip;
+            continue;
+        }
+        if (type == H2_HEADERS || type == H2_CONTINUATION)
+        {
+            //HEADERS先要收到填充长度和优先级字段，优先级忽略
+            int pad = 0;
+            int skip = H2_FRAME_HEADER_LEN;
+            if (type == H2_HEADERS)
+            {
+                skip += ((flags & H2_FLAG_PADDED) ? 1 : 0) + ((flags & H2_FLAG_PRIORITY) ? 5 : 0);
+                if (len - pos < skip)
+                    break;
+                if (flags & H2_FLAG_PADDED)
+                    pad = p[pos + H2_FRAME_HEADER_LEN];
+                if (skip - H2_FRAME_HEADER_LEN + pad > flen)
+                {
+                    fail(H2_PROTOCOL_ERROR);
+                    break;
+                }
+            }
+            int frag = flen - (skip - H2_FRAME_HEADER_LEN) - pad;
+            if (type == H2_HEADERS ? !on_headers(flags, id, frag) : !on_continuation(id, frag))
+                break;
+            m_in_block = true;
+            m_block_last = flags & H2_FLAG_END_HEADERS;
+            m_block_left = flen - (skip - H2_FRAME_HEADER_LEN);
+            m_block_pad = pad;
+            pos += skip;
+            continue;
+        }
+        //其他帧须完整收到再处理，读缓冲区放不下的帧无法处理
+        if (H2_FRAME_HEADER_LEN + flen > cap)
+        {
+            fail(H2_ENHANCE_YOUR_CALM);
+            break;
+        }
+        if (len - pos < H2_FRAME_HEADER_LEN + flen)
+            break;
+        if (!frame(type, flags, id, p + pos + H2_FRAME_HEADER_LEN, flen))
+            break;
+        pos += H2_FRAME_HEADER_LEN + flen;
+    }
+    return m_failed ? len : pos;
+}
+
+bool h2_session::frame(int type, int flags, unsigned int id, const unsigned char *p, int len)
+{
+    //头部块的HEADERS和CONTINUATION之间不能插入其他帧
+    if (m_block_id && type != H2_CONTINUATION)
+        return fail(H2_PROTOCOL_ERROR);
+    switch (type)
+    {
+    case H2_SETTINGS:
+        return on_settings(flags, id, p, len);
+    case H2_WINDOW_UPDATE:
+        return on_window_update(id, p, len);
+    case H2_RST_STREAM:
+        return on_rst_stream(id, p, len);
+    case H2_PING:
+    {
+        if (id)
+            return fail(H2_PROTOCOL_ERROR);
+        if (len != 8)
+            return fail(H2_FRAME_SIZE_ERROR);
+        if (flags & H2_FLAG_ACK)
+            return true;
+        unsigned char *ack = queue(H2_PING, H2_FLAG_ACK, 0, 8);
+        if (!ack)
+            return false;
+        memcpy(ack, p, 8);
+        return true;
+    }
+    case H2_PRIORITY:
+        if (id == 0)
+            return fail(H2_PROTOCOL_ERROR);
+        if (len != 5)
+            reset(id, H2_FRAME_SIZE_ERROR);
+        return !m_failed;
+    case H2_GOAWAY:
+        if (id)
+            return fail(H2_PROTOCOL_ERROR);
+        m_peer_goaway = true;
+        return true;
+    case H2_PUSH_PROMISE:
+        //客户端不能推送
+        return fail(H2_PROTOCOL_ERROR);
+    default:
+        //未知类型的帧忽略
+        return true;
+    }
+}
+
+bool h2_session::on_settings(int flags, unsigned int id, const unsigned char *p, int len)
+{
+    if (id)
+        return fail(H2_PROTOCOL_ERROR);
+    if (flags & H2_FLAG_ACK)
+        return len == 0 ? true : fail(H2_FRAME_SIZE_ERROR);
+    if (len % 6 != 0)
+        return fail(H2_FRAME_SIZE_ERROR);
+    int error = apply_settings(p, len);
+    if (error != H2_NO_ERROR)
+        return fail(error);
+    return queue(H2_SETTINGS, H2_FLAG_ACK, 0, 0) != NULL;
+}
+
+bool h2_session::on_window_update(unsigned int id, const unsigned char *p, int len)
+{
+    if (len != 4)
+        return fail(H2_FRAME_SIZE_ERROR);
+    unsigned int increment = get32(p) & 0x7fffffff;
+    if (id == 0)
+    {
+        if (increment == 0)
+            return fail(H2_PROTOCOL_ERROR);
+        m_window += increment;
+        return m_window <= H2_WINDOW_MAX ? true : fail(H2_FLOW_CONTROL_ERROR);
+    }
+    h2_stream *s = find(id);
+    if (!s)
+        return id <= m_last_id ? true : fail(H2_PROTOCOL_ERROR);
+    if (increment == 0 || (long long)s->window + increment > H2_WINDOW_MAX)
+    {
+        reset(id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+        close_stream(s);
+        return !m_failed;
+    }
+    s->window += increment;
+    return true;
+}
+
+//对端取消了流，接收期间没有正在发送的一批，流持有的文件可以立即释放，错误码不影响处理
+bool h2_session::on_rst_stream(unsigned int id, const unsigned char *, int len)
+{
+    if (id == 0)
+        return fail(H2_PROTOCOL_ERROR);
+    if (len != 4)
+        return fail(H2_FRAME_SIZE_ERROR);
+    h2_stream *s = find(id);
+    if (s)
+        close_stream(s);
+    return id <= m_last_id ? true : fail(H2_PROTOCOL_ERROR);
+}
+
+bool h2_session::on_headers(int flags, unsigned int id, int len)
+{
+    //头部块的HEADERS和CONTINUATION之间不能插入其他帧
+    if (m_block_id)
+        return fail(H2_PROTOCOL_ERROR);
+    //客户端发起的流编号为奇数
+    if (id == 0 || !(id & 1))
+        return fail(H2_PROTOCOL_ERROR);
+
+    m_block_refused = false;
+    m_block_trailer = false;
+    if (id <= m_last_id)
+    {
+        //请求体之后的trailer，须带END_STREAM
+        h2_stream *s = find(id);
+        if (!s || s->state != H2_OPEN || !(flags & H2_FLAG_END_STREAM))
+            return fail(H2_PROTOCOL_ERROR);
+        m_block_trailer = true;
+    }
+    else
+    {
+        m_last_id = id;
+        //GOAWAY之后不再接受新的流；没有空闲的槽时拒绝，头部块仍要解码，保持动态表同步
+        if (m_goaway || !open_stream(id))
+            m_block_refused = true;
+    }
+    m_block_id = id;
+    m_block_end = flags & H2_FLAG_END_STREAM;
+    m_block_len = 0;
+    //超出上限的头部块在收到负载之前就拒绝
+    if (len > H2_HEADER_BLOCK)
+        return fail(H2_ENHANCE_YOUR_CALM);
+    return true;
+}
+
+bool h2_session::on_continuation(unsigned int id, int len)
+{
+    if (!m_block_id || id != m_block_id)
+        return fail(H2_PROTOCOL_ERROR);
+    if (m_block_len + len > H2_HEADER_BLOCK)
+        return fail(H2_ENHANCE_YOUR_CALM);
+    return true;
+}
+
+bool h2_session::append_block(const unsigned char *p, int len)
+{
+    if (m_block_len + len > H2_HEADER_BLOCK)
+        return fail(H2_ENHANCE_YOUR_CALM);
+    memcpy(m_block + m_block_len, p, len);
+    m_block_len += len;
+    return true;
+}
+
+bool h2_session::end_headers()
+{
+    unsigned int id = m_block_id;
+    m_block_id = 0;
+    h2_stream *s = (m_block_refused || m_block_trailer) ? NULL : find(id);
+    m_has_method = false;
+    m_has_path = false;
+
+    m_decoder.begin(m_block, m_block_len);
+    hpack_field field;
+    int ret;
+    while ((ret = m_decoder.next(&field)) == 1)
+        if (s)
+            header(s, field);
+    if (ret < 0)
+        return fail(H2_COMPRESSION_ERROR);
+
+    if (m_block_refused)
+    {
+        reset(id, H2_REFUSED_STREAM);
+        return !m_failed;
+    }
+    if (m_block_trailer)
+    {
+        find(id)->state = H2_READY;
+        return true;
+    }
+    //缺少:method或:path的请求是畸形的
+    if (!m_has_method || !m_has_path)
+    {
+        reset(id, H2_PROTOCOL_ERROR);
+        close_stream(s);
+        return !m_failed;
+    }
+    if (m_block_end)
+        s->state = H2_READY;
+    return true;
+}
+
+//只取出http_conn用到的字段，其他的忽略
+void h2_session::header(h2_stream *s, const hpack_field &f)
+{
+    if (field_is(f, ":method"))
+    {
+        m_has_method = true;
+        if (f.value_len == 4 && memcmp(f.value, "POST", 4) == 0)
+            s->post = true;
+        else if (f.value_len != 3 || memcmp(f.value, "GET", 3) != 0)
+            s->bad = true;
+    }
+    else if (field_is(f, ":path"))
+    {
+        m_has_path = true;
+        if (f.value_len == 0 || f.value_len >= H2_PATH_LEN || f.value[0] != '/')
+            s->bad = true;
+        else
+            copy_field(s->path, H2_PATH_LEN, f.value, f.value_len);
+    }
+    else if (field_is(f, ":authority") || (field_is(f, "host") && !s->authority[0]))
+        copy_field(s->authority, H2_FIELD_LEN, f.value, f.value_len);
+    else if (field_is(f, "accept-encoding"))
+        copy_field(s->accept_encoding, H2_FIELD_LEN, f.value, f.value_len);
+    else if (field_is(f, "if-none-match"))
+        copy_field(s->if_none_match, H2_FIELD_LEN, f.value, f.value_len);
+}
+
+//每收到一个DATA帧立即按其长度归还连接和流的接收窗口，请求体很小，不需要限制对端
+bool h2_session::begin_data(int flags, unsigned int id, int len)
+{
+    if (m_block_id || id == 0)
+        return fail(H2_PROTOCOL_ERROR);
+    h2_stream *s = find(id);
+    m_data_stream = (s && s->state == H2_OPEN) ? s : NULL;
+    m_data_id = id;
+    m_data_end = flags & H2_FLAG_END_STREAM;
+    m_in_data = true;
+    if (!m_data_stream)
+    {
+        if (id > m_last_id)
+            return fail(H2_PROTOCOL_ERROR);
+        reset(id, H2_STREAM_CLOSED);
+    }
+    if (len > 0 && !window_update(0, len))
+        return false;
+    if (len > 0 && m_data_stream && !m_data_end && !window_update(id, len))
+        return false;
+    return !m_failed;
+}
+
+void h2_session::data(const char *p, int len)
+{
+    h2_stream *s = m_data_stream;
+    if (!s)
+        return;
+    if (s->body_len + len > H2_BODY_LEN)
+    {
+        s->bad = true;
+        return;
+    }
+    memcpy(s->body + s->body_len, p, len);
+    s->body_len += len;
+    s->body[s->body_len] = '\0';
+}
+
+void h2_session::end_data()
+{
+    if (m_data_stream && m_data_end)
+        m_data_stream->state = H2_READY;
+    m_data_stream = NULL;
+    m_in_data = false;
+}
+
+//按流编号的顺序处理
+h2_stream *h2_session::next_request()
+{
+    h2_stream *next = NULL;
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        h2_stream *s = &m_streams[i];
+        if (s->state == H2_READY && (!next || s->id < next->id))
+            next = s;
+    }
+    if (next)
+        next->state = H2_SENDING;
+    return next;
+}
+
+void h2_session::respond(h2_stream *s, const char *data, long long size)
+{
+    s->data = data;
+    s->size = size;
+    s->sent = 0;
+    s->head_sent = false;
+    s->state = H2_SENDING;
+}
+
+void h2_session::shutdown()
+{
+    if (!m_goaway)
+        goaway(H2_NO_ERROR);
+}
+
+void h2_session::refuse()
+{
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        h2_stream *s = &m_streams[i];
+        if (s->state != H2_READY)
+            continue;
+        reset(s->id, H2_REFUSED_STREAM);
+        close_stream(s);
+    }
+}
+
+bool h2_session::closing()
+{
+    return m_failed || ((m_goaway || m_peer_goaway) && active() == 0);
+}
+
+void h2_session::flush_out()
+{
+    if (m_out_len == m_out_mark)
+        return;
+    m_iov[m_iov_count].iov_base = m_out + m_out_mark;
+    m_iov[m_iov_count].iov_len = m_out_len - m_out_mark;
+    m_iov_count++;
+    m_batch += m_out_len - m_out_mark;
+    m_out_mark = m_out_len;
+}
+
+void h2_session::add_iov(const char *base, long long len)
+{
+    flush_out();
+    m_iov[m_iov_count].iov_base = (void *)base;
+    m_iov[m_iov_count].iov_len = len;
+    m_iov_count++;
+    m_batch += len;
+}
+
+//轮转：每轮每个流至多发送H2_QUANTUM字节，受对端的帧大小、流和连接的发送窗口限制
+//没有响应头之外的数据或窗口用完的流跳过，直到一批放满或没有流可以再发送
+long long h2_session::fill()
+{
+    m_iov_count = 0;
+    m_batch = 0;
+    m_out_mark = 0;
+    //升级的连接在收到客户端的前言之前只发送101和SETTINGS，客户端在101之后的一次读取中能缓存的数据有限
+    bool progress = !m_expect_preface;
+    bool full = false;
+    while (!m_failed && progress && !full && m_batch + m_out_len < H2_BATCH_MAX)
+    {
+        progress = false;
+        for (int k = 0; k < H2_MAX_STREAMS && !full; k++)
+        {
+            h2_stream *s = &m_streams[(m_next + k) % H2_MAX_STREAMS];
+            if (s->state != H2_SENDING || s->head_len == 0)
+                continue;
+            if (!s->head_sent)
+            {
+                if (m_out_len + H2_FRAME_HEADER_LEN + s->head_len > H2_OUT_LEN)
+                {
+                    full = true;
+                    break;
+                }
+                bool end = s->size == 0;
+                put_header(m_out + m_out_len, s->head_len, H2_HEADERS,
+                           H2_FLAG_END_HEADERS | (end ? H2_FLAG_END_STREAM : 0), s->id);
+                memcpy(m_out + m_out_len + H2_FRAME_HEADER_LEN, s->head, s->head_len);
+                m_out_len += H2_FRAME_HEADER_LEN + s->head_len;
+                s->head_sent = true;
+                progress = true;
+                if (end)
+                {
+                    s->state = H2_SENT;
+                    continue;
+                }
+            }
+            long long n = s->size - s->sent;
+            if (n > H2_QUANTUM)
+                n = H2_QUANTUM;
+            if (n > m_peer_frame)
+                n = m_peer_frame;
+            if (n > s->window)
+                n = s->window;
+            if (n > m_window)
+                n = m_window;
+            if (n <= 0)
+                continue;
+            //帧头和消息体各一个iovec，最后还要留一个给m_out的剩余部分
+            if (m_out_len + H2_FRAME_HEADER_LEN > H2_OUT_LEN || m_iov_count + 3 > H2_IOV_MAX)
+            {
+                full = true;
+                break;
+            }
+            bool end = s->sent + n == s->size;
+            put_header(m_out + m_out_len, n, H2_DATA, end ? H2_FLAG_END_STREAM : 0, s->id);
+            m_out_len += H2_FRAME_HEADER_LEN;
+            add_iov(s->data + s->sent, n);
+            s->sent += n;
+            s->window -= n;
+            m_window -= n;
+            progress = true;
+            if (end)
+                s->state = H2_SENT;
+        }
+    }
+    m_next = (m_next + 1) % H2_MAX_STREAMS;
+    flush_out();
+    return m_batch;
+}
+
+bool h2_session::sent(long long len)
+{
+    m_batch -= len;
+    for (int i = 0; i < m_iov_count && len > 0; i++)
+    {
+        long long n = len < (long long)m_iov[i].iov_len ? len : m_iov[i].iov_len;
+        m_iov[i].iov_base = (char *)m_iov[i].iov_base + n;
+        m_iov[i].iov_len -= n;
+        len -= n;
+    }
+    if (m_batch > 0)
+        return false;
+    //这一批已发完，最后一帧在其中的流不再被iovec引用，可以释放
+    for (int i = 0; i < H2_MAX_STREAMS; i++)
+        if (m_streams[i].state == H2_SENT)
+            close_stream(&m_streams[i]);
+    m_out_len = 0;
+    return fill() == 0;
+}
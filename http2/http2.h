@@ -0,0 +1,238 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <sys/uio.h>
+#include "hpack.h"
+#include "metrics.h"
+#include "vhost.h"
+
+//HTTP/2(RFC 9113)的连接层：帧的解析和生成、SETTINGS、流量控制和流的调度
+//明文连接以前言开头(先知模式)或由HTTP/1.1请求的Upgrade:h2c升级而来，TLS连接由ALPN协商为h2后以前言开头
+//请求完整的流交给http_conn，按HTTP/1.1的流程查找文件和处理登录注册，生成的响应由本模块分帧
+//响应的消息体不复制，iovec直接指向缓存、镜像或mmap的文件，多个流的DATA帧轮转放入同一批writev
+//不支持服务器推送，不处理PRIORITY，按流的编号轮转发送
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+#define H2_FRAME_HEADER_LEN 9
+#define H2_MAX_STREAMS 16                  //SETTINGS_MAX_CONCURRENT_STREAMS，同时打开的流
+#define H2_FRAME_SIZE 16384                //SETTINGS_MAX_FRAME_SIZE的初始值，收发的帧都不超过它
+#define H2_WINDOW 65535                    //流量控制窗口的初始值
+#define H2_WINDOW_MAX 0x7fffffff
+#define H2_HEADER_BLOCK 4096               //HEADERS和CONTINUATION拼成的头部块上限，即通告的SETTINGS_MAX_HEADER_LIST_SIZE
+#define H2_PATH_LEN 200                    //:path上限，与http_conn::FILENAME_LEN相同，do_request会原地改写
+#define H2_FIELD_LEN 128                   //:authority、accept-encoding和if-none-match，超出的部分截断
+#define H2_BODY_LEN 1024                   //请求体上限，只有登录和注册的表单，超出时按错误请求处理
+#define H2_HEAD_LEN 512                    //一个响应的头部块
+#define H2_OUT_LEN 8192                    //一批发送中控制帧、HEADERS帧和DATA帧头的缓冲区
+#define H2_OUT_RESERVE 64                  //为GOAWAY保留的空间，控制帧不能占用
+#define H2_IOV_MAX 64                      //一批发送的iovec数
+#define H2_QUANTUM 16384                   //轮转一次每个流最多发送的字节数
+#define H2_BATCH_MAX (256 * 1024)          //一批最多发送的字节数，发完再生成下一批
+
+//帧类型
+enum H2_FRAME{
+    H2_DATA = 0,
+    H2_HEADERS,
+    H2_PRIORITY,
+    H2_RST_STREAM,
+    H2_SETTINGS,
+    H2_PUSH_PROMISE,
+    H2_PING,
+    H2_GOAWAY,
+    H2_WINDOW_UPDATE,
+    H2_CONTINUATION
+};
+
+//帧标志
+#define H2_FLAG_END_STREAM 0x1
+#define H2_FLAG_ACK 0x1
+#define H2_FLAG_END_HEADERS 0x4
+#define H2_FLAG_PADDED 0x8
+#define H2_FLAG_PRIORITY 0x20
+
+//SETTINGS参数
+enum H2_SETTING{
+    H2_SETTINGS_HEADER_TABLE_SIZE = 1,
+    H2_SETTINGS_ENABLE_PUSH,
+    H2_SETTINGS_MAX_CONCURRENT_STREAMS,
+    H2_SETTINGS_INITIAL_WINDOW_SIZE,
+    H2_SETTINGS_MAX_FRAME_SIZE,
+    H2_SETTINGS_MAX_HEADER_LIST_SIZE
+};
+
+//RST_STREAM和GOAWAY中的错误码
+enum H2_ERROR{
+    H2_NO_ERROR = 0,
+    H2_PROTOCOL_ERROR,
+    H2_INTERNAL_ERROR,
+    H2_FLOW_CONTROL_ERROR,
+    H2_SETTINGS_TIMEOUT,
+    H2_STREAM_CLOSED,
+    H2_FRAME_SIZE_ERROR,
+    H2_REFUSED_STREAM,
+    H2_CANCEL,
+    H2_COMPRESSION_ERROR,
+    H2_CONNECT_ERROR,
+    H2_ENHANCE_YOUR_CALM
+};
+
+//流的状态，只区分服务器需要的几种
+enum H2_STREAM_STATE{
+    H2_IDLE = 0,        //空闲的槽
+    H2_OPEN,            //正在接收请求头或请求体
+    H2_READY,           //请求已完整，等待http_conn处理
+    H2_SENDING,         //已交给http_conn处理或响应正在发送
+    H2_SENT             //最后一帧已放入当前一批，这批发完后释放
+};
+
+struct h2_stream{
+    unsigned int id;
+    int state;
+    int window;                             //发送窗口，对端调小SETTINGS_INITIAL_WINDOW_SIZE后可能为负
+
+    //请求，字符串都以'\0'结尾，没有该字段时为空串
+    bool post;
+    bool bad;                               //不支持的方法、:path无效或请求体过长
+    char path[H2_PATH_LEN];
+    char authority[H2_FIELD_LEN];
+    char accept_encoding[H2_FIELD_LEN];
+    char if_none_match[H2_FIELD_LEN];
+    int body_len;
+    char body[H2_BODY_LEN + 1];
+
+    //响应
+    char head[H2_HEAD_LEN];                 //HPACK编码的头部块
+    int head_len;
+    bool head_sent;
+    const char *data;                       //消息体，指向缓存、镜像、mmap的文件或metrics
+    long long size;
+    long long sent;                         //已放入DATA帧的字节数
+    static_file *cache;                     //消息体来自缓存时持有的引用，发送完释放
+    char *map;                              //消息体是mmap的文件时发送完munmap
+    long long map_len;
+    metrics_buf metrics;                    ///metrics的消息体
+
+    //添加:status和一个静态表中名字的字段，头部块放不下时返回false
+    bool add_status(int status);
+    bool add_header(int name_index, const char *value, int len);
+    bool add_header(int name_index, long long value);
+};
+
+class h2_session{
+public:
+    h2_session();
+    ~h2_session();
+
+    //先知模式：之后收到的数据须以前言开头，排入服务器的SETTINGS
+    void start();
+    //h2c升级：settings为HTTP2-Settings头的值(base64url编码的SETTINGS负载)，无效时返回NULL
+    //排入101响应和服务器的SETTINGS，返回编号为1的流，升级前的请求在这个流上响应
+    h2_stream *upgrade(const char *settings);
+
+    //处理buf中的完整帧，返回消耗的字节数，DATA、HEADERS和CONTINUATION帧的负载可以只收到一部分
+    //cap为读缓冲区的大小，放不下的其他帧(只有很长的SETTINGS等)按连接错误处理；连接错误时排入GOAWAY，之后的数据都丢弃
+    int receive(const char *buf, int len, int cap);
+    //取出下一个请求已完整的流，状态改为H2_SENDING，没有时返回NULL
+    h2_stream *next_request();
+    //头部块已由add_status和add_header生成，data为消息体，按流轮转发送
+    void respond(h2_stream *s, const char *data, long long size);
+    //优雅关闭：排入GOAWAY，不再接受新的流，已有的流发送完毕后关闭连接
+    void shutdown();
+    //拒绝所有等待处理的流，客户端可以在其他连接上重试
+    void refuse();
+
+    //生成下一批要发送的数据，返回字节数，0表示没有可以发送的
+    long long fill();
+    struct iovec *iov() { return m_iov; }
+    int iov_count() { return m_iov_count; }
+    //当前一批中还没有发送的字节数
+    long long pending() { return m_batch; }
+    //已发送len字节，一批发完后释放发送完的流并生成下一批，都发送完毕返回true
+    bool sent(long long len);
+    //GOAWAY已发出且不会再有数据要发送，可以关闭连接
+    bool closing();
+
+private:
+    h2_stream *find(unsigned int id);
+    //为新的流分配一个槽，没有空闲的槽返回NULL
+    h2_stream *open_stream(unsigned int id);
+    //释放流持有的文件，槽变为空闲
+    void close_stream(h2_stream *s);
+    //没有关闭的流的个数
+    int active();
+
+    bool frame(int type, int flags, unsigned int id, const unsigned char *p, int len);
+    //HEADERS和CONTINUATION只检查帧头，负载由receive分次追加到m_block，len为去掉填充等之后的片段长度
+    bool on_headers(int flags, unsigned int id, int len);
+    bool on_continuation(unsigned int id, int len);
+    bool on_settings(int flags, unsigned int id, const unsigned char *p, int len);
+    bool on_window_update(unsigned int id, const unsigned char *p, int len);
+    bool on_rst_stream(unsigned int id, const unsigned char *p, int len);
+    bool begin_data(int flags, unsigned int id, int len);
+    void data(const char *p, int len);
+    void end_data();
+    bool append_block(const unsigned char *p, int len);
+    bool end_headers();
+    //返回错误码，H2_NO_ERROR表示成功
+    int apply_settings(const unsigned char *p, int len);
+    void header(h2_stream *s, const hpack_field &f);
+
+    //连接错误：排入GOAWAY，返回false，调用者停止处理之后的数据
+    bool fail(int error);
+    void goaway(int error);
+    void reset(unsigned int id, int error);
+    bool window_update(unsigned int id, int increment);
+    //在m_out中为控制帧预留9+len字节并写好帧头，空间不足时按连接错误处理并返回NULL
+    unsigned char *queue(int type, int flags, unsigned int id, int len);
+    void add_iov(const char *base, long long len);
+    void flush_out();
+
+    h2_stream m_streams[H2_MAX_STREAMS];
+    unsigned int m_last_id;                 //收到的最大的流编号
+    int m_next;                             //轮转发送的起点
+    hpack_decoder m_decoder;
+
+    //对端的参数
+    int m_peer_window;                      //SETTINGS_INITIAL_WINDOW_SIZE，新流的发送窗口
+    int m_peer_frame;                       //SETTINGS_MAX_FRAME_SIZE
+    long long m_window;                     //连接的发送窗口
+
+    bool m_expect_preface;
+    bool m_failed;                          //连接错误，GOAWAY之后不再发送流的数据
+    bool m_goaway;                          //已排入GOAWAY
+    bool m_peer_goaway;                     //对端发来了GOAWAY
+
+    //头部块，HEADERS后跟CONTINUATION时拼接
+    unsigned int m_block_id;                //正在接收头部块的流，0表示不在头部块中
+    bool m_block_end;                       //HEADERS带有END_STREAM
+    bool m_block_refused;                   //流没有分配到槽，解码后回复RST_STREAM
+    bool m_block_trailer;                   //请求体之后的trailer，解码后丢弃
+    bool m_has_method;                      //头部块中有:method和:path
+    bool m_has_path;
+    int m_block_len;
+    char m_block[H2_HEADER_BLOCK];
+    //正在接收的HEADERS或CONTINUATION帧，与DATA帧相同，负载可以分多次收到
+    bool m_in_block;
+    bool m_block_last;                      //该帧带有END_HEADERS
+    int m_block_left;                       //负载中还没有收到的字节数，含填充
+    int m_block_pad;
+
+    //正在接收的DATA帧
+    h2_stream *m_data_stream;               //负载的去向，流已关闭时为NULL
+    unsigned int m_data_id;
+    int m_data_left;                        //负载中还没有收到的字节数，含填充
+    int m_data_pad;                         //负载末尾的填充字节数
+    bool m_data_end;
+    bool m_in_data;
+
+    //发送：控制帧和帧头写入m_out，与消息体交替组成iovec
+    char m_out[H2_OUT_LEN];
+    int m_out_len;
+    int m_out_mark;                         //m_out中还没有放入iovec的起点
+    struct iovec m_iov[H2_IOV_MAX];
+    int m_iov_count;
+    long long m_batch;
+};
+
+#endif
@@ -0,0 +1,112 @@
+#include <algorithm>
+#include <sys/mman.h>
+#include "ip_limiter.h"
+#include "clock_service.h"
+
+int ip_limiter::s_rate[LIMIT_KINDS];
+int ip_limiter::s_burst[LIMIT_KINDS];
+static limit_slot local_table[LIMIT_TABLE_SIZE];
+limit_slot *ip_limiter::s_table = local_table;
+
+#define TOKEN_MASK ((1ULL << LIMIT_TOKEN_BITS) - 1)
+
+static inline unsigned long long make_bucket(long long stamp, long long tokens)
+{
+    return ((unsigned long long)stamp << LIMIT_TOKEN_BITS) | (unsigned long long)tokens;
+}
+
+void ip_limiter::configure(int kind, int rate, int burst)
+{
+    if (kind < 0 || kind >= LIMIT_KINDS)
+        return;
+    s_rate[kind] = std::max(rate, 0);
+    s_burst[kind] = std::min(std::max(burst, 1), LIMIT_MAX_BURST);
+}
+
+bool ip_limiter::allow(unsigned int ip, int kind, int cost)
+{
+    if (s_rate[kind] <= 0 || ip == 0)
+        return true;
+    long long now = clock_service::mono_ms();
+    limit_slot *slot = find(ip, now);
+    if (!slot)
+        return true;
+    return take(slot->bucket[kind], kind, cost, now);
+}
+
+//槽中只有原子变量，CAS在MAP_SHARED的内存上跨进程同样有效
+bool ip_limiter::share()
+{
+    void *p = mmap(NULL, sizeof(local_table), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return false;
+    s_table = (limit_slot *)p;
+    return true;
+}
+
+//槽最近一次补充令牌的时间
+static long long last_access(limit_slot *slot)
+{
+    long long last = 0;
+    for (int k = 0; k < LIMIT_KINDS; k++)
+        last = std::max(last, (long long)(slot->bucket[k].load(std::memory_order_relaxed) >> LIMIT_TOKEN_BITS));
+    return last;
+}
+
+limit_slot *ip_limiter::find(unsigned int ip, long long now)
+{
+    unsigned int home = (ip * 2654435761u) >> (32 - LIMIT_TABLE_BITS);
+    limit_slot *victim = NULL;
+    unsigned int victim_key = 0;
+    for (int i = 0; i < LIMIT_PROBE; i++)
+    {
+        limit_slot *slot = &s_table[(home + i) & (LIMIT_TABLE_SIZE - 1)];
+        unsigned int key = slot->key.load(std::memory_order_acquire);
+        if (key == ip)
+            return slot;
+        //记下第一个可用的槽，但继续查找，该IP可能在更后面
+        if (!victim && (key == 0 || now - last_access(slot) > LIMIT_IDLE_MS))
+        {
+            victim = slot;
+            victim_key = key;
+        }
+        if (key == 0)
+            break;
+    }
+    if (!victim)
+        return NULL;
+
+    //抢占失败说明其他线程刚占用了该槽，放行本次
+    if (!victim->key.compare_exchange_strong(victim_key, ip, std::memory_order_acq_rel))
+        return victim_key == ip ? victim : NULL;
+    //新IP从满桶开始；与其他线程并发时可能有一次判断用到旧IP的令牌，限流本身是近似的
+    for (int k = 0; k < LIMIT_KINDS; k++)
+        victim->bucket[k].store(make_bucket(now, (long long)s_burst[k] << LIMIT_TOKEN_FRAC), std::memory_order_relaxed);
+    return victim;
+}
+
+bool ip_limiter::take(std::atomic<unsigned long long> &bucket, int kind, int cost, long long now)
+{
+    long long burst = (long long)s_burst[kind] << LIMIT_TOKEN_FRAC;
+    long long need = (long long)cost << LIMIT_TOKEN_FRAC;
+    unsigned long long old = bucket.load(std::memory_order_relaxed);
+    while (true)
+    {
+        long long stamp = old >> LIMIT_TOKEN_BITS;
+        long long tokens = old & TOKEN_MASK;
+        //按流逝的时间补充令牌，不足一个最小单位时保留原时间，让时间继续累积
+        long long elapsed = std::min(std::max(now - stamp, 0LL), 3600000LL);
+        long long add = elapsed * s_rate[kind] * (1 << LIMIT_TOKEN_FRAC) / 1000;
+        if (add > 0)
+        {
+            tokens = std::min(tokens + add, burst);
+            stamp = now;
+        }
+        bool ok = tokens >= need;
+        if (ok)
+            tokens -= need;
+        unsigned long long next = make_bucket(stamp, tokens);
+        if (next == old || bucket.compare_exchange_weak(old, next, std::memory_order_relaxed))
+            return ok;
+    }
+}
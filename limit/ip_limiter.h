@@ -0,0 +1,54 @@
+#ifndef IP_LIMITER_H
+#define IP_LIMITER_H
+
+#include <atomic>
+
+//每个客户端IP两个令牌桶：新建连接和请求
+enum LIMIT_KIND{
+    LIMIT_CONN = 0,     //accept时检查，超限直接关闭
+    LIMIT_REQUEST,      //请求行解析后检查，超限回复429
+    LIMIT_KINDS
+};
+
+#define LIMIT_TABLE_BITS 16                     //哈希表65536个槽，固定大小，不扩容
+#define LIMIT_TABLE_SIZE (1 << LIMIT_TABLE_BITS)
+#define LIMIT_PROBE 8                           //线性探测的最大长度
+#define LIMIT_IDLE_MS 60000                     //超过该时间未访问的槽视为过期，可被其他IP复用
+#define LIMIT_DB_COST 4                         //登录和注册请求消耗的令牌数，其他请求为1
+
+//令牌桶状态压缩在一个64位字中：高40位为上次补充令牌的时间(ms)，低24位为令牌数(4位小数)
+//一次CAS即可完成补充和扣减
+#define LIMIT_TOKEN_BITS 24
+#define LIMIT_TOKEN_FRAC 4
+#define LIMIT_MAX_BURST ((1 << (LIMIT_TOKEN_BITS - LIMIT_TOKEN_FRAC)) - 1)
+
+struct limit_slot{
+    std::atomic<unsigned int> key;                       //IPv4地址，0表示空槽
+    std::atomic<unsigned long long> bucket[LIMIT_KINDS];
+};
+
+//按客户端IP限流，开放寻址的无锁哈希表
+//槽只会被占用或在过期后被其他IP复用，不会被删除，所以查找遇到空槽即可停止
+//表满(探测范围内没有空槽或过期槽)时放行，宁可漏限也不误伤
+class ip_limiter{
+public:
+    //rate为每秒补充的令牌数，burst为桶容量，rate为0表示不限制该项
+    static void configure(int kind, int rate, int burst);
+    static bool enabled(int kind) { return s_rate[kind] > 0; }
+
+    //扣减cost个令牌，令牌不足返回false，主线程和工作线程都可以调用
+    static bool allow(unsigned int ip, int kind, int cost = 1);
+
+    //多进程模式下fork前把表移到共享内存，所有worker按同一份令牌桶限流，失败返回false
+    static bool share();
+
+private:
+    static limit_slot *find(unsigned int ip, long long now);
+    static bool take(std::atomic<unsigned long long> &bucket, int kind, int cost, long long now);
+
+    static int s_rate[LIMIT_KINDS];
+    static int s_burst[LIMIT_KINDS];
+    static limit_slot *s_table;
+};
+
+#endif
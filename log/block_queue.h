@@ -136,7 +136,9 @@ public:
     //往队列添加元素，需要将所有使用队列的线程先唤醒
     //当有元素push进队列,相当于生产者生产了一个元素
     //若当前没有线程等待条件变量,则唤醒无意义
-    bool push(const T &item)
+    //item可以是能赋值给T的其他类型，如T为string时直接传入char*，不构造临时对象
+    template <class V>
+    bool push(const V &item)
     {
 
         m_mutex.lock();
@@ -3,6 +3,7 @@
 #include <sys/time.h>
 #include <stdarg.h>
 #include "log.h"
+#include "clock_service.h"
 #include <pthread.h>
 using namespace std;
 
@@ -30,10 +31,8 @@ bool Log::init(const char *file_name, int log_buf_size, int split_lines, int max
 
         //创建并设置阻塞队列长度
         m_log_queue = new block_queue<string>(max_queue_size);
-        pthread_t tid;
-
         //flush_log_thread为回调函数,这里表示创建线程异步写日志
-        pthread_create(&tid, NULL, flush_log_thread, NULL);
+        pthread_create(&m_flush_tid, NULL, flush_log_thread, NULL);
     }
 
     //输出内容的长度
@@ -83,11 +82,9 @@ bool Log::init(const char *file_name, int log_buf_size, int split_lines, int max
 
 void Log::write_log(int level, const char *format, ...)
 {
-    struct timeval now = {0, 0};
-    gettimeofday(&now, NULL);
-    time_t t = now.tv_sec;
-    struct tm *sys_tm = localtime(&t);
-    struct tm my_tm = *sys_tm;
+    //时间取自主线程每轮循环更新的时钟快照，不调用gettimeofday和localtime
+    clock_snapshot now;
+    clock_service::read(&now);
     char s[16] = {0};
 
     //日志分级
@@ -117,10 +114,12 @@ void Log::write_log(int level, const char *format, ...)
 
     //日志不是今天或写入的日志行数是最大行的倍数
     //m_split_lines为最大行数
-    if (m_today != my_tm.tm_mday || m_count % m_split_lines == 0) //everyday log
+    if (m_today != now.mday || m_count % m_split_lines == 0) //everyday log
     {
         
         char new_log[256] = {0};
+        struct tm my_tm;
+        localtime_r(&now.wall, &my_tm);
         fflush(m_fp);
         fclose(m_fp);
         char tail[16] = {0};
@@ -149,35 +148,24 @@ void Log::write_log(int level, const char *format, ...)
     //将传入的format参数赋值给valst，便于格式化输出
     va_start(valst, format);
 
-    string log_str;
     m_mutex.lock();
 
     //写入的内容格式：时间+内容
     //时间格式化，snprintf成功返回写字符的总数，其中不包括结尾的null字符
-    int n = snprintf(m_buf, 48, "%d-%02d-%02d %02d:%02d:%02d.%06ld %s ",
-                     my_tm.tm_year + 1900, my_tm.tm_mon + 1, my_tm.tm_mday,
-                     my_tm.tm_hour, my_tm.tm_min, my_tm.tm_sec, now.tv_usec, s);
+    int n = snprintf(m_buf, 48, "%s %s ", now.log_ts, s);
 
     //内容格式化，用于向字符串中打印数据、数据格式用户自定义，返回写入到字符数组str中的字符个数(不包含终止符)
     int m = vsnprintf(m_buf + n, m_log_buf_size - 1, format, valst);
     m_buf[n + m] = '\n';
     m_buf[n + m + 1] = '\0';
-    log_str = m_buf;
-
-    m_mutex.unlock();
 
     //若m_is_async为true表示异步，默认为同步
-    //若异步,则将日志信息加入阻塞队列,同步则加锁向文件中写
-    if (m_is_async && !m_log_queue->full())
-    {
-        m_log_queue->push(log_str);
-    }
-    else
-    {
-        m_mutex.lock();
-        fputs(log_str.c_str(), m_fp);
-        m_mutex.unlock();
-    }
+    //若异步,则将日志信息加入阻塞队列,同步则直接向文件中写
+    //都在持有锁时直接使用m_buf，不再为每行日志构造string：队列中的string在多次使用间保留容量，赋值时不再分配内存
+    if (!m_is_async || !m_log_queue->push(m_buf))
+        fputs(m_buf, m_fp);
+
+    m_mutex.unlock();
 
     va_end(valst);
 }
@@ -36,6 +36,13 @@ public:
     //强制刷新缓冲区
     void flush(void);
 
+    //异步模式下取得写日志线程，用于绑定CPU，同步模式返回false
+    bool get_flush_thread(pthread_t *tid)
+    {
+        *tid = m_flush_tid;
+        return m_is_async;
+    }
+
 private:
     Log();
     virtual ~Log();
@@ -64,6 +71,7 @@ private:
     char *m_buf;        //要输出的内容
     block_queue<string> *m_log_queue; //阻塞队列
     bool m_is_async;                  //是否同步标志位
+    pthread_t m_flush_tid;            //异步写日志线程
     locker m_mutex;           
 };
 
@@ -1,5 +1,6 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -7,6 +8,8 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <cassert>
+#include <algorithm>
+#include <new>
 #include <sys/epoll.h>
 
 #include "locker.h"
@@ -15,11 +18,34 @@
 #include "http_conn.h"
 #include "log.h"
 #include "sql_connection_pool.h"
+#include "config.h"
+#include "io_ring.h"
+#include "clock_service.h"
+#include "ip_limiter.h"
+#include "vhost.h"
+#include "master.h"
+#include "affinity.h"
 
 #define MAX_FD 65536      //最大文件描述符数
 #define MAX_EVENT_NUMBER 10000   //最大事件数
 #define TIMESLOT 5      //最小超时单位
 
+#define RETRY_AFTER 1               //过载时建议客户端重试的间隔(s)
+
+#define THREAD_NUM 8                //工作线程数
+//各类请求队列的权重和并发上限，数据库请求最多占用一半工作线程，静态文件始终有线程可用
+#define LANE_STATIC_WEIGHT 4
+#define LANE_STATIC_INFLIGHT THREAD_NUM
+#define LANE_DYNAMIC_WEIGHT 2
+#define LANE_DYNAMIC_INFLIGHT THREAD_NUM
+#define LANE_DB_WEIGHT 1
+#define LANE_DB_INFLIGHT (THREAD_NUM / 2)
+#define ACCEPT_RESUME_POLL 10       //暂停accept期间epoll_wait的超时(ms)，用于检查是否恢复
+#define ACCEPT_BATCH 64             //水平触发下每次listenfd就绪最多accept的连接数
+#define DEFER_ACCEPT_TIMEOUT 5      //TCP_DEFER_ACCEPT等待首个数据包的时间(s)，超时后仍交给accept
+#define GRACEFUL_TIMEOUT 30         //优雅退出时等待已接受的请求处理完的最长时间(s)
+#define DRAIN_POLL 100              //优雅退出期间检查空闲连接和剩余连接数的间隔(ms)
+
 #define SYNLOG     //同步写日志
 //#define ASYNLOG    //异步写日志
 
@@ -27,7 +53,7 @@
 //#define listenfdET    //边缘触发阻塞
 
 //此三个函数在http_conn.cpp中有定义，gcc在编译的时候会自动链接
-int addfd(int epollfd, int fd, bool one_shot);
+int addfd(int epollfd, int fd, bool one_shot, unsigned gen = 0);
 int removefd(int epollfd, int fd);
 int setnonblocking(int fd);
 
@@ -37,6 +63,30 @@ static sort_timer_lst timer_lst;
 
 static int epollfd = 0;         //epoll例程(指向被监视文件描述符的保存空间)
 
+static http_conn *users = NULL;          //所有客户端的http连接，以文件描述符为下标
+static client_data *users_timer = NULL;  //连接资源，所有客户端的定时器相关数据
+
+//工作线程处理完的连接，由主线程直接发送
+static completion_queue<http_conn> *completions = NULL;
+
+//线程池，/metrics输出队列深度和占用情况时使用
+static threadpool<http_conn> *thread_pool = NULL;
+
+//预留的文件描述符，描述符耗尽时释放它来accept并拒绝新连接
+static int spare_fd = -1;
+
+//优雅退出：收到SIGTERM后停止accept，关闭空闲的长连接，正在处理的请求发送完响应后关闭
+//所有连接关闭或超过GRACEFUL_TIMEOUT后退出，期间再次收到SIGTERM立即退出
+static bool drain_requested = false;
+static bool draining = false;
+static time_t drain_deadline = 0;
+
+//平滑升级：收到SIGUSR2后以相同参数启动新的可执行文件，并把监听socket交给它
+static bool upgrade_requested = false;
+static char **main_argv = NULL;
+//监听socket已被新进程继承，关闭自己的描述符不影响全连接队列
+static bool listen_shared = false;
+
 //信号处理函数，这里只是用于通知主线程，并不处理，缩短异步处理时间，减少对主程序的影响
 void sig_handler(int sig){
 	//为保证函数的可重入性，保留原来的errno（这种系统定义的全局变量可能会在中断的时候改变）
@@ -73,7 +123,7 @@ void addsig(int sig, void(handler)(int), bool restart = true){
 //定时处理任务，重新定时以不断触发SIGALRM信号
 void timer_handler()
 {
-    timer_lst.tick();
+    metrics::add(COUNTER_TIMER_EXPIRED, timer_lst.tick());
     alarm(TIMESLOT);
 }
 
@@ -83,11 +133,21 @@ void cb_func(client_data *user_data){
 	//删除非活动连接在epollfd上的注册事件
 	epoll_ctl(epollfd, EPOLL_CTL_DEL, user_data->sockfd, 0);
 	assert(user_data);
-	//关闭文件描述符
-	close(user_data->sockfd);
+	int fd = user_data->sockfd;
+	//之后到达的该连接的事件都是旧事件，将被丢弃
+	users[fd].retire();
+	//工作线程或完成队列还持有引用时不能close，否则编号会被新连接复用，工作线程的响应会写给新连接
+	//先shutdown让客户端看到连接关闭、工作线程的读写尽快失败，归还最后一个引用时再close
+	if (users[fd].release())
+		close(fd);
+	else
+		shutdown(fd, SHUT_RDWR);
 	
-	//减少连接数
-	http_conn::m_user_count--;
+	//计入关闭数，连接数减一
+	metrics::add(COUNTER_CLOSED);
+
+	//连接已关闭，定时器由调用者删除，同一批中该连接后续的过期事件据此忽略
+	user_data->timer = NULL;
 
 	LOG_INFO("close fd %d", user_data->sockfd);
     Log::get_instance()->flush();
@@ -96,12 +156,964 @@ void cb_func(client_data *user_data){
 void show_error(int connfd, const char *info)
 {
     printf("%s", info);
-    send(connfd, info, strlen(info), 0);
+    //TLS连接还没有握手，不能回复明文
+    if (!tls_context::enabled())
+        send(connfd, info, strlen(info), 0);
+    close(connfd);
+}
+
+//请求各阶段的超时时间(s)和最低发送速率(B/s)，由启动参数设置
+static int header_timeout = 0;
+static int body_timeout = 0;
+static int request_timeout = 0;
+static int min_send_rate = 0;
+//请求在线程池中的排队期限(ms)，由启动参数设置
+static int task_deadline = 0;
+
+//连接关闭回调，epoll和io_uring引擎关闭连接的方式不同
+static void (*close_func)(client_data *) = cb_func;
+
+//初始化client_data数据（连接资源）
+//创建定时器，设置回调函数和超时时间，绑定用户数据，将定时器添加到链表中
+void timer_init(int connfd, struct sockaddr_in client_address)
+{
+    users_timer[connfd].address = client_address;
+    users_timer[connfd].sockfd = connfd;
+    time_t cur = clock_service::mono();
+    users_timer[connfd].last_active = cur;
+    users_timer[connfd].request_start = 0;
+    users_timer[connfd].body_start = 0;
+    users_timer[connfd].send_deadline = 0;
+
+	//创建定时器临时变量
+    util_timer *timer = new util_timer;
+	//设置定时器对应的连接资源
+    timer->user_data = &users_timer[connfd];
+	//设置回调函数
+    timer->cb_func = close_func;
+	//设置绝对超时时间
+    timer->expire = cur + 3 * TIMESLOT;
+	//创建该连接对应的定时器，初始化为前述临时变量
+    users_timer[connfd].timer = timer;
+	//将该定时器添加到链表中
+    timer_lst.add_timer(timer);
+}
+
+//连接的超时时间，取以下各项中最早的
+//空闲：最近一次读写后3个单位
+//请求进行中：请求头、请求体各自的截止时间，以及从第一个数据到开始发送响应的总时间
+//发送响应：按最低发送速率计算的截止时间，慢速读取的客户端不能无限期占用连接
+static time_t conn_deadline(client_data *user_data)
+{
+    time_t deadline = user_data->last_active + 3 * TIMESLOT;
+    if (user_data->send_deadline)
+        return std::min(deadline, user_data->send_deadline);
+    if (!user_data->request_start)
+        return deadline;
+
+    deadline = std::min(deadline, user_data->request_start + request_timeout);
+    if (user_data->body_start)
+        return std::min(deadline, user_data->body_start + body_timeout);
+    return std::min(deadline, user_data->request_start + header_timeout);
+}
+
+//读事件到达，读取数据之前调用
+//读缓冲区为空说明是新请求的第一个数据；上一次解析已进入请求体，则开始计算请求体超时
+void deadline_on_read(int sockfd)
+{
+    client_data *user_data = &users_timer[sockfd];
+    time_t cur = clock_service::mono();
+    user_data->last_active = cur;
+    if (!users[sockfd].has_request_data())
+    {
+        user_data->request_start = cur;
+        user_data->body_start = 0;
+        user_data->send_deadline = 0;
+    }
+    else if (!user_data->body_start && users[sockfd].reading_body())
+    {
+        user_data->body_start = cur;
+    }
+}
+
+//发送响应报文之前调用，第一次发送时按报文长度确定发送截止时间，留出一个单位的余量
+void deadline_on_write(int sockfd)
+{
+    client_data *user_data = &users_timer[sockfd];
+    user_data->last_active = clock_service::mono();
+    if (!user_data->send_deadline)
+        user_data->send_deadline = user_data->last_active + TIMESLOT + users[sockfd].bytes_pending() / min_send_rate;
+}
+
+//响应发送完毕，长连接回到空闲状态
+void deadline_on_sent(int sockfd)
+{
+    client_data *user_data = &users_timer[sockfd];
+    user_data->last_active = clock_service::mono();
+    user_data->request_start = 0;
+    user_data->body_start = 0;
+    user_data->send_deadline = 0;
+}
+
+//有数据传输或请求阶段变化时重新计算超时时间
+//超时时间推后时定时器不在链表中移动，到期时由tick重新插入
+void adjust_timer(util_timer *timer)
+{
+    if (timer)
+    {
+        timer->expire = conn_deadline(timer->user_data);
+        LOG_INFO("%s", "adjust timer once");
+        Log::get_instance()->flush();
+        timer_lst.adjust_timer(timer);
+    }
+}
+
+//服务器端关闭连接，移除对应的定时器
+void deal_timer(util_timer *timer, int sockfd)
+{
+    //连接已经关闭
+    if (!timer)
+    {
+        return;
+    }
+    timer->cb_func(&users_timer[sockfd]);
+    timer_lst.del_timer(timer);
+}
+
+//发送响应报文，主线程检测到写事件或从完成队列中取出连接时调用
+void deal_with_write(int sockfd)
+{
+    util_timer *timer = users_timer[sockfd].timer;
+    if (!timer)
+    {
+        return;
+    }
+    deadline_on_write(sockfd);
+    if (users[sockfd].write())
+    {
+        LOG_INFO("send data to the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
+        Log::get_instance()->flush();
+
+        //长连接的响应已发送完毕，否则仍在等待EPOLLOUT
+        if (!users[sockfd].bytes_pending())
+            deadline_on_sent(sockfd);
+        adjust_timer(timer);
+    }
+    else
+    {
+        deal_timer(timer, sockfd);
+    }
+}
+
+//交给线程池，任务持有连接的一个引用，由工作线程处理完后归还，请求队列已满返回false
+static bool dispatch(threadpool<http_conn> *pool, int fd)
+{
+    users[fd].hold();
+    if (pool->append(users + fd, users[fd].classify()))
+        return true;
+    users[fd].release();
+    return false;
+}
+
+//直接回复503并关闭连接，移除对应的定时器，不经过工作线程
+void reject_busy(client_data *user_data)
+{
+    char response[256];
+    int len = http_conn::busy_response(response, sizeof(response));
+    //HTTP/2连接上不能发送HTTP/1.1报文，直接关闭，客户端会重试未完成的流；TLS连接不能直接写入明文
+    if (!users[user_data->sockfd].http2() && !users[user_data->sockfd].tls())
+        send(user_data->sockfd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    metrics::status(503);
+    LOG_WARN("server overloaded, reject fd %d", user_data->sockfd);
+
+    deal_timer(user_data->timer, user_data->sockfd);
+}
+
+//文件描述符耗尽(EMFILE/ENFILE)时，新连接一直留在全连接队列中，水平触发下listenfd持续就绪导致忙等
+//释放预留的描述符，取出一个连接回复503后关闭，再重新预留，取出连接返回true
+bool reject_no_fd(int listenfd)
+{
+    if (spare_fd >= 0)
+        close(spare_fd);
+    int connfd = accept(listenfd, NULL, NULL);
+    if (connfd >= 0)
+    {
+        char response[256];
+        int len = http_conn::busy_response(response, sizeof(response));
+        if (!tls_context::enabled())
+            send(connfd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        metrics::status(503);
+        close(connfd);
+    }
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    LOG_WARN("%s", "out of file descriptors, reject connection");
+    return connfd >= 0;
+}
+
+//单IP新建连接超过速率，直接关闭，不占用users和定时器
+static bool limit_accept(int connfd, const struct sockaddr_in &client_address)
+{
+    if (ip_limiter::allow(client_address.sin_addr.s_addr, LIMIT_CONN))
+        return false;
     close(connfd);
+    metrics::add(COUNTER_LIMITED_CONN);
+    return true;
+}
+
+//初始化新连接
+static void accept_conn(int connfd, const struct sockaddr_in &client_address)
+{
+    if (limit_accept(connfd, client_address))
+        return;
+    //每个连接占用一个小于MAX_FD的描述符，描述符号未越界时连接数也不会超过MAX_FD，不需要再汇总连接数
+    if (connfd >= MAX_FD)
+    {
+        show_error(connfd, "Internal server busy");
+        LOG_ERROR("%s", "Internal server busy");
+        return;
+    }
+    users[connfd].init(connfd, client_address);
+    timer_init(connfd, client_address);
+}
+
+//处理新到的客户连接
+//accept4直接创建非阻塞的连接，水平触发下每次最多取ACCEPT_BATCH个，边缘触发下取到队列为空
+void deal_with_accept(int listenfd)
+{
+#ifdef listenfdLT
+    for (int n = 0; n < ACCEPT_BATCH; n++)
+#endif
+#ifdef listenfdET
+    while (1)
+#endif
+    {
+		//初始化客户端连接地址
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof(client_address);
+
+		//该连接分配的文件描述符
+        int connfd = accept4(listenfd, (struct sockaddr *)&client_address, &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0)
+        {
+            if ((errno == EMFILE || errno == ENFILE) && reject_no_fd(listenfd))
+            {
+                continue;
+            }
+            //全连接队列已取空
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                LOG_ERROR("%s:errno is:%d", "accept error", errno);
+            break;
+        }
+        accept_conn(connfd, client_address);
+    }
+}
+
+///metrics中的瞬时值：线程池各队列的深度和占用
+void render_gauges(metrics_buf *out)
+{
+    static const char *lane_names[http_conn::LANE_COUNT] = {"static", "dynamic", "db"};
+    out->append("# TYPE webserver_pool_threads gauge\nwebserver_pool_threads %d\n", THREAD_NUM);
+    out->append("# TYPE webserver_queue_depth gauge\n");
+    for (int l = 0; l < http_conn::LANE_COUNT; l++)
+    {
+        threadpool<http_conn>::lane_stat st;
+        thread_pool->get_lane_stat(l, &st);
+        out->append("webserver_queue_depth{lane=\"%s\"} %d\n", lane_names[l], st.depth);
+    }
+    out->append("# TYPE webserver_pool_busy_threads gauge\n");
+    for (int l = 0; l < http_conn::LANE_COUNT; l++)
+    {
+        threadpool<http_conn>::lane_stat st;
+        thread_pool->get_lane_stat(l, &st);
+        out->append("webserver_pool_busy_threads{lane=\"%s\"} %d\n", lane_names[l], st.inflight);
+    }
+    out->append("# TYPE webserver_queue_age_seconds gauge\nwebserver_queue_age_seconds %.6f\n", thread_pool->queue_age_us() / 1e6);
+}
+
+//处理从管道读出的信号值
+void deal_with_signal(const char *signals, int n, bool &timeout, bool &stop_server)
+{
+	//信号对应的处理逻辑
+	for(int i=0; i < n; i++){
+	  //这里是字符
+	  switch(signals[i]){
+	  	case SIGALRM:
+	  	{
+	  	  timeout = true;
+	  	  break;
+	  	}
+	  	//第一次为优雅退出，第二次立即退出
+	  	case SIGTERM:
+	  	{
+	  	  if(draining)
+	  	    stop_server = true;
+	  	  else
+	  	    drain_requested = true;
+	  	  break;
+	  	}
+	  	case SIGUSR2:
+	  	{
+	  	  upgrade_requested = true;
+	  	  break;
+	  	}
+	  }
+	}
+}
+
+//定时处理任务，并输出线程池各队列的统计信息
+void deal_with_timeout(threadpool<http_conn> *pool)
+{
+    timer_handler();
+
+    //各队列的统计信息
+    static const char *lane_names[http_conn::LANE_COUNT] = {"static", "dynamic", "db"};
+    for (int l = 0; l < http_conn::LANE_COUNT; l++)
+    {
+        threadpool<http_conn>::lane_stat st;
+        pool->get_lane_stat(l, &st);
+        LOG_INFO("lane %s: depth %d, inflight %d, enqueued %llu, completed %llu, rejected %llu, expired %llu, lifo %d, delay p50 %lldus p99 %lldus",
+                 lane_names[l], st.depth, st.inflight, st.enqueued, st.completed, st.rejected, st.expired, st.lifo,
+                 pool->queue_delay_percentile(0.5, l), pool->queue_delay_percentile(0.99, l));
+    }
+}
+
+//io_uring引擎
+//所有连接的recv/writev、accept、信号管道和完成队列的读取都以SQE的形式提交，
+//每轮循环只调用一次io_uring_enter，同时完成提交和等待
+#define URING_ENTRIES 4096          //SQ大小，CQ为其两倍
+#define URING_BUF_GROUP 0           //provided buffer组号
+#define URING_BUF_COUNT 1024        //provided buffer个数，须为2的幂
+#define URING_BUF_SIZE 2048         //单个provided buffer大小，与读缓冲区一致
+
+//user_data编码：高8位为操作类型，中间24位为连接代数，低32位为文件描述符
+//连接关闭时代数加一，旧连接残留的完成事件据此丢弃
+enum URING_OP{
+    URING_ACCEPT = 1,
+    URING_RECV,
+    URING_WRITEV,
+    URING_COMPLETION,
+    URING_SIGNAL,
+    URING_CLOSE,
+    URING_TIMEOUT,
+    URING_CANCEL,
+    URING_DRAIN
+};
+
+static io_ring *ring = NULL;
+static unsigned long long uring_syscalls = 0;    //io_uring_enter以外的系统调用次数
+static unsigned long long uring_responses = 0;   //已发送完毕的响应数
+//多次触发的accept还在内核中，优雅退出时须等它被取消后才能退出，否则期间取出的连接会丢失
+static bool uring_accept_armed = false;
+
+static inline unsigned long long uring_data(int op, int fd)
+{
+    return ((unsigned long long)op << 56) | ((unsigned long long)(users[fd].gen() & 0xffffff) << 32) | (unsigned)fd;
+}
+
+static inline int uring_op(unsigned long long data) { return data >> 56; }
+static inline unsigned uring_gen(unsigned long long data) { return (data >> 32) & 0xffffff; }
+static inline int uring_fd(unsigned long long data) { return (int)(data & 0xffffffff); }
+
+//SQ已满且内核暂时取不走时，在submit中处理完已有完成事件前只能放弃本次提交
+static struct io_uring_sqe *uring_sqe()
+{
+    struct io_uring_sqe *sqe = ring->get_sqe();
+    if (!sqe)
+        LOG_ERROR("%s", "io_uring submission queue full");
+    return sqe;
+}
+
+//多次触发的accept，一个SQE持续产生新连接
+void uring_post_accept(int listenfd)
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listenfd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = (unsigned long long)URING_ACCEPT << 56;
+    uring_accept_armed = true;
+}
+
+//由内核从provided buffer中挑选缓冲区，空闲连接不占用读缓冲
+void uring_post_recv(int fd)
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe)
+        return;
+    int len = users[fd].read_space();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->len = len < (int)ring->buf_size() ? len : ring->buf_size();
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = ring->buf_group();
+    sqe->user_data = uring_data(URING_RECV, fd);
+}
+
+//响应头和mmap映射的文件在同一个writev中发出
+void uring_post_writev(int fd)
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)users[fd].get_iov();
+    sqe->len = users[fd].get_iov_count();
+    sqe->user_data = uring_data(URING_WRITEV, fd);
+}
+
+//从文件描述符读到固定缓冲区，用于信号管道和完成队列的eventfd
+void uring_post_read(int fd, int op, void *buf, unsigned len)
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)buf;
+    sqe->len = len;
+    sqe->user_data = (unsigned long long)op << 56;
+}
+
+void uring_post_timeout(struct __kernel_timespec *ts)
+{
+    struct io_uring_sqe *sqe = uring_sqe();
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)ts;
+    sqe->len = 1;
+    sqe->user_data = (unsigned long long)URING_TIMEOUT << 56;
+}
+
+//io_uring引擎的定时器回调函数
+//连接上可能还有未完成的recv或writev，先shutdown让它们结束，再关闭文件描述符
+//工作线程或完成队列还持有引用时只shutdown，归还最后一个引用时由close_released关闭
+void uring_cb_func(client_data *user_data)
+{
+    int fd = user_data->sockfd;
+    users[fd].retire();
+
+    if (!users[fd].release())
+    {
+        //直接调用shutdown，提交到ring中的shutdown可能晚于close_released中的close执行
+        shutdown(fd, SHUT_RDWR);
+        uring_syscalls++;
+    }
+    else
+    {
+        struct io_uring_sqe *sqe = uring_sqe();
+        if (sqe)
+        {
+            sqe->opcode = IORING_OP_SHUTDOWN;
+            sqe->fd = fd;
+            sqe->len = SHUT_RDWR;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->user_data = uring_data(URING_CLOSE, fd);
+            sqe = uring_sqe();
+        }
+        if (sqe)
+        {
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = fd;
+            sqe->user_data = uring_data(URING_CLOSE, fd);
+        }
+        else
+        {
+            shutdown(fd, SHUT_RDWR);
+            close(fd);
+        }
+    }
+
+    metrics::add(COUNTER_CLOSED);
+    user_data->timer = NULL;
+
+    LOG_INFO("close fd %d", fd);
+    Log::get_instance()->flush();
+}
+
+//连接已被关闭，最后一个引用由完成队列中的事件归还，此时才close文件描述符
+static void close_released(int fd)
+{
+    close(fd);
+    if (ring)
+        uring_syscalls++;
+}
+
+//新连接
+void uring_on_accept(int connfd)
+{
+    struct sockaddr_in client_address;
+    socklen_t client_addrlength = sizeof(client_address);
+    getpeername(connfd, (struct sockaddr *)&client_address, &client_addrlength);
+    uring_syscalls++;
+    if (limit_accept(connfd, client_address))
+    {
+        uring_syscalls++;
+        return;
+    }
+
+    //每个连接占用一个小于MAX_FD的描述符，描述符号未越界时连接数也不会超过MAX_FD，不需要再汇总连接数
+    if (connfd >= MAX_FD)
+    {
+        show_error(connfd, "Internal server busy");
+        LOG_ERROR("%s", "Internal server busy");
+        return;
+    }
+    users[connfd].init(connfd, client_address);
+    timer_init(connfd, client_address);
+    uring_post_recv(connfd);
+}
+
+//recv完成，数据从provided buffer拷入连接的读缓冲区，缓冲区立即归还内核
+void uring_on_recv(int fd, struct io_uring_cqe *cqe, threadpool<http_conn> *pool)
+{
+    util_timer *timer = users_timer[fd].timer;
+    if (cqe->res == -ENOBUFS)
+    {
+        //provided buffer暂时用完，本轮结束时会归还
+        uring_post_recv(fd);
+        return;
+    }
+
+    deadline_on_read(fd);
+    bool ok = false;
+    if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER))
+    {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        ok = users[fd].feed(ring->buf_addr(bid), cqe->res);
+        ring->add_buffer(bid);
+    }
+    else if (cqe->res < 0 && cqe->res != -ECANCELED)
+        metrics::add(COUNTER_IO_ERRORS);
+    if (!ok)
+    {
+        deal_timer(timer, fd);
+        return;
+    }
+
+    LOG_INFO("deal with the client(%s)", inet_ntoa(users[fd].get_address()->sin_addr));
+    Log::get_instance()->flush();
+
+    ///metrics由主线程直接回复
+    int inline_ret = users[fd].process_inline();
+    if (inline_ret > 0)
+    {
+        deadline_on_write(fd);
+        adjust_timer(timer);
+        uring_post_writev(fd);
+        return;
+    }
+    else if (inline_ret < 0)
+    {
+        deal_timer(timer, fd);
+        return;
+    }
+
+    //线程池过载或请求队列已满，直接回复503，不再交给工作线程
+    if (pool->overloaded() || !dispatch(pool, fd))
+    {
+        uring_syscalls++;
+        reject_busy(&users_timer[fd]);
+        return;
+    }
+    adjust_timer(timer);
+}
+
+//writev完成，未发完则继续提交，发完后长连接重新提交recv
+void uring_on_writev(int fd, struct io_uring_cqe *cqe)
+{
+    util_timer *timer = users_timer[fd].timer;
+    if (cqe->res < 0)
+    {
+        if (cqe->res != -ECANCELED)
+            metrics::add(COUNTER_IO_ERRORS);
+        deal_timer(timer, fd);
+        return;
+    }
+    if (!users[fd].advance_iov(cqe->res))
+    {
+        deadline_on_write(fd);
+        adjust_timer(timer);
+        uring_post_writev(fd);
+        return;
+    }
+
+    uring_responses++;
+    if (users[fd].finish_write())
+    {
+        LOG_INFO("send data to the client(%s)", inet_ntoa(users[fd].get_address()->sin_addr));
+        Log::get_instance()->flush();
+
+        deadline_on_sent(fd);
+        adjust_timer(timer);
+        uring_post_recv(fd);
+    }
+    else
+    {
+        deal_timer(timer, fd);
+    }
+}
+
+//工作线程处理完的连接
+void uring_on_completion()
+{
+    http_conn *conn = completions->take_all();
+    while (conn)
+    {
+        http_conn *next = conn->m_cq_next;
+        int connfd = conn - users;
+
+        //连接已被定时器关闭，事件直接丢弃
+        if (users_timer[connfd].timer)
+        {
+            switch (conn->m_cq_event)
+            {
+            case http_conn::CQ_WRITE:
+                deadline_on_write(connfd);
+                adjust_timer(users_timer[connfd].timer);
+                uring_post_writev(connfd);
+                break;
+            case http_conn::CQ_READ:
+                uring_post_recv(connfd);
+                break;
+            case http_conn::CQ_CLOSE:
+                deal_timer(users_timer[connfd].timer, connfd);
+                break;
+            }
+        }
+        //归还事件持有的引用
+        if (conn->release())
+            close_released(connfd);
+        conn = next;
+    }
+}
+
+//空闲连接：已处理过请求，没有未处理完的请求，也没有未发完的响应
+//刚accept还没读到数据的连接不算空闲，优雅退出时从全连接队列取出的连接要处理完
+//reactor模式下读写都在工作线程中，主线程不知道响应何时发完，
+//只有缓冲区为空且超过任务排队期限没有新事件的连接才视为空闲，此时不会有工作线程还在处理它
+static bool conn_idle(int fd)
+{
+    client_data *user_data = &users_timer[fd];
+    if (!user_data->timer || users[fd].never_read())
+        return false;
+    if (http_conn::m_actor_model == 1)
+        return !users[fd].has_request_data() && !users[fd].bytes_pending() &&
+               clock_service::mono() - user_data->last_active > task_deadline / 1000 + 1;
+    return !user_data->request_start && !user_data->send_deadline;
+}
+
+//关闭空闲的连接，由定时器链表遍历调用，返回是否关闭
+static bool close_idle(util_timer *timer)
+{
+    int fd = timer->user_data->sockfd;
+    if (!conn_idle(fd))
+        return false;
+    deal_timer(timer, fd);
+    return true;
+}
+
+//开始优雅退出：停止accept并关闭监听socket，关闭所有空闲连接
+//此后生成的响应都带Connection:close，发送完即关闭
+static void start_drain(int &listenfd)
+{
+    draining = true;
+    http_conn::m_draining = true;
+    drain_deadline = clock_service::mono() + GRACEFUL_TIMEOUT;
+
+    if (http_conn::m_io_engine == 1)
+    {
+        struct io_uring_sqe *sqe = uring_sqe();
+        if (sqe)
+        {
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = (unsigned long long)URING_ACCEPT << 56;
+            sqe->user_data = (unsigned long long)URING_CANCEL << 56;
+        }
+    }
+    else
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, listenfd, 0);
+
+    //监听socket没有被新进程继承时，关闭后全连接队列中已完成握手的连接会被重置，先把它们取出来处理完
+    int accepted = 0;
+    while (!listen_shared)
+    {
+        struct sockaddr_in client_address;
+        socklen_t client_addrlength = sizeof(client_address);
+        int connfd = accept4(listenfd, (struct sockaddr *)&client_address, &client_addrlength, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (connfd < 0)
+            break;
+        accepted++;
+        if (http_conn::m_io_engine == 1)
+            uring_on_accept(connfd);
+        else
+            accept_conn(connfd, client_address);
+    }
+    close(listenfd);
+    listenfd = -1;
+
+    int closed = timer_lst.sweep(close_idle);
+    LOG_INFO("graceful shutdown: %d accepted from backlog, %d idle closed, %d remaining",
+             accepted, closed, http_conn::user_count());
+}
+
+//每轮循环结束时调用：处理升级请求，优雅退出期间关闭变为空闲的连接，全部关闭或超时后退出
+static void check_lifecycle(int &listenfd, bool &stop_server)
+{
+    if (upgrade_requested)
+    {
+        upgrade_requested = false;
+        if (!draining && master::upgrade(main_argv, listenfd))
+        {
+            listen_shared = true;
+            LOG_INFO("%s", "upgrade: new binary started with the listening socket");
+        }
+        else
+            LOG_ERROR("%s", "upgrade failed");
+    }
+    if (drain_requested)
+    {
+        drain_requested = false;
+        start_drain(listenfd);
+    }
+    if (!draining)
+        return;
+
+    //请求处理完的长连接，只遍历定时器链表中存活的连接，不扫描全部MAX_FD个描述符
+    timer_lst.sweep(close_idle);
+    if (http_conn::user_count() <= 0 && !uring_accept_armed)
+        stop_server = true;
+    else if (clock_service::mono() >= drain_deadline)
+    {
+        LOG_WARN("graceful shutdown timed out, %d connections dropped", http_conn::user_count());
+        stop_server = true;
+    }
+}
+
+//io_uring事件循环，ring初始化失败返回false，由调用者退回epoll
+bool uring_loop(int &listenfd, threadpool<http_conn> *pool, bool &stop_server)
+{
+    ring = new io_ring;
+    if (!ring->init(URING_ENTRIES) || !ring->setup_buffers(URING_BUF_GROUP, URING_BUF_COUNT, URING_BUF_SIZE))
+    {
+        delete ring;
+        ring = NULL;
+        return false;
+    }
+    http_conn::m_io_engine = 1;
+    close_func = uring_cb_func;
+
+    char signals[1024];
+    uint64_t cq_count;
+    bool timeout = false;
+
+    //过载时取消accept，新连接留在内核的全连接队列中，定期检查是否恢复
+    bool accept_paused = false;
+    struct __kernel_timespec resume_ts;
+    resume_ts.tv_sec = 0;
+    resume_ts.tv_nsec = ACCEPT_RESUME_POLL * 1000000LL;
+
+    //优雅退出期间定期醒来检查剩余连接
+    bool drain_posted = false;
+    struct __kernel_timespec drain_ts;
+    drain_ts.tv_sec = 0;
+    drain_ts.tv_nsec = DRAIN_POLL * 1000000LL;
+
+    uring_post_accept(listenfd);
+    uring_post_read(pipefd[0], URING_SIGNAL, signals, sizeof(signals));
+    uring_post_read(completions->get_fd(), URING_COMPLETION, &cq_count, sizeof(cq_count));
+
+    while (!stop_server)
+    {
+        ring->commit_buffers();
+        //提交本轮所有SQE并等待至少一个完成事件，被信号中断时返回-1
+        if (ring->submit(1) < 0 && errno != EINTR)
+        {
+            LOG_ERROR("%s", "io_uring failure");
+            break;
+        }
+        clock_service::update();
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = ring->peek_cqe()) != NULL)
+        {
+            unsigned long long data = cqe->user_data;
+            int op = uring_op(data);
+            int fd = uring_fd(data);
+
+            //旧连接残留的recv完成事件，归还其占用的缓冲区后丢弃
+            if ((op == URING_RECV || op == URING_WRITEV) && uring_gen(data) != (users[fd].gen() & 0xffffff))
+            {
+                if (cqe->flags & IORING_CQE_F_BUFFER)
+                    ring->add_buffer(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+                ring->cqe_seen();
+                continue;
+            }
+
+            switch (op)
+            {
+            case URING_ACCEPT:
+            {
+                //多次触发的accept结束(出错或被取消)，未暂停且不在退出中则重新提交
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                {
+                    uring_accept_armed = false;
+                    if (!accept_paused && !draining)
+                        uring_post_accept(listenfd);
+                }
+                if (cqe->res < 0)
+                {
+                    if (cqe->res == -EMFILE || cqe->res == -ENFILE)
+                        reject_no_fd(listenfd);
+                    else if (cqe->res != -ECANCELED)
+                        LOG_ERROR("%s:errno is:%d", "accept error", -cqe->res);
+                    break;
+                }
+                uring_on_accept(cqe->res);
+
+                //线程池过载，暂停accept，直到队列回落到阈值以下
+                if (!accept_paused && !draining && pool->overloaded())
+                {
+                    struct io_uring_sqe *sqe = uring_sqe();
+                    if (sqe)
+                    {
+                        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                        sqe->addr = (unsigned long long)URING_ACCEPT << 56;
+                        sqe->user_data = (unsigned long long)URING_CANCEL << 56;
+                    }
+                    uring_post_timeout(&resume_ts);
+                    accept_paused = true;
+                    LOG_WARN("overload: queue depth %d, queue age %lldus, pause accept",
+                             pool->queue_depth(), pool->queue_age_us());
+                }
+                break;
+            }
+            case URING_TIMEOUT:
+            {
+                //过载解除后恢复accept，退出中不再恢复
+                if (draining)
+                    accept_paused = false;
+                else if (!pool->overloaded())
+                {
+                    accept_paused = false;
+                    uring_post_accept(listenfd);
+                    LOG_INFO("%s", "overload cleared, resume accept");
+                }
+                else
+                    uring_post_timeout(&resume_ts);
+                break;
+            }
+            case URING_RECV:
+                uring_on_recv(fd, cqe, pool);
+                break;
+            case URING_WRITEV:
+                uring_on_writev(fd, cqe);
+                break;
+            case URING_COMPLETION:
+                uring_on_completion();
+                uring_post_read(completions->get_fd(), URING_COMPLETION, &cq_count, sizeof(cq_count));
+                break;
+            case URING_SIGNAL:
+                if (cqe->res > 0)
+                    deal_with_signal(signals, cqe->res, timeout, stop_server);
+                uring_post_read(pipefd[0], URING_SIGNAL, signals, sizeof(signals));
+                break;
+            case URING_DRAIN:
+                drain_posted = false;
+                break;
+            default:
+                //URING_CLOSE、URING_CANCEL无需处理
+                break;
+            }
+            ring->cqe_seen();
+        }
+
+        if (timeout)
+        {
+            deal_with_timeout(pool);
+            timeout = false;
+
+            LOG_INFO("io_uring: %llu responses, %llu syscalls, %.2f syscalls per response",
+                     uring_responses, ring->m_enter_calls + uring_syscalls,
+                     uring_responses ? (double)(ring->m_enter_calls + uring_syscalls) / uring_responses : 0.0);
+        }
+
+        check_lifecycle(listenfd, stop_server);
+        if (draining && !drain_posted)
+        {
+            struct io_uring_sqe *sqe = uring_sqe();
+            if (sqe)
+            {
+                sqe->opcode = IORING_OP_TIMEOUT;
+                sqe->fd = -1;
+                sqe->addr = (unsigned long)&drain_ts;
+                sqe->len = 1;
+                sqe->user_data = (unsigned long long)URING_DRAIN << 56;
+                drain_posted = true;
+            }
+        }
+    }
+
+    delete ring;
+    return true;
 }
 
 int main(int argc, char *argv[]){
+	//日志和定时器都读取时钟服务，必须先发布第一个快照
+	clock_service::update();
 
+	//解析命令行参数
+	Config config;
+	if(!config.parse_arg(argc, argv)){
+		config.usage(basename(argv[0]));    //basename函数输出路径中最后一个斜杠后的字符串
+		return 1;
+	}
+	
+	int port = config.port;
+	
+	//按Host区分的文档根目录、路由表和静态文件缓存
+	if(config.vhost_file && !vhost::load(config.vhost_file))
+		return 1;
+	//镜像在fork前映射，多进程模式下所有worker共用
+	if(config.bundle_file && !(vhost::get_default()->packed = bundle::open(config.bundle_file, config.bundle_huge)))
+		return 1;
+	//证书和ticket主密钥在fork前加载和生成，所有worker相同，一个worker发出的ticket可以在其他worker上复用
+	if(config.tls_cert && !tls_context::init(config.tls_cert, config.tls_key))
+		return 1;
+	
+	//多进程模式：master在run中fork并看管worker，直到收到SIGTERM
+	//worker从这里继续，各自初始化日志、数据库连接池和线程池，运行完整的事件循环
+	//fork前把指标分片、限流表和TLS会话缓存映射到共享内存，所有worker共用
+	int worker_id = 0;
+	if(config.workers > 0){
+		if(!metrics::share(config.workers) || !ip_limiter::share() || (tls_context::enabled() && !tls_context::share()))
+			return 1;
+		int worker = master::run(config.workers, config.stats_port, argv);
+		if(worker == MASTER_EXIT)
+			return 0;
+		if(worker == MASTER_FAILED)
+			return 1;
+		worker_id = worker;
+	}
+	
+	//主线程最先绑定CPU：写日志线程和工作线程创建时继承该绑定，users等大数组由主线程构造，首次写入的页分配在它所在的节点
+	//多进程模式下每个worker的主线程只绑定reactor_cpus中的一个CPU，覆盖master的分配
+	bool pinned;
+	if(config.workers > 0 && CPU_COUNT(&config.reactor_cpus) > 0)
+		pinned = affinity::pin_cpu(pthread_self(), affinity::nth(&config.reactor_cpus, worker_id));
+	else
+		pinned = affinity::pin(pthread_self(), &config.reactor_cpus);
+	if(!pinned){
+		fprintf(stderr, "cannot pin reactor to the given CPUs\n");
+		return 1;
+	}
+	
+	//日志在fork之后初始化，异步日志的写线程不会被fork复制
 #ifdef SYNLOG
 	Log::get_instance()->init("ServerLog", 2000, 800000, 0);  //同步日志模型
 #endif
@@ -109,13 +1121,10 @@ int main(int argc, char *argv[]){
 #ifdef ASYNLOG
 	Log::get_instance()->init("ServerLog", 2000, 800000, 8);  //异步日志模型
 #endif
-
-	if(argc != 2){
-		printf("usage：%s port_number\n", basename(argv[0]));    //basename函数输出路径中最后一个斜杠后的字符串
-		return 1;
-	}
 	
-	int port = atoi(argv[1]);
+	pthread_t log_thread;
+	if(Log::get_instance()->get_flush_thread(&log_thread))
+		affinity::pin(log_thread, &config.log_cpus);
 	
 	addsig(SIGPIPE, SIG_IGN);
 	
@@ -126,33 +1135,93 @@ int main(int argc, char *argv[]){
 	//创建线程池
 	threadpool<http_conn> *pool = NULL;
 	try{
-		pool = new threadpool<http_conn>(connPool);
+		pool = new threadpool<http_conn>(connPool, THREAD_NUM, 10000, config.overload_depth, config.overload_age);
 	}catch(...){         //三个点表示任意类型参数,可捕获任意异常
 		return 1;
 	}
+	pool->set_queue_policy(config.task_deadline, config.codel_target, config.codel_interval);
+	task_deadline = config.task_deadline;
+	if(!pool->set_cpus(&config.worker_cpus)){
+		fprintf(stderr, "cannot pin worker threads to the given CPUs\n");
+		return 1;
+	}
+	thread_pool = pool;
+	metrics::set_gauges(render_gauges);
+	header_timeout = config.header_timeout;
+	body_timeout = config.body_timeout;
+	request_timeout = config.request_timeout;
+	min_send_rate = config.min_send_rate;
+	ip_limiter::configure(LIMIT_CONN, config.conn_rate, config.conn_burst);
+	ip_limiter::configure(LIMIT_REQUEST, config.request_rate, config.request_burst);
+	pool->set_actor_model(config.actor_model);
+	http_conn::m_actor_model = config.actor_model;
+	pool->set_lane(http_conn::LANE_STATIC, LANE_STATIC_WEIGHT, LANE_STATIC_INFLIGHT);
+	pool->set_lane(http_conn::LANE_DYNAMIC, LANE_DYNAMIC_WEIGHT, LANE_DYNAMIC_INFLIGHT);
+	pool->set_lane(http_conn::LANE_DB, LANE_DB_WEIGHT, LANE_DB_INFLIGHT);
+	
+	http_conn::init_busy_response(RETRY_AFTER);
+	
+	//连接的缓冲区在proactor和io_uring下由主线程读写，reactor模式下由工作线程读写
+	//这些线程都在同一个节点上时，连接相关的数组先映射并设置放置策略再构造，物理页从该节点分配
+	cpu_set_t reactor_set;
+	sched_getaffinity(0, sizeof(reactor_set), &reactor_set);
+	int conn_node = affinity::node_of_set(config.actor_model == 1 ? &config.worker_cpus : &reactor_set);
 	
 	//创建MAX_FD个http类对象
-	http_conn* users = new http_conn[MAX_FD];
+	users = (http_conn *)affinity::alloc_memory(sizeof(http_conn) * MAX_FD, conn_node);
 	assert(users);
+	for(int i = 0; i < MAX_FD; i++)
+		new (users + i) http_conn();
+	//主线程分配的缓冲区只有reactor模式下需要放到工作线程的节点上，其他模式下主线程首次写入即是本地的
+	if(config.actor_model == 1 && !http_conn::reserve_cold(MAX_FD, conn_node))
+		LOG_WARN("cannot reserve connection buffers on node %d", conn_node);
+	{
+		char reactor_list[128], worker_list[128];
+		affinity::format(&reactor_set, reactor_list, sizeof(reactor_list));
+		affinity::format(&config.worker_cpus, worker_list, sizeof(worker_list));
+		LOG_INFO("affinity: reactor cpus %s, worker cpus %s, connection memory on node %d",
+			reactor_list, worker_list[0] ? worker_list : "unpinned", conn_node);
+	}
+	if(vhost::get_default()->packed){
+		bundle *pack = vhost::get_default()->packed;
+		LOG_INFO("bundle: %u files, %llu bytes%s", pack->files(), pack->size(), pack->huge() ? ", huge pages" : "");
+	}
 	
 	//初始化数据库读取表
 	users->initmysql_result(connPool);
 	
-	int listenfd = socket(PF_INET, SOCK_STREAM, 0);
-	assert(listenfd >= 0);
-	
 	int ret=0;
 	
-	struct sockaddr_in address;
-	bzero(&address, sizeof(address));
-	address.sin_family = AF_INET;
-	address.sin_addr.s_addr = htonl(INADDR_ANY);
-	address.sin_port = htons(port);
+	//平滑升级时继承旧进程的监听socket，不重新bind和listen，全连接队列中的连接不会丢失
+	int listenfd = master::inherited_listen_fd();
+	if(listenfd < 0){
+		//listenfd为非阻塞，accept取空全连接队列时返回EAGAIN
+		listenfd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		assert(listenfd >= 0);
 	
-	int flag=1;
-	setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
-	assert(bind(listenfd, (struct sockaddr*)&address, sizeof(address)) != -1);
-	assert(listen(listenfd, 5) != -1);
+		struct sockaddr_in address;
+		bzero(&address, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_addr.s_addr = htonl(INADDR_ANY);
+		address.sin_port = htons(port);
+	
+		int flag=1;
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+		//多进程模式下每个worker绑定同一端口，由内核按四元组哈希分配新连接
+		if(config.workers > 0)
+			setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));
+		//标记为主线程所在的CPU，内核在同一端口的SO_REUSEPORT组中优先把该CPU上收到的连接交给这个worker
+		int rx_cpu = affinity::pinned_cpu();
+		if(config.incoming_cpu && rx_cpu >= 0)
+			setsockopt(listenfd, SOL_SOCKET, SO_INCOMING_CPU, &rx_cpu, sizeof(rx_cpu));
+		assert(bind(listenfd, (struct sockaddr*)&address, sizeof(address)) != -1);
+		//客户端发来数据后内核才完成accept，只建立连接不发请求的客户端不占用连接资源
+		int defer = DEFER_ACCEPT_TIMEOUT;
+		setsockopt(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
+		assert(listen(listenfd, config.backlog) != -1);
+	}
+	
+	spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 	
 	//创建内核事件表
 	epoll_event events[MAX_EVENT_NUMBER];
@@ -170,6 +1239,8 @@ int main(int argc, char *argv[]){
 	
 	//设置管道写端为非阻塞，原因是避免信号处理函数阻塞，增加时间开销
 	setnonblocking(pipefd[1]);
+	//读端也设为非阻塞，addfd不再设置
+	setnonblocking(pipefd[0]);
 	
 	//统一事件源，将管道读端注册为epoll读事件
 	addfd(epollfd, pipefd[0], false);
@@ -177,119 +1248,94 @@ int main(int argc, char *argv[]){
 	//注册信号源对应的信号处理函数
 	addsig(SIGALRM, sig_handler, false);
 	addsig(SIGTERM, sig_handler, false);
+	//多进程模式下由master处理升级
+	main_argv = argv;
+	if(config.workers == 0)
+		addsig(SIGUSR2, sig_handler, false);
 	
 	//循环条件
 	bool stop_server = false;
 	
 	//连接资源，所有客户端的相关数据
-	client_data *users_timer = new client_data[MAX_FD];
+	//值初始化，优雅退出时遍历所有描述符，从未使用过的槽timer须为NULL
+	users_timer = (client_data *)affinity::alloc_memory(sizeof(client_data) * MAX_FD, conn_node);
+	assert(users_timer);
+	for(int i = 0; i < MAX_FD; i++)
+		new (users_timer + i) client_data();
+	
+	//创建完成队列，将其eventfd注册为epoll读事件
+	try{
+		completions = new completion_queue<http_conn>;
+	}catch(...){
+		return 1;
+	}
+	addfd(epollfd, completions->get_fd(), false);
+	http_conn::m_completion = completions;
 	
 	//超时标志
 	bool timeout = false;
 	
+	//过载时暂停accept，将listenfd从epoll中移除，新连接留在内核的全连接队列中
+	bool accept_paused = false;
+	
 	//隔TIMESLOT时间触发一次SIGALRM信号
 	alarm(TIMESLOT);
 	
+	//io_uring引擎运行到服务器退出，内核不支持时退回epoll
+	if(config.io_engine == 1 && !uring_loop(listenfd, pool, stop_server))
+		LOG_ERROR("%s", "io_uring setup failed, fall back to epoll");
+	
 	while(!stop_server){
+		//过载解除后恢复accept
+		if(accept_paused && !draining && !pool->overloaded()){
+			addfd(epollfd, listenfd, false);
+			accept_paused = false;
+			LOG_INFO("%s", "overload cleared, resume accept");
+		}
+		
 		//等待所监视的文件描述符的事件发生
-		int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, -1);
+		//暂停accept期间需要定期醒来检查队列状态，优雅退出期间定期检查剩余连接
+		int timeout_ms = draining ? DRAIN_POLL : (accept_paused ? ACCEPT_RESUME_POLL : -1);
+		int number = epoll_wait(epollfd, events, MAX_EVENT_NUMBER, timeout_ms);
 		if(number < 0 && errno != EINTR){
 			LOG_ERROR("%s", "epoll failure");
 			break;
 		}
+		//每轮循环更新一次时钟，本轮的定时器、日志和响应头都使用这个时间
+		clock_service::update();
 		
 		//轮询所有就绪事件并处理
 		for(int i=0; i < number; i++){
-		  int sockfd = events[i].data.fd;
+		  int sockfd = http_conn::handle_fd(events[i].data.u64);
+		  
+		  //连接在本轮中已被关闭，文件描述符可能已被新连接复用，代数不同的是旧连接残留的事件
+		  if(sockfd < MAX_FD && !users[sockfd].current(http_conn::handle_gen(events[i].data.u64)))
+			continue;
 
 		  //1.处理新到的客户连接
           if (sockfd == listenfd)
             {
-				//初始化客户端连接地址
-                struct sockaddr_in client_address;
-                socklen_t client_addrlength = sizeof(client_address);
-#ifdef listenfdLT
-
-				//该连接分配的文件描述符
-                int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlength);
-                if (connfd < 0)
+                //线程池过载，暂停accept，直到队列回落到阈值以下
+                if (pool->overloaded())
                 {
-                    LOG_ERROR("%s:errno is:%d", "accept error", errno);
-                    continue;
-                }
-                if (http_conn::m_user_count >= MAX_FD)
-                {
-                    show_error(connfd, "Internal server busy");
-                    LOG_ERROR("%s", "Internal server busy");
-                    continue;
-                }
-                users[connfd].init(connfd, client_address);
-
-                //初始化client_data数据（连接资源）
-                //创建定时器，设置回调函数和超时时间，绑定用户数据，将定时器添加到链表中
-                users_timer[connfd].address = client_address;
-                users_timer[connfd].sockfd = connfd;
-
-				//创建定时器临时变量
-                util_timer *timer = new util_timer;
-				//设置定时器对应的连接资源
-                timer->user_data = &users_timer[connfd];
-				//设置回调函数
-                timer->cb_func = cb_func;
-                time_t cur = time(NULL);
-				//设置绝对超时时间
-                timer->expire = cur + 3 * TIMESLOT;
-				//创建该连接对应的定时器，初始化为前述临时变量
-                users_timer[connfd].timer = timer;
-				//将该定时器添加到链表中
-                timer_lst.add_timer(timer);
-#endif
-
-#ifdef listenfdET
-                //需要循环接收数据
-                while (1)
-                {
-                    int connfd = accept(listenfd, (struct sockaddr *)&client_address, &client_addrlength);
-                    if (connfd < 0)
+                    if (!accept_paused)
                     {
-                        LOG_ERROR("%s:errno is:%d", "accept error", errno);
-                        break;
+                        epoll_ctl(epollfd, EPOLL_CTL_DEL, listenfd, 0);
+                        accept_paused = true;
+                        LOG_WARN("overload: queue depth %d, queue age %lldus, pause accept",
+                                 pool->queue_depth(), pool->queue_age_us());
                     }
-                    if (http_conn::m_user_count >= MAX_FD)
-                    {
-                        show_error(connfd, "Internal server busy");
-                        LOG_ERROR("%s", "Internal server busy");
-                        break;
-                    }
-                    users[connfd].init(connfd, client_address);
-
-                    //初始化client_data数据
-                    //创建定时器，设置回调函数和超时时间，绑定用户数据，将定时器添加到链表中
-                    users_timer[connfd].address = client_address;
-                    users_timer[connfd].sockfd = connfd;
-                    util_timer *timer = new util_timer;
-                    timer->user_data = &users_timer[connfd];
-                    timer->cb_func = cb_func;
-                    time_t cur = time(NULL);
-                    timer->expire = cur + 3 * TIMESLOT;
-                    users_timer[connfd].timer = timer;
-                    timer_lst.add_timer(timer);
+                    continue;
                 }
-                continue;
-#endif
+
+                deal_with_accept(listenfd);
             }
 
 		  //2.处理异常事件
             else if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
             {
                 //服务器端关闭连接，移除对应的定时器
-                util_timer *timer = users_timer[sockfd].timer;
-                timer->cb_func(&users_timer[sockfd]);
-
-                if (timer)
-                {
-                    timer_lst.del_timer(timer);
-                }
+                deal_timer(users_timer[sockfd].timer, sockfd);
             }
 			
 		  //3.处理信号
@@ -308,91 +1354,118 @@ int main(int argc, char *argv[]){
 				continue;
 			}
 			else {
-				//信号对应的处理逻辑
-				for(int i=0; i < ret; i++){
-				  //这里是字符
-				  switch(signals[i]){
-				  	case SIGALRM:
-				  	{
-				  	  timeout = true;
-				  	  break;
-				  	}
-				  	case SIGTERM:
-				  	{
-				  	  stop_server = true;
-				  	}
-				  }
-				}
+				deal_with_signal(signals, ret, timeout, stop_server);
 			}
 		  }
 
 		  
 
+		  //完成队列：工作线程已生成响应报文，直接尝试发送，发送不完时write内部注册EPOLLOUT
+		  else if(sockfd == completions->get_fd()){
+			http_conn *conn = completions->pop_all();
+			while(conn){
+				http_conn *next = conn->m_cq_next;
+				int connfd = conn - users;
+				
+				//工作线程处理失败，由主线程关闭连接并删除定时器；连接已关闭时两者都直接返回
+				if(conn->m_cq_event == http_conn::CQ_CLOSE)
+					deal_timer(users_timer[connfd].timer, connfd);
+				else if(conn->m_cq_event == http_conn::CQ_WRITE)
+					deal_with_write(connfd);
+				//归还事件持有的引用，连接已关闭且没有其他引用时close文件描述符
+				if(conn->release())
+					close_released(connfd);
+				conn = next;
+			}
+		  }
+
 		  //4.处理客户连接上接收到的数据
             else if (events[i].events & EPOLLIN)
             {
 				//创建定时器临时变量，将该连接对应的定时器取出来
                 util_timer *timer = users_timer[sockfd].timer;
-                //读入对应缓冲区
-                if (users[sockfd].read_once())
+                //连接已在本轮中被关闭
+                if (!timer)
                 {
+                    continue;
+                }
+
+                //reactor模式，主线程只分发读事件，由工作线程读取并解析
+                //此时还没有读到请求行，只能按缓冲区中已有的数据选择队列
+                deadline_on_read(sockfd);
+                if (config.actor_model == 1)
+                {
+                    users[sockfd].m_state = 0;
+                    if (pool->overloaded() || !dispatch(pool, sockfd))
+                    {
+                        reject_busy(&users_timer[sockfd]);
+                        continue;
+                    }
+                    adjust_timer(timer);
+                }
+                //proactor模式，读入对应缓冲区
+                else if (http_conn::READ_STATUS status = users[sockfd].read_once())
+                {
+                    //TLS握手或记录不完整，还没有新的请求数据，read_once已重新注册事件
+                    if (status == http_conn::READ_WAIT)
+                    {
+                        adjust_timer(timer);
+                        continue;
+                    }
+
                     LOG_INFO("deal with the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
                     Log::get_instance()->flush();
 
-                    //若监测到读事件，将该事件放入请求队列
-                    pool->append(users + sockfd);
-
-                    //若有数据传输，则将定时器往后延迟3个单位
-                    //并对新的定时器在链表上的位置进行调整
-                    if (timer)
+                    ///metrics由主线程直接回复
+                    int inline_ret = users[sockfd].process_inline();
+                    if (inline_ret > 0)
+                    {
+                        deal_with_write(sockfd);
+                        continue;
+                    }
+                    else if (inline_ret < 0)
                     {
-                        time_t cur = time(NULL);
-                        timer->expire = cur + 3 * TIMESLOT;
-                        LOG_INFO("%s", "adjust timer once");
-                        Log::get_instance()->flush();
+                        deal_timer(timer, sockfd);
+                        continue;
+                    }
 
-                        timer_lst.adjust_timer(timer);
+                    //线程池过载或请求队列已满，直接回复503，不再交给工作线程
+                    if (pool->overloaded() || !dispatch(pool, sockfd))
+                    {
+                        reject_busy(&users_timer[sockfd]);
+                        continue;
                     }
+
+                    adjust_timer(timer);
                 }
                 else
                 {
-                    timer->cb_func(&users_timer[sockfd]);
-                    if (timer)
-                    {
-                        timer_lst.del_timer(timer);
-                    }
+                    deal_timer(timer, sockfd);
                 }
             }
 
 			//5.处理写事件，服务器通过连接给浏览器发送数据
 			else if (events[i].events & EPOLLOUT)
             {
-                util_timer *timer = users_timer[sockfd].timer;
-                if (users[sockfd].write())
+                if (!users_timer[sockfd].timer)
                 {
-                    LOG_INFO("send data to the client(%s)", inet_ntoa(users[sockfd].get_address()->sin_addr));
-                    Log::get_instance()->flush();
-
-                    //若有数据传输，则将定时器往后延迟3个单位
-                    //并对新的定时器在链表上的位置进行调整
-                    if (timer)
-                    {
-                        time_t cur = time(NULL);
-                        timer->expire = cur + 3 * TIMESLOT;
-                        LOG_INFO("%s", "adjust timer once");
-                        Log::get_instance()->flush();
-                        timer_lst.adjust_timer(timer);
-                    }
+                    continue;
                 }
-                else
+
+                //reactor模式，由工作线程继续发送
+                if (config.actor_model == 1)
                 {
-					//服务器端关闭连接，移除对应的定时器
-                    timer->cb_func(&users_timer[sockfd]);
-                    if (timer)
+                    deadline_on_write(sockfd);
+                    users[sockfd].m_state = 1;
+                    if (!dispatch(pool, sockfd))
                     {
-                        timer_lst.del_timer(timer);
+                        deal_timer(users_timer[sockfd].timer, sockfd);
+                        continue;
                     }
+                    adjust_timer(users_timer[sockfd].timer);
                 }
+                else
+                    deal_with_write(sockfd);
             }
 		  
 		  
@@ -402,17 +1475,24 @@ int main(int argc, char *argv[]){
 		//完成读写事件后，再进行处理
 		if (timeout)
         {
-            timer_handler();
+            deal_with_timeout(pool);
             timeout = false;
         }
+		
+		check_lifecycle(listenfd, stop_server);
 	}
 
 	close(epollfd);
     close(listenfd);
     close(pipefd[1]);
     close(pipefd[0]);
-    delete[] users;
-    delete[] users_timer;
+    close(spare_fd);
+    for (int i = 0; i < MAX_FD; i++)
+        users[i].~http_conn();
+    http_conn::release_cold_pool();
+    affinity::free_memory(users, sizeof(http_conn) * MAX_FD);
+    affinity::free_memory(users_timer, sizeof(client_data) * MAX_FD);
     delete pool;
+    delete completions;
     return 0;
 }
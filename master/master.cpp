@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <algorithm>
+#include <sched.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include "master.h"
+#include "metrics.h"
+#include "clock_service.h"
+
+static int s_workers = 0;
+static pid_t s_pid[MASTER_MAX_WORKERS];             //0表示该编号的worker等待重启
+static long long s_started[MASTER_MAX_WORKERS];     //worker启动的时间(ms)
+static long long s_respawn_at[MASTER_MAX_WORKERS];  //计划重启的时间(ms)
+static unsigned long long s_restarts = 0;
+static int s_sig_pipe[2] = {-1, -1};
+static int s_stats_fd = -1;
+
+//正在处理的/metrics连接，fd为-1表示没有
+static struct
+{
+    int fd;
+    long long deadline;                             //总时限(ms)，慢速客户端不能占住master
+    char req[2048];
+    int len;
+    bool sending;                                   //请求已读完，正在发送响应
+    char head[256];
+    struct iovec iov[2];
+} s_stats = {-1, 0, {0}, 0, false, {0}, {{NULL, 0}, {NULL, 0}}};
+
+extern char **environ;
+
+//与main中的信号处理方式相同，只把信号值写入管道，由循环处理
+static void master_sig(int sig)
+{
+    int save_errno = errno;
+    char msg = sig;
+    ssize_t n = write(s_sig_pipe[1], &msg, 1);
+    (void)n;
+    errno = save_errno;
+}
+
+static void set_sig(int sig, void (*handler)(int))
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sa.sa_flags = SA_RESTART;
+    sigfillset(&sa.sa_mask);
+    sigaction(sig, &sa, NULL);
+}
+
+//在master允许使用的CPU中按编号选一个，容器或taskset限制了CPU时只在其中分配
+static void pin_worker(int id)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+        return;
+    int count = CPU_COUNT(&allowed);
+    if (count <= 1)
+        return;
+    int want = id % count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed) || want-- > 0)
+            continue;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        sched_setaffinity(0, sizeof(set), &set);
+        return;
+    }
+}
+
+bool master::spawn(int id)
+{
+    //fork前刷出stdio缓冲区，避免worker重复输出
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        fprintf(stderr, "master: fork worker %d failed: %s\n", id, strerror(errno));
+        s_respawn_at[id] = clock_service::mono_ms() + MASTER_RESPAWN_DELAY;
+        return false;
+    }
+    if (pid > 0)
+    {
+        s_pid[id] = pid;
+        s_started[id] = clock_service::mono_ms();
+        return false;
+    }
+
+    //worker：恢复默认信号处理，关闭master的描述符，由main重新设置
+    pid_t parent = getppid();
+    set_sig(SIGCHLD, SIG_DFL);
+    set_sig(SIGTERM, SIG_DFL);
+    set_sig(SIGINT, SIG_DFL);
+    set_sig(SIGUSR2, SIG_DFL);
+    close(s_sig_pipe[0]);
+    close(s_sig_pipe[1]);
+    if (s_stats_fd >= 0)
+        close(s_stats_fd);
+    if (s_stats.fd >= 0)
+        close(s_stats.fd);
+    //master异常退出时worker随之退出，不留下无人管理的进程
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    if (getppid() != parent)
+        exit(0);
+    pin_worker(id);
+    metrics::use_region(id);
+    return true;
+}
+
+void master::reap()
+{
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        for (int i = 0; i < s_workers; i++)
+        {
+            if (s_pid[i] != pid)
+                continue;
+            if (WIFSIGNALED(status))
+                fprintf(stderr, "master: worker %d (pid %d) killed by signal %d\n", i, pid, WTERMSIG(status));
+            else
+                fprintf(stderr, "master: worker %d (pid %d) exited with %d\n", i, pid, WEXITSTATUS(status));
+            //启动后很快退出，多半会再次退出，推迟重启
+            long long now = clock_service::mono_ms();
+            s_pid[i] = 0;
+            //重启的worker复用这一份共享的分片，先并入汇总并清零
+            metrics::retire_region(i);
+            s_respawn_at[i] = now - s_started[i] < MASTER_RESPAWN_DELAY ? now + MASTER_RESPAWN_DELAY : now;
+            s_restarts++;
+            break;
+        }
+    }
+}
+
+void master::render_gauges(metrics_buf *out)
+{
+    int alive = 0;
+    for (int i = 0; i < s_workers; i++)
+        alive += s_pid[i] != 0;
+    out->append("# TYPE webserver_workers gauge\nwebserver_workers %d\n", alive);
+    out->append("# TYPE webserver_worker_restarts_total counter\nwebserver_worker_restarts_total %llu\n", s_restarts);
+}
+
+//master只回复GET /metrics，每个连接一个请求
+void master::accept_stats(int listenfd)
+{
+    int fd = accept4(listenfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0)
+        return;
+    s_stats.fd = fd;
+    s_stats.deadline = clock_service::mono_ms() + MASTER_STATS_TIMEOUT * 1000;
+    s_stats.len = 0;
+    s_stats.sending = false;
+}
+
+void master::close_stats()
+{
+    close(s_stats.fd);
+    s_stats.fd = -1;
+}
+
+void master::serve_stats()
+{
+    static metrics_buf body;
+    if (!s_stats.sending)
+    {
+        //读到请求头结束，或缓冲区已满按收到的部分判断
+        while (s_stats.len < (int)sizeof(s_stats.req) - 1)
+        {
+            int n = recv(s_stats.fd, s_stats.req + s_stats.len, sizeof(s_stats.req) - 1 - s_stats.len, 0);
+            if (n < 0 && errno == EAGAIN)
+                return;
+            if (n <= 0)
+            {
+                close_stats();
+                return;
+            }
+            s_stats.len += n;
+            s_stats.req[s_stats.len] = '\0';
+            if (strstr(s_stats.req, "\r\n\r\n"))
+                break;
+        }
+
+        char date[CLOCK_DATE_LEN + 1];
+        clock_service::date(date);
+        const char *req = s_stats.req;
+        bool ok = strncmp(req, "GET /metrics", 12) == 0 && (req[12] == ' ' || req[12] == '?');
+        int n;
+        if (ok)
+        {
+            metrics::render(&body);
+            n = snprintf(s_stats.head, sizeof(s_stats.head), "HTTP/1.1 200 OK\r\nDate:%s\r\nContent-Type:text/plain; version=0.0.4\r\n"
+                                                             "Content-Length:%d\r\nConnection:close\r\n\r\n", date, body.size());
+        }
+        else
+            n = snprintf(s_stats.head, sizeof(s_stats.head), "HTTP/1.1 404 Not Found\r\nDate:%s\r\nContent-Length:0\r\nConnection:close\r\n\r\n", date);
+        s_stats.iov[0].iov_base = s_stats.head;
+        s_stats.iov[0].iov_len = n;
+        s_stats.iov[1].iov_base = (void *)body.data();
+        s_stats.iov[1].iov_len = ok ? body.size() : 0;
+        s_stats.sending = true;
+    }
+
+    //发送缓冲区满时等待写事件，由poll继续
+    while (s_stats.iov[0].iov_len + s_stats.iov[1].iov_len > 0)
+    {
+        ssize_t n = writev(s_stats.fd, s_stats.iov, 2);
+        if (n < 0 && errno == EAGAIN)
+            return;
+        if (n < 0)
+            break;
+        for (int i = 0; i < 2; i++)
+        {
+            size_t step = std::min((size_t)n, s_stats.iov[i].iov_len);
+            s_stats.iov[i].iov_base = (char *)s_stats.iov[i].iov_base + step;
+            s_stats.iov[i].iov_len -= step;
+            n -= step;
+        }
+    }
+    close_stats();
+}
+
+bool master::upgrade(char **argv, int listenfd)
+{
+    //fork之后到exec之前只能调用异步信号安全的函数，环境变量在fork前准备好
+    static char fd_env[64];
+    int count = 0;
+    while (environ[count])
+        count++;
+    char **envp = (char **)malloc(sizeof(char *) * (count + 2));
+    if (!envp)
+        return false;
+    int n = 0;
+    int prefix = strlen(LISTEN_FD_ENV);
+    for (int i = 0; i < count; i++)
+        if (strncmp(environ[i], LISTEN_FD_ENV, prefix) != 0 || environ[i][prefix] != '=')
+            envp[n++] = environ[i];
+    if (listenfd >= 0)
+    {
+        snprintf(fd_env, sizeof(fd_env), "%s=%d", LISTEN_FD_ENV, listenfd);
+        envp[n++] = fd_env;
+    }
+    envp[n] = NULL;
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        //再fork一次，新进程由init接管，当前进程不需要回收它
+        if (fork() != 0)
+            _exit(0);
+        //只有监听socket需要继承，epoll、管道等描述符大多没有设置CLOEXEC
+        if (syscall(SYS_close_range, 3, ~0U, 4 /* CLOSE_RANGE_CLOEXEC */) != 0)
+        {
+            long max = sysconf(_SC_OPEN_MAX);
+            for (int fd = 3; fd < max; fd++)
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+        if (listenfd >= 0)
+            fcntl(listenfd, F_SETFD, 0);
+        execve(argv[0], argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    if (pid < 0)
+        return false;
+    waitpid(pid, NULL, 0);
+    return true;
+}
+
+int master::inherited_listen_fd()
+{
+    int fd = -1;
+    const char *env = getenv(LISTEN_FD_ENV);
+    const char *pid = getenv("LISTEN_PID");
+    const char *fds = getenv("LISTEN_FDS");
+    if (env)
+        fd = atoi(env);
+    //systemd按socket激活时，第一个描述符固定为3
+    else if (pid && fds && atoi(pid) == getpid() && atoi(fds) >= 1)
+        fd = 3;
+    //不再传给之后fork的进程
+    unsetenv(LISTEN_FD_ENV);
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    if (fd < 0)
+        return -1;
+
+    int listening = 0;
+    socklen_t len = sizeof(listening);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0 || !listening)
+    {
+        fprintf(stderr, "inherited fd %d is not a listening socket\n", fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+int master::run(int workers, int stats_port, char **argv)
+{
+    if (workers <= 0 || workers > MASTER_MAX_WORKERS)
+        return MASTER_FAILED;
+    s_workers = workers;
+
+    if (pipe2(s_sig_pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+        return MASTER_FAILED;
+    if (stats_port > 0)
+    {
+        s_stats_fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        struct sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_ANY);
+        address.sin_port = htons(stats_port);
+        int flag = 1;
+        setsockopt(s_stats_fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+        //升级期间新旧master同时监听
+        setsockopt(s_stats_fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));
+        if (s_stats_fd < 0 || bind(s_stats_fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(s_stats_fd, 16) != 0)
+        {
+            fprintf(stderr, "master: cannot listen on stats port %d\n", stats_port);
+            return MASTER_FAILED;
+        }
+        metrics::set_gauges(render_gauges);
+    }
+    set_sig(SIGCHLD, master_sig);
+    set_sig(SIGTERM, master_sig);
+    set_sig(SIGINT, master_sig);
+    set_sig(SIGUSR2, master_sig);
+    set_sig(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < workers; i++)
+        if (spawn(i))
+            return i;
+
+    bool stop = false;
+    while (!stop)
+    {
+        //有worker等待重启或/metrics连接有时限时定期醒来
+        long long now = clock_service::mono_ms();
+        int timeout = -1;
+        for (int i = 0; i < workers; i++)
+        {
+            if (s_pid[i] != 0)
+                continue;
+            int wait = std::max(0LL, s_respawn_at[i] - now);
+            if (timeout < 0 || wait < timeout)
+                timeout = wait;
+        }
+        if (s_stats.fd >= 0)
+        {
+            int wait = std::max(0LL, s_stats.deadline - now);
+            if (timeout < 0 || wait < timeout)
+                timeout = wait;
+        }
+
+        //正在处理一个/metrics连接时不再accept，等待它的读写事件
+        struct pollfd fds[2] = {{s_sig_pipe[0], POLLIN, 0}, {s_stats_fd, POLLIN, 0}};
+        if (s_stats.fd >= 0)
+        {
+            fds[1].fd = s_stats.fd;
+            fds[1].events = s_stats.sending ? POLLOUT : POLLIN;
+        }
+        int n = poll(fds, s_stats_fd >= 0 ? 2 : 1, timeout);
+        if (n < 0 && errno != EINTR)
+            break;
+        clock_service::update();
+
+        if (n > 0 && (fds[0].revents & POLLIN))
+        {
+            char signals[64];
+            int len = read(s_sig_pipe[0], signals, sizeof(signals));
+            for (int i = 0; i < len; i++)
+            {
+                if (signals[i] == SIGCHLD)
+                    reap();
+                else if (signals[i] == SIGTERM || signals[i] == SIGINT)
+                    stop = true;
+                //新master的worker另建SO_REUSEPORT的监听socket，与当前worker并存
+                else if (signals[i] == SIGUSR2 && !upgrade(argv, -1))
+                    fprintf(stderr, "master: upgrade failed: %s\n", strerror(errno));
+            }
+        }
+        if (n > 0 && s_stats_fd >= 0 && fds[1].revents)
+        {
+            if (s_stats.fd < 0)
+                accept_stats(s_stats_fd);
+            //accept之后请求通常已经到达，直接读
+            if (s_stats.fd >= 0)
+                serve_stats();
+        }
+
+        now = clock_service::mono_ms();
+        if (s_stats.fd >= 0 && now >= s_stats.deadline)
+            close_stats();
+        for (int i = 0; i < workers && !stop; i++)
+            if (s_pid[i] == 0 && now >= s_respawn_at[i] && spawn(i))
+                return i;
+    }
+
+    //通知所有worker优雅退出并等待，worker处理完已接受的连接后退出
+    for (int i = 0; i < workers; i++)
+        if (s_pid[i] > 0)
+            kill(s_pid[i], SIGTERM);
+    for (int i = 0; i < workers; i++)
+        if (s_pid[i] > 0)
+            waitpid(s_pid[i], NULL, 0);
+    return MASTER_EXIT;
+}
@@ -0,0 +1,46 @@
+#ifndef MASTER_H
+#define MASTER_H
+
+#define MASTER_MAX_WORKERS 64          //worker数上限，与METRIC_MAX_PROCESSES相同
+#define MASTER_RESPAWN_DELAY 1000      //worker启动后该时间(ms)内退出时延迟重启，避免反复崩溃时不停fork
+#define MASTER_STATS_TIMEOUT 1         //master处理一个/metrics连接的总时限(s)，从accept到响应发完
+#define LISTEN_FD_ENV "WEBSERVER_LISTEN_FD"   //升级时新进程从该环境变量取得继承的监听socket
+
+//run在master进程中的返回值
+#define MASTER_EXIT -1                 //所有worker已退出，master正常结束
+#define MASTER_FAILED -2               //启动失败
+
+class metrics_buf;
+
+//nginx式多进程：master只负责fork、重启worker和输出汇总指标，不处理业务连接
+//worker各自创建SO_REUSEPORT的监听socket，运行main中完整的事件循环，由内核在worker之间分配新连接
+class master{
+public:
+    //fork出workers个worker，第i个worker绑定到可用CPU中的第i个(取模)
+    //在worker进程中返回其编号；master进程收到SIGTERM或SIGINT后通知所有worker退出，等待后返回MASTER_EXIT
+    //stats_port不为0时master在该端口回复/metrics，内容为所有worker共享内存中计数的汇总
+    //收到SIGUSR2时以相同的argv启动新的可执行文件(平滑升级)
+    static int run(int workers, int stats_port, char **argv);
+
+    //平滑升级：fork并exec argv[0]处(部署时已被替换)的新程序，参数与当前进程相同
+    //listenfd不为-1时新进程继承该监听socket，新旧进程共用同一个全连接队列，升级期间不会拒绝连接
+    //新进程被两次fork后由init接管，不是当前进程的子进程；当前进程随后收到SIGTERM时优雅退出
+    static bool upgrade(char **argv, int listenfd);
+    //取得升级前的进程或systemd(LISTEN_FDS)传来的监听socket，没有返回-1
+    static int inherited_listen_fd();
+
+private:
+    //fork第id个worker，在worker进程中返回true
+    static bool spawn(int id);
+    //回收退出的worker，安排重启
+    static void reap();
+    ///metrics连接是非阻塞的，与信号管道一起由poll等待，同一时刻只处理一个，其余留在全连接队列中
+    static void accept_stats(int listenfd);
+    //读请求或发送响应，完成、出错或超过总时限时关闭连接
+    static void serve_stats();
+    static void close_stats();
+    //输出worker数和重启次数
+    static void render_gauges(metrics_buf *out);
+};
+
+#endif
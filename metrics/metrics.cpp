@@ -0,0 +1,256 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <sys/mman.h>
+#include "metrics.h"
+
+__thread metrics_shard *metrics::t_shard = NULL;
+
+//所有线程的分片，线程退出后分片保留，计数不会丢失
+//单进程时只有local_region，多进程时regions指向共享内存中每个worker的一份
+static metrics_region local_region;
+static metrics_region *regions = &local_region;
+static int region_count = 1;
+//当前进程新登记的线程使用的一份
+static metrics_region *self = &local_region;
+//多进程模式下已退出的worker的汇总，紧跟在各worker的分片之后，只由master写入
+static metrics_shard *retired = NULL;
+
+static void (*gauge_func)(metrics_buf *) = NULL;
+
+static const char *stage_names[STAGE_COUNT] = {
+    "accept_read", "queue_wait", "db_wait", "process_read", "do_request", "write"};
+
+metrics_buf::~metrics_buf()
+{
+    free(m_buf);
+}
+
+bool metrics_buf::append(const char *format, ...)
+{
+    while (true)
+    {
+        va_list arg_list;
+        va_start(arg_list, format);
+        int len = m_buf ? vsnprintf(m_buf + m_len, m_cap - m_len, format, arg_list) : m_cap;
+        va_end(arg_list);
+        if (len < 0)
+            return false;
+        if (m_buf && len < m_cap - m_len)
+        {
+            m_len += len;
+            return true;
+        }
+
+        int cap = m_cap ? m_cap * 2 : 16384;
+        while (cap - m_len <= len)
+            cap *= 2;
+        char *buf = (char *)realloc(m_buf, cap);
+        if (!buf)
+            return false;
+        m_buf = buf;
+        m_cap = cap;
+    }
+}
+
+//分片在静态区或新映射的共享内存中，初始即为0，占用一个下标即可使用
+metrics_shard *metrics::register_thread()
+{
+    int n = self->count.fetch_add(1, std::memory_order_relaxed);
+    metrics_shard *s = n < METRIC_MAX_THREADS ? &self->shards[n] : &self->overflow;
+    t_shard = s;
+    return s;
+}
+
+bool metrics::share(int processes)
+{
+    if (processes <= 0 || processes > METRIC_MAX_PROCESSES)
+        return false;
+    //每份约3.7MB，只有登记过的线程的分片会真正占用内存
+    void *p = mmap(NULL, sizeof(metrics_region) * processes + sizeof(metrics_shard), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return false;
+    regions = (metrics_region *)p;
+    region_count = processes;
+    retired = (metrics_shard *)(regions + processes);
+    return true;
+}
+
+void metrics::use_region(int process)
+{
+    if (regions == &local_region || process < 0 || process >= region_count)
+        return;
+    self = &regions[process];
+    t_shard = NULL;
+}
+
+//并入from后清零，from的写者已经退出
+static void fold_shard(metrics_shard &to, metrics_shard &from)
+{
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        for (int b = 0; b < METRIC_BUCKETS; b++)
+        {
+            to.hist[s][b].store(to.hist[s][b].load(std::memory_order_relaxed) + from.hist[s][b].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            from.hist[s][b].store(0, std::memory_order_relaxed);
+        }
+        to.sum[s].store(to.sum[s].load(std::memory_order_relaxed) + from.sum[s].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        from.sum[s].store(0, std::memory_order_relaxed);
+    }
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        to.counter[i].store(to.counter[i].load(std::memory_order_relaxed) + from.counter[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        from.counter[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void metrics::retire_region(int process)
+{
+    if (!retired || process < 0 || process >= region_count)
+        return;
+    metrics_region &region = regions[process];
+    int n = std::min(region.count.load(std::memory_order_relaxed), METRIC_MAX_THREADS);
+    unsigned long long accepted = retired->counter[COUNTER_ACCEPTED].load(std::memory_order_relaxed);
+    unsigned long long closed = retired->counter[COUNTER_CLOSED].load(std::memory_order_relaxed);
+    fold_shard(*retired, region.overflow);
+    for (int t = 0; t < n; t++)
+        fold_shard(*retired, region.shards[t]);
+    region.count.store(0, std::memory_order_relaxed);
+
+    //该worker退出时仍打开的连接
+    accepted = retired->counter[COUNTER_ACCEPTED].load(std::memory_order_relaxed) - accepted;
+    closed = retired->counter[COUNTER_CLOSED].load(std::memory_order_relaxed) - closed;
+    if (accepted > closed)
+        retired->counter[COUNTER_CLOSED].store(retired->counter[COUNTER_CLOSED].load(std::memory_order_relaxed) + accepted - closed, std::memory_order_relaxed);
+}
+
+//依次访问所有进程的所有分片
+template <class F>
+static void for_each_shard(F f)
+{
+    if (retired)
+        f(*retired);
+    for (int r = 0; r < region_count; r++)
+    {
+        metrics_region &region = regions[r];
+        int n = std::min(region.count.load(std::memory_order_relaxed), METRIC_MAX_THREADS);
+        f(region.overflow);
+        for (int t = 0; t < n; t++)
+            f(region.shards[t]);
+    }
+}
+
+//已登记的线程数
+static int thread_total()
+{
+    int n = 0;
+    for (int r = 0; r < region_count; r++)
+        n += std::min(regions[r].count.load(std::memory_order_relaxed), METRIC_MAX_THREADS);
+    return n;
+}
+
+unsigned long long metrics::local(int counter)
+{
+    unsigned long long total = self->overflow.counter[counter].load(std::memory_order_relaxed);
+    int n = std::min(self->count.load(std::memory_order_relaxed), METRIC_MAX_THREADS);
+    for (int t = 0; t < n; t++)
+        total += self->shards[t].counter[counter].load(std::memory_order_relaxed);
+    return total;
+}
+
+void metrics::status(int code)
+{
+    add(COUNTER_REQUESTS);
+    switch (code)
+    {
+    case 200: add(COUNTER_STATUS_200); break;
+    case 304: add(COUNTER_STATUS_304); break;
+    case 403: add(COUNTER_STATUS_403); break;
+    case 404: add(COUNTER_STATUS_404); break;
+    case 429: add(COUNTER_STATUS_429); break;
+    case 500: add(COUNTER_STATUS_500); break;
+    case 503: add(COUNTER_STATUS_503); break;
+    }
+}
+
+void metrics::set_gauges(void (*func)(metrics_buf *))
+{
+    gauge_func = func;
+}
+
+void metrics::render(metrics_buf *out)
+{
+    out->clear();
+
+    //计数器
+    unsigned long long c[COUNTER_COUNT] = {0};
+    for_each_shard([&](metrics_shard &s) {
+        for (int i = 0; i < COUNTER_COUNT; i++)
+            c[i] += s.counter[i].load(std::memory_order_relaxed);
+    });
+
+    //多进程模式下为所有worker的连接数之和
+    out->append("# TYPE webserver_connections gauge\n"
+                "webserver_connections %lld\n", (long long)(c[COUNTER_ACCEPTED] - c[COUNTER_CLOSED]));
+    out->append("# TYPE webserver_connections_accepted_total counter\n"
+                "webserver_connections_accepted_total %llu\n", c[COUNTER_ACCEPTED]);
+    out->append("# TYPE webserver_connections_closed_total counter\n"
+                "webserver_connections_closed_total %llu\n", c[COUNTER_CLOSED]);
+    out->append("# TYPE webserver_requests_total counter\n"
+                "webserver_requests_total %llu\n", c[COUNTER_REQUESTS]);
+    out->append("# TYPE webserver_io_errors_total counter\n"
+                "webserver_io_errors_total %llu\n", c[COUNTER_IO_ERRORS]);
+    out->append("# TYPE webserver_read_bytes_total counter\n"
+                "webserver_read_bytes_total %llu\n", c[COUNTER_BYTES_READ]);
+    out->append("# TYPE webserver_written_bytes_total counter\n"
+                "webserver_written_bytes_total %llu\n", c[COUNTER_BYTES_WRITTEN]);
+    out->append("# TYPE webserver_responses_total counter\n");
+    static const int codes[] = {200, 304, 403, 404, 429, 500, 503};
+    for (int i = 0; i < 7; i++)
+        out->append("webserver_responses_total{code=\"%d\"} %llu\n", codes[i], c[COUNTER_STATUS_200 + i]);
+    out->append("# TYPE webserver_timer_expired_total counter\n"
+                "webserver_timer_expired_total %llu\n", c[COUNTER_TIMER_EXPIRED]);
+    out->append("# TYPE webserver_rate_limited_connections_total counter\n"
+                "webserver_rate_limited_connections_total %llu\n", c[COUNTER_LIMITED_CONN]);
+    out->append("# TYPE webserver_tls_handshakes_total counter\n"
+                "webserver_tls_handshakes_total{result=\"full\"} %llu\n"
+                "webserver_tls_handshakes_total{result=\"resumed\"} %llu\n"
+                "webserver_tls_handshakes_total{result=\"failed\"} %llu\n",
+                c[COUNTER_TLS_FULL], c[COUNTER_TLS_RESUMED], c[COUNTER_TLS_FAILED]);
+    out->append("# TYPE webserver_tls_ktls_connections_total counter\n"
+                "webserver_tls_ktls_connections_total %llu\n", c[COUNTER_TLS_KTLS]);
+
+    //各阶段时延直方图，对外以2的幂为边界输出，与内部分桶的组边界对齐
+    out->append("# TYPE webserver_stage_duration_seconds histogram\n");
+    for (int s = 0; s < STAGE_COUNT; s++)
+    {
+        unsigned long long hist[METRIC_BUCKETS] = {0};
+        unsigned long long sum = 0;
+        for_each_shard([&](metrics_shard &shard) {
+            for (int b = 0; b < METRIC_BUCKETS; b++)
+                hist[b] += shard.hist[s][b].load(std::memory_order_relaxed);
+            sum += shard.sum[s].load(std::memory_order_relaxed);
+        });
+
+        unsigned long long cumulative = 0;
+        for (int b = 0; b < METRIC_BUCKETS - 1; b++)
+        {
+            cumulative += hist[b];
+            //1us到64s之间每个2的幂输出一个边界
+            unsigned long long upper = bucket_upper(b);
+            if (upper >= 1024 && (upper & (upper - 1)) == 0 && upper <= (1ULL << 36))
+                out->append("webserver_stage_duration_seconds_bucket{stage=\"%s\",le=\"%.9g\"} %llu\n",
+                            stage_names[s], upper / 1e9, cumulative);
+        }
+        cumulative += hist[METRIC_BUCKETS - 1];
+        out->append("webserver_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage_names[s], cumulative);
+        out->append("webserver_stage_duration_seconds_sum{stage=\"%s\"} %.9f\n", stage_names[s], sum / 1e9);
+        out->append("webserver_stage_duration_seconds_count{stage=\"%s\"} %llu\n", stage_names[s], cumulative);
+    }
+
+    out->append("# TYPE webserver_metrics_threads gauge\nwebserver_metrics_threads %d\n", thread_total());
+    if (gauge_func)
+        gauge_func(out);
+}
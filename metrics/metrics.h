@@ -0,0 +1,171 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <time.h>
+#include <stdarg.h>
+
+//请求处理的各个阶段，每个阶段一个时延直方图
+enum METRIC_STAGE{
+    STAGE_ACCEPT_READ = 0,  //accept到读到第一个请求数据
+    STAGE_QUEUE_WAIT,       //在线程池队列中等待
+    STAGE_DB_WAIT,          //等待数据库连接池分配连接
+    STAGE_PROCESS_READ,     //解析请求报文，不含do_request
+    STAGE_DO_REQUEST,       //路由、登录注册和打开文件
+    STAGE_WRITE,            //响应报文生成到发送完毕
+    STAGE_COUNT
+};
+
+//计数器
+enum METRIC_COUNTER{
+    COUNTER_ACCEPTED = 0,   //接受的连接数
+    COUNTER_CLOSED,         //关闭的连接数，与接受数之差即当前连接数
+    COUNTER_REQUESTS,       //生成的响应数，每个请求一个
+    COUNTER_IO_ERRORS,      //读写socket出错(不含对方正常关闭和EAGAIN)的次数
+    COUNTER_BYTES_READ,     //读取的请求字节数
+    COUNTER_BYTES_WRITTEN,  //发送的响应字节数
+    COUNTER_STATUS_200,     //各状态码的响应数
+    COUNTER_STATUS_304,
+    COUNTER_STATUS_403,
+    COUNTER_STATUS_404,
+    COUNTER_STATUS_429,
+    COUNTER_STATUS_500,
+    COUNTER_STATUS_503,
+    COUNTER_TIMER_EXPIRED,  //定时器超时关闭的连接数
+    COUNTER_LIMITED_CONN,   //超过单IP新建连接速率被直接关闭的连接数
+    COUNTER_TLS_FULL,       //TLS完整握手数
+    COUNTER_TLS_RESUMED,    //TLS会话复用(会话缓存或ticket)的握手数
+    COUNTER_TLS_FAILED,     //TLS握手失败数
+    COUNTER_TLS_KTLS,       //发送方向交给内核加密的TLS连接数
+    COUNTER_COUNT
+};
+
+//HDR风格的对数线性分桶：按最高位分组，每组再按其后3位均分为8个子桶，相对误差不超过12.5%
+//单位为纳秒，超过2^40ns(约18分钟)的样本计入最后一个桶
+#define METRIC_SUB_BITS 3
+#define METRIC_SUB_BUCKETS (1 << METRIC_SUB_BITS)
+#define METRIC_MAX_BITS 40
+#define METRIC_BUCKETS ((METRIC_MAX_BITS - METRIC_SUB_BITS + 1) * METRIC_SUB_BUCKETS)
+#define METRIC_MAX_THREADS 256
+#define METRIC_MAX_PROCESSES 64         //多进程模式下worker数的上限
+
+//每个线程一份，只有所属线程写入，读取时汇总所有线程
+//单写者不需要原子加，relaxed的读后写即可，避免lock前缀和缓存行争用
+struct alignas(64) metrics_shard{
+    std::atomic<unsigned long long> hist[STAGE_COUNT][METRIC_BUCKETS];
+    std::atomic<unsigned long long> sum[STAGE_COUNT];
+    std::atomic<unsigned long long> counter[COUNTER_COUNT];
+};
+
+//一个进程的全部分片，单进程时为静态变量
+//多进程模式下每个worker一份，放在fork前映射的共享内存中，master和任一worker都能汇总所有进程
+struct metrics_region{
+    std::atomic<int> count;                     //已登记的线程数，可能超过METRIC_MAX_THREADS
+    metrics_shard overflow;                     //线程数超过上限后共用的分片，计数可能有少量丢失
+    metrics_shard shards[METRIC_MAX_THREADS];
+};
+
+//Prometheus文本输出缓冲区，空间不足时扩容，缓冲区在多次请求间复用
+class metrics_buf{
+public:
+    metrics_buf() : m_buf(0), m_len(0), m_cap(0) {}
+    ~metrics_buf();
+
+    void clear() { m_len = 0; }
+    bool append(const char *format, ...);
+    char *data() { return m_buf; }
+    int size() { return m_len; }
+
+private:
+    char *m_buf;
+    int m_len;
+    int m_cap;
+};
+
+class metrics{
+public:
+    //单调时钟，纳秒
+    static long long now_ns()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    //记录一个时延样本
+    static void record(int stage, long long ns)
+    {
+        if (ns < 0)
+            ns = 0;
+        metrics_shard *s = shard();
+        inc(s->hist[stage][bucket(ns)], 1);
+        inc(s->sum[stage], ns);
+    }
+
+    static void add(int counter, long long n = 1)
+    {
+        inc(shard()->counter[counter], n);
+    }
+
+    //响应状态码对应的计数器，同时计入请求数
+    static void status(int code);
+
+    //当前进程所有线程分片中某个计数器之和，不含多进程模式下的其他worker
+    //各分片单写者、计数只增不减，读到的是各线程某一时刻的值，不会出现撕裂的中间值
+    static unsigned long long local(int counter);
+
+    //设置输出线程池、连接数等瞬时值的回调，由main注册
+    static void set_gauges(void (*func)(metrics_buf *));
+
+    //按Prometheus文本格式输出全部指标，多进程模式下计数器和直方图为所有worker之和
+    static void render(metrics_buf *out);
+
+    //多进程模式：fork前为processes个worker映射共享的分片，失败返回false
+    static bool share(int processes);
+    //worker进程fork后选择自己的一份，之后登记的线程都使用它
+    static void use_region(int process);
+    //master回收退出的worker后、重启之前调用：把它的计数和直方图并入已退出worker的汇总，再清零这一份
+    //退出时仍打开的连接已由内核关闭，计为关闭；重启的worker从0开始登记线程，连接数也从0开始
+    static void retire_region(int process);
+
+    //样本值对应的桶
+    static int bucket(unsigned long long v)
+    {
+        if (v < METRIC_SUB_BUCKETS)
+            return v;
+        int msb = 63 - __builtin_clzll(v);
+        if (msb >= METRIC_MAX_BITS)
+            return METRIC_BUCKETS - 1;
+        return (msb - METRIC_SUB_BITS + 1) * METRIC_SUB_BUCKETS + ((v >> (msb - METRIC_SUB_BITS)) & (METRIC_SUB_BUCKETS - 1));
+    }
+
+    //桶的上界(不含)
+    static unsigned long long bucket_upper(int b)
+    {
+        if (b < METRIC_SUB_BUCKETS)
+            return b + 1;
+        int msb = b / METRIC_SUB_BUCKETS + METRIC_SUB_BITS - 1;
+        unsigned long long sub = b % METRIC_SUB_BUCKETS;
+        return (METRIC_SUB_BUCKETS + sub + 1) << (msb - METRIC_SUB_BITS);
+    }
+
+private:
+    static void inc(std::atomic<unsigned long long> &c, unsigned long long n)
+    {
+        c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    //当前线程的分片，第一次使用时分配并登记
+    static metrics_shard *shard()
+    {
+        metrics_shard *s = t_shard;
+        if (!s)
+            s = register_thread();
+        return s;
+    }
+    static metrics_shard *register_thread();
+
+    static __thread metrics_shard *t_shard;
+};
+
+#endif
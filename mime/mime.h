@@ -0,0 +1,139 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <string.h>
+
+//扩展名到Content-Type的表，在编译期建成完美哈希，查找时一次乘法、一次比较，没有分支
+//每项带有完整的Content-Type头部行，生成响应时直接复制，文本类型带charset
+
+#define MIME_TABLE_BITS 6                  //64个槽，约为类型数的两倍多，容易找到无冲突的乘数
+#define MIME_TABLE_SIZE (1 << MIME_TABLE_BITS)
+#define MIME_EXT_MAX 8                     //扩展名最长8个字符，正好放进一个64位的键
+#define MIME_HEADER(type) "Content-Type:" type "\r\n"
+#define MIME_TYPE(ext, type) {ext, type, MIME_HEADER(type), sizeof(MIME_HEADER(type)) - 1}
+
+struct mime_type{
+    const char *ext;                        //小写扩展名，不含.
+    const char *type;
+    const char *header;                     //"Content-Type:类型\r\n"
+    int header_len;
+};
+
+//第0项为未知扩展名的默认类型
+inline constexpr mime_type mime_types[] = {
+    MIME_TYPE("", "application/octet-stream"),
+    MIME_TYPE("html", "text/html; charset=utf-8"),
+    MIME_TYPE("htm", "text/html; charset=utf-8"),
+    MIME_TYPE("css", "text/css; charset=utf-8"),
+    MIME_TYPE("js", "text/javascript; charset=utf-8"),
+    MIME_TYPE("mjs", "text/javascript; charset=utf-8"),
+    MIME_TYPE("txt", "text/plain; charset=utf-8"),
+    MIME_TYPE("csv", "text/csv; charset=utf-8"),
+    MIME_TYPE("xml", "application/xml; charset=utf-8"),
+    MIME_TYPE("json", "application/json"),
+    MIME_TYPE("map", "application/json"),
+    MIME_TYPE("wasm", "application/wasm"),
+    MIME_TYPE("pdf", "application/pdf"),
+    MIME_TYPE("svg", "image/svg+xml; charset=utf-8"),
+    MIME_TYPE("jpg", "image/jpeg"),
+    MIME_TYPE("jpeg", "image/jpeg"),
+    MIME_TYPE("png", "image/png"),
+    MIME_TYPE("gif", "image/gif"),
+    MIME_TYPE("webp", "image/webp"),
+    MIME_TYPE("avif", "image/avif"),
+    MIME_TYPE("ico", "image/x-icon"),
+    MIME_TYPE("mp4", "video/mp4"),
+    MIME_TYPE("webm", "video/webm"),
+    MIME_TYPE("mp3", "audio/mpeg"),
+    MIME_TYPE("woff", "font/woff"),
+    MIME_TYPE("woff2", "font/woff2"),
+};
+#define MIME_TYPE_COUNT (int)(sizeof(mime_types) / sizeof(mime_types[0]))
+
+//扩展名的键：逐字节转小写后按小端拼成64位整数，空或超过MIME_EXT_MAX时为0，0不在表中
+//|0x20把大写字母转成小写，数字不变
+constexpr unsigned long long mime_key(const char *ext, int len)
+{
+    if (len <= 0 || len > MIME_EXT_MAX)
+        return 0;
+    unsigned long long key = 0;
+    for (int i = 0; i < len; i++)
+        key |= (unsigned long long)((unsigned char)ext[i] | 0x20) << (8 * i);
+    return key;
+}
+
+constexpr int mime_strlen(const char *s)
+{
+    int n = 0;
+    while (s[n])
+        n++;
+    return n;
+}
+
+//乘法哈希的完美哈希表，乘数在编译期逐个尝试，直到所有扩展名落在不同的槽
+struct mime_table{
+    struct slot{
+        unsigned long long key = 0;         //0表示空槽
+        int index = 0;                      //在mime_types中的下标
+    };
+    slot slots[MIME_TABLE_SIZE];
+    unsigned long long mult;                //找不到时为0，由static_assert报错
+
+    static constexpr unsigned int slot_of(unsigned long long key, unsigned long long mult)
+    {
+        return (key * mult) >> (64 - MIME_TABLE_BITS);
+    }
+
+    constexpr mime_table() : slots(), mult(0)
+    {
+        unsigned long long m = 0x9e3779b97f4a7c15ULL;
+        for (int tries = 0; tries < 4096; tries++, m += 0x5851f42d4c957f2eULL)
+        {
+            bool used[MIME_TABLE_SIZE] = {};
+            bool ok = true;
+            for (int i = 1; i < MIME_TYPE_COUNT && ok; i++)
+            {
+                unsigned int s = slot_of(mime_key(mime_types[i].ext, mime_strlen(mime_types[i].ext)), m | 1);
+                ok = !used[s];
+                used[s] = true;
+            }
+            if (!ok)
+                continue;
+            mult = m | 1;
+            for (int i = 1; i < MIME_TYPE_COUNT; i++)
+            {
+                unsigned long long key = mime_key(mime_types[i].ext, mime_strlen(mime_types[i].ext));
+                slots[slot_of(key, mult)] = slot{key, i};
+            }
+            return;
+        }
+    }
+};
+
+inline constexpr mime_table mime_index;
+static_assert(mime_index.mult != 0, "no collision-free multiplier for the MIME table, raise MIME_TABLE_BITS");
+
+class mime{
+public:
+    //按扩展名查找；槽中的键不同时下标与上全0的掩码，落到第0项，不用分支
+    static constexpr const mime_type &by_ext(const char *ext, int len)
+    {
+        unsigned long long key = mime_key(ext, len);
+        const mime_table::slot &s = mime_index.slots[mime_table::slot_of(key, mime_index.mult)];
+        return mime_types[s.index & -(int)(s.key == key)];
+    }
+
+    //path中最后一个/之后的最后一个.为扩展名，没有扩展名时为默认类型
+    static const mime_type &of(const char *path)
+    {
+        const char *name = strrchr(path, '/');
+        const char *dot = strrchr(name ? name : path, '.');
+        return dot ? by_ext(dot + 1, strlen(dot + 1)) : mime_types[0];
+    }
+};
+
+static_assert(mime::by_ext("html", 4).header_len == sizeof(MIME_HEADER("text/html; charset=utf-8")) - 1, "");
+static_assert(mime::by_ext("JPG", 3).header == mime_types[14].header, "");
+static_assert(mime::by_ext("exe", 3).header == mime_types[0].header, "");
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef COMPLETION_QUEUE_H
+#define COMPLETION_QUEUE_H
+
+#include <atomic>
+#include <exception>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+//工作线程到主线程(reactor)的完成队列，多生产者单消费者，无锁
+//工作线程处理完请求后把连接放入队列，主线程直接尝试写出响应，写不完再注册EPOLLOUT
+//省去工作线程中的epoll_ctl以及一次epoll_wait往返
+//
+//队列是侵入式的Treiber栈，T需要有成员T *m_cq_next
+//同一个连接在EPOLLONESHOT下同时只会被一个线程处理，不会重复入队
+//只有栈由空变为非空时才写eventfd，一批完成事件只唤醒主线程一次
+template <typename T>
+class completion_queue{
+	private:
+		std::atomic<T *> m_head;   //栈顶
+		int m_eventfd;             //通知主线程有完成事件
+
+	public:
+		completion_queue() : m_head(NULL){
+			m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if(m_eventfd < 0)
+				throw std::exception();
+		}
+		~completion_queue(){
+			close(m_eventfd);
+		}
+		
+		//注册到epoll中的文件描述符
+		int get_fd(){ return m_eventfd; }
+		
+		//工作线程调用
+		void push(T *item){
+			T *head = m_head.load(std::memory_order_relaxed);
+			do {
+				item->m_cq_next = head;
+			} while(!m_head.compare_exchange_weak(head, item, std::memory_order_release, std::memory_order_relaxed));
+			
+			//之前为空，说明主线程已经取走了上一批，需要重新唤醒
+			if(head == NULL){
+				uint64_t one = 1;
+				ssize_t ret = write(m_eventfd, &one, sizeof(one));
+				(void)ret;
+			}
+		}
+		
+		//主线程调用，取出全部完成事件，按入队顺序返回链表
+		//必须先清空eventfd再取栈，否则在两步之间入队的事件不会再触发通知
+		T *pop_all(){
+			uint64_t cnt;
+			ssize_t ret = read(m_eventfd, &cnt, sizeof(cnt));
+			(void)ret;
+			return take_all();
+		}
+		
+		//eventfd已由调用者读过(如io_uring引擎提交的read已完成)，直接取栈
+		T *take_all(){
+			T *head = m_head.exchange(NULL, std::memory_order_acquire);
+			
+			//栈是后进先出，反转成先进先出
+			T *list = NULL;
+			while(head){
+				T *next = head->m_cq_next;
+				head->m_cq_next = list;
+				list = head;
+				head = next;
+			}
+			return list;
+		}
+};
+
+#endif
@@ -2,46 +2,160 @@
 #define THREADPOOL_H
 
 #include <list>
+#include <atomic>
 #include <cstdio>
 #include <exception>
 #include <pthread.h>
+#include <time.h>
+#include <string.h>
 #include "locker.h"
 #include "sql_connection_pool.h"
+#include "metrics.h"
+#include "affinity.h"
+
+//单调时钟，单位微秒，用于计算任务在队列中的等待时间
+static inline long long pool_now_us(){
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
 template <typename T>
 class threadpool{                     //线程池类
+	public:
+		//排队时延直方图的桶数，第i个桶统计[2^i, 2^(i+1))微秒的时延，最后一个桶包含更大的值
+		static const int DELAY_BUCKETS = 24;
+		//最多支持的队列(lane)数，不同类别的请求进入不同队列，互不阻塞
+		static const int MAX_LANES = 4;
+
+		//单个队列的统计信息
+		struct lane_stat{
+			int depth;                   //排队任务数
+			int inflight;                //正在处理的任务数
+			unsigned long long enqueued;   //累计入队数
+			unsigned long long completed;  //累计处理完成数
+			unsigned long long rejected;   //队列已满被拒绝数
+			unsigned long long expired;    //排队超时被快速失败数
+			bool lifo;                   //当前是否为LIFO出队
+		};
+
+	private:
+		//请求队列中的任务，记录入队时间
+		struct work_item{
+			T* request;
+			long long enqueue_us;
+			bool read;                   //reactor模式下已由工作线程读出请求，改投到其他队列
+		};
+		
+		//每个队列有独立的权重和并发上限，工作线程按平滑加权轮询在队列间选择任务
+		//并发上限保证昂贵的请求(如数据库)不会占满所有工作线程
+		struct lane{
+			std::list<work_item> queue;
+			int weight;                  //权重
+			int max_inflight;            //最多同时占用的工作线程数
+			int inflight;
+			int current_weight;          //平滑加权轮询的当前权重
+			long long first_above_us;    //排队时延持续超过目标值时，允许切换LIFO的时刻，0表示未超过
+			bool lifo;
+			unsigned long long delay_hist[DELAY_BUCKETS];   //排队时延直方图
+			unsigned long long enqueued;
+			unsigned long long completed;
+			unsigned long long rejected;
+			unsigned long long expired;
+		};
+
 	private:
 		int m_thread_number;   //线程池中的线程数
-		int m_max_requests;     //请求队列中允许的最大请求数
+		int m_max_requests;     //请求队列中允许的最大请求数，所有队列合计
+		int m_overload_depth;   //队列深度超过该值视为过载
+		long long m_overload_age_us;   //队首任务等待时间超过该值视为过载
 		pthread_t* m_threads;  //描述线程池的数组，大小为m_thread_number
-		std::list<T *> m_workqueue;  //请求队列
+		lane m_lanes[MAX_LANES];     //请求队列
+		//主线程不加锁读取以下两个值，只在持有队列锁时写入，读到的是近似值即可
+		std::atomic<int> m_queue_depth;            //所有队列的总深度
+		std::atomic<long long> m_oldest_enqueue_us;  //各队首任务中最早的入队时间，队列为空时为0
+		
+		//排队时延控制，参考CoDel：排队时延持续超过目标值一个观察周期后改为LIFO出队
+		//优先处理新请求，已经等待很久的请求大概率客户端已放弃，超过截止时间则直接快速失败
+		long long m_task_deadline_us;   //任务截止时间，排队超过该值不再处理，0表示不限制
+		long long m_codel_target_us;    //排队时延目标值
+		long long m_codel_interval_us;  //观察周期
+		
 		locker m_queuelocker;   //保护请求队列的互斥锁
-		sem m_queuestat;          //是否有任务需要处理
+		cond m_queuecond;         //有可以处理的任务，或有任务处理完成释放了并发额度
 		bool m_stop;                  //是否结束线程
+		int m_actor_model;            //并发模型，0为proactor，1为reactor
 		connection_pool* m_connPool;      //数据库连接池
 
 	private:
 		//工作线程运行的函数，不断从工作队列中取出任务并执行
 		static void* worker(void* arg);    //线程处理函数
 		void run();
+		//选出下一个要服务的队列，没有可服务的队列返回-1，调用时已持有队列锁
+		int pick_lane();
+		//出队时调用，记录取出任务的排队时延，按队列中最早任务的等待时间更新LIFO状态，调用时已持有队列锁
+		void on_dequeue(lane &l, long long delay_us, long long now_us);
+		//更新总深度和最早入队时间，调用时已持有队列锁
+		void update_depth();
+		//reactor模式下读到请求后发现类别与所在队列不同，改投到lane_id，归还from的并发额度
+		//任务继续持有分发时取得的连接引用，不受队列上限限制，总是成功
+		void reroute(lane &from, T* request, int lane_id);
 
 	public:
 		//connPool是数据库连接池指针，thread_number是线程池中线程的数量，max_requests是请求队列中最多允许的、等待的数量
-		threadpool(connection_pool* connPool, int thread_number = 8, int max_requests = 10000);
+		//overload_depth和overload_age_ms是过载阈值，队列深度或队首等待时间超过阈值时拒绝新请求
+		threadpool(connection_pool* connPool, int thread_number = 8, int max_requests = 10000, \
+				int overload_depth = 5000, int overload_age_ms = 500);
 		~threadpool();
-		bool append(T* request);     //往请求队列添加任务
+		bool append(T* request, int lane = 0);     //往指定队列添加任务，队列已满返回false
+		
+		//准入控制，主线程在分发任务和accept之前检查，无需加锁
+		bool overloaded();
+		int queue_depth(){ return m_queue_depth.load(std::memory_order_relaxed); }
+		long long queue_age_us();    //队首任务已等待的时间
+		
+		//设置队列的权重和并发上限，默认权重为1，并发上限为线程数
+		void set_lane(int lane, int weight, int max_inflight);
+		//设置排队截止时间和CoDel参数，单位ms，task_deadline_ms为0表示不丢弃超时任务
+		void set_queue_policy(int task_deadline_ms, int codel_target_ms, int codel_interval_ms);
+		//排队时延统计，lane为-1时合计所有队列
+		void queue_delay_histogram(unsigned long long* buckets, int lane = -1);
+		long long queue_delay_percentile(double p, int lane = -1);   //返回对应桶的上界，单位微秒
+		void get_lane_stat(int lane, lane_stat* stat);
+		//reactor模式下工作线程还要负责读和写
+		void set_actor_model(int actor_model){ m_actor_model = actor_model; }
+		//第i个工作线程绑定到cpus中的第i个(取模)CPU，每个线程固定在一个核上，私有缓存和所在NUMA节点不变
+		//cpus为空时不绑定，任一线程绑定失败返回false
+		bool set_cpus(const cpu_set_t *cpus);
 };
 
 //线程池的创建与回收
 template <typename T>
 threadpool<T>::threadpool(connection_pool* connPool, \
-			int thread_number, int max_requests \
+			int thread_number, int max_requests, \
+			int overload_depth, int overload_age_ms \
 			) : m_thread_number(thread_number), \
-			m_max_requests(max_requests), m_stop(false), \
-			m_threads(NULL), m_connPool(connPool){   //初始化列表，冒号后面的相当于赋值，例如其中一个m_stop=false
+			m_max_requests(max_requests), \
+			m_overload_depth(overload_depth), m_overload_age_us(overload_age_ms * 1000LL), \
+			m_threads(NULL), \
+			m_queue_depth(0), m_oldest_enqueue_us(0), \
+			m_task_deadline_us(0), m_codel_target_us(5000), m_codel_interval_us(100000), \
+			m_stop(false), m_actor_model(0), m_connPool(connPool){   //初始化列表，冒号后面的相当于赋值，例如其中一个m_stop=false
 			
 			if(thread_number <= 0 || max_requests <= 0)
 				throw std::exception();
+			
+			for(int i = 0; i < MAX_LANES; i++){
+				lane &l = m_lanes[i];
+				l.weight = 1;
+				l.max_inflight = thread_number;
+				l.inflight = 0;
+				l.current_weight = 0;
+				l.first_above_us = 0;
+				l.lifo = false;
+				memset(l.delay_hist, 0, sizeof(l.delay_hist));
+				l.enqueued = l.completed = l.rejected = l.expired = 0;
+			}
 				
 			//线程id初始化
 			m_threads = new pthread_t [m_thread_number];
@@ -64,33 +178,227 @@ threadpool<T>::threadpool(connection_pool* connPool, \
 
 }
 
+template <typename T>
+bool threadpool<T>::set_cpus(const cpu_set_t *cpus){
+	if(CPU_COUNT(cpus) == 0)
+		return true;
+	bool ok = true;
+	for(int i = 0; i < m_thread_number; i++)
+		ok = affinity::pin_cpu(m_threads[i], affinity::nth(cpus, i)) && ok;
+	return ok;
+}
+
 //线程池类的析构函数
 template <typename T>
 threadpool<T>::~threadpool(){
 	delete[] m_threads;        //删除线程的数组
 	m_stop = true;               //结束线程
+	m_queuecond.broadcast();
 }
 
-//向请求队列中添加任务，通过互斥锁保证线程安全，添加完成后通过信号量唤醒工作进程
+//向请求队列中添加任务，通过互斥锁保证线程安全，添加完成后通过条件变量唤醒工作进程
 template <typename T>
-bool threadpool<T>::append(T* request){
+bool threadpool<T>::append(T* request, int lane_id){
+	if(lane_id < 0 || lane_id >= MAX_LANES)
+		lane_id = 0;
+	lane &l = m_lanes[lane_id];
+	
 	m_queuelocker.lock();     //上锁
 	
 	//根据服务器硬件，预先设置请求队列最大值
-	if(m_workqueue.size() >= m_max_requests){
+	if(m_queue_depth.load(std::memory_order_relaxed) >= m_max_requests){
+		l.rejected++;
 		m_queuelocker.unlock();
 		return false;
 	}
 	
-	//添加任务
-	m_workqueue.push_back(request);
+	//添加任务，记录入队时间
+	work_item item;
+	item.request = request;
+	item.enqueue_us = pool_now_us();
+	item.read = false;
+	l.queue.push_back(item);
+	l.enqueued++;
+	update_depth();
 	m_queuelocker.unlock();
 	
-	//通过信号量提醒有任务要处理
-	m_queuestat.post();
+	//通过条件变量提醒有任务要处理
+	m_queuecond.signal();
 	return true;
 }
 
+template <typename T>
+void threadpool<T>::reroute(lane &from, T* request, int lane_id){
+	lane &l = m_lanes[lane_id];
+	work_item item;
+	item.request = request;
+	item.enqueue_us = pool_now_us();
+	item.read = true;
+	
+	//读取这一步在原队列中完成，计入其完成数，各队列的入队数仍等于完成、排队和处理中之和
+	m_queuelocker.lock();
+	from.inflight--;
+	from.completed++;
+	l.queue.push_back(item);
+	l.enqueued++;
+	update_depth();
+	m_queuelocker.unlock();
+	
+	//既有新任务又归还了并发额度，可能有两个线程可以继续
+	m_queuecond.broadcast();
+}
+
+template <typename T>
+void threadpool<T>::update_depth(){
+	int depth = 0;
+	long long oldest = 0;
+	for(int i = 0; i < MAX_LANES; i++){
+		lane &l = m_lanes[i];
+		if(l.queue.empty())
+			continue;
+		depth += l.queue.size();
+		if(oldest == 0 || l.queue.front().enqueue_us < oldest)
+			oldest = l.queue.front().enqueue_us;
+	}
+	m_queue_depth.store(depth, std::memory_order_relaxed);
+	m_oldest_enqueue_us.store(oldest, std::memory_order_relaxed);
+}
+
+//队首任务已等待的时间，队列为空时为0
+template <typename T>
+long long threadpool<T>::queue_age_us(){
+	long long oldest = m_oldest_enqueue_us.load(std::memory_order_relaxed);
+	if(oldest == 0)
+		return 0;
+	return pool_now_us() - oldest;
+}
+
+//队列深度或排队时间超过阈值即认为过载，由主线程调用，读到的是近似值即可
+template <typename T>
+bool threadpool<T>::overloaded(){
+	if(queue_depth() >= m_overload_depth)
+		return true;
+	return queue_age_us() >= m_overload_age_us;
+}
+
+template <typename T>
+void threadpool<T>::set_lane(int lane_id, int weight, int max_inflight){
+	if(lane_id < 0 || lane_id >= MAX_LANES || weight <= 0 || max_inflight <= 0)
+		return;
+	m_queuelocker.lock();
+	m_lanes[lane_id].weight = weight;
+	m_lanes[lane_id].max_inflight = max_inflight;
+	m_queuelocker.unlock();
+}
+
+template <typename T>
+void threadpool<T>::set_queue_policy(int task_deadline_ms, int codel_target_ms, int codel_interval_ms){
+	m_queuelocker.lock();
+	m_task_deadline_us = task_deadline_ms * 1000LL;
+	m_codel_target_us = codel_target_ms * 1000LL;
+	m_codel_interval_us = codel_interval_ms * 1000LL;
+	m_queuelocker.unlock();
+}
+
+//平滑加权轮询(与nginx upstream相同)，只在有任务且未达到并发上限的队列中选择
+template <typename T>
+int threadpool<T>::pick_lane(){
+	int best = -1;
+	int total = 0;
+	for(int i = 0; i < MAX_LANES; i++){
+		lane &l = m_lanes[i];
+		if(l.queue.empty() || l.inflight >= l.max_inflight)
+			continue;
+		l.current_weight += l.weight;
+		total += l.weight;
+		if(best < 0 || l.current_weight > m_lanes[best].current_weight)
+			best = i;
+	}
+	if(best >= 0)
+		m_lanes[best].current_weight -= total;
+	return best;
+}
+
+template <typename T>
+void threadpool<T>::on_dequeue(lane &l, long long delay_us, long long now_us){
+	//按2的幂分桶
+	int bucket = 0;
+	for(long long d = delay_us; d > 1 && bucket < DELAY_BUCKETS - 1; d >>= 1)
+		bucket++;
+	l.delay_hist[bucket]++;
+	
+	//状态按队首(最早入队)任务已等待的时间判断，而不是刚取出的任务
+	//LIFO时取出的是最新的任务，其时延总是低于目标值，用它判断会在下一次出队时就退回FIFO
+	long long standing_us = l.queue.empty() ? 0 : now_us - l.queue.front().enqueue_us;
+	
+	//最早的任务等待时间低于目标值或队列已空，说明积压已消除，恢复FIFO
+	if(standing_us < m_codel_target_us){
+		l.first_above_us = 0;
+		l.lifo = false;
+		return;
+	}
+	
+	//第一次超过目标值，开始一个观察周期
+	if(l.first_above_us == 0){
+		l.first_above_us = now_us + m_codel_interval_us;
+		return;
+	}
+	
+	//整个观察周期内时延都高于目标值，切换为LIFO
+	if(now_us >= l.first_above_us)
+		l.lifo = true;
+}
+
+template <typename T>
+void threadpool<T>::queue_delay_histogram(unsigned long long* buckets, int lane_id){
+	memset(buckets, 0, sizeof(unsigned long long) * DELAY_BUCKETS);
+	m_queuelocker.lock();
+	for(int i = 0; i < MAX_LANES; i++){
+		if(lane_id >= 0 && lane_id != i)
+			continue;
+		for(int j = 0; j < DELAY_BUCKETS; j++)
+			buckets[j] += m_lanes[i].delay_hist[j];
+	}
+	m_queuelocker.unlock();
+}
+
+template <typename T>
+long long threadpool<T>::queue_delay_percentile(double p, int lane_id){
+	unsigned long long buckets[DELAY_BUCKETS];
+	queue_delay_histogram(buckets, lane_id);
+	
+	unsigned long long total = 0;
+	for(int i = 0; i < DELAY_BUCKETS; i++)
+		total += buckets[i];
+	if(total == 0)
+		return 0;
+	
+	unsigned long long rank = (unsigned long long)(p * total);
+	unsigned long long seen = 0;
+	for(int i = 0; i < DELAY_BUCKETS; i++){
+		seen += buckets[i];
+		if(seen > rank)
+			return 1LL << (i + 1);
+	}
+	return 1LL << DELAY_BUCKETS;
+}
+
+template <typename T>
+void threadpool<T>::get_lane_stat(int lane_id, lane_stat* stat){
+	if(lane_id < 0 || lane_id >= MAX_LANES)
+		return;
+	m_queuelocker.lock();
+	lane &l = m_lanes[lane_id];
+	stat->depth = l.queue.size();
+	stat->inflight = l.inflight;
+	stat->enqueued = l.enqueued;
+	stat->completed = l.completed;
+	stat->rejected = l.rejected;
+	stat->expired = l.expired;
+	stat->lifo = l.lifo;
+	m_queuelocker.unlock();
+}
+
 //内部访问私有成员函数run。个人认为worker函数与run函数的配合是为了满足pthread_create函数的调用，最终是为了运行run函数
 template <typename T>
 void* threadpool<T>::worker(void* arg){
@@ -103,38 +411,107 @@ void* threadpool<T>::worker(void* arg){
 template <typename T>
 void threadpool<T>::run(){
 	while(!m_stop){
-		//等待信号量
-		m_queuestat.wait();
-		
-		//被唤醒后先加上互斥锁
+		//加上互斥锁，等待有可以处理的任务
 		m_queuelocker.lock();
-		if(m_workqueue.empty()){
+		int lane_id;
+		while(!m_stop && (lane_id = pick_lane()) < 0)
+			m_queuecond.wait(m_queuelocker.get());
+		if(m_stop){
 			m_queuelocker.unlock();
-			continue;
+			break;
+		}
+		lane &l = m_lanes[lane_id];
+		
+		//从选中的队列中取出一个任务，然后将任务从请求队列中删除
+		//正常情况下取队首(FIFO)，持续积压时取队尾(LIFO)，优先服务仍在等待的新请求
+		work_item item;
+		if(l.lifo){
+			item = l.queue.back();
+			l.queue.pop_back();
 		}
+		else {
+			item = l.queue.front();
+			l.queue.pop_front();
+		}
+		update_depth();
+		
+		long long now = pool_now_us();
+		long long delay = now - item.enqueue_us;
+		on_dequeue(l, delay, now);
+		metrics::record(STAGE_QUEUE_WAIT, delay * 1000);
 		
-		//从请求队列中取出第一个任务，然后将任务从请求队列中删除
-		T* request = m_workqueue.front();
-		m_workqueue.pop_front();
+		//排队超过截止时间，客户端很可能已经放弃，直接快速失败，不再占用数据库连接
+		bool expired = m_task_deadline_us > 0 && delay > m_task_deadline_us;
+		if(expired)
+			l.expired++;
+		else
+			l.inflight++;
 		m_queuelocker.unlock();
-		if(!request)continue;
 		
-		//从连接池中取出一个数据库连接
-		//request->mysql = m_connPool->GetConnection();
-		//将数据库连接放回连接池
-		//m_connPool->ReleaseConnection(request->mysql);
-
-		//以上两个关于数据库连接的获取与释放，由RAII机制处理
-		//负责自动获取和释放数据库连接
-		connectionRAII mysqlcon(&request->mysql, m_connPool);
+		T* request = item.request;
+		if(expired){
+			if(request){
+				request->process_busy();
+				request->done();
+			}
+			continue;
+		}
 		
-		//由http_conn类的process方法进行处理
-		request->process();
+		//reactor模式：主线程只分发就绪事件，读、解析和写都在工作线程中完成
+		if(request && m_actor_model == 1){
+			if(request->m_state == 0){
+				//read_once的结果直接返回，TLS握手或记录不完整时read_once已重新注册事件
+				//连接可能已交给另一个工作线程，不能再读取连接的状态来判断
+				int status = item.read ? T::READ_DATA : request->read_once();
+				//读不到数据或对方关闭连接
+				if(status == T::READ_CLOSED)
+					request->close_later();
+				else if(status == T::READ_DATA){
+					//主线程分发时还没有读到请求，都进入了静态文件的队列，按读到的请求行改投
+					//登录和注册由此受数据库队列的权重和并发上限约束
+					int real = item.read ? lane_id : request->classify();
+					if(real != lane_id && real >= 0 && real < MAX_LANES){
+						reroute(l, request, real);
+						continue;
+					}
+					long long db_start = metrics::now_ns();
+					connectionRAII mysqlcon(&request->mysql, m_connPool);
+					metrics::record(STAGE_DB_WAIT, metrics::now_ns() - db_start);
+					request->process();
+				}
+			}
+			else if(!request->write())
+				request->close_later();
+		}
+		else if(request){
+			//从连接池中取出一个数据库连接
+			//request->mysql = m_connPool->GetConnection();
+			//将数据库连接放回连接池
+			//m_connPool->ReleaseConnection(request->mysql);
+
+			//以上两个关于数据库连接的获取与释放，由RAII机制处理
+			//负责自动获取和释放数据库连接
+			long long db_start = metrics::now_ns();
+			connectionRAII mysqlcon(&request->mysql, m_connPool);
+			metrics::record(STAGE_DB_WAIT, metrics::now_ns() - db_start);
+			
+			//由http_conn类的process方法进行处理
+			request->process();
+		}
 		
+		//归还分发时取得的连接引用，之后不能再访问request
+		if(request)
+			request->done();
 		
+		//归还并发额度，该队列中被并发上限挡住的任务可以继续处理
+		m_queuelocker.lock();
+		l.inflight--;
+		l.completed++;
+		m_queuelocker.unlock();
+		m_queuecond.signal();
 	}
 }
 
 
 
-#endif
\ No newline at end of file
+#endif
@@ -3,6 +3,7 @@
 
 #include <time.h>
 #include "log.h"
+#include "clock_service.h"
 
 //连接资源结构体成员需要用到定时器类
 //需要前向声明
@@ -18,12 +19,23 @@ struct client_data{
 	
 	//定时器
 	util_timer *timer;
+	
+	//以下由主线程维护，用于计算连接的超时时间，为0表示不在该阶段
+	//时间均为clock_service::mono()的单调时钟秒数，不受系统时间调整影响
+	time_t last_active;     //最近一次读写的时间
+	time_t request_start;   //当前请求第一个数据到达的时间
+	time_t body_start;      //开始接收请求体的时间
+	time_t send_deadline;   //按最低发送速率计算的响应发送截止时间
 };
 
 //定时器类
+//超时时间expire可以随时修改而不调整链表，链表按加入时的超时时间queued排序
+//queued到期时再检查expire，未到期则按新的expire重新插入
+//这样每次读写只需修改expire，每个连接每个超时周期最多移动一次
 class util_timer{
 	public:
-	  time_t expire;   //超时时间
+	  time_t expire;   //超时时间(单调时钟)
+	  time_t queued;   //在链表中排序使用的超时时间
 	  void (*cb_func)(client_data*);  //回调函数
 	  client_data *user_data;     //连接资源
 	  util_timer *prev;     //前向定时器
@@ -41,32 +53,37 @@ class sort_timer_lst{
 	  util_timer *tail;
 	
 	private:
-	  //私有成员，被公有成员add_timer和adjust_tiemr调用
-	  //主要用于调整链表内部节点
-	  void add_timer(util_timer *timer, util_timer *lst_head){
-	  	util_timer *prev = lst_head;
-	  	util_timer *tmp = prev->next;
+	  //按queued插入链表，新定时器的超时时间通常最晚，从尾部向前查找
+	  void insert(util_timer *timer){
+	  	timer->queued = timer->expire;
+	  	util_timer *tmp = tail;
+	  	while(tmp && timer->queued < tmp->queued)
+	  		tmp = tmp->prev;
 	  	
-	  	//遍历当前结点之后的链表，按照超时时间找到目标定时器对应的位置，常规双向链表插入操作
-	  	while(tmp){
-              if( timer->expire < tmp->expire ){
-                prev->next = timer;
-                timer->next = tmp;
-                tmp->prev = timer;
-                timer->prev = prev;
-                break;
-            	  }
-            	prev = tmp;
-            	tmp = tmp->next;
-        	}
-
-        	//遍历完发现，目标定时器需要放到尾结点处
-        	if(!tmp){
-        	    prev->next = timer;
-        	    timer->prev = prev;
-        	    timer->next = NULL;
-        	    tail = timer;
-      	  	}
+	  	//插入到tmp之后，tmp为NULL时插入到头部
+	  	timer->prev = tmp;
+	  	timer->next = tmp ? tmp->next : head;
+	  	if(timer->next)
+	  		timer->next->prev = timer;
+	  	else
+	  		tail = timer;
+	  	if(tmp)
+	  		tmp->next = timer;
+	  	else
+	  		head = timer;
+	  }
+	  
+	  //从链表中取下定时器，不释放
+	  void unlink(util_timer *timer){
+	  	if(timer->prev)
+	  		timer->prev->next = timer->next;
+	  	else
+	  		head = timer->next;
+	  	if(timer->next)
+	  		timer->next->prev = timer->prev;
+	  	else
+	  		tail = timer->prev;
+	  	timer->prev = timer->next = NULL;
 	  }
 	
 	public:
@@ -80,53 +97,22 @@ class sort_timer_lst{
 	  	}
 	  }
 	  
-	  //添加定时器，内部调用私有成员add_timer
+	  //添加定时器
 	  void add_timer(util_timer *timer){
 	  	if(!timer)return;
-	  	if(!head){
-	  		head = tail = timer;
-	  		return;
-	  	}
-	  	
-	  	//如果新的定时器超时时间小于当前头部结点
-	  	//直接将当前定时器结点作为头部结点
-	  	if(timer->expire < head->expire){
-	  		timer->next = head;
-	  		head->prev = timer;
-	  		head = timer;
-	  		return;
-	  	}
-	  	
-	  	//否则调用私有成员，调整内部结点
-	  	add_timer(timer, head);
+	  	insert(timer);
 	  }
 	  
-	  //调整定时器，任务发生变化时，调整定时器在链表中的位置
+	  //调整定时器，调用前已修改expire
+	  //超时时间推后时不移动，由tick处理；提前时才需要重新插入
 	  void adjust_timer(util_timer *timer){
 	  	if(!timer)return;
 	  	
-	  	util_timer *tmp = timer->next;
-	  	
-	  	//被调整的定时器在链表尾部
-	  	//定时器超时值仍然小于下一个定时器超时值，不调整
-	  	if(!tmp || (timer->expire < tmp->expire))
+	  	if(timer->expire >= timer->queued)
 	  		return;
-	  	
-	  	//被调整定时器是链表头结点，将定时器取出，重新插入
-	  	if(timer == head){
-	  		head = head->next;
-	  		head->prev = NULL;
-	  		timer->next = NULL;
-	  		add_timer(timer, head);
-	  	}
-	  	
-	  	//被调整定时器在内部，将定时器取出，重新插入
-	  	else {
-	  		timer->prev->next = timer->next;
-	  		timer->next->prev = timer->prev;
-	  		add_timer(timer, timer->next);
-	  	}	
-	  }	  
+	  	unlink(timer);
+	  	insert(timer);
+	  }
 	  
 	  //删除定时器
 	  void del_timer(util_timer *timer){
@@ -167,34 +153,59 @@ class sort_timer_lst{
         timer->next->prev = timer->prev;
         delete timer;
       }
+	  
+	  //依次对链表中的每个定时器调用func，func可以删除传入的定时器，返回func返回true的次数
+	  //链表中只有存活的连接，代价与连接数成正比，与描述符的范围无关
+	  int sweep(bool (*func)(util_timer *)){
+	  	int count = 0;
+	  	util_timer *tmp = head;
+	  	while(tmp){
+	  		util_timer *next = tmp->next;
+	  		if(func(tmp))
+	  			count++;
+	  		tmp = next;
+	  	}
+	  	return count;
+	  }
 
-	  //定时任务处理函数
-	  void tick(){
+	  //定时任务处理函数，返回超时关闭的连接数
+	  int tick(){
+        int expired = 0;
         if (!head)
         {
-            return;
+            return expired;
         }
 
         //printf( "timer tick\n" );
         LOG_INFO("%s", "timer tick");
         Log::get_instance()->flush();
 		
-		//获取当前时间
-        time_t cur = time(NULL);
+		//获取当前时间，与设置expire时一样取时钟服务的单调时间
+        time_t cur = clock_service::mono();
         util_timer *tmp = head;
 
 		//遍历定时器链表
         while (tmp)
         {
 			//链表容器为升序排列
-            //当前时间小于定时器的超时时间，后面的定时器也没有到期
-            if (cur < tmp->expire)
+            //当前时间小于定时器的排序时间，后面的定时器也没有到期
+            if (cur < tmp->queued)
             {
                 break;
             }
 
+            //超时时间已被推后，按新的超时时间重新插入
+            if (cur < tmp->expire)
+            {
+                unlink(tmp);
+                insert(tmp);
+                tmp = head;
+                continue;
+            }
+
 			//当前定时器到期，则调用回调函数，执行定时事件
             tmp->cb_func(tmp->user_data);
+            expired++;
 
 			//将处理后的定时器从链表容器中删除，并重置头结点
             head = tmp->next;
@@ -205,6 +216,7 @@ class sort_timer_lst{
             delete tmp;
             tmp = head;
         }
+        return expired;
       }
 };
 
@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
+#include "tls.h"
+#include "metrics.h"
+#include "clock_service.h"
+
+SSL_CTX *tls_context::s_ctx = NULL;
+
+//==========会话缓存==========
+//会话ID由服务器随机生成，直接取前8字节作哈希值
+//每个分片是一个小的开放寻址表，插入时在探测范围内替换空槽、过期槽或最早过期的槽
+struct tls_cache_slot
+{
+    unsigned char id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned int id_len;                    //0表示空槽
+    int len;                                //der中序列化的会话长度
+    time_t expire;                          //墙上时间，多个进程一致
+    unsigned char der[TLS_SESSION_MAX];
+};
+
+//锁是进程间共享的健壮锁，持有锁的worker崩溃后其他worker仍能取得
+struct tls_cache_shard
+{
+    pthread_mutex_t lock;
+    tls_cache_slot slots[TLS_CACHE_SLOTS];
+};
+
+static tls_cache_shard local_cache[TLS_CACHE_SHARDS];
+static tls_cache_shard *cache = local_cache;
+
+static bool init_locks(tls_cache_shard *shards)
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    bool ok = true;
+    for (int i = 0; i < TLS_CACHE_SHARDS && ok; i++)
+        ok = pthread_mutex_init(&shards[i].lock, &attr) == 0;
+    pthread_mutexattr_destroy(&attr);
+    return ok;
+}
+
+static unsigned long long session_hash(const unsigned char *id, unsigned int len)
+{
+    unsigned long long h = 0;
+    memcpy(&h, id, len < sizeof(h) ? len : sizeof(h));
+    return h;
+}
+
+static tls_cache_shard *lock_shard(unsigned long long hash)
+{
+    tls_cache_shard *shard = &cache[hash % TLS_CACHE_SHARDS];
+    //上一个持有者崩溃时分片中的槽可能只写了一半，清空后继续使用
+    if (pthread_mutex_lock(&shard->lock) == EOWNERDEAD)
+    {
+        memset(shard->slots, 0, sizeof(shard->slots));
+        pthread_mutex_consistent(&shard->lock);
+    }
+    return shard;
+}
+
+static tls_cache_slot *probe(tls_cache_shard *shard, unsigned long long hash, int i)
+{
+    return &shard->slots[(hash / TLS_CACHE_SHARDS + i) % TLS_CACHE_SLOTS];
+}
+
+static bool same_id(const tls_cache_slot *slot, const unsigned char *id, unsigned int len)
+{
+    return slot->id_len == len && memcmp(slot->id, id, len) == 0;
+}
+
+//新会话完成握手后调用，返回0表示没有保留对会话的引用
+static int new_session(SSL *, SSL_SESSION *sess)
+{
+    unsigned int id_len;
+    const unsigned char *id = SSL_SESSION_get_id(sess, &id_len);
+    int len = i2d_SSL_SESSION(sess, NULL);
+    if (id_len == 0 || len <= 0 || len > TLS_SESSION_MAX)
+        return 0;
+    //序列化在锁外完成
+    unsigned char der[TLS_SESSION_MAX];
+    unsigned char *p = der;
+    i2d_SSL_SESSION(sess, &p);
+    time_t now = clock_service::wall();
+    time_t expire = SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess);
+
+    unsigned long long hash = session_hash(id, id_len);
+    tls_cache_shard *shard = lock_shard(hash);
+    tls_cache_slot *victim = NULL;
+    for (int i = 0; i < TLS_CACHE_PROBE; i++)
+    {
+        tls_cache_slot *slot = probe(shard, hash, i);
+        if (slot->id_len == 0 || slot->expire <= now || same_id(slot, id, id_len))
+        {
+            victim = slot;
+            break;
+        }
+        if (!victim || slot->expire < victim->expire)
+            victim = slot;
+    }
+    memcpy(victim->id, id, id_len);
+    victim->id_len = id_len;
+    victim->len = len;
+    victim->expire = expire;
+    memcpy(victim->der, der, len);
+    pthread_mutex_unlock(&shard->lock);
+    return 0;
+}
+
+//客户端带会话ID时调用，返回的会话由OpenSSL释放
+static SSL_SESSION *get_session(SSL *, const unsigned char *id, int id_len, int *copy)
+{
+    *copy = 0;
+    if (id_len <= 0 || id_len > SSL_MAX_SSL_SESSION_ID_LENGTH)
+        return NULL;
+    unsigned char der[TLS_SESSION_MAX];
+    int len = 0;
+    time_t now = clock_service::wall();
+
+    unsigned long long hash = session_hash(id, id_len);
+    tls_cache_shard *shard = lock_shard(hash);
+    for (int i = 0; i < TLS_CACHE_PROBE; i++)
+    {
+        tls_cache_slot *slot = probe(shard, hash, i);
+        if (same_id(slot, id, id_len) && slot->expire > now)
+        {
+            len = slot->len;
+            memcpy(der, slot->der, len);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+
+    //反序列化在锁外完成
+    const unsigned char *p = der;
+    return len ? d2i_SSL_SESSION(NULL, &p, len) : NULL;
+}
+
+//会话过期或握手失败时调用
+static void remove_session(SSL_CTX *, SSL_SESSION *sess)
+{
+    unsigned int id_len;
+    const unsigned char *id = SSL_SESSION_get_id(sess, &id_len);
+    if (id_len == 0)
+        return;
+    unsigned long long hash = session_hash(id, id_len);
+    tls_cache_shard *shard = lock_shard(hash);
+    for (int i = 0; i < TLS_CACHE_PROBE; i++)
+    {
+        tls_cache_slot *slot = probe(shard, hash, i);
+        if (same_id(slot, id, id_len))
+            slot->id_len = 0;
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+//==========ticket密钥==========
+//每个时间段的密钥由主密钥派生：HMAC-SHA256(主密钥, 时间段编号 || 用途)
+//主密钥在fork前生成，各worker算出的密钥相同，一个worker发出的ticket可以在任一worker上解密，不需要共享内存
+//平滑升级后的新进程主密钥不同，旧ticket失效，客户端退回完整握手
+struct ticket_key
+{
+    long long epoch;
+    unsigned char name[16];
+    unsigned char aes[32];
+    unsigned char hmac[32];
+};
+
+static unsigned char ticket_secret[32];
+//派生的密钥按线程缓存当前和上一个时间段，轮换后每个线程只派生一次
+//__thread变量只能静态初始化，epoch为-1表示还没有派生
+static __thread ticket_key t_keys[2] = {{-1, {0}, {0}, {0}}, {-1, {0}, {0}, {0}}};
+
+static bool derive(long long epoch, unsigned char usage, unsigned char *out, size_t len)
+{
+    unsigned char data[9];
+    memcpy(data, &epoch, 8);
+    data[8] = usage;
+    unsigned char md[EVP_MAX_MD_SIZE];
+    size_t md_len = 0;
+    if (!EVP_Q_mac(NULL, "HMAC", NULL, "SHA256", NULL, ticket_secret, sizeof(ticket_secret),
+                   data, sizeof(data), md, sizeof(md), &md_len) || md_len < len)
+        return false;
+    memcpy(out, md, len);
+    return true;
+}
+
+static const ticket_key *key_for(long long epoch)
+{
+    ticket_key *k = &t_keys[epoch & 1];
+    if (k->epoch == epoch)
+        return k;
+    if (!derive(epoch, 'n', k->name, sizeof(k->name)) || !derive(epoch, 'a', k->aes, sizeof(k->aes)) ||
+        !derive(epoch, 'h', k->hmac, sizeof(k->hmac)))
+    {
+        k->epoch = -1;
+        return NULL;
+    }
+    k->epoch = epoch;
+    return k;
+}
+
+static bool use_key(const ticket_key *k, unsigned char *iv, EVP_CIPHER_CTX *cipher, EVP_MAC_CTX *mac, int enc)
+{
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, (void *)k->hmac, sizeof(k->hmac)),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0),
+        OSSL_PARAM_construct_end()};
+    if (!EVP_MAC_CTX_set_params(mac, params))
+        return false;
+    return EVP_CipherInit_ex(cipher, EVP_aes_256_cbc(), NULL, k->aes, iv, enc) == 1;
+}
+
+//加密时用当前时间段的密钥；解密时按密钥名找当前或上一个时间段，上一个时间段的返回2，OpenSSL据此换发新ticket
+static int ticket_key_cb(SSL *, unsigned char key_name[16], unsigned char *iv, EVP_CIPHER_CTX *cipher,
+                         EVP_MAC_CTX *mac, int enc)
+{
+    long long epoch = clock_service::wall() / TLS_TICKET_ROTATE;
+    if (enc)
+    {
+        const ticket_key *k = key_for(epoch);
+        if (!k || RAND_bytes(iv, EVP_CIPHER_get_iv_length(EVP_aes_256_cbc())) != 1)
+            return -1;
+        memcpy(key_name, k->name, sizeof(k->name));
+        return use_key(k, iv, cipher, mac, 1) ? 1 : -1;
+    }
+    for (int back = 0; back < 2; back++)
+    {
+        const ticket_key *k = key_for(epoch - back);
+        if (k && memcmp(key_name, k->name, sizeof(k->name)) == 0)
+            return use_key(k, iv, cipher, mac, 0) ? (back ? 2 : 1) : -1;
+    }
+    //密钥已轮换出去，按完整握手处理
+    return 0;
+}
+
+//==========ALPN==========
+//客户端提供h2时选择HTTP/2，之后的数据以连接前言开头，由http_conn按先知模式处理
+static int select_alpn(SSL *, const unsigned char **out, unsigned char *outlen, const unsigned char *in,
+                       unsigned int inlen, void *)
+{
+    static const unsigned char protos[] = "\x02h2\x08http/1.1";
+    if (SSL_select_next_proto((unsigned char **)out, outlen, protos, sizeof(protos) - 1, in, inlen) != OPENSSL_NPN_NEGOTIATED)
+        return SSL_TLSEXT_ERR_NOACK;
+    return SSL_TLSEXT_ERR_OK;
+}
+
+bool tls_context::init(const char *cert_file, const char *key_file)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+        return false;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    //重协商会让发送方向也需要等待读事件，禁用；对方不发close_notify直接关闭按正常关闭处理
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    //SSL_write写完一个记录就可以返回，与writev的部分写语义一致；reactor模式下重试可能在另一个线程的合并缓冲区中
+    //空闲的长连接不保留读写缓冲区
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+        SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(ctx) != 1 ||
+        RAND_bytes(ticket_secret, sizeof(ticket_secret)) != 1 ||
+        !init_locks(local_cache))
+    {
+        ERR_print_errors_fp(stderr);
+        SSL_CTX_free(ctx);
+        return false;
+    }
+
+    //会话只存放在外部缓存中，多个worker看到同一份
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"webserver", 9);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+    SSL_CTX_set_timeout(ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_sess_set_new_cb(ctx, new_session);
+    SSL_CTX_sess_set_get_cb(ctx, get_session);
+    SSL_CTX_sess_set_remove_cb(ctx, remove_session);
+
+    SSL_CTX_set_num_tickets(ctx, TLS_TICKETS);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, ticket_key_cb);
+    SSL_CTX_set_alpn_select_cb(ctx, select_alpn, NULL);
+
+    s_ctx = ctx;
+    return true;
+}
+
+bool tls_context::share()
+{
+    void *p = mmap(NULL, sizeof(local_cache), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return false;
+    if (!init_locks((tls_cache_shard *)p))
+    {
+        munmap(p, sizeof(local_cache));
+        return false;
+    }
+    cache = (tls_cache_shard *)p;
+    return true;
+}
+
+//==========连接==========
+tls_conn::tls_conn(int fd) : m_ssl(NULL), m_fd(fd), m_established(false), m_ktls(false)
+{
+    m_ssl = SSL_new(tls_context::ctx());
+    if (m_ssl && SSL_set_fd(m_ssl, fd) == 1)
+        SSL_set_accept_state(m_ssl);
+    else
+    {
+        SSL_free(m_ssl);
+        m_ssl = NULL;
+    }
+}
+
+tls_conn::~tls_conn()
+{
+    if (!m_ssl)
+        return;
+    //连接大多不发close_notify就关闭，标记为已关闭，否则OpenSSL会把会话从缓存中删除
+    SSL_set_shutdown(m_ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+    SSL_free(m_ssl);
+}
+
+int tls_conn::status(int ret)
+{
+    int err = SSL_get_error(m_ssl, ret);
+    ERR_clear_error();
+    switch (err)
+    {
+    case SSL_ERROR_WANT_READ:
+        return TLS_WANT_READ;
+    case SSL_ERROR_WANT_WRITE:
+        return TLS_WANT_WRITE;
+    case SSL_ERROR_ZERO_RETURN:
+        return TLS_CLOSED;
+    default:
+        return TLS_ERROR;
+    }
+}
+
+int tls_conn::handshake()
+{
+    if (!m_ssl)
+        return TLS_ERROR;
+    int ret = SSL_do_handshake(m_ssl);
+    if (ret != 1)
+    {
+        ret = status(ret);
+        if (ret == TLS_ERROR)
+            metrics::add(COUNTER_TLS_FAILED);
+        return ret;
+    }
+    m_established = true;
+    metrics::add(SSL_session_reused(m_ssl) ? COUNTER_TLS_RESUMED : COUNTER_TLS_FULL);
+    //OpenSSL在握手完成时已按协商的密码套件尝试配置内核，这里只查询结果
+    m_ktls = BIO_get_ktls_send(SSL_get_wbio(m_ssl));
+    if (m_ktls)
+        metrics::add(COUNTER_TLS_KTLS);
+    return 1;
+}
+
+int tls_conn::read(char *buf, int len)
+{
+    if (!m_established)
+    {
+        int ret = handshake();
+        if (ret != 1)
+            return ret;
+    }
+    size_t n = 0;
+    if (SSL_read_ex(m_ssl, buf, len, &n) == 1)
+        return n;
+    return status(0);
+}
+
+ssize_t tls_conn::writev(const struct iovec *iov, int count)
+{
+    //内核加密，与明文连接相同，发送不完时内核返回EAGAIN
+    if (m_ktls)
+        return ::writev(m_fd, iov, count);
+
+    //跳过已发送完的片段
+    while (count > 0 && iov->iov_len == 0)
+    {
+        iov++;
+        count--;
+    }
+    if (count == 0)
+        return 0;
+
+    //第一个片段不足一个记录时把之后的片段合并进来，响应头和小文件在同一个记录、同一次send中发出
+    //上次返回EAGAIN后重试时iovec没有变化，合并出的数据相同，满足OpenSSL重试时数据不变的要求
+    static __thread char gather[TLS_RECORD_SIZE];
+    const char *data = (const char *)iov[0].iov_base;
+    size_t len = iov[0].iov_len;
+    if (len < TLS_RECORD_SIZE && count > 1)
+    {
+        len = 0;
+        for (int i = 0; i < count && len < TLS_RECORD_SIZE; i++)
+        {
+            size_t n = iov[i].iov_len < TLS_RECORD_SIZE - len ? iov[i].iov_len : TLS_RECORD_SIZE - len;
+            memcpy(gather + len, iov[i].iov_base, n);
+            len += n;
+        }
+        data = gather;
+    }
+    else if (len > TLS_RECORD_SIZE)
+        len = TLS_RECORD_SIZE;
+
+    size_t written = 0;
+    if (m_ssl && SSL_write_ex(m_ssl, data, len, &written) == 1)
+        return written;
+    int ret = m_ssl ? status(0) : TLS_ERROR;
+    errno = (ret == TLS_WANT_READ || ret == TLS_WANT_WRITE) ? EAGAIN : EIO;
+    return -1;
+}
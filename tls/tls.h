@@ -0,0 +1,74 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <openssl/ssl.h>
+
+//TLS终结：启用后监听socket上的所有连接都走TLS，不再需要前置的TLS代理
+//握手完成后尝试把发送方向的记录加密交给内核(kTLS)，之后响应直接writev到socket，缓存、镜像和mmap的文件不经过用户态加密
+//内核不支持时由OpenSSL在用户态加密，响应的各个片段合并成完整的记录再交给SSL_write
+//会话复用：TLS 1.3和带ticket扩展的TLS 1.2用ticket，ticket密钥由启动时生成的主密钥按时间段派生，定期轮换
+//只有会话ID的TLS 1.2客户端查找分片的会话缓存，多进程模式下缓存在共享内存中，所有worker共用
+//只支持epoll引擎，io_uring引擎直接提交recv和writev，不经过OpenSSL
+
+#define TLS_CACHE_SHARDS 16                 //会话缓存的分片数，每个分片一把锁
+#define TLS_CACHE_SLOTS 256                 //每个分片的槽数
+#define TLS_CACHE_PROBE 4                   //查找和插入时探测的槽数
+#define TLS_SESSION_MAX 512                 //序列化后的会话上限，超出的不缓存
+#define TLS_SESSION_TIMEOUT 3600            //会话和ticket的有效期(s)
+#define TLS_TICKET_ROTATE 3600              //ticket密钥的轮换周期(s)，上一个周期的密钥仍可解密，解密后换发新ticket
+#define TLS_TICKETS 1                       //TLS 1.3握手后发送的ticket数，OpenSSL默认为2
+#define TLS_RECORD_SIZE 16384               //一个记录的最大明文长度
+
+//tls_conn::read的返回值，大于0为读到的字节数
+#define TLS_CLOSED 0                        //对方关闭了连接
+#define TLS_ERROR -1                        //握手失败或读取出错，需要关闭连接
+#define TLS_WANT_READ -2                    //握手或记录不完整，等待读事件
+#define TLS_WANT_WRITE -3                   //握手消息没有发完，等待写事件
+
+//全局的TLS上下文：证书、会话缓存和ticket密钥，fork前初始化，所有worker相同
+class tls_context
+{
+public:
+    //加载证书链和私钥，生成ticket的主密钥，失败返回false
+    static bool init(const char *cert_file, const char *key_file);
+    //多进程模式下fork前把会话缓存移到共享内存，失败返回false
+    static bool share();
+    static bool enabled() { return s_ctx != NULL; }
+    static SSL_CTX *ctx() { return s_ctx; }
+
+private:
+    static SSL_CTX *s_ctx;
+};
+
+//一个连接的TLS状态，accept后创建，连接的读写都经过它
+//同一时刻只有持有该连接的一个线程访问，与http_conn的其他成员相同
+class tls_conn
+{
+public:
+    explicit tls_conn(int fd);
+    ~tls_conn();
+
+    //推进握手，返回1表示握手完成，否则为TLS_WANT_READ等
+    //握手不会多读应用数据，完成后请求仍在socket中，水平触发下随后会有读事件
+    int handshake();
+    bool handshaking() { return !m_established; }
+    //握手未完成时先推进握手，完成后读取解密的数据，返回值见TLS_CLOSED等
+    int read(char *buf, int len);
+    //与writev相同，返回发送的字节数，需要等待写事件时返回-1并置errno为EAGAIN
+    ssize_t writev(const struct iovec *iov, int count);
+    //SSL中还有已解密但没有读出的数据，套接字上不会再有读事件
+    bool pending() { return m_ssl && SSL_pending(m_ssl) > 0; }
+
+private:
+    //把OpenSSL的错误转换为TLS_WANT_READ等，清空本线程的错误队列
+    int status(int ret);
+
+    SSL *m_ssl;
+    int m_fd;
+    bool m_established;
+    bool m_ktls;                            //发送方向已交给内核
+};
+
+#endif
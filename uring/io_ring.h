@@ -0,0 +1,224 @@
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+//io_uring的简单封装，直接使用系统调用，不依赖liburing
+//只由主线程使用，不加锁
+//提交队列(SQ)和完成队列(CQ)是与内核共享的环形缓冲区，
+//应用写SQ尾、读CQ头，内核读SQ头、写CQ尾，因此读写对方的指针时需要内存屏障
+class io_ring{
+	private:
+		int m_ring_fd;
+
+		//提交队列
+		unsigned *m_sq_head;
+		unsigned *m_sq_tail;
+		unsigned *m_sq_mask;
+		unsigned *m_sq_array;
+		unsigned m_sq_entries;
+		struct io_uring_sqe *m_sqes;
+		unsigned m_sq_local_tail;    //已填写但未提交给内核的SQE也计入
+		unsigned m_to_submit;        //待提交的SQE数
+
+		//完成队列
+		unsigned *m_cq_head;
+		unsigned *m_cq_tail;
+		unsigned *m_cq_mask;
+		struct io_uring_cqe *m_cqes;
+
+		void *m_sq_ptr;
+		size_t m_sq_size;
+		void *m_cq_ptr;
+		size_t m_cq_size;
+		size_t m_sqes_size;
+
+		//provided buffer ring，recv时由内核从中挑选空闲缓冲区
+		struct io_uring_buf_ring *m_buf_ring;
+		char *m_bufs;
+		unsigned m_buf_count;
+		unsigned m_buf_size;
+		unsigned short m_buf_group;
+		unsigned short m_pending_bufs;   //已归还但尚未发布给内核的缓冲区数
+
+	public:
+		unsigned long long m_enter_calls;   //io_uring_enter系统调用次数
+
+	public:
+		io_ring() : m_ring_fd(-1), m_sqes(NULL), m_sq_ptr(MAP_FAILED), m_cq_ptr(MAP_FAILED),
+		            m_buf_ring(NULL), m_bufs(NULL), m_buf_count(0), m_pending_bufs(0), m_enter_calls(0){}
+
+		~io_ring(){
+			if(m_buf_ring)
+				free(m_buf_ring);
+			if(m_bufs)
+				free(m_bufs);
+			if(m_sqes)
+				munmap(m_sqes, m_sqes_size);
+			if(m_cq_ptr != MAP_FAILED && m_cq_ptr != m_sq_ptr)
+				munmap(m_cq_ptr, m_cq_size);
+			if(m_sq_ptr != MAP_FAILED)
+				munmap(m_sq_ptr, m_sq_size);
+			if(m_ring_fd >= 0)
+				close(m_ring_fd);
+		}
+
+		//创建ring并映射共享内存，entries为SQ大小，CQ默认为其两倍
+		bool init(unsigned entries){
+			struct io_uring_params p;
+			memset(&p, 0, sizeof(p));
+			//只有主线程提交，允许内核据此优化
+			p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+			m_ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+			if(m_ring_fd < 0){
+				//旧内核不支持上述标志
+				memset(&p, 0, sizeof(p));
+				m_ring_fd = syscall(__NR_io_uring_setup, entries, &p);
+				if(m_ring_fd < 0)
+					return false;
+			}
+
+			m_sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+			m_cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+			//新内核中SQ和CQ共用一次映射
+			if(p.features & IORING_FEAT_SINGLE_MMAP){
+				if(m_cq_size > m_sq_size)
+					m_sq_size = m_cq_size;
+				m_cq_size = m_sq_size;
+			}
+
+			m_sq_ptr = mmap(0, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+			if(m_sq_ptr == MAP_FAILED)
+				return false;
+			if(p.features & IORING_FEAT_SINGLE_MMAP)
+				m_cq_ptr = m_sq_ptr;
+			else {
+				m_cq_ptr = mmap(0, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+				if(m_cq_ptr == MAP_FAILED)
+					return false;
+			}
+
+			m_sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+			void *sqes = mmap(0, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+			if(sqes == MAP_FAILED)
+				return false;
+			m_sqes = (struct io_uring_sqe *)sqes;
+
+			char *sq = (char *)m_sq_ptr;
+			m_sq_head = (unsigned *)(sq + p.sq_off.head);
+			m_sq_tail = (unsigned *)(sq + p.sq_off.tail);
+			m_sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+			m_sq_array = (unsigned *)(sq + p.sq_off.array);
+			m_sq_entries = p.sq_entries;
+			m_sq_local_tail = *m_sq_tail;
+			m_to_submit = 0;
+
+			char *cq = (char *)m_cq_ptr;
+			m_cq_head = (unsigned *)(cq + p.cq_off.head);
+			m_cq_tail = (unsigned *)(cq + p.cq_off.tail);
+			m_cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+			m_cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+			return true;
+		}
+
+		//取一个空闲的SQE，SQ已满时先提交
+		struct io_uring_sqe *get_sqe(){
+			unsigned head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+			if(m_sq_local_tail - head >= m_sq_entries){
+				submit(0);
+				head = __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+				if(m_sq_local_tail - head >= m_sq_entries)
+					return NULL;
+			}
+			unsigned idx = m_sq_local_tail & *m_sq_mask;
+			struct io_uring_sqe *sqe = &m_sqes[idx];
+			memset(sqe, 0, sizeof(*sqe));
+			m_sq_array[idx] = idx;
+			m_sq_local_tail++;
+			m_to_submit++;
+			return sqe;
+		}
+
+		//批量提交本轮填写的所有SQE，wait_nr>0时同时等待至少wait_nr个完成事件
+		//一轮事件循环只调用一次，这是io_uring减少系统调用的关键
+		int submit(unsigned wait_nr){
+			__atomic_store_n(m_sq_tail, m_sq_local_tail, __ATOMIC_RELEASE);
+			unsigned flags = wait_nr ? IORING_ENTER_GETEVENTS : 0;
+			int ret;
+			do {
+				m_enter_calls++;
+				ret = syscall(__NR_io_uring_enter, m_ring_fd, m_to_submit, wait_nr, flags, NULL, 0);
+			} while(ret < 0 && errno == EINTR && wait_nr == 0);
+			//内核已取走的SQE不再计入待提交数
+			m_to_submit = m_sq_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+			return ret;
+		}
+
+		//取下一个完成事件，没有则返回NULL，处理完后调用cqe_seen
+		struct io_uring_cqe *peek_cqe(){
+			unsigned head = *m_cq_head;
+			if(head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+				return NULL;
+			return &m_cqes[head & *m_cq_mask];
+		}
+
+		void cqe_seen(){
+			__atomic_store_n(m_cq_head, *m_cq_head + 1, __ATOMIC_RELEASE);
+		}
+
+		//注册provided buffer ring，count必须是2的幂
+		bool setup_buffers(unsigned short group, unsigned count, unsigned size){
+			if(posix_memalign((void **)&m_buf_ring, 4096, count * sizeof(struct io_uring_buf)) != 0)
+				return false;
+			memset(m_buf_ring, 0, count * sizeof(struct io_uring_buf));
+			if(posix_memalign((void **)&m_bufs, 64, (size_t)count * size) != 0)
+				return false;
+
+			struct io_uring_buf_reg reg;
+			memset(&reg, 0, sizeof(reg));
+			reg.ring_addr = (unsigned long)m_buf_ring;
+			reg.ring_entries = count;
+			reg.bgid = group;
+			if(syscall(__NR_io_uring_register, m_ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+				return false;
+
+			m_buf_count = count;
+			m_buf_size = size;
+			m_buf_group = group;
+			for(unsigned i = 0; i < count; i++)
+				add_buffer(i);
+			commit_buffers();
+			return true;
+		}
+
+		unsigned short buf_group(){ return m_buf_group; }
+		unsigned buf_size(){ return m_buf_size; }
+		char *buf_addr(unsigned short bid){ return m_bufs + (size_t)bid * m_buf_size; }
+
+		//把用完的缓冲区还给内核，攒到commit_buffers时统一发布
+		void add_buffer(unsigned short bid){
+			unsigned short tail = m_buf_ring->tail;
+			//C++下__DECLARE_FLEX_ARRAY展开的bufs不在偏移0处，直接按数组访问
+			struct io_uring_buf *buf = (struct io_uring_buf *)m_buf_ring + ((tail + m_pending_bufs) & (m_buf_count - 1));
+			buf->addr = (unsigned long)buf_addr(bid);
+			buf->len = m_buf_size;
+			buf->bid = bid;
+			m_pending_bufs++;
+		}
+
+		void commit_buffers(){
+			if(m_pending_bufs == 0)
+				return;
+			__atomic_store_n(&m_buf_ring->tail, (unsigned short)(m_buf_ring->tail + m_pending_bufs), __ATOMIC_RELEASE);
+			m_pending_bufs = 0;
+		}
+
+};
+
+#endif
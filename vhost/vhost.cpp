@@ -0,0 +1,367 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <ctype.h>
+#include "vhost.h"
+#include "clock_service.h"
+
+vhost::name_slot vhost::s_names[VHOST_TABLE_SIZE];
+vhost *vhost::s_hosts[VHOST_MAX];
+int vhost::s_host_count = 0;
+
+//FNV-1a
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static unsigned long long hash_path(const char *path)
+{
+    unsigned long long h = FNV_OFFSET;
+    for (; *path; path++)
+        h = (h ^ (unsigned char)*path) * FNV_PRIME;
+    return h;
+}
+
+vhost::vhost()
+{
+    root[0] = '\0';
+    root_len = 0;
+    cgi = false;
+    packed = NULL;
+    m_route_count = 0;
+    m_cache_budget = (long long)VHOST_DEFAULT_CACHE_MB << 20;
+    m_cache_used = 0;
+    memset(m_cache, 0, sizeof(m_cache));
+}
+
+//未指定配置文件时的默认主机，与原来写死的文档根目录和路由一致
+struct builtin_host{
+    vhost host;
+    builtin_host()
+    {
+        strcpy(host.root, VHOST_DEFAULT_ROOT);
+        host.root_len = strlen(VHOST_DEFAULT_ROOT);
+        host.cgi = true;
+        host.add_route("/0", "/register.html");
+        host.add_route("/1", "/log.html");
+        host.add_route("/5", "/picture.html");
+        host.add_route("/6", "/video.html");
+        host.add_route("/7", "/fans.html");
+        vhost::s_hosts[0] = &host;
+        vhost::s_host_count = 1;
+    }
+};
+static builtin_host s_builtin;
+
+unsigned long long vhost::hash(const char *host, int *len)
+{
+    //IPv6字面量[::1]:80中的冒号不是端口分隔符
+    const char *end = host[0] == '[' ? strchr(host, ']') : NULL;
+    int n = end ? end - host + 1 : strcspn(host, ": \t");
+    while (n > 0 && host[n - 1] == '.')
+        n--;
+    unsigned long long h = FNV_OFFSET;
+    for (int i = 0; i < n; i++)
+        h = (h ^ (unsigned char)tolower((unsigned char)host[i])) * FNV_PRIME;
+    *len = n;
+    //0表示空槽
+    return h ? h : 1;
+}
+
+vhost *vhost::find(const char *host)
+{
+    if (!host || s_host_count <= 1)
+        return get_default();
+    int len;
+    unsigned long long h = hash(host, &len);
+    for (unsigned int i = h; ; i++)
+    {
+        name_slot &slot = s_names[i & (VHOST_TABLE_SIZE - 1)];
+        if (slot.hash == 0)
+            return get_default();
+        if (slot.hash == h && strncasecmp(slot.name, host, len) == 0 && slot.name[len] == '\0')
+            return slot.host;
+    }
+}
+
+bool vhost::add_name(const char *name)
+{
+    int len;
+    unsigned long long h = hash(name, &len);
+    if (len == 0 || len >= VHOST_NAME_LEN || name[len] != '\0')
+        return false;
+    //表的大小是名字总数上限的两倍，总能找到空槽
+    for (unsigned int i = h; ; i++)
+    {
+        name_slot &slot = s_names[i & (VHOST_TABLE_SIZE - 1)];
+        if (slot.hash == h && strcasecmp(slot.name, name) == 0)
+            return false;
+        if (slot.hash == 0)
+        {
+            slot.hash = h;
+            strcpy(slot.name, name);
+            slot.host = this;
+            return true;
+        }
+    }
+}
+
+bool vhost::add_route(const char *url, const char *file)
+{
+    if (m_route_count >= VHOST_ROUTE_MAX || url[0] != '/' || file[0] != '/')
+        return false;
+    if (strlen(url) >= VHOST_ROUTE_LEN || strlen(file) >= VHOST_ROUTE_LEN)
+        return false;
+    strcpy(m_routes[m_route_count].url, url);
+    strcpy(m_routes[m_route_count].file, file);
+    m_route_count++;
+    return true;
+}
+
+const char *vhost::route(const char *url) const
+{
+    for (int i = 0; i < m_route_count; i++)
+        if (strcmp(m_routes[i].url, url) == 0)
+            return m_routes[i].file;
+    return NULL;
+}
+
+//配置文件每行一条指令，#之后为注释，host开始一个新主机，之后的指令属于该主机：
+//  host   www.example.com example.com     主机名和别名
+//  root   /srv/example                    文档根目录
+//  cache  32                              静态文件缓存上限(MB)，0为不缓存
+//  route  /0 /register.html               url完全匹配时改为访问该文件
+//  cgi    on                              处理登录和注册(/2、/3开头的POST)
+//  bundle /srv/example.bundle [huge]      从bundle_pack打包的镜像提供静态文件，huge为放入大页内存
+bool vhost::load(const char *path)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+    {
+        fprintf(stderr, "vhost: cannot open %s\n", path);
+        return false;
+    }
+
+    //内置的默认主机不再使用；加载失败时调用者直接退出
+    memset(s_names, 0, sizeof(s_names));
+    s_host_count = 0;
+    int names = 0;
+    vhost *host = NULL;
+    char line[512];
+    int lineno = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), fp))
+    {
+        lineno++;
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+
+        //按空白切分，argv[0]为指令
+        char *argv[8];
+        int argc = 0;
+        char *save;
+        for (char *tok = strtok_r(line, " \t\r\n", &save); tok && argc < 8; tok = strtok_r(NULL, " \t\r\n", &save))
+            argv[argc++] = tok;
+        if (argc == 0)
+            continue;
+
+        if (strcmp(argv[0], "host") == 0)
+        {
+            ok = argc >= 2 && s_host_count < VHOST_MAX;
+            if (!ok)
+                break;
+            host = new vhost;
+            s_hosts[s_host_count++] = host;
+            for (int i = 1; i < argc && ok; i++)
+                ok = ++names <= VHOST_NAME_MAX && host->add_name(argv[i]);
+        }
+        else if (!host)
+            ok = false;
+        else if (strcmp(argv[0], "root") == 0 && argc == 2)
+        {
+            //去掉末尾的/，url以/开头
+            char *root = argv[1];
+            int len = strlen(root);
+            while (len > 1 && root[len - 1] == '/')
+                root[--len] = '\0';
+            ok = len < VHOST_ROOT_LEN;
+            if (ok)
+            {
+                strcpy(host->root, root);
+                host->root_len = len;
+            }
+        }
+        else if (strcmp(argv[0], "cache") == 0 && argc == 2)
+        {
+            host->m_cache_budget = atoll(argv[1]) << 20;
+            ok = host->m_cache_budget >= 0;
+        }
+        else if (strcmp(argv[0], "route") == 0 && argc == 3)
+            ok = host->add_route(argv[1], argv[2]);
+        else if (strcmp(argv[0], "cgi") == 0 && argc == 2)
+        {
+            host->cgi = strcmp(argv[1], "on") == 0;
+            ok = host->cgi || strcmp(argv[1], "off") == 0;
+        }
+        else if (strcmp(argv[0], "bundle") == 0 && (argc == 2 || (argc == 3 && strcmp(argv[2], "huge") == 0)))
+        {
+            host->packed = bundle::open(argv[1], argc == 3);
+            if (!host->packed)
+            {
+                fclose(fp);
+                return false;
+            }
+        }
+        else
+            ok = false;
+    }
+    fclose(fp);
+
+    if (!ok)
+    {
+        fprintf(stderr, "vhost: %s:%d: bad directive\n", path, lineno);
+        return false;
+    }
+    for (int i = 0; i < s_host_count; i++)
+    {
+        if (s_hosts[i]->root_len == 0)
+        {
+            fprintf(stderr, "vhost: %s: host without root\n", path);
+            return false;
+        }
+    }
+    if (s_host_count == 0)
+    {
+        fprintf(stderr, "vhost: %s: no host\n", path);
+        return false;
+    }
+    return true;
+}
+
+void vhost::unlink(static_file *file)
+{
+    static_file **p = &m_cache[file->hash & (VHOST_CACHE_BUCKETS - 1)];
+    while (*p && *p != file)
+        p = &(*p)->next;
+    if (*p)
+        *p = file->next;
+}
+
+static_file *vhost::lookup(const char *file)
+{
+    if (m_cache_budget == 0)
+        return NULL;
+    const char *path = file + root_len;
+    unsigned long long h = hash_path(path);
+    locker &lock = m_cache_lock[h & (VHOST_CACHE_LOCKS - 1)];
+
+    lock.lock();
+    static_file *hit = m_cache[h & (VHOST_CACHE_BUCKETS - 1)];
+    while (hit && (hit->hash != h || strcmp(hit->path, path) != 0))
+        hit = hit->next;
+    if (hit)
+        hit->refs++;
+    lock.unlock();
+    if (!hit)
+        return NULL;
+
+    //文件可能已被修改或删除，过期后在锁外stat复核，多个线程同时复核也无妨
+    long long now = clock_service::mono_ms();
+    if (now - hit->checked_ms.load(std::memory_order_relaxed) < VHOST_CACHE_VALID_MS)
+        return hit;
+    struct stat st;
+    if (stat(file, &st) == 0 && st.st_mtime == hit->st.st_mtime && st.st_size == hit->st.st_size &&
+        st.st_ino == hit->st.st_ino && st.st_mode == hit->st.st_mode)
+    {
+        hit->checked_ms.store(now, std::memory_order_relaxed);
+        return hit;
+    }
+
+    //已变化，从缓存中摘下，由调用者重新读入
+    lock.lock();
+    bool cached = false;
+    for (static_file *p = m_cache[h & (VHOST_CACHE_BUCKETS - 1)]; p; p = p->next)
+        cached |= p == hit;
+    if (cached)
+        unlink(hit);
+    lock.unlock();
+    if (cached)
+    {
+        m_cache_used -= hit->st.st_size;
+        release(hit);
+    }
+    release(hit);
+    return NULL;
+}
+
+static_file *vhost::insert(const char *file, int fd, const struct stat &st)
+{
+    if (st.st_size == 0 || st.st_size > VHOST_CACHE_FILE_MAX || !S_ISREG(st.st_mode))
+        return NULL;
+    //先占用预算，超出则放弃，不淘汰已缓存的文件
+    if (m_cache_used.fetch_add(st.st_size) + st.st_size > m_cache_budget)
+    {
+        m_cache_used -= st.st_size;
+        return NULL;
+    }
+
+    static_file *entry = new static_file;
+    entry->data = (char *)malloc(st.st_size);
+    long long got = 0;
+    while (entry->data && got < st.st_size)
+    {
+        ssize_t n = pread(fd, entry->data + got, st.st_size - got, got);
+        if (n <= 0)
+            break;
+        got += n;
+    }
+    if (got != st.st_size)
+    {
+        free(entry->data);
+        delete entry;
+        m_cache_used -= st.st_size;
+        return NULL;
+    }
+    const char *path = file + root_len;
+    entry->hash = hash_path(path);
+    entry->path = strdup(path);
+    entry->st = st;
+    entry->mime = &mime::of(path);
+    entry->checked_ms = clock_service::mono_ms();
+    //缓存持有一次引用，调用者持有一次
+    entry->refs = 2;
+
+    //其他线程可能同时读入了同一个文件，保留先放入的
+    locker &lock = m_cache_lock[entry->hash & (VHOST_CACHE_LOCKS - 1)];
+    static_file **bucket = &m_cache[entry->hash & (VHOST_CACHE_BUCKETS - 1)];
+    lock.lock();
+    static_file *old = *bucket;
+    while (old && (old->hash != entry->hash || strcmp(old->path, path) != 0))
+        old = old->next;
+    if (!old)
+    {
+        entry->next = *bucket;
+        *bucket = entry;
+    }
+    lock.unlock();
+    if (old)
+    {
+        m_cache_used -= st.st_size;
+        entry->refs = 1;
+        release(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+void vhost::release(static_file *file)
+{
+    if (file && file->refs.fetch_sub(1) == 1)
+    {
+        free(file->data);
+        free(file->path);
+        delete file;
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef VHOST_H
+#define VHOST_H
+
+#include <sys/stat.h>
+#include <atomic>
+#include "locker.h"
+#include "bundle.h"
+#include "mime.h"
+
+#define VHOST_MAX 32                       //最多虚拟主机数
+#define VHOST_NAME_MAX 128                 //所有主机的名字和别名总数
+#define VHOST_TABLE_BITS 8                 //Host查找表256个槽，开放寻址，启动后只读
+#define VHOST_TABLE_SIZE (1 << VHOST_TABLE_BITS)
+#define VHOST_NAME_LEN 64
+#define VHOST_ROOT_LEN 128                 //须小于http_conn::FILENAME_LEN，给url留出空间
+#define VHOST_ROUTE_MAX 16
+#define VHOST_ROUTE_LEN 64
+#define VHOST_DEFAULT_ROOT "/root/intrv/webservnote/root"
+
+#define VHOST_CACHE_BITS 10                //每个主机静态文件缓存1024个哈希桶
+#define VHOST_CACHE_BUCKETS (1 << VHOST_CACHE_BITS)
+#define VHOST_CACHE_LOCKS 16               //按桶分段加锁，工作线程之间很少竞争同一把锁
+#define VHOST_CACHE_FILE_MAX (4 << 20)     //超过4MB的文件不缓存，仍然每次mmap
+#define VHOST_CACHE_VALID_MS 1000          //命中时至多每秒stat一次，文件被修改后重新读入
+#define VHOST_DEFAULT_CACHE_MB 32
+
+//缓存中的静态文件，由缓存和正在发送它的连接共同持有，引用计数归零时释放
+struct static_file{
+    static_file *next;                      //同一个桶中的下一个文件
+    unsigned long long hash;
+    char *path;                             //相对文档根目录的路径
+    char *data;
+    struct stat st;
+    const mime_type *mime;                  //按扩展名在读入时查好，发送时直接复制Content-Type头
+    std::atomic<long long> checked_ms;      //上次确认文件未被修改的时间
+    std::atomic<int> refs;
+};
+
+//路由改写，请求的url与url完全相同时改为访问file
+struct vhost_route{
+    char url[VHOST_ROUTE_LEN];
+    char file[VHOST_ROUTE_LEN];
+};
+
+//按Host区分的虚拟主机，每个主机有自己的文档根目录、路由表和静态文件缓存
+//主机在启动时创建，运行期间不增删，查找表只读，工作线程无锁查找
+class vhost{
+    friend struct builtin_host;
+
+public:
+    vhost();
+
+    //Host头的哈希，忽略大小写、端口和末尾的点，读取请求头时计算一次
+    static unsigned long long hash(const char *host, int *len);
+    //按Host查找，未配置的Host或没有Host头时返回默认主机
+    static vhost *find(const char *host);
+    static vhost *get_default() { return s_hosts[0]; }
+    //读取配置文件，替换内置的默认主机，第一个主机为默认主机，格式错误返回false
+    static bool load(const char *path);
+
+    //路由表中url对应的文件，没有改写返回NULL
+    const char *route(const char *url) const;
+    //启动时添加路由，路由表已满或url、file过长返回false
+    bool add_route(const char *url, const char *file);
+
+    //file为完整路径，以root开头；命中时引用计数加一，超过VHOST_CACHE_VALID_MS时先stat复核
+    static_file *lookup(const char *file);
+    //把已打开的文件读入缓存并加一次引用，超出预算、文件过大或读取失败返回NULL
+    static_file *insert(const char *file, int fd, const struct stat &st);
+    static void release(static_file *file);
+
+public:
+    char root[VHOST_ROOT_LEN];
+    int root_len;
+    bool cgi;                               //是否处理登录和注册
+    bundle *packed;                         //文档根目录打包成的镜像，不为NULL时只在镜像中查找，不访问文件系统
+
+private:
+    bool add_name(const char *name);
+    //从桶中摘下文件，调用时持有该桶的锁
+    void unlink(static_file *file);
+
+    vhost_route m_routes[VHOST_ROUTE_MAX];
+    int m_route_count;
+
+    long long m_cache_budget;               //缓存文件的总字节数上限，0为不缓存
+    std::atomic<long long> m_cache_used;
+    static_file *m_cache[VHOST_CACHE_BUCKETS];
+    locker m_cache_lock[VHOST_CACHE_LOCKS];
+
+    struct name_slot{
+        unsigned long long hash;            //0表示空槽
+        char name[VHOST_NAME_LEN];
+        vhost *host;
+    };
+    static name_slot s_names[VHOST_TABLE_SIZE];
+    static vhost *s_hosts[VHOST_MAX];
+    static int s_host_count;
+};
+
+#endif